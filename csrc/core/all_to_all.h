@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstdint>
+#include "host_device.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Split/offset bookkeeping and buffer layout of the all-to-all.
+
+Operation:
+    Rank s sends send_count[d] elements, starting at send_offset[d] of its
+    send buffer, to every rank d, and receives recv_count[s] elements into
+    recv_offset[s] of its receive buffer from every rank s. The offsets are
+    the prefix sums of the counts, as in torch.distributed.all_to_all_single.
+
+    A segment is cut into chunks of `chunk_elements`, the values a codec
+    encodes in one `send` (a rank segment of a two-shot tile). The chunks of
+    all the segments of a rank form a single list, which the blocks of the
+    kernel stride over: a block first sends its chunks, then receives its
+    chunks, so a block never waits on a peer before it has sent everything.
+
+    Every receiver holds a region per source rank in its data buffer, and a
+    flag per (source, chunk) in the all-to-all flags buffer. The whole
+    exchange fits in the regions, which is what makes it a single pass: no
+    region is reused during a launch. Between launches, a start barrier
+    (one flag per peer) makes sure every peer finished the previous launch,
+    and thus read its regions, before anything is overwritten. The barrier
+    and chunk flags carry the launch color, which every rank advances by one
+    per launch.
+
+    The two-shot kernels use the same data buffer without that barrier, so
+    a launch also ends with a completion barrier. The blocks of a rank count
+    their arrivals once they have read their chunks; the last one resets the
+    counter, sets its done flag on every peer and waits for the done flags
+    of all the peers. When a launch completes, no peer reads its regions any
+    more, and the next launch of any kind may overwrite them.
+*/
+static constexpr int kAllToAllMaxRanks = 8;
+
+struct AllToAllPlan {
+  uint32_t send_offset[kAllToAllMaxRanks];
+  uint32_t send_count[kAllToAllMaxRanks];
+  uint32_t recv_offset[kAllToAllMaxRanks];
+  uint32_t recv_count[kAllToAllMaxRanks];
+  // Start of the chunks of each segment in the chunk list of the rank.
+  uint32_t send_chunk_begin[kAllToAllMaxRanks + 1];
+  uint32_t recv_chunk_begin[kAllToAllMaxRanks + 1];
+  uint32_t chunk_elements;
+  int world_size;
+
+  __quickreduce_host_device_inline__ uint32_t num_send_chunks() const {
+    return send_chunk_begin[world_size];
+  }
+  __quickreduce_host_device_inline__ uint32_t num_recv_chunks() const {
+    return recv_chunk_begin[world_size];
+  }
+};
+
+enum struct AllToAllPlanError {
+  OK = 0,
+  WORLD_SIZE,       // world size above kAllToAllMaxRanks
+  UNALIGNED_COUNT,  // a count that is not a whole number of 16B atoms
+  CAPACITY,         // a segment larger than the region of a source rank
+};
+
+// Fill `plan` from the counts. A segment holds at most `max_chunks` chunks.
+__quickreduce_host_device_inline__ AllToAllPlanError make_all_to_all_plan(
+    int world_size, uint32_t const* send_counts, uint32_t const* recv_counts,
+    uint32_t chunk_elements, uint32_t max_chunks, AllToAllPlan& plan) {
+  if (world_size <= 0 || world_size > kAllToAllMaxRanks) {
+    return AllToAllPlanError::WORLD_SIZE;
+  }
+  plan.world_size = world_size;
+  plan.chunk_elements = chunk_elements;
+  uint32_t send_offset = 0;
+  uint32_t recv_offset = 0;
+  plan.send_chunk_begin[0] = 0;
+  plan.recv_chunk_begin[0] = 0;
+  for (int r = 0; r < world_size; r++) {
+    if (send_counts[r] % 8 != 0 || recv_counts[r] % 8 != 0) {
+      return AllToAllPlanError::UNALIGNED_COUNT;
+    }
+    uint32_t send_chunks = (send_counts[r] + chunk_elements - 1) / chunk_elements;
+    uint32_t recv_chunks = (recv_counts[r] + chunk_elements - 1) / chunk_elements;
+    if (send_chunks > max_chunks || recv_chunks > max_chunks) {
+      return AllToAllPlanError::CAPACITY;
+    }
+    plan.send_offset[r] = send_offset;
+    plan.send_count[r] = send_counts[r];
+    plan.recv_offset[r] = recv_offset;
+    plan.recv_count[r] = recv_counts[r];
+    plan.send_chunk_begin[r + 1] = plan.send_chunk_begin[r] + send_chunks;
+    plan.recv_chunk_begin[r + 1] = plan.recv_chunk_begin[r] + recv_chunks;
+    send_offset += send_counts[r];
+    recv_offset += recv_counts[r];
+  }
+  return AllToAllPlanError::OK;
+}
+
+// Segment of chunk `j` of a chunk list, and the index of the chunk within
+// the segment.
+struct ChunkRef {
+  int rank;
+  uint32_t chunk;
+};
+
+__quickreduce_host_device_inline__ ChunkRef find_chunk(
+    uint32_t const* chunk_begin, int world_size, uint32_t j) {
+  int r = 0;
+  while (r + 1 < world_size && chunk_begin[r + 1] <= j) r++;
+  return {r, j - chunk_begin[r]};
+}
+
+// Chunks a source can have in flight to a receiver, `chunk_bytes` apart:
+// the chunk size of the codec that transmits the most, see
+// kMaxTransmittedTileSize.
+__quickreduce_host_device_inline__ uint32_t all_to_all_max_chunks(
+    int64_t data_buffer_size, int world_size, uint32_t chunk_bytes) {
+  return static_cast<uint32_t>(data_buffer_size / world_size / chunk_bytes);
+}
+
+// Bytes of the all-to-all flags buffer: a barrier flag and a done flag per
+// rank, the arrival counter, then a flag per (source, chunk). Rounded to 256B
+// to keep the data buffer aligned.
+__quickreduce_host_device_inline__ uint32_t all_to_all_flags_size(
+    int world_size, uint32_t max_chunks) {
+  uint64_t bytes =
+      (2 * uint64_t(world_size) + 1 + uint64_t(world_size) * max_chunks) * 4;
+  return static_cast<uint32_t>((bytes + 255) / 256 * 256);
+}
+
+__quickreduce_host_device_inline__ uint32_t all_to_all_barrier_offset(
+    uint32_t flags_offset, int rank) {
+  return flags_offset + rank * sizeof(uint32_t);
+}
+
+__quickreduce_host_device_inline__ uint32_t all_to_all_done_offset(
+    uint32_t flags_offset, int world_size, int rank) {
+  return flags_offset + (world_size + rank) * sizeof(uint32_t);
+}
+
+__quickreduce_host_device_inline__ uint32_t all_to_all_arrival_offset(
+    uint32_t flags_offset, int world_size) {
+  return flags_offset + 2 * world_size * sizeof(uint32_t);
+}
+
+__quickreduce_host_device_inline__ uint32_t all_to_all_chunk_flag_offset(
+    uint32_t flags_offset, int world_size, uint32_t max_chunks, int source,
+    uint32_t chunk) {
+  return flags_offset +
+         (2 * world_size + 1 + uint64_t(source) * max_chunks + chunk) *
+             sizeof(uint32_t);
+}
+
+// Byte offset of a chunk from `source` in the data buffer of the receiver.
+// Every source owns max_chunks chunks of `chunk_bytes`, as in
+// all_to_all_max_chunks; a smaller codec packs its chunks at the start of
+// the region.
+__quickreduce_host_device_inline__ uint64_t all_to_all_chunk_data_offset(
+    uint32_t data_offset, uint32_t max_chunks, uint32_t chunk_bytes,
+    int source, uint32_t chunk, uint32_t transmitted_chunk_size) {
+  return data_offset + uint64_t(source) * max_chunks * chunk_bytes +
+         uint64_t(chunk) * transmitted_chunk_size;
+}
+
+}  // namespace quickreduce
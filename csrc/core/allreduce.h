@@ -2,10 +2,25 @@
 
 #include <hip/hip_runtime.h>
 #include "base.h"
+#include "all_to_all.h"
+#include "codec_layout.h"
+#include "direct_output.h"
+#include "hadamard.h"
+#include "layout.h"
+#include "mx_format.h"
+#include "quant_error.h"
+#include "readiness.h"
+#include "reduce_op.h"
+#include "schedule.h"
 
 namespace quickreduce {
 
 struct CodecBase {
+  // Whether decode(encode(x)) == x. Only lossless codecs run max/min.
+  static constexpr bool kLossless = false;
+  // Whether recv_mx hands the received blocks over to an MxOutput.
+  static constexpr bool kMxEncoded = false;
+
   const int thread;
   const int rank;
   const int group_leader;
@@ -20,6 +35,7 @@ struct CodecBase {
 // Default full precision codec.
 template <int world_size>
 struct CodecFP : public CodecBase {
+  static constexpr bool kLossless = true;
   static constexpr int kWorldSize = world_size;
   static constexpr int kRankAtoms = kAtoms / kWorldSize;
 
@@ -54,19 +70,18 @@ struct CodecFP : public CodecBase {
   }
 };
 
-// Int4 symmetric quantization codec.
-// We quantize the FP16 data to block-scaled Int4 in blocks of 4 *
-// kThreadGroupSize.
-template < int world_size>
-struct CodecQ4 : public CodecBase {
+// Lossless fp16 codec: the exact fp16 values, with the exponents coded
+// against a base per group of threads. See LosslessLayout in
+// core/codec_layout.h.
+template <int world_size>
+struct CodecFPLossless : public CodecBase {
+  static constexpr bool kLossless = true;
+  using Layout = LosslessLayout;
   static constexpr int kWorldSize = world_size;
-
-  // Codec tile size process by this workgroup.
-  // Each threads processes a fragment of fp16x8_t (16B),
-  // into a int4x8_t (4B) and a fp16 scale shared among 32 values.
   static constexpr int kRankAtoms = kAtoms / kWorldSize;
-  static constexpr int kRankTileStride = 1152;
-  static constexpr int kRankTileScaleOffset = 1024;
+
+  // Codec tile size process by this workgroup, bounded by the raw threads.
+  static constexpr int kRankTileStride = Layout::kTileStride;
   static constexpr int kRankTransmittedTileSize = kRankTileStride * kRankAtoms;
   static_assert(kRankTransmittedTileSize % 16 == 0,
                 "kRankTransmittedTileSize must be 16B aligned.");
@@ -77,152 +92,192 @@ struct CodecQ4 : public CodecBase {
   // Total tile size for the collective communication.
   static constexpr int kTransmittedTileSize =
       kRankTransmittedTileSize * kWorldSize;
+  static_assert(kTransmittedTileSize == kMaxTransmittedTileSize,
+                "The buffer regions are sized for the lossless tile.");
 
-  // Constants configuration
-
-  // {-1/8.0h, -1/8.0h}, f16x2_t
-  static constexpr int kScaleFactor =  0xB000B000;
-   //   std::is_same<T, half>::value ? 0xB000B000 : 0xBE00BE00;
-
-  // {1e-7, 1e-7}, f16x2_t
-  static constexpr int kScaleEpsilon = 0x00010001;
-   //   std::is_same<T, half>::value ? 0x00010001 : 0x33D733D7;
-
-  // {-8, -8}, f16x2_t
-  static constexpr int kRangeMin = 0xC800C800;
-   //   std::is_same<T, half>::value ? 0xC800C800 : 0xC100C100;
-
-  // {+7, +7}, f16x2_t
-  static constexpr int kRangeMax = 0x47004700;
-  //    std::is_same<T, half>::value ? 0x47004700 : 0x40E040E0;
-    
-
-  // {+8, +8}, int16x2_t
-  static constexpr int kRangeBias = 0x00080008;
-
-  __quickreduce_device_inline__ CodecQ4(int thread, int rank)
+  __quickreduce_device_inline__ CodecFPLossless(int thread, int rank)
       : CodecBase(thread, rank) {}
 
   __quickreduce_device_inline__ void send(int32x4_t* __restrict__ send_buffer,
                                           const int32x4_t* __restrict__ data) {
+    int const wave = thread / kWavefront;
+
     for (int k = 0; k < kRankAtoms; k++) {
       int32x4_t const atom = data[k];
+      uint32_t const* v = reinterpret_cast<uint32_t const*>(&atom);
+      uint8_t* atom_ptr =
+          reinterpret_cast<uint8_t*>(send_buffer + k * kRankBufferTileStride);
 
-      // Compute the absolute maximum of the atom in the thread group
-      // In 2 blocks of values, upper/lower halves of the f16x2_t
-      int wblockmax = group_abs_max<half>(atom);
-
-      // Derive scales
-      int decoding_scale;
-      int encoding_scale;
-      decoding_scale = packed_mul<half>(wblockmax, kScaleFactor);
-      encoding_scale = packed_add<half>(decoding_scale, kScaleEpsilon);
-      encoding_scale = packed_rcp<half>(encoding_scale);
-
-      // Apply scales to get quantized values
-      int32x4_t w;
-      for (int i = 0; i < 4; i++) {
-        w[i] = packed_mul<half>(atom[i], encoding_scale);
-        w[i] = packed_max<half>(w[i], kRangeMin);
-        w[i] = packed_min<half>(w[i], kRangeMax);
+      // Exponent base of the thread group.
+      int base = Layout::max_exponent(v);
+      for (int i = 1; i < kThreadGroupSize; i <<= 1) {
+        base = max(base, __shfl_xor(base, i));
       }
 
-      // Convert from f16x2_t to uint16x2_t
-      int32x4_t q;
-      {
-        int16_t* qi = reinterpret_cast<int16_t*>(&q);
-        //T* wh = reinterpret_cast<T*>(&w);
-        half* wh = reinterpret_cast<half*>(&w);
-        for (int i = 0; i < 8; i++) qi[i] = (int16_t)rintf(T2float_cast(wh[i]));
-
-        for (int i = 0; i < 4; i++) {
-          q[i] = packed_add<int16_t>(q[i], kRangeBias);
-        }
+      int32x2_t low;
+      Layout::pack_low(v, reinterpret_cast<uint32_t*>(&low));
+      uint32_t high[2];
+      bool const raw = Layout::pack_high(v, base, high);
+      uint64_t const raw_mask = __ballot(raw);
+
+      __builtin_nontemporal_store(
+          low, reinterpret_cast<int32x2_t*>(atom_ptr + Layout::kLowOffset) +
+                   thread);
+      __builtin_nontemporal_store(
+          high[0],
+          reinterpret_cast<uint32_t*>(atom_ptr + Layout::kHigh0Offset) +
+              thread);
+      __builtin_nontemporal_store(
+          static_cast<uint16_t>(high[1]),
+          reinterpret_cast<uint16_t*>(atom_ptr + Layout::kHigh1Offset) +
+              thread);
+      if (raw) {
+        __builtin_nontemporal_store(
+            static_cast<uint16_t>(high[1] >> 16),
+            reinterpret_cast<uint16_t*>(atom_ptr + Layout::kRawOffset) +
+                thread);
       }
-
-      // Pack 8 x q4 into int32_t
-      int qw = q[0] | (q[1] << 4) | (q[2] << 8) | (q[3] << 12);
-
-      // Write quantized atom to send_buffer
-      // note: only the group leader stores the scale
-      uint8_t* atom_ptr =
-          reinterpret_cast<uint8_t*>(send_buffer + k * kRankBufferTileStride);
-      int32_t* qw_ptr = reinterpret_cast<int32_t*>(atom_ptr) + thread;
-      int* qs_ptr = reinterpret_cast<int*>(atom_ptr + kRankTileScaleOffset) +
-                    (thread / 8);
-
-      __builtin_nontemporal_store(qw, qw_ptr);
-      if (threadIdx.x == group_leader) {
-        __builtin_nontemporal_store(decoding_scale, qs_ptr);
+      if (threadIdx.x % kThreadGroupSize == 0) {
+        __builtin_nontemporal_store(
+            static_cast<uint8_t>(base),
+            atom_ptr + Layout::kBaseOffset + thread / kThreadGroupSize);
+      }
+      if (threadIdx.x == 0) {
+        __builtin_nontemporal_store(
+            raw_mask,
+            reinterpret_cast<uint64_t*>(atom_ptr + Layout::kMaskOffset) + wave);
       }
     }
   }
 
   __quickreduce_device_inline__ void recv(int32x4_t** __restrict__ recv_buffer,
                                           int32x4_t* __restrict__ data) {
+    int const wave = thread / kWavefront;
+
     for (int k = 0; k < kRankAtoms; k++) {
-      // Directly read quantized atom from recv_buffer
       uint8_t* atom_ptr = reinterpret_cast<uint8_t*>(*recv_buffer);
-      int32_t* qw_ptr = reinterpret_cast<int32_t*>(atom_ptr) + thread;
-      int* qs_ptr = reinterpret_cast<int*>(atom_ptr + kRankTileScaleOffset) +
-                    (thread / 8);
-
-      int32_t qw = __builtin_nontemporal_load(qw_ptr);
-      int qs = __builtin_nontemporal_load(qs_ptr);
+      int32x2_t low = __builtin_nontemporal_load(
+          reinterpret_cast<int32x2_t*>(atom_ptr + Layout::kLowOffset) + thread);
+      uint32_t high[2];
+      high[0] = __builtin_nontemporal_load(
+          reinterpret_cast<uint32_t*>(atom_ptr + Layout::kHigh0Offset) +
+          thread);
+      high[1] = __builtin_nontemporal_load(
+          reinterpret_cast<uint16_t*>(atom_ptr + Layout::kHigh1Offset) +
+          thread);
+      int base = __builtin_nontemporal_load(
+          atom_ptr + Layout::kBaseOffset + thread / kThreadGroupSize);
+      uint64_t raw_mask = __builtin_nontemporal_load(
+          reinterpret_cast<uint64_t*>(atom_ptr + Layout::kMaskOffset) + wave);
+      bool const raw = (raw_mask >> threadIdx.x) & 1;
+      if (raw) {
+        high[1] |= uint32_t(__builtin_nontemporal_load(
+                       reinterpret_cast<uint16_t*>(atom_ptr +
+                                                   Layout::kRawOffset) +
+                       thread))
+                   << 16;
+      }
 
       *recv_buffer += kRankBufferTileStride;
 
-      // Unpack q4 into f16x8_t
       int32x4_t w;
-      {
-        static constexpr uint kMask000F = 0x000F000F;
-        static constexpr uint kHalf2_1024 =
-            0x64006400;  // {1024.0, 1024.0}, fp16x2_t
-        static uint constexpr kHalf2_1032 =
-            0xE408E408;  // {-1032.0, -1032.0}, fp16x2_t
-
-        for (int i = 0; i < 4; i++) {
-          if constexpr (std::is_same<half, half>::value) {
-            int32_t q4 = ((qw >> (i * 4)) & kMask000F) | kHalf2_1024;
-            w[i] = packed_add<half>(q4, kHalf2_1032);
-          } else {
-            int32_t int16_2 = (qw >> (i * 4)) & kMask000F;
-            int16_t low = static_cast<int16_t>(int16_2 & 0xFFFF);
-            int16_t high = static_cast<int16_t>((int16_2 >> 16) & 0xFFFF);
-            nv_bfloat16 bf_low = __float2bfloat16(static_cast<float>(low));
-            nv_bfloat16 bf_high = __float2bfloat16(static_cast<float>(high));
-            nv_bfloat162 bf2 = __halves2bfloat162(bf_low, bf_high);
-            int32_t packed_bf16 = *reinterpret_cast<int32_t*>(&bf2);
-            w[i] = packed_add<nv_bfloat16>(packed_bf16, kRangeMin);
-          }
-        }
-      }
-
-      // Apply decoding scales
-      for (int i = 0; i < 4; i++) {
-       // w[i] = packed_mul<half>(w[i], qs);
-        w[i] = packed_mul<half>(w[i], qs);
-      }
-
+      Layout::unpack(reinterpret_cast<uint32_t const*>(&low), high, raw, base,
+                     reinterpret_cast<uint32_t*>(&w));
       data[k] = w;
     }
   }
 };
 
-// Int6 symmetric quantization codec.
-// We quantize the FP16 data to block-scaled Int6 in blocks of 4 *
-// kThreadGroupSize.
-template <int world_size>
-struct CodecQ6 : public CodecBase {
+// Store the code planes of a thread, see core/codec_layout.h. Every plane is
+// a single nontemporal store of its width.
+template <class Layout>
+__quickreduce_device_inline__ void store_code_planes(uint8_t* atom_ptr,
+                                                     int const thread,
+                                                     int32x4_t const& q) {
+  uint32_t const* codes = reinterpret_cast<uint32_t const*>(&q);
+#pragma unroll
+  for (int k = 0; k < Layout::kNumPlanes; k++) {
+    uint32_t word[2];
+    Layout::pack_plane(codes, k, word);
+    uint8_t* plane = atom_ptr + Layout::plane_offset(k);
+    switch (Layout::plane_width(k)) {
+      case 8: {
+        int32x2_t qw;
+        qw[0] = word[0];
+        qw[1] = word[1];
+        __builtin_nontemporal_store(
+            qw, reinterpret_cast<int32x2_t*>(plane) + thread);
+        break;
+      }
+      case 4:
+        __builtin_nontemporal_store(
+            word[0], reinterpret_cast<uint32_t*>(plane) + thread);
+        break;
+      case 2:
+        __builtin_nontemporal_store(
+            static_cast<uint16_t>(word[0]),
+            reinterpret_cast<uint16_t*>(plane) + thread);
+        break;
+      default:
+        __builtin_nontemporal_store(static_cast<uint8_t>(word[0]),
+                                    plane + thread);
+        break;
+    }
+  }
+}
+
+// Load the code planes of a thread into uint16x2_t codes.
+template <class Layout>
+__quickreduce_device_inline__ int32x4_t load_code_planes(uint8_t* atom_ptr,
+                                                         int const thread) {
+  int32x4_t q = {};
+  uint32_t* codes = reinterpret_cast<uint32_t*>(&q);
+#pragma unroll
+  for (int k = 0; k < Layout::kNumPlanes; k++) {
+    uint32_t word[2] = {0, 0};
+    uint8_t* plane = atom_ptr + Layout::plane_offset(k);
+    switch (Layout::plane_width(k)) {
+      case 8: {
+        int32x2_t qw = __builtin_nontemporal_load(
+            reinterpret_cast<int32x2_t*>(plane) + thread);
+        word[0] = qw[0];
+        word[1] = qw[1];
+        break;
+      }
+      case 4:
+        word[0] = __builtin_nontemporal_load(
+            reinterpret_cast<uint32_t*>(plane) + thread);
+        break;
+      case 2:
+        word[0] = __builtin_nontemporal_load(
+            reinterpret_cast<uint16_t*>(plane) + thread);
+        break;
+      default:
+        word[0] = __builtin_nontemporal_load(plane + thread);
+        break;
+    }
+    Layout::unpack_plane(word, k, codes);
+  }
+  return q;
+}
+
+// Symmetric block-quantization codec of `bits` bits.
+// We quantize the FP16 data to block-scaled intN in blocks of 4 *
+// kThreadGroupSize, with a fp16 scale per block. The tile layout, range and
+// bias constants are derived from the bit-width (core/codec_layout.h); Q4,
+// Q6 and Q8 keep the byte layout of the former hand-written codecs.
+template <int world_size, int bits>
+struct CodecQ : public CodecBase {
+  using Layout = QuantCodeLayout<bits>;
+  using Constants = SymmetricQuantConstants<bits>;
   static constexpr int kWorldSize = world_size;
 
   // Codec tile size process by this workgroup.
   // Each threads processes a fragment of fp16x8_t (16B),
-  // into a int6x8_t (4B + 2B) and a fp16 scale shared among 32 values.
+  // into a intNx8_t (N bytes) and a fp16 scale shared among 32 values.
   static constexpr int kRankAtoms = kAtoms / kWorldSize;
-  static constexpr int kRankTileStride = 1664;
-  static constexpr int kRankTileQ2Offset = 1024;
-  static constexpr int kRankTileScaleOffset = 1536;
+  static constexpr int kRankTileStride = Layout::kTileStride;
+  static constexpr int kRankTileScaleOffset = Layout::kScaleOffset;
   static constexpr int kRankTransmittedTileSize = kRankTileStride * kRankAtoms;
   static_assert(kRankTransmittedTileSize % 16 == 0,
                 "kRankTransmittedTileSize must be 16B aligned.");
@@ -236,26 +291,22 @@ struct CodecQ6 : public CodecBase {
 
   // Constants configuration
 
-  // {-1/32.0h, -1/32.0h}, fp16x2_t
-  static constexpr int kScaleFactor = 0xA800A800;
-  //    std::is_same<T, half>::value ? 0xA800A800 : 0xBD00BD00;
+  // {-1/2^(bits-1), -1/2^(bits-1)}, f16x2_t
+  static constexpr int kScaleFactor = Constants::kScaleFactor;
 
-  // {1e-7, 1e-7}, fp16x2_t
+  // {1e-7, 1e-7}, f16x2_t
   static constexpr int kScaleEpsilon = 0x00010001;
-   //   std::is_same<T, half>::value ? 0x00010001 : 0x33D733D7;
 
-  // {-32, -32}, fp16x2_t
-  static constexpr int kRangeMin = 0xD000D000;
-   //   std::is_same<T, half>::value ? 0xD000D000 : 0xC200C200;
+  // {-2^(bits-1), -2^(bits-1)}, f16x2_t
+  static constexpr int kRangeMin = Constants::kRangeMin;
 
-  // {+31, +31}, fp16x2_t
-  static constexpr int kRangeMax = 0x4FC04FC0;
-   //   std::is_same<T, half>::value ? 0x4FC04FC0 : 0x41F841F8;
+  // {2^(bits-1) - 1, 2^(bits-1) - 1}, f16x2_t
+  static constexpr int kRangeMax = Constants::kRangeMax;
 
-  // {+32, +32}, int16x2_t
-  static constexpr int kRangeBias = 0x00200020;
+  // {2^(bits-1), 2^(bits-1)}, int16x2_t
+  static constexpr int kRangeBias = Constants::kRangeBias;
 
-  __quickreduce_device_inline__ CodecQ6(int thread, int rank)
+  __quickreduce_device_inline__ CodecQ(int thread, int rank)
       : CodecBase(thread, rank) {}
 
   __quickreduce_device_inline__ void send(int32x4_t* __restrict__ send_buffer,
@@ -267,143 +318,295 @@ struct CodecQ6 : public CodecBase {
       // In 2 blocks of values, upper/lower halves of the f16x2_t
       int wblockmax = group_abs_max<half>(atom);
 
-      // Derive scales
-      int decoding_scale;
-      int encoding_scale;
-      decoding_scale = packed_mul<half>(wblockmax, kScaleFactor);
-      encoding_scale = packed_add<half>(decoding_scale, kScaleEpsilon);
-      encoding_scale = packed_rcp<half>(encoding_scale);
+      encode_atom(
+          reinterpret_cast<uint8_t*>(send_buffer + k * kRankBufferTileStride),
+          atom, wblockmax);
+    }
+  }
+
+  __quickreduce_device_inline__ void recv(int32x4_t** __restrict__ recv_buffer,
+                                          int32x4_t* __restrict__ data) {
+    for (int k = 0; k < kRankAtoms; k++) {
+      // Directly read quantized atom from recv_buffer
+      data[k] = decode_atom(reinterpret_cast<uint8_t*>(*recv_buffer));
+      *recv_buffer += kRankBufferTileStride;
+    }
+  }
+
+  // Quantize an atom into the rank tile at atom_ptr, with the signed
+  // absolute maximum of its blocks from group_abs_max.
+  __quickreduce_device_inline__ void encode_atom(uint8_t* atom_ptr,
+                                                 int32x4_t const& atom,
+                                                 int wblockmax) {
+    // Derive scales
+    int decoding_scale;
+    int encoding_scale;
+    decoding_scale = packed_mul<half>(wblockmax, kScaleFactor);
+    encoding_scale = packed_add<half>(decoding_scale, kScaleEpsilon);
+    encoding_scale = packed_rcp<half>(encoding_scale);
+
+    // Apply scales to get quantized values
+    int32x4_t w;
+    for (int i = 0; i < 4; i++) {
+      w[i] = packed_mul<half>(atom[i], encoding_scale);
+      w[i] = packed_max<half>(w[i], kRangeMin);
+      w[i] = packed_min<half>(w[i], kRangeMax);
+    }
+
+    // Convert from f16x2_t to uint16x2_t
+    int32x4_t q;
+    {
+      int16_t* qi = reinterpret_cast<int16_t*>(&q);
+      half* wh = reinterpret_cast<half*>(&w);
+      for (int i = 0; i < 8; i++) qi[i] = (int16_t)rintf(T2float_cast(wh[i]));
 
-      // Apply scales to get quantized values
-      int32x4_t w;
       for (int i = 0; i < 4; i++) {
-        w[i] = packed_mul<half>(atom[i], encoding_scale);
-        w[i] = packed_max<half>(w[i], kRangeMin);
-        w[i] = packed_min<half>(w[i], kRangeMax);
+        q[i] = packed_add<int16_t>(q[i], kRangeBias);
       }
+    }
 
-      // Convert from f16x2_t to uint16x2_t
-      int32x4_t q;
-      {
-        int16_t* qi = reinterpret_cast<int16_t*>(&q);
-        //T* wh = reinterpret_cast<T*>(&w);
-         half* wh = reinterpret_cast<half*>(&w);
-        for (int i = 0; i < 8; i++) qi[i] = (int16_t)rintf(T2float_cast(wh[i]));
+    // Write quantized atom to send_buffer
+    // note: only the group leader stores the scale
+    int* qs_ptr = reinterpret_cast<int*>(atom_ptr + kRankTileScaleOffset) +
+                  (thread / 8);
 
-        for (int i = 0; i < 4; i++) {
-          q[i] = packed_add<int16_t>(q[i], kRangeBias);
-        }
-      }
+    store_code_planes<Layout>(atom_ptr, thread, q);
+    if (threadIdx.x == group_leader) {
+      __builtin_nontemporal_store(decoding_scale, qs_ptr);
+    }
+  }
+
+  // Dequantize the atom of the rank tile at atom_ptr.
+  __quickreduce_device_inline__ int32x4_t decode_atom(uint8_t* atom_ptr) {
+    int* qs_ptr = reinterpret_cast<int*>(atom_ptr + kRankTileScaleOffset) +
+                  (thread / 8);
+
+    int32x4_t w = load_code_planes<Layout>(atom_ptr, thread);
+    int qs = __builtin_nontemporal_load(qs_ptr);
+
+    // Convert the uint16x2_t codes to f16x2_t: or'ed into 1024.0h they read
+    // as 1024 + code, and kDecodeOffset removes 1024 and the range bias.
+    {
+      // {1024.0, 1024.0}, fp16x2_t
+      static uint constexpr kHalf2_1024 = 0x64006400;
 
-      // Pack 8 x q6 into int32_t + int16_t
-      uint32_t q4w;
-      uint16_t q2w = 0;
-      q4w = (q[0] & 0x000F000F) | ((q[1] & 0x000F000F) << 4) |
-            ((q[2] & 0x000F000F) << 8) | ((q[3] & 0x000F000F) << 12);
-      {
-        int16_t* tw = reinterpret_cast<int16_t*>(&q);
 #pragma unroll
-        for (int i = 0; i < 8; i++) {
-          q2w |= (tw[i] >> 4) << (i * 2);
-        }
+      for (int i = 0; i < 4; i++) {
+        w[i] = packed_add<half>(w[i] | kHalf2_1024, Constants::kDecodeOffset);
       }
-      // Write quantized atom to send_buffer
-      // note: only the group leader stores the scale
+    }
+
+    // Apply decoding scales
+    for (int i = 0; i < 4; i++) {
+      w[i] = packed_mul<half>(w[i], qs);
+    }
+
+    return w;
+  }
+};
+
+template <int world_size>
+using CodecQ3 = CodecQ<world_size, 3>;
+
+template <int world_size>
+using CodecQ4 = CodecQ<world_size, 4>;
+
+template <int world_size>
+using CodecQ5 = CodecQ<world_size, 5>;
+
+template <int world_size>
+using CodecQ6 = CodecQ<world_size, 6>;
+
+template <int world_size>
+using CodecQ7 = CodecQ<world_size, 7>;
+
+template <int world_size>
+using CodecQ8 = CodecQ<world_size, 8>;
+
+// Symmetric block-quantization with a per-block escape to fp16.
+// Blocks dominated by an outlier are sent as raw fp16 values in up to
+// `escapes` slots per wavefront, next to the codes of every block, see
+// EscapeLayout in core/codec_layout.h. The decoder reads the codes as CodecQ
+// and replaces the escaped blocks with their fp16 values.
+template <int world_size, int bits, int escapes>
+struct CodecQEscape : public CodecQ<world_size, bits> {
+  using Base = CodecQ<world_size, bits>;
+  using Escape = EscapeLayout<bits, escapes>;
+  using Base::group_leader;
+  using Base::thread;
+  static constexpr int kWorldSize = world_size;
+
+  // Codec tile size process by this workgroup.
+  static constexpr int kRankAtoms = Base::kRankAtoms;
+  static constexpr int kRankTileStride = Escape::kTileStride;
+  static constexpr int kRankTransmittedTileSize = kRankTileStride * kRankAtoms;
+  static_assert(kRankTransmittedTileSize % 16 == 0,
+                "kRankTransmittedTileSize must be 16B aligned.");
+
+  static constexpr int kRankBufferTileStride =
+      kRankTileStride / sizeof(int32x4_t);
+
+  // Total tile size for the collective communication.
+  static constexpr int kTransmittedTileSize =
+      kRankTransmittedTileSize * kWorldSize;
+
+  __quickreduce_device_inline__ CodecQEscape(int thread, int rank)
+      : Base(thread, rank) {}
+
+  __quickreduce_device_inline__ void send(int32x4_t* __restrict__ send_buffer,
+                                          const int32x4_t* __restrict__ data) {
+    int const wave = thread / kWavefront;
+    int const block = 2 * (threadIdx.x / kThreadGroupSize);
+
+    for (int k = 0; k < kRankAtoms; k++) {
+      int32x4_t const atom = data[k];
       uint8_t* atom_ptr =
           reinterpret_cast<uint8_t*>(send_buffer + k * kRankBufferTileStride);
-      uint32_t* q4w_ptr = reinterpret_cast<uint32_t*>(atom_ptr) + thread;
-      uint16_t* q2w_ptr =
-          reinterpret_cast<uint16_t*>(atom_ptr + kRankTileQ2Offset) + thread;
-      int* qs_ptr = reinterpret_cast<int*>(atom_ptr + kRankTileScaleOffset) +
-                    (thread / 8);
-
-      __builtin_nontemporal_store(q4w, q4w_ptr);
-      __builtin_nontemporal_store(q2w, q2w_ptr);
-      if (threadIdx.x == group_leader) {
-        __builtin_nontemporal_store(decoding_scale, qs_ptr);
+
+      int wblockmax = group_abs_max<half>(atom);
+      this->encode_atom(atom_ptr, atom, wblockmax);
+
+      // Compare the absolute maximum of both blocks with their mean
+      // magnitude.
+      float mean[2];
+      group_abs_mean(atom, mean);
+      bool const lo =
+          half_to_float(wblockmax & 0x7FFF) > Escape::kRatio * mean[0];
+      bool const hi =
+          half_to_float((wblockmax >> 16) & 0x7FFF) > Escape::kRatio * mean[1];
+      uint32_t const escaped =
+          Escape::select(wave_blocks(__ballot(lo), __ballot(hi)));
+
+      if (threadIdx.x == 0) {
+        __builtin_nontemporal_store(
+            static_cast<uint16_t>(escaped),
+            reinterpret_cast<uint16_t*>(atom_ptr + Escape::kMaskOffset) + wave);
+      }
+
+      // Raw values of the escaped blocks, 4 per thread.
+#pragma unroll
+      for (int h = 0; h < 2; h++) {
+        if (!(escaped & (1u << (block + h)))) continue;
+        int32x2_t raw;
+        raw[0] = half_of(atom[0], h) | (half_of(atom[1], h) << 16);
+        raw[1] = half_of(atom[2], h) | (half_of(atom[3], h) << 16);
+        int slot = Escape::slot(escaped, block + h);
+        __builtin_nontemporal_store(
+            raw, reinterpret_cast<int32x2_t*>(
+                     atom_ptr + Escape::slot_offset(wave, slot)) +
+                     (threadIdx.x % kThreadGroupSize));
       }
     }
   }
 
   __quickreduce_device_inline__ void recv(int32x4_t** __restrict__ recv_buffer,
                                           int32x4_t* __restrict__ data) {
+    int const wave = thread / kWavefront;
+    int const block = 2 * (threadIdx.x / kThreadGroupSize);
+
     for (int k = 0; k < kRankAtoms; k++) {
-      // Directly read quantized atom from recv_buffer
       uint8_t* atom_ptr = reinterpret_cast<uint8_t*>(*recv_buffer);
-      uint32_t* q4w_ptr = reinterpret_cast<uint32_t*>(atom_ptr) + thread;
-      uint16_t* q2w_ptr =
-          reinterpret_cast<uint16_t*>(atom_ptr + kRankTileQ2Offset) + thread;
-      int* qs_ptr = reinterpret_cast<int*>(atom_ptr + kRankTileScaleOffset) +
-                    (thread / 8);
-
-      uint32_t q4w = __builtin_nontemporal_load(q4w_ptr);
-      uint16_t q2w = __builtin_nontemporal_load(q2w_ptr);
-      int qs = __builtin_nontemporal_load(qs_ptr);
+      int32x4_t w = this->decode_atom(atom_ptr);
+      uint32_t escaped = __builtin_nontemporal_load(
+          reinterpret_cast<uint16_t*>(atom_ptr + Escape::kMaskOffset) + wave);
 
       *recv_buffer += kRankBufferTileStride;
 
-      // Unpack q6 into fp16x8_t
-      int32x4_t w;
-      {
-        static uint constexpr kMask000F = 0x000F000F;
-        static uint constexpr kHalf2_1024 =
-            0x64006400;  // {1024.0, 1024.0}, fp16x2_t
-        static uint constexpr kHalf2_1056 =
-            0xE420E420;  // {-1056.0, -1056.0}, fp16x2_t
-
 #pragma unroll
-        for (int i = 0; i < 4; i++) {
-          int32_t q4 = q4w & kMask000F;
-          int32_t q2 = (q2w & 0x3) | ((q2w & 0xC) << 14);
-          q4w >>= 4;
-          q2w >>= 4;
-          if constexpr (std::is_same<half, half>::value) {
-            int32_t q6 = q4 | (q2 << 4) | kHalf2_1024;
-            asm volatile("v_pk_add_f16 %0, %1, %2"
-                         : "=v"(w[i])
-                         : "v"(q6), "v"(kHalf2_1056));
-          } else {
-            int32_t int16_2 = q4 | (q2 << 4);
-            int16_t low = static_cast<int16_t>(int16_2 & 0xFFFF);
-            int16_t high = static_cast<int16_t>((int16_2 >> 16) & 0xFFFF);
-
-            nv_bfloat16 bf_low = __float2bfloat16(static_cast<float>(low));
-            nv_bfloat16 bf_high = __float2bfloat16(static_cast<float>(high));
-            nv_bfloat162 bf2 = __halves2bfloat162(bf_low, bf_high);
-            int32_t packed_bf16 = *reinterpret_cast<int32_t*>(&bf2);
-            w[i] = packed_add<nv_bfloat16>(packed_bf16, kRangeMin);
-          }
-        }
+      for (int h = 0; h < 2; h++) {
+        if (!(escaped & (1u << (block + h)))) continue;
+        int slot = Escape::slot(escaped, block + h);
+        int32x2_t raw = __builtin_nontemporal_load(
+            reinterpret_cast<int32x2_t*>(
+                atom_ptr + Escape::slot_offset(wave, slot)) +
+            (threadIdx.x % kThreadGroupSize));
+        uint32_t const keep = h ? 0x0000FFFF : 0xFFFF0000;
+        int const shift = 16 * h;
+        w[0] = (w[0] & keep) | (half_of(raw[0], 0) << shift);
+        w[1] = (w[1] & keep) | (half_of(raw[0], 1) << shift);
+        w[2] = (w[2] & keep) | (half_of(raw[1], 0) << shift);
+        w[3] = (w[3] & keep) | (half_of(raw[1], 1) << shift);
       }
 
-      // Apply decoding scales
+      data[k] = w;
+    }
+  }
+
+ private:
+  __quickreduce_device_inline__ static uint32_t half_of(int pair, int h) {
+    return (static_cast<uint32_t>(pair) >> (16 * h)) & 0xFFFF;
+  }
+
+  __quickreduce_device_inline__ static float half_to_float(uint32_t bits) {
+    return __half2float(__ushort_as_half(static_cast<uint16_t>(bits)));
+  }
+
+  // Mean magnitude of the lower and upper blocks of the thread group. The
+  // magnitudes are summed in fp32 and scaled by 1/32 once: scaled first, the
+  // values of a tiny block flush to zero, and fp16 sums could overflow.
+  __quickreduce_device_inline__ void group_abs_mean(int32x4_t const& atom,
+                                                    float (&mean)[2]) {
+#pragma unroll
+    for (int h = 0; h < 2; h++) {
+      float a[4];
+#pragma unroll
       for (int i = 0; i < 4; i++) {
-       // w[i] = packed_mul<T>(w[i], qs);
-       w[i] = packed_mul<half>(w[i], qs);
+        a[i] = half_to_float(half_of(atom[i], h) & 0x7FFF);
+      }
+      float sum = (a[0] + a[1]) + (a[2] + a[3]);
+      for (int i = 1; i < kThreadGroupSize; i <<= 1) {
+        sum += __shfl_down(sum, i);
       }
+      mean[h] = __shfl(sum, group_leader) * (1.0f / 32);
+    }
+  }
 
-      // That's pretty much it...
-      data[k] = w;
+  // Block mask of the wavefront from the ballots of the lower and upper
+  // blocks: bit 2g + h is the ballot of the leader of group g.
+  __quickreduce_device_inline__ static uint32_t wave_blocks(uint64_t lo,
+                                                            uint64_t hi) {
+    uint32_t blocks = 0;
+#pragma unroll
+    for (int g = 0; g < kWavefront / kThreadGroupSize; g++) {
+      blocks |= ((lo >> (g * kThreadGroupSize)) & 1) << (2 * g);
+      blocks |= ((hi >> (g * kThreadGroupSize)) & 1) << (2 * g + 1);
     }
+    return blocks;
   }
 };
 
-// Int8 symmetric quantization codec.
-// We quantize the FP16 data to block-scaled Int8 in blocks of 4 *
-// kThreadGroupSize.
 template <int world_size>
-struct CodecQ8 : public CodecBase {
+using CodecQ4Escape = CodecQEscape<world_size, 4, 2>;
+
+template <int world_size>
+using CodecQ6Escape = CodecQEscape<world_size, 6, 2>;
+
+// Asymmetric (zero-point) quantization codec.
+// We quantize the FP16 data in blocks of 4 * kThreadGroupSize onto the
+// unsigned range [0, 2^bits - 1] spanned by the block minimum and maximum.
+// Unlike the symmetric codecs, blocks with a skewed range (eg: post-activation
+// tensors) use the full code space. The codes are packed as in CodecQ,
+// and a fp16 scale and a fp16 minimum are stored per block.
+template <int world_size, int bits>
+struct CodecQAsym : public CodecBase {
+  static_assert(bits == 4 || bits == 6 || bits == 8,
+                "CodecQAsym supports 4, 6 and 8 bits.");
+  using Layout = AsymmetricCodeLayout<bits>;
+  static_assert(sizeof(int32x2_t) == 8, "A (scale, min) pair is 8B.");
   static constexpr int kWorldSize = world_size;
 
   // Codec tile size process by this workgroup.
-  // Each threads processes a fragment of f16x8_t (16B),
-  // into a int8x8_t (8B) and a f16 scale shared among 32 values.
+  // Each threads processes a fragment of fp16x8_t (16B),
+  // into a uintNx8_t and a (scale, min) pair shared among 32 values.
   static constexpr int kRankAtoms = kAtoms / kWorldSize;
-  static constexpr int kRankTileStride = 2176;
-  static constexpr int kRankTileScaleOffset = 2048;
+  static constexpr int kRankTileScaleOffset = Layout::kScaleOffset;
+  // The pairs follow the `bits` code bytes of every thread of the block.
+  static_assert(kRankTileScaleOffset == bits * kBlockSize,
+                "The (scale, min) pairs must not overlap the codes.");
+  static constexpr int kRankTileStride = Layout::kTileStride;
   static constexpr int kRankTransmittedTileSize = kRankTileStride * kRankAtoms;
   static_assert(kRankTransmittedTileSize % 16 == 0,
-                "kRankTileSize must be 16B aligned.");
+                "kRankTransmittedTileSize must be 16B aligned.");
 
   static constexpr int kRankBufferTileStride =
       kRankTileStride / sizeof(int32x4_t);
@@ -414,46 +617,46 @@ struct CodecQ8 : public CodecBase {
 
   // Constants configuration
 
-  // {-1/128.0h, -1/128.0h}, f16x2_t
-  static constexpr int kScaleFactor = 0xA000A000;
-  //    std::is_same<T, half>::value ? 0xA000A000 : 0xBC00BC00;
+  // {1/(2^bits - 1), 1/(2^bits - 1)}, f16x2_t
+  static constexpr int kScaleFactor =
+      bits == 4 ? 0x2C442C44 : (bits == 6 ? 0x24102410 : 0x1C041C04);
 
   // {1e-7, 1e-7}, f16x2_t
   static constexpr int kScaleEpsilon = 0x00010001;
-   //   std::is_same<T, half>::value ? 0x00010001 : 0x33D733D7;
 
-  // {-128, -128}, f16x2_t
-  static constexpr int kRangeMin = 0xD800D800;
-   //   std::is_same<T, half>::value ? 0xD800D800 : 0xC300C300;
-  // {+127, +127}, f16x2_t
-  static constexpr int kRangeMax = 0x57F057F0 ;
-    //  std::is_same<T, half>::value ? 0x57F057F0 : 0x42FE42FE;
+  // {0, 0}, f16x2_t
+  static constexpr int kRangeMin = 0x00000000;
 
-  // {+128, +128}, int16x2_t
-  static constexpr int kRangeBias = 0x00800080;
+  // {2^bits - 1, 2^bits - 1}, f16x2_t
+  static constexpr int kRangeMax =
+      bits == 4 ? 0x4B804B80 : (bits == 6 ? 0x53E053E0 : 0x5BF85BF8);
 
-  __quickreduce_device_inline__ CodecQ8(int thread, int rank)
+  __quickreduce_device_inline__ CodecQAsym(int thread, int rank)
       : CodecBase(thread, rank) {}
 
   __quickreduce_device_inline__ void send(int32x4_t* __restrict__ send_buffer,
-                                          int32x4_t const* __restrict__ data) {
+                                          const int32x4_t* __restrict__ data) {
     for (int k = 0; k < kRankAtoms; k++) {
       int32x4_t const atom = data[k];
-      // Compute the absolute maximum of the atom in the thread group
+
+      // Compute the range of the atom in the thread group
       // In 2 blocks of values, upper/lower halves of the f16x2_t
-      int wblockmax = group_abs_max<half>(atom);
+      int wmin, wmax;
+      group_min_max<half>(atom, wmin, wmax);
 
       // Derive scales
       int decoding_scale;
       int encoding_scale;
-      decoding_scale = packed_mul<half>(wblockmax, kScaleFactor);
+      decoding_scale = packed_sub<half>(wmax, wmin);
+      decoding_scale = packed_mul<half>(decoding_scale, kScaleFactor);
       encoding_scale = packed_add<half>(decoding_scale, kScaleEpsilon);
       encoding_scale = packed_rcp<half>(encoding_scale);
 
       // Apply scales to get quantized values
       int32x4_t w;
       for (int i = 0; i < 4; i++) {
-        w[i] = packed_mul<half>(atom[i], encoding_scale);
+        w[i] = packed_sub<half>(atom[i], wmin);
+        w[i] = packed_mul<half>(w[i], encoding_scale);
         w[i] = packed_max<half>(w[i], kRangeMin);
         w[i] = packed_min<half>(w[i], kRangeMax);
       }
@@ -462,31 +665,24 @@ struct CodecQ8 : public CodecBase {
       int32x4_t q;
       {
         int16_t* qi = reinterpret_cast<int16_t*>(&q);
-       // T* wh = reinterpret_cast<T*>(&w);
         half* wh = reinterpret_cast<half*>(&w);
         for (int i = 0; i < 8; i++) qi[i] = (int16_t)rintf(T2float_cast(wh[i]));
-
-        for (int i = 0; i < 4; i++) {
-          q[i] = packed_add<int16_t>(q[i], kRangeBias);
-        }
       }
 
-      // Pack 8 x q8 into int32x2_t
-      int32x2_t qw;
-      qw[0] = q[0] | (q[1] << 8);
-      qw[1] = q[2] | (q[3] << 8);
-
       // Write quantized atom to send_buffer
-      // note: only the group leader stores the scale
+      // note: only the group leader stores the scale and minimum
       uint8_t* atom_ptr =
           reinterpret_cast<uint8_t*>(send_buffer + k * kRankBufferTileStride);
-      int32x2_t* qw_ptr = reinterpret_cast<int32x2_t*>(atom_ptr) + thread;
-      int* qs_ptr = reinterpret_cast<int*>(atom_ptr + kRankTileScaleOffset) +
-                    (thread / 8);
+      int32x2_t* qs_ptr =
+          reinterpret_cast<int32x2_t*>(atom_ptr + kRankTileScaleOffset) +
+          (thread / 8);
 
-      __builtin_nontemporal_store(qw, qw_ptr);
+      store_code_planes<Layout>(atom_ptr, thread, q);
       if (threadIdx.x == group_leader) {
-        __builtin_nontemporal_store(decoding_scale, qs_ptr);
+        int32x2_t qs;
+        qs[0] = decoding_scale;
+        qs[1] = wmin;
+        __builtin_nontemporal_store(qs, qs_ptr);
       }
     }
   }
@@ -496,212 +692,1406 @@ struct CodecQ8 : public CodecBase {
     for (int k = 0; k < kRankAtoms; k++) {
       // Directly read quantized atom from recv_buffer
       uint8_t* atom_ptr = reinterpret_cast<uint8_t*>(*recv_buffer);
-      int32x2_t* qw_ptr = reinterpret_cast<int32x2_t*>(atom_ptr) + thread;
-      int* qs_ptr = reinterpret_cast<int*>(atom_ptr + kRankTileScaleOffset) +
-                    (thread / 8);
+      int32x2_t* qs_ptr =
+          reinterpret_cast<int32x2_t*>(atom_ptr + kRankTileScaleOffset) +
+          (thread / 8);
 
-      int32x2_t qw = __builtin_nontemporal_load(qw_ptr);
-      int qs = __builtin_nontemporal_load(qs_ptr);
+      int32x4_t w = load_code_planes<Layout>(atom_ptr, thread);
+      int32x2_t qs = __builtin_nontemporal_load(qs_ptr);
 
       *recv_buffer += kRankBufferTileStride;
 
-      // Unpack q8 into fp16x8_t
-      int32x4_t w;
+      // Convert the uint16x2_t codes to f16x2_t, and apply the decoding scale
+      // and minimum.
       {
-        static uint constexpr kMask00FF = 0x00FF00FF;
-
         // {1024.0, 1024.0}, fp16x2_t
         static uint constexpr kHalf2_1024 = 0x64006400;
 
-        // {-1152.0, -1152.0}, fp16x2_t
-        static uint constexpr kHalf2_1152 = 0xE480E480;
+        // {-1024.0, -1024.0}, fp16x2_t
+        static uint constexpr kHalf2_Neg1024 = 0xE400E400;
 
 #pragma unroll
         for (int i = 0; i < 4; i++) {
-          if constexpr (std::is_same<half, half>::value) {
-            int32_t q8 =
-                ((qw[i / 2] >> ((i % 2) * 8)) & kMask00FF) | kHalf2_1024;
-            w[i] = packed_add<half>(q8, kHalf2_1152);
-          } else {
-            int32_t int16_2 = (qw[i / 2] >> ((i % 2) * 8)) & kMask00FF;
-            int16_t low = static_cast<int16_t>(int16_2 & 0xFFFF);
-            int16_t high = static_cast<int16_t>((int16_2 >> 16) & 0xFFFF);
-            nv_bfloat16 bf_low = __float2bfloat16(static_cast<float>(low));
-            nv_bfloat16 bf_high = __float2bfloat16(static_cast<float>(high));
-            nv_bfloat162 bf2 = __halves2bfloat162(bf_low, bf_high);
-            int32_t packed_bf16 = *reinterpret_cast<int32_t*>(&bf2);
-            w[i] = packed_add<nv_bfloat16>(packed_bf16, kRangeMin);
-          }
+          w[i] = packed_add<half>(w[i] | kHalf2_1024, kHalf2_Neg1024);
+          w[i] = packed_fma<half>(w[i], qs[0], qs[1]);
         }
       }
 
-      // Apply decoding scales
-      for (int i = 0; i < 4; i++) {
-        //w[i] = packed_mul<T>(w[i], qs);
-        w[i] = packed_mul<half>(w[i], qs);
-      }
-
       data[k] = w;
     }
   }
 };
 
-// Twoshot All Reduce
-template <class Codec, bool cast_bf2half>
-struct AllReduceTwoshot {
-  //static_assert(sizeof(T) == 2);
+template <int world_size>
+using CodecQ4Asym = CodecQAsym<world_size, 4>;
 
-  static constexpr int kWorldSize = Codec::kWorldSize;
+template <int world_size>
+using CodecQ6Asym = CodecQAsym<world_size, 6>;
 
-  __device__ static void run(
-      half * __restrict__ input, 
-      uint32_t const N,                    // number of elements
-      int const block,                     // block index
-      int const rank,                      // rank index
-      uint8_t** __restrict__ buffer_list,  // communication buffers
-      uint32_t const data_offset,          // offset to start of the data buffer
-      uint32_t flag_color) {
-    // Topology
-    int thread = threadIdx.x + threadIdx.y * kWavefront;
-    uint8_t* rank_buffer = buffer_list[rank];
-    Codec codec(thread, rank);
-    int block_id = blockIdx.x;
-    int grid_size = gridDim.x;
-    // --------------------------------------------------------
-    // Read input into registers
-    int32x4_t tA[kAtoms];
+template <int world_size>
+using CodecQ8Asym = CodecQAsym<world_size, 8>;
+
+// Top-k sparsification codec.
+// Each thread sends the k values of largest magnitude among its f16x8_t as
+// (index, value) pairs and drops the rest, which suits sparse residual or
+// gradient-like updates. The values are sent as fp16, or as int8 with a fp16
+// scale per thread group when quantize_values is set. The receiver expands
+// the pairs back into a dense atom, so the dropped values read as zero and
+// Phase-1B adds the received values into the reduction as usual.
+// The tile stride is fixed by k, which keeps the buffer layout of the dense
+// codecs.
+template <int world_size, int k, bool quantize_values>
+struct CodecTopK : public CodecBase {
+  static_assert(k == 1 || k == 2 || k == 4, "CodecTopK supports k = 1, 2, 4.");
+  static constexpr int kWorldSize = world_size;
 
-    //BufferResource src_buffer(const_cast<T*>(input), N * sizeof(T));
-    BufferResource src_buffer(const_cast<half*>(input), N * sizeof(half));
-    uint32_t src_offset = block * kTileSize + thread * sizeof(int32x4_t);
+  // Codec tile size process by this workgroup.
+  // Each threads processes a fragment of fp16x8_t (16B),
+  // into k values (fp16 or int8) and k 3-bit indices.
+  static constexpr int kRankAtoms = kAtoms / kWorldSize;
+  static constexpr int kValueBytes = quantize_values ? 1 : 2;
+  static constexpr int kIndexBytes = k <= 2 ? 1 : 2;
+  static constexpr int kRankTileIndexOffset = kBlockSize * k * kValueBytes;
+  static constexpr int kRankTileScaleOffset =
+      kRankTileIndexOffset + kBlockSize * kIndexBytes;
+  static constexpr int kRankTileStride =
+      kRankTileScaleOffset +
+      (quantize_values ? (kBlockSize / kThreadGroupSize) * sizeof(half) : 0);
+  static constexpr int kRankTransmittedTileSize = kRankTileStride * kRankAtoms;
+  static_assert(kRankTransmittedTileSize % 16 == 0,
+                "kRankTransmittedTileSize must be 16B aligned.");
 
-    for (int i = 0; i < kAtoms; i++) {
-      tA[i] = buffer_load_dwordx4(src_buffer.descriptor, src_offset, 0, 0);
-      src_offset += kAtomStride * sizeof(int32x4_t);
-      if constexpr (cast_bf2half) {
-        const nv_bfloat162* bf_buf =
-            reinterpret_cast<const nv_bfloat162*>(&tA[i]);
-        half2 half_buf[4];
-#pragma unroll
-        for (int j = 0; j < 4; ++j) {
-          float2 f = __bfloat1622float2(bf_buf[j]);
-          half_buf[j] = __float22half2_rn(f);
-        }
-        tA[i] = *reinterpret_cast<const int32x4_t*>(half_buf);
-      }
-    }
+  static constexpr int kRankBufferTileStride =
+      kRankTileStride / sizeof(int32x4_t);
 
-    // --------------------------------------------------------
-    // Phase-1A: Write segment data into the communication buffer of the target
-    // rank responsible for this segment.
-    uint32_t comm_data0_offset =
-        data_offset + block_id * Codec::kTransmittedTileSize;
-    uint32_t comm_data1_offset =
-        grid_size * Codec::kTransmittedTileSize + comm_data0_offset;
+  // Total tile size for the collective communication.
+  static constexpr int kTransmittedTileSize =
+      kRankTransmittedTileSize * kWorldSize;
 
-    uint32_t comm_flags0_offset = block_id * (kWorldSize * sizeof(uint32_t));
-    uint32_t comm_flags1_offset =
-        grid_size * (kWorldSize * sizeof(uint32_t)) + comm_flags0_offset;
+  // Largest int8 code of the quantized values.
+  static constexpr float kValueRange = 127.0f;
 
-    for (int r = 0; r < kWorldSize; r++) {
-      int32x4_t* send_buffer =
-          reinterpret_cast<int32x4_t*>(buffer_list[r] + comm_data0_offset +
-                                       rank * Codec::kRankTransmittedTileSize);
-      codec.send(send_buffer, &tA[r * Codec::kRankAtoms]);
+  __quickreduce_device_inline__ CodecTopK(int thread, int rank)
+      : CodecBase(thread, rank) {}
+
+  __quickreduce_device_inline__ void send(int32x4_t* __restrict__ send_buffer,
+                                          const int32x4_t* __restrict__ data) {
+    for (int a = 0; a < kRankAtoms; a++) {
+      int32x4_t const atom = data[a];
+      uint16_t const* v = reinterpret_cast<uint16_t const*>(&atom);
+
+      // Select the k largest magnitudes. Positive fp16 values order like
+      // their bit patterns, and the lowest index wins among equals.
+      uint32_t taken = 0;
+      uint32_t indices = 0;
+      uint16_t selected[k];
+#pragma unroll
+      for (int s = 0; s < k; s++) {
+        int best = 0;
+        uint16_t best_value = 0;
+        int best_magnitude = -1;
+#pragma unroll
+        for (int j = 0; j < 8; j++) {
+          int magnitude = v[j] & 0x7FFF;
+          if (!(taken & (1u << j)) && magnitude > best_magnitude) {
+            best = j;
+            best_value = v[j];
+            best_magnitude = magnitude;
+          }
+        }
+        taken |= 1u << best;
+        indices |= best << (3 * s);
+        selected[s] = best_value;
+      }
+
+      uint8_t* atom_ptr =
+          reinterpret_cast<uint8_t*>(send_buffer + a * kRankBufferTileStride);
+
+      uint64_t values = 0;
+      if constexpr (quantize_values) {
+        // The first selected value has the largest magnitude of the thread.
+        int wmax = selected[0] & 0x7FFF;
+        for (int i = 1; i < kThreadGroupSize; i <<= 1) {
+          wmax = max(wmax, __shfl_down(wmax, i));
+        }
+        wmax = __shfl(wmax, group_leader);
+
+        // Derive scales
+        half decoding_scale = __float2half(
+            __half2float(__ushort_as_half(static_cast<uint16_t>(wmax))) /
+            kValueRange);
+        float encoding_scale =
+            1.0f / fmaxf(__half2float(decoding_scale), 1e-7f);
+
+#pragma unroll
+        for (int s = 0; s < k; s++) {
+          float w = __half2float(__ushort_as_half(selected[s])) * encoding_scale;
+          w = fminf(fmaxf(rintf(w), -kValueRange), kValueRange);
+          values |= uint64_t(static_cast<uint8_t>(static_cast<int8_t>(w)))
+                    << (8 * s);
+        }
+
+        // note: only the group leader stores the scale
+        if (threadIdx.x == group_leader) {
+          uint16_t* qs_ptr =
+              reinterpret_cast<uint16_t*>(atom_ptr + kRankTileScaleOffset) +
+              (thread / 8);
+          __builtin_nontemporal_store(__half_as_ushort(decoding_scale), qs_ptr);
+        }
+      } else {
+#pragma unroll
+        for (int s = 0; s < k; s++) {
+          values |= uint64_t(selected[s]) << (16 * s);
+        }
+      }
+
+      store_bits<k * kValueBytes>(atom_ptr, values);
+      store_bits<kIndexBytes>(atom_ptr + kRankTileIndexOffset, indices);
+    }
+  }
+
+  __quickreduce_device_inline__ void recv(int32x4_t** __restrict__ recv_buffer,
+                                          int32x4_t* __restrict__ data) {
+    for (int a = 0; a < kRankAtoms; a++) {
+      uint8_t* atom_ptr = reinterpret_cast<uint8_t*>(*recv_buffer);
+      uint64_t values = load_bits<k * kValueBytes>(atom_ptr);
+      uint32_t indices = static_cast<uint32_t>(
+          load_bits<kIndexBytes>(atom_ptr + kRankTileIndexOffset));
+
+      float decoding_scale = 0.0f;
+      if constexpr (quantize_values) {
+        uint16_t* qs_ptr =
+            reinterpret_cast<uint16_t*>(atom_ptr + kRankTileScaleOffset) +
+            (thread / 8);
+        decoding_scale =
+            __half2float(__ushort_as_half(__builtin_nontemporal_load(qs_ptr)));
+      }
+
+      *recv_buffer += kRankBufferTileStride;
+
+      // Expand the pairs into a dense atom. Every position is written with
+      // static register indexing; unselected positions read as zero.
+      int32x4_t w;
+      uint16_t* wh = reinterpret_cast<uint16_t*>(&w);
+#pragma unroll
+      for (int j = 0; j < 8; j++) {
+        wh[j] = 0;
+      }
+#pragma unroll
+      for (int s = 0; s < k; s++) {
+        int index = (indices >> (3 * s)) & 0x7;
+        uint16_t value;
+        if constexpr (quantize_values) {
+          int8_t q = static_cast<int8_t>((values >> (8 * s)) & 0xFF);
+          value = __half_as_ushort(__float2half(q * decoding_scale));
+        } else {
+          value = static_cast<uint16_t>((values >> (16 * s)) & 0xFFFF);
+        }
+#pragma unroll
+        for (int j = 0; j < 8; j++) {
+          wh[j] = index == j ? value : wh[j];
+        }
+      }
+
+      data[a] = w;
     }
+  }
 
-    __syncthreads();
-    if (thread < kWorldSize) {
-      int r = thread;
-      uint32_t* flag_ptr = reinterpret_cast<uint32_t*>(
-          buffer_list[r] + comm_flags0_offset + rank * sizeof(uint32_t));
-      set_sync_flag(flag_ptr, flag_color);
+ private:
+  // Per-thread stores of 1, 2, 4 or 8 bytes.
+  template <int bytes>
+  __quickreduce_device_inline__ void store_bits(uint8_t* region,
+                                                uint64_t bits) {
+    if constexpr (bytes == 1) {
+      __builtin_nontemporal_store(static_cast<uint8_t>(bits), region + thread);
+    } else if constexpr (bytes == 2) {
+      __builtin_nontemporal_store(static_cast<uint16_t>(bits),
+                                  reinterpret_cast<uint16_t*>(region) + thread);
+    } else if constexpr (bytes == 4) {
+      __builtin_nontemporal_store(static_cast<uint32_t>(bits),
+                                  reinterpret_cast<uint32_t*>(region) + thread);
+    } else {
+      int32x2_t qw;
+      qw[0] = static_cast<int>(bits);
+      qw[1] = static_cast<int>(bits >> 32);
+      __builtin_nontemporal_store(qw,
+                                  reinterpret_cast<int32x2_t*>(region) + thread);
+    }
+  }
+
+  template <int bytes>
+  __quickreduce_device_inline__ uint64_t load_bits(uint8_t* region) {
+    if constexpr (bytes == 1) {
+      return __builtin_nontemporal_load(region + thread);
+    } else if constexpr (bytes == 2) {
+      return __builtin_nontemporal_load(reinterpret_cast<uint16_t*>(region) +
+                                        thread);
+    } else if constexpr (bytes == 4) {
+      return __builtin_nontemporal_load(reinterpret_cast<uint32_t*>(region) +
+                                        thread);
+    } else {
+      int32x2_t qw = __builtin_nontemporal_load(
+          reinterpret_cast<int32x2_t*>(region) + thread);
+      return static_cast<uint32_t>(qw[0]) |
+             (static_cast<uint64_t>(static_cast<uint32_t>(qw[1])) << 32);
+    }
+  }
+};
+
+template <int world_size>
+using CodecTop4 = CodecTopK<world_size, 4, false>;
+
+template <int world_size>
+using CodecTop2 = CodecTopK<world_size, 2, false>;
+
+template <int world_size>
+using CodecTop2Q8 = CodecTopK<world_size, 2, true>;
+
+// OCP Microscaling codec, see core/mx_format.h.
+// An MX block is 32 consecutive values, the 8 values of 4 consecutive
+// threads, with a shared E8M0 scale byte. The codes use the bit planes of
+// QuantCodeLayout, followed by the 64 scale bytes of the rank tile in block
+// order. The power-of-two scales are applied with ldexp.
+template <int world_size, class Element>
+struct CodecMX : public CodecBase {
+  static constexpr bool kMxEncoded = true;
+  using Layout = QuantCodeLayout<Element::kBits, 2>;
+  static constexpr int kWorldSize = world_size;
+
+  // Threads of an MX block.
+  static constexpr int kBlockThreads = kMxBlockSize / 8;
+
+  // Codec tile size process by this workgroup.
+  // Each threads processes a fragment of fp16x8_t (16B),
+  // into kBits bytes of codes and a scale byte shared by 4 threads.
+  static constexpr int kRankAtoms = kAtoms / kWorldSize;
+  static constexpr int kRankTileStride = Layout::kTileStride;
+  static constexpr int kRankTileScaleOffset = Layout::kScaleOffset;
+  static constexpr int kRankTransmittedTileSize = kRankTileStride * kRankAtoms;
+  static_assert(kRankTransmittedTileSize % 16 == 0,
+                "kRankTransmittedTileSize must be 16B aligned.");
+
+  static constexpr int kRankBufferTileStride =
+      kRankTileStride / sizeof(int32x4_t);
+
+  // Total tile size for the collective communication.
+  static constexpr int kTransmittedTileSize =
+      kRankTransmittedTileSize * kWorldSize;
+
+  __quickreduce_device_inline__ CodecMX(int thread, int rank)
+      : CodecBase(thread, rank) {}
+
+  __quickreduce_device_inline__ void send(int32x4_t* __restrict__ send_buffer,
+                                          const int32x4_t* __restrict__ data) {
+    for (int k = 0; k < kRankAtoms; k++) {
+      int32x4_t const atom = data[k];
+      half const* v = reinterpret_cast<half const*>(&atom);
+
+      // Largest magnitude of the block. Positive fp16 values order like
+      // their bit patterns.
+      int wmax = 0;
+#pragma unroll
+      for (int i = 0; i < 4; i++) {
+        wmax = packed_max<half>(wmax, atom[i] & 0x7FFF7FFF);
+      }
+      wmax = max(wmax & 0xFFFF, (wmax >> 16) & 0xFFFF);
+      for (int i = 1; i < kBlockThreads; i <<= 1) {
+        wmax = max(wmax, __shfl_xor(wmax, i));
+      }
+      float amax = __half2float(__ushort_as_half(static_cast<uint16_t>(wmax)));
+      int x = mx_shared_exponent<Element>(amax);
+
+      int32x4_t q;
+#pragma unroll
+      for (int i = 0; i < 4; i++) {
+        q[i] = Element::encode(ldexpf(__half2float(v[2 * i]), -x)) |
+               (Element::encode(ldexpf(__half2float(v[2 * i + 1]), -x)) << 16);
+      }
+
+      uint8_t* atom_ptr =
+          reinterpret_cast<uint8_t*>(send_buffer + k * kRankBufferTileStride);
+      store_code_planes<Layout>(atom_ptr, thread, q);
+      // note: only the first thread of a block stores the scale
+      if (threadIdx.x % kBlockThreads == 0) {
+        __builtin_nontemporal_store(
+            static_cast<uint8_t>(x + kMxScaleBias),
+            atom_ptr + kRankTileScaleOffset + thread / kBlockThreads);
+      }
+    }
+  }
+
+  __quickreduce_device_inline__ void recv(int32x4_t** __restrict__ recv_buffer,
+                                          int32x4_t* __restrict__ data) {
+    for (int k = 0; k < kRankAtoms; k++) {
+      uint8_t* atom_ptr = reinterpret_cast<uint8_t*>(*recv_buffer);
+      int32x4_t q = load_code_planes<Layout>(atom_ptr, thread);
+      int x = static_cast<int>(__builtin_nontemporal_load(
+                  atom_ptr + kRankTileScaleOffset + thread / kBlockThreads)) -
+              kMxScaleBias;
+
+      *recv_buffer += kRankBufferTileStride;
+
+      int32x4_t w;
+      half* wh = reinterpret_cast<half*>(&w);
+      uint32_t const* codes = reinterpret_cast<uint32_t const*>(&q);
+#pragma unroll
+      for (int j = 0; j < 8; j++) {
+        uint32_t code = (codes[j / 2] >> (16 * (j % 2))) & 0xFFFF;
+        wh[j] = __float2half(ldexpf(Element::decode(code), x));
+      }
+      data[k] = w;
+    }
+  }
+
+  // Copy the received blocks of a segment to `out`, starting at element
+  // `first_element`, without decoding them. Elements from N on are dropped.
+  __quickreduce_device_inline__ void recv_mx(
+      int32x4_t** __restrict__ recv_buffer, MxOutput const& out,
+      uint32_t const first_element, uint32_t const N) {
+    for (int k = 0; k < kRankAtoms; k++) {
+      uint8_t* atom_ptr = reinterpret_cast<uint8_t*>(*recv_buffer);
+      int32x4_t q = load_code_planes<Layout>(atom_ptr, thread);
+      uint8_t scale = __builtin_nontemporal_load(
+          atom_ptr + kRankTileScaleOffset + thread / kBlockThreads);
+
+      *recv_buffer += kRankBufferTileStride;
+
+      uint32_t element = first_element + (k * kAtomStride + thread) * 8;
+      if (element >= N) continue;
+
+      // The 8 codes of the thread, consecutive in element order.
+      uint64_t packed = 0;
+      uint32_t const* codes = reinterpret_cast<uint32_t const*>(&q);
+#pragma unroll
+      for (int j = 0; j < 8; j++) {
+        uint64_t code = (codes[j / 2] >> (16 * (j % 2))) & 0xFFFF;
+        packed |= code << (j * Element::kBits);
+      }
+      uint8_t* dst = out.elements + (element / 8) * Element::kBits;
+      if constexpr (Element::kBits == 4) {
+        *reinterpret_cast<uint32_t*>(dst) = static_cast<uint32_t>(packed);
+      } else if constexpr (Element::kBits == 8) {
+        *reinterpret_cast<uint64_t*>(dst) = packed;
+      } else {
+        static_assert(Element::kBits % 2 == 0);
+#pragma unroll
+        for (int b = 0; b < Element::kBits / 2; b++) {
+          reinterpret_cast<uint16_t*>(dst)[b] =
+              static_cast<uint16_t>(packed >> (16 * b));
+        }
+      }
+      if (threadIdx.x % kBlockThreads == 0) {
+        out.scales[element / kMxBlockSize] = scale;
+      }
+    }
+  }
+};
+
+template <int world_size>
+using CodecMXFP4 = CodecMX<world_size, MxFp4>;
+
+template <int world_size>
+using CodecMXFP6 = CodecMX<world_size, MxFp6>;
+
+template <int world_size>
+using CodecMXINT8 = CodecMX<world_size, MxInt8>;
+
+// A codec per phase of the two-shot all-reduce: Phase1 for the
+// reduce-scatter, Phase2 for the all-gather of the reduced segments. Phase-1
+// quantizes every input and Phase-2 only the sum, so a cheap Phase-1 codec
+// with a finer Phase-2 codec trades the two error terms separately.
+template <class Phase1, class Phase2>
+struct PhaseCodecs {
+  static_assert(Phase1::kWorldSize == Phase2::kWorldSize);
+  static constexpr bool kLossless = Phase1::kLossless && Phase2::kLossless;
+};
+
+// Hadamard rotation of the quantization blocks of a line codec, see
+// core/hadamard.h. The sends rotate the atoms before encoding them and the
+// receives rotate them back after decoding; the two-shot all-reduce rotates
+// the whole tile instead (see PhaseCodecTraits).
+template <class Inner>
+struct CodecHadamard : public Inner {
+  static constexpr int kRankAtoms = Inner::kRankAtoms;
+
+  __quickreduce_device_inline__ CodecHadamard(int thread, int rank)
+      : Inner(thread, rank) {}
+
+  __quickreduce_device_inline__ void send(int32x4_t* __restrict__ send_buffer,
+                                          const int32x4_t* __restrict__ data) {
+    int32x4_t rotated[kRankAtoms];
+    for (int k = 0; k < kRankAtoms; k++) {
+      rotated[k] = data[k];
+      hadamard_rotate(rotated[k]);
+    }
+    Inner::send(send_buffer, rotated);
+  }
+
+  __quickreduce_device_inline__ void recv(int32x4_t** __restrict__ recv_buffer,
+                                          int32x4_t* __restrict__ data) {
+    Inner::recv(recv_buffer, data);
+    for (int k = 0; k < kRankAtoms; k++) {
+      hadamard_rotate(data[k]);
     }
+  }
+};
+
+template <int world_size>
+using CodecQ4Hadamard = CodecHadamard<CodecQ4<world_size>>;
+
+template <int world_size>
+using CodecQ6Hadamard = CodecHadamard<CodecQ6<world_size>>;
+
+// Codecs of each phase, for a line codec or a PhaseCodecs pair. With
+// kRotated, the two-shot all-reduce rotates the tile after loading it and
+// before storing it, and the phases run in the rotated domain: the sum of
+// rotated blocks is the rotated sum, so Phase-1B reduces without rotating
+// back.
+template <class LineCodec>
+struct PhaseCodecTraits {
+  using Phase1 = LineCodec;
+  using Phase2 = LineCodec;
+  static constexpr bool kRotated = false;
+};
+
+template <class Phase1_, class Phase2_>
+struct PhaseCodecTraits<PhaseCodecs<Phase1_, Phase2_>> {
+  using Phase1 = Phase1_;
+  using Phase2 = Phase2_;
+  static constexpr bool kRotated = false;
+};
+
+template <class Inner>
+struct PhaseCodecTraits<CodecHadamard<Inner>> {
+  using Phase1 = Inner;
+  using Phase2 = Inner;
+  static constexpr bool kRotated = true;
+};
+
+template <int world_size>
+using CodecQ4Q8 = PhaseCodecs<CodecQ4<world_size>, CodecQ8<world_size>>;
+
+template <int world_size>
+using CodecQ4FP = PhaseCodecs<CodecQ4<world_size>, CodecFP<world_size>>;
+
+template <int world_size>
+using CodecQ6Q8 = PhaseCodecs<CodecQ6<world_size>, CodecQ8<world_size>>;
+
+template <int world_size>
+using CodecQ6FP = PhaseCodecs<CodecQ6<world_size>, CodecFP<world_size>>;
+
+template <int world_size>
+using CodecQ8FP = PhaseCodecs<CodecQ8<world_size>, CodecFP<world_size>>;
+
+// Reduction operators of Phase-1B (see core/reduce_op.h). `combine` folds the
+// segment of a rank into the accumulator, which starts as the segment of
+// rank 0, and `finalize` runs once before the reduced segment is broadcast.
+struct ReduceSum {
+  __quickreduce_device_inline__ static void combine(int32x4_t* acc,
+                                                    int32x4_t* value) {
+    packed_assign_add<half>(acc, value);
+  }
+  __quickreduce_device_inline__ static void finalize(int32x4_t*, int) {}
+};
+
+struct ReduceMax {
+  __quickreduce_device_inline__ static void combine(int32x4_t* acc,
+                                                    int32x4_t* value) {
+    for (int j = 0; j < 4; j++) {
+      (*acc)[j] = packed_max<half>((*acc)[j], (*value)[j]);
+    }
+  }
+  __quickreduce_device_inline__ static void finalize(int32x4_t*, int) {}
+};
+
+struct ReduceMin {
+  __quickreduce_device_inline__ static void combine(int32x4_t* acc,
+                                                    int32x4_t* value) {
+    for (int j = 0; j < 4; j++) {
+      (*acc)[j] = packed_min<half>((*acc)[j], (*value)[j]);
+    }
+  }
+  __quickreduce_device_inline__ static void finalize(int32x4_t*, int) {}
+};
+
+struct ReduceMean : ReduceSum {
+  // Sum scaled by 1 / world_size, exact for a power-of-two world size.
+  __quickreduce_device_inline__ static void finalize(int32x4_t* acc,
+                                                     int world_size) {
+    half2 scale = __float2half2_rn(1.0f / world_size);
+    int scale_bits = __builtin_bit_cast(int, scale);
+    for (int j = 0; j < 4; j++) {
+      (*acc)[j] = packed_mul<half>((*acc)[j], scale_bits);
+    }
+  }
+};
+
+// Twoshot All Reduce
+// Codec encodes the Phase-1 sends and Phase2Codec the Phase-2 sends. The
+// regions of both phases are strided by the larger transmitted tile. With
+// `rotated`, both phases run on the Hadamard rotation of the tile.
+template <class Codec, bool cast_bf2half, class Reduce = ReduceSum,
+          class Phase2Codec = Codec, bool rotated = false>
+struct AllReduceTwoshot {
+  //static_assert(sizeof(T) == 2);
+
+  static constexpr int kWorldSize = Codec::kWorldSize;
+  static_assert(Phase2Codec::kWorldSize == kWorldSize);
+  static constexpr int kTransmittedTileSize =
+      Codec::kTransmittedTileSize > Phase2Codec::kTransmittedTileSize
+          ? Codec::kTransmittedTileSize
+          : Phase2Codec::kTransmittedTileSize;
+  static_assert(kTransmittedTileSize <= kMaxTransmittedTileSize,
+                "The buffer regions do not fit the tiles of the codec.");
+
+  __device__ static void run(
+      half * __restrict__ input, 
+      TensorLayout const layout,           // rows/strides of the input
+      int const block,                     // block index
+      int const rank,                      // rank index
+      uint8_t** __restrict__ buffer_list,  // communication buffers
+      uint32_t const data_offset,          // offset to start of the data buffer
+      uint32_t const max_grid,             // stride of the buffer regions
+      uint32_t flag_color,
+      TileReadiness const readiness = {},  // producer flags of the input
+      DirectOutput const direct = {},      // registered outputs of the ranks
+      MxOutput const mx = {},              // MX-encoded output of the result
+      QuantErrorTelemetry const telemetry = {}) {  // sampled codec errors
+    // Topology
+    int thread = threadIdx.x + threadIdx.y * kWavefront;
+    uint8_t* rank_buffer = buffer_list[rank];
+    Codec codec(thread, rank);
+    Phase2Codec codec2(thread, rank);
+    int block_id = blockIdx.x;
+    // --------------------------------------------------------
+    // Read input into registers
+    int32x4_t tA[kAtoms];
+    wait_tile_ready(readiness, layout.numel(), block, kTileElements, thread);
+    load_tile(input, layout, block, thread, tA);
+    rotate_atoms(tA, kAtoms);
+
+    // --------------------------------------------------------
+    // Phase-1A: Write segment data into the communication buffer of the target
+    // rank responsible for this segment.
+    uint32_t comm_data0_offset = comm_data_offset(
+        data_offset, 0, 0, block_id, max_grid, kTransmittedTileSize);
+    uint32_t comm_data1_offset = comm_data_offset(
+        data_offset, 1, 0, block_id, max_grid, kTransmittedTileSize);
+
+    uint32_t comm_flags0_offset =
+        comm_flags_offset(0, 0, block_id, max_grid, kWorldSize);
+    uint32_t comm_flags1_offset =
+        comm_flags_offset(1, 0, block_id, max_grid, kWorldSize);
+
+    scatter_segments(codec, tA, thread, rank, buffer_list, comm_data0_offset,
+                     comm_flags0_offset, flag_color);
+
     // --------------------------------------------------------
     // Phase-1B: Reduce the segment data from the communication buffers.
+    QuantErrorRecord* errors = telemetry.sampled(block);
     int32x4_t tR[Codec::kRankAtoms] = {};
-    {
-      // Read the data from the communication buffer.
-      int32x4_t* recv_buffer =
-          reinterpret_cast<int32x4_t*>(rank_buffer + comm_data0_offset);
-      uint32_t* flag_ptr =
-          reinterpret_cast<uint32_t*>(rank_buffer + comm_flags0_offset);
-
-      for (int r = 0; r < kWorldSize; r++) {
-        // Wait for the flags to be set.
-        if (thread == 0) {
-          wait_sync_flag(&flag_ptr[r], flag_color);
-        }
-        __syncthreads();
+    reduce_segments(codec, tA, tR, thread, rank, rank_buffer,
+                    comm_data0_offset, comm_flags0_offset, flag_color,
+                    errors ? &errors->phase[0] : nullptr);
+
+    if constexpr (Phase2Codec::kLossless) {
+      if (direct.enabled()) {
+        // Phase-2: Write the reduced segment to the output of every rank.
+        rotate_atoms(tR, Codec::kRankAtoms);
+        store_segment_direct(tR, layout, block, thread, rank, direct,
+                             buffer_list, comm_flags1_offset, flag_color);
+        wait_segments_direct(thread, rank_buffer, comm_flags1_offset,
+                             flag_color);
+        return;
+      }
+    }
 
-        // note: we reuse tA as temp buffer here
-        codec.recv(&recv_buffer, tA);
+    // Phase-2: Write the reduced segment to every other rank
+    broadcast_segment(codec2, tR, thread, rank, buffer_list, comm_data1_offset,
+                      comm_flags1_offset, flag_color);
+
+    if constexpr (Phase2Codec::kMxEncoded && !rotated) {
+      if (mx.enabled()) {
+        // Phase-2: Hand the gathered segments over MX-encoded.
+        gather_segments_mx(codec2, mx, block, thread, rank_buffer,
+                           comm_data1_offset, comm_flags1_offset, flag_color,
+                           layout.numel());
+        return;
+      }
+    }
 
-        for (int i = 0; i < Codec::kRankAtoms; i++) {
-          packed_assign_add<half>(&tR[i], &tA[i]);
+    // Phase-2: Read the gather segments from the rank's communication buffer.
+    gather_segments(codec2, tA, thread, rank_buffer, comm_data1_offset,
+                    comm_flags1_offset, flag_color, rank, tR,
+                    errors ? &errors->phase[1] : nullptr);
+
+    // --------------------------------------------------------
+    // Write the result to output.
+    rotate_atoms(tA, kAtoms);
+    store_tile(input, layout, block, thread, tA);
+  }
+
+  // Rotate the blocks of `n` atoms into or out of the rotated domain.
+  __device__ static void rotate_atoms(int32x4_t* __restrict__ atoms,
+                                      int const n) {
+    if constexpr (rotated) {
+      for (int i = 0; i < n; i++) {
+        hadamard_rotate(atoms[i]);
+      }
+    }
+  }
+
+  // Read the input tile into registers, gathering the atoms of a strided
+  // layout in place.
+  __device__ static void load_tile(half* __restrict__ input,
+                                   TensorLayout const& layout,
+                                   int const block, int const thread,
+                                   int32x4_t* __restrict__ tA) {
+    uint32_t range = layout_span(layout) * sizeof(half);
+    BufferResource src_buffer(const_cast<half*>(input), range);
+
+    for (int i = 0; i < kAtoms; i++) {
+      uint32_t src_offset = layout_atom_offset(
+          layout, block, thread, i, kTileElements, kAtomStride, range);
+      tA[i] = buffer_load_dwordx4(src_buffer.descriptor, src_offset, 0, 0);
+      if constexpr (cast_bf2half) {
+        const nv_bfloat162* bf_buf =
+            reinterpret_cast<const nv_bfloat162*>(&tA[i]);
+        half2 half_buf[4];
+#pragma unroll
+        for (int j = 0; j < 4; ++j) {
+          float2 f = __bfloat1622float2(bf_buf[j]);
+          half_buf[j] = __float22half2_rn(f);
         }
+        tA[i] = *reinterpret_cast<const int32x4_t*>(half_buf);
       }
     }
+  }
 
-    // Phase-2: Write the reduced segment to every other rank
-    for (int r = 0; r < kWorldSize; r++) {
-      int32x4_t* send_buffer =
-          reinterpret_cast<int32x4_t*>(buffer_list[r] + comm_data1_offset +
-                                       rank * Codec::kRankTransmittedTileSize);
-      codec.send(send_buffer, tR);
+  // Write the registers to the output tile, scattering the atoms of a
+  // strided layout in place.
+  __device__ static void store_tile(half* __restrict__ input,
+                                    TensorLayout const& layout,
+                                    int const block, int const thread,
+                                    int32x4_t const* __restrict__ tA) {
+    uint32_t range = layout_span(layout) * sizeof(half);
+    BufferResource dst_buffer(input, range);
+
+    for (int i = 0; i < kAtoms; i++) {
+      uint32_t dst_offset = layout_atom_offset(
+          layout, block, thread, i, kTileElements, kAtomStride, range);
+      buffer_store_dwordx4(output_atom(tA[i]), dst_buffer.descriptor,
+                           dst_offset, 0, 0);
     }
+  }
+
+  // An fp16 atom in the type of the output.
+  __device__ static int32x4_t output_atom(int32x4_t const& atom) {
+    if constexpr (cast_bf2half) {
+      const half2* half_buf = reinterpret_cast<const half2*>(&atom);
+      nv_bfloat162 bf16_buf[4];
+#pragma unroll
+      for (int j = 0; j < 4; ++j) {
+        float2 f = __half22float2(half_buf[j]);
+        bf16_buf[j] = __float22bfloat162_rn(f);
+      }
+      return *reinterpret_cast<const int32x4_t*>(bf16_buf);
+    } else {
+      return atom;
+    }
+  }
 
+  // Set the flag of this rank in the region of every rank.
+  __device__ static void signal_ranks(int const thread, int const rank,
+                                      uint8_t** __restrict__ buffer_list,
+                                      uint32_t const flags_offset,
+                                      uint32_t const flag_color) {
     __syncthreads();
     if (thread < kWorldSize) {
       int r = thread;
       uint32_t* flag_ptr = reinterpret_cast<uint32_t*>(
-          buffer_list[r] + comm_flags1_offset + rank * sizeof(uint32_t));
+          buffer_list[r] + flags_offset + rank * sizeof(uint32_t));
       set_sync_flag(flag_ptr, flag_color);
     }
+  }
 
-    // Phase-2: Read the gather segments from the rank's communication buffer.
-    {
-      // Read the data from the communication buffer.
-      int32x4_t* recv_buffer =
-          reinterpret_cast<int32x4_t*>(rank_buffer + comm_data1_offset);
-      uint32_t* flag_ptr =
-          reinterpret_cast<uint32_t*>(rank_buffer + comm_flags1_offset);
-
-      for (int r = 0; r < kWorldSize; r++) {
-        // Wait for the flags to be set.
-        if (thread == 0) {
-          wait_sync_flag(&flag_ptr[r], flag_color);
+  // Phase-1A: Send segment r of the tile to rank r.
+  __device__ static void scatter_segments(Codec& codec,
+                                          int32x4_t const* __restrict__ tA,
+                                          int const thread, int const rank,
+                                          uint8_t** __restrict__ buffer_list,
+                                          uint32_t const data_offset,
+                                          uint32_t const flags_offset,
+                                          uint32_t const flag_color) {
+    for (int r = 0; r < kWorldSize; r++) {
+      int32x4_t* send_buffer =
+          reinterpret_cast<int32x4_t*>(buffer_list[r] + data_offset +
+                                       rank * Codec::kRankTransmittedTileSize);
+      codec.send(send_buffer, &tA[r * Codec::kRankAtoms]);
+    }
+    signal_ranks(thread, rank, buffer_list, flags_offset, flag_color);
+  }
+
+  // Phase-1B: Reduce the segments received from every rank into tR.
+  // note: the first segment of tA is used as temp buffer, after rank 0 is
+  // received into tR. With `errors` (sampled tiles only), the own segment of
+  // the rank is compared with the segment it sent: `sent` if given, else
+  // the own segment of tA, which is not overwritten before it is received.
+  __device__ static void reduce_segments(Codec& codec,
+                                         int32x4_t* __restrict__ tA,
+                                         int32x4_t* __restrict__ tR,
+                                         int const thread, int const rank,
+                                         uint8_t* __restrict__ rank_buffer,
+                                         uint32_t const data_offset,
+                                         uint32_t const flags_offset,
+                                         uint32_t const flag_color,
+                                         QuantErrorStats* errors = nullptr,
+                                         int32x4_t const* sent = nullptr) {
+    // Read the data from the communication buffer.
+    int32x4_t* recv_buffer =
+        reinterpret_cast<int32x4_t*>(rank_buffer + data_offset);
+    uint32_t* flag_ptr =
+        reinterpret_cast<uint32_t*>(rank_buffer + flags_offset);
+
+#pragma unroll
+    for (int r = 0; r < kWorldSize; r++) {
+      // Wait for the flags to be set.
+      if (thread == 0) {
+        wait_sync_flag(&flag_ptr[r], flag_color);
+      }
+      __syncthreads();
+
+      int32x4_t* received = r == 0 ? tR : tA;
+      codec.recv(&recv_buffer, received);
+      if (errors != nullptr && r == rank) {
+        accumulate_quant_error(
+            errors, sent != nullptr ? sent : &tA[r * Codec::kRankAtoms],
+            received, Codec::kRankAtoms);
+      }
+
+      if (r != 0) {
+        for (int i = 0; i < Codec::kRankAtoms; i++) {
+          Reduce::combine(&tR[i], &tA[i]);
         }
-        __syncthreads();
+      }
+    }
+    for (int i = 0; i < Codec::kRankAtoms; i++) {
+      Reduce::finalize(&tR[i], kWorldSize);
+    }
+  }
+
+  // Phase-2: Send the reduced segment to every rank.
+  template <class LineCodec>
+  __device__ static void broadcast_segment(LineCodec& codec,
+                                           int32x4_t const* __restrict__ tR,
+                                           int const thread, int const rank,
+                                           uint8_t** __restrict__ buffer_list,
+                                           uint32_t const data_offset,
+                                           uint32_t const flags_offset,
+                                           uint32_t const flag_color) {
+    for (int r = 0; r < kWorldSize; r++) {
+      int32x4_t* send_buffer = reinterpret_cast<int32x4_t*>(
+          buffer_list[r] + data_offset +
+          rank * LineCodec::kRankTransmittedTileSize);
+      codec.send(send_buffer, tR);
+    }
+    signal_ranks(thread, rank, buffer_list, flags_offset, flag_color);
+  }
+
+  // Phase-2: Gather all reduced and final rank segments into tA.
+  // With `errors` (sampled tiles only), the own segment of the rank is
+  // compared with the reduced segment it sent, still in tR.
+  template <class LineCodec>
+  __device__ static void gather_segments(
+      LineCodec& codec, int32x4_t* __restrict__ tA, int const thread,
+      uint8_t* __restrict__ rank_buffer, uint32_t const data_offset,
+      uint32_t const flags_offset, uint32_t const flag_color,
+      int const rank = 0, int32x4_t const* __restrict__ tR = nullptr,
+      QuantErrorStats* errors = nullptr) {
+    // Read the data from the communication buffer.
+    int32x4_t* recv_buffer =
+        reinterpret_cast<int32x4_t*>(rank_buffer + data_offset);
+    uint32_t* flag_ptr =
+        reinterpret_cast<uint32_t*>(rank_buffer + flags_offset);
 
-        // Gather all reduced and final rank segments into tA.
-        codec.recv(&recv_buffer, &tA[r * Codec::kRankAtoms]);
+#pragma unroll
+    for (int r = 0; r < kWorldSize; r++) {
+      // Wait for the flags to be set.
+      if (thread == 0) {
+        wait_sync_flag(&flag_ptr[r], flag_color);
+      }
+      __syncthreads();
+
+      codec.recv(&recv_buffer, &tA[r * LineCodec::kRankAtoms]);
+      if (errors != nullptr && r == rank) {
+        accumulate_quant_error(errors, tR, &tA[r * LineCodec::kRankAtoms],
+                               LineCodec::kRankAtoms);
       }
     }
+  }
 
-    // --------------------------------------------------------
-    // Write the result to output.
-    //BufferResource dst_buffer(input, N * sizeof(T));
-    BufferResource dst_buffer(input, N * sizeof(half));
-    uint32_t dst_offset = block * kTileSize + thread * sizeof(int32x4_t);
+  // Phase-2, MX: Gather all reduced rank segments into the MX output,
+  // without decoding them.
+  template <class LineCodec>
+  __device__ static void gather_segments_mx(LineCodec& codec,
+                                            MxOutput const& mx,
+                                            int const block, int const thread,
+                                            uint8_t* __restrict__ rank_buffer,
+                                            uint32_t const data_offset,
+                                            uint32_t const flags_offset,
+                                            uint32_t const flag_color,
+                                            uint32_t const N) {
+    int32x4_t* recv_buffer =
+        reinterpret_cast<int32x4_t*>(rank_buffer + data_offset);
+    uint32_t* flag_ptr =
+        reinterpret_cast<uint32_t*>(rank_buffer + flags_offset);
 
-    for (int i = 0; i < kAtoms; i++) {
-      if constexpr (cast_bf2half) {
-        const half2* half_buf = reinterpret_cast<const half2*>(&tA[i]);
-        nv_bfloat162 bf16_buf[4];
+    for (int r = 0; r < kWorldSize; r++) {
+      if (thread == 0) {
+        wait_sync_flag(&flag_ptr[r], flag_color);
+      }
+      __syncthreads();
+
+      uint32_t first_element = block * kTileElements +
+                               r * LineCodec::kRankAtoms * kAtomStride *
+                                   kAtomElements;
+      codec.recv_mx(&recv_buffer, mx, first_element, N);
+    }
+  }
+
+  // Phase-2, direct: Store the reduced segment into the output of every
+  // rank, then set the flag of this rank on every rank.
+  __device__ static void store_segment_direct(int32x4_t const* __restrict__ tR,
+                                              TensorLayout const& layout,
+                                              int const block,
+                                              int const thread, int const rank,
+                                              DirectOutput const& direct,
+                                              uint8_t** __restrict__ buffer_list,
+                                              uint32_t const flags_offset,
+                                              uint32_t const flag_color) {
+    uint32_t range = layout_span(layout) * sizeof(half);
+    for (int r = 0; r < kWorldSize; r++) {
+      BufferResource dst_buffer(direct.outputs[r], range);
+      for (int i = 0; i < Codec::kRankAtoms; i++) {
+        uint32_t dst_offset = layout_atom_offset(
+            layout, block, thread, rank * Codec::kRankAtoms + i,
+            kTileElements, kAtomStride, range);
+        buffer_store_dwordx4(output_atom(tR[i]), dst_buffer.descriptor,
+                             dst_offset, 0, 0);
+      }
+    }
+    signal_ranks(thread, rank, buffer_list, flags_offset, flag_color);
+  }
+
+  // Phase-2, direct: Wait until every rank stored its segment of the tile.
+  __device__ static void wait_segments_direct(int const thread,
+                                              uint8_t* __restrict__ rank_buffer,
+                                              uint32_t const flags_offset,
+                                              uint32_t const flag_color) {
+    uint32_t* flag_ptr =
+        reinterpret_cast<uint32_t*>(rank_buffer + flags_offset);
+    if (thread < kWorldSize) {
+      wait_sync_flag(&flag_ptr[thread], flag_color);
+    }
+    __syncthreads();
+  }
+};
+
+// Software-pipelined Twoshot All Reduce.
+// A block processes the tiles block_id, block_id + grid, ... in a single run.
+// The Phase-1A send of the next tile is issued before waiting on the Phase-1B
+// flags of the current one, which hides the fabric latency when a block has
+// more than one tile. Consecutive tiles alternate between the two buffer
+// slots of the block: a rank only sends tile i + 1 after it gathered tile
+// i - 1 (or saw its Phase-2 flags, with direct outputs), which every peer
+// sends after reducing it, so the slot of tile i + 1 is free on every peer.
+// The own segment of a tile sampled for error telemetry is kept for Phase-1B;
+// if the next tile is sampled too, it is sent after Phase-1B instead.
+// See the schedule simulator in test/.
+template <class Codec, bool cast_bf2half, class Reduce = ReduceSum,
+          class Phase2Codec = Codec, bool rotated = false>
+struct AllReduceTwoshotPipelined {
+  using Twoshot =
+      AllReduceTwoshot<Codec, cast_bf2half, Reduce, Phase2Codec, rotated>;
+  static constexpr int kWorldSize = Codec::kWorldSize;
+  static constexpr int kTransmittedTileSize = Twoshot::kTransmittedTileSize;
+
+  __device__ static void run(
+      half* __restrict__ input,
+      TensorLayout const layout,           // rows/strides of the input
+      uint32_t const num_blocks,           // number of tiles
+      int const rank,                      // rank index
+      uint8_t** __restrict__ buffer_list,  // communication buffers
+      uint32_t const data_offset,          // offset to start of the data buffer
+      uint32_t const max_grid,             // stride of the buffer regions
+      uint32_t const flag_color,
+      TileReadiness const readiness = {},  // producer flags of the input
+      DirectOutput const direct = {},      // registered outputs of the ranks
+      MxOutput const mx = {},              // MX-encoded output of the result
+      QuantErrorTelemetry const telemetry = {}) {  // sampled codec errors
+    // Topology
+    int thread = threadIdx.x + threadIdx.y * kWavefront;
+    uint8_t* rank_buffer = buffer_list[rank];
+    Codec codec(thread, rank);
+    Phase2Codec codec2(thread, rank);
+    int block_id = blockIdx.x;
+    int grid = gridDim.x;
+
+    int32x4_t tA[kAtoms];
+    // The own segment of a sampled tile, as sent: tA holds the next tile by
+    // the time the tile is received, or its output on the last tile.
+    int32x4_t tS[Codec::kRankAtoms];
+    if (block_id >= num_blocks) return;
+
+    uint32_t const N = layout.numel();
+
+    // Phase-1A of tile `i` of the block, into its slot.
+    auto scatter_tile = [&](uint32_t i, uint32_t block) {
+      wait_tile_ready(readiness, N, block, kTileElements, thread);
+      Twoshot::load_tile(input, layout, block, thread, tA);
+      Twoshot::rotate_atoms(tA, kAtoms);
+      if (telemetry.sampled(block) != nullptr) {
+        for (int j = 0; j < Codec::kRankAtoms; j++) {
+          tS[j] = tA[rank * Codec::kRankAtoms + j];
+        }
+      }
+      Twoshot::scatter_segments(
+          codec, tA, thread, rank, buffer_list,
+          comm_data_offset(data_offset, 0, pipeline_slot(i), block_id,
+                           max_grid, kTransmittedTileSize),
+          comm_flags_offset(0, pipeline_slot(i), block_id, max_grid,
+                            kWorldSize),
+          tile_color(flag_color, i));
+    };
+
+    // Prologue: Phase-1A of the first tile.
+    scatter_tile(0, block_id);
+
+    for (uint32_t i = 0, block = block_id; block < num_blocks;
+         i++, block += grid) {
+      int slot = pipeline_slot(i);
+      uint32_t color = tile_color(flag_color, i);
+      uint32_t next_block = block + grid;
+      QuantErrorRecord* errors = telemetry.sampled(block);
+      bool const prefetch = next_block < num_blocks;
+      // Loading a sampled tile replaces the own segment of this one in tS.
+      bool const defer = errors != nullptr &&
+                         telemetry.sampled(next_block) != nullptr;
+
+      // Phase-1A of the next tile, into the other slot.
+      if (prefetch && !defer) scatter_tile(i + 1, next_block);
+
+      // Phase-1B
+      int32x4_t tR[Codec::kRankAtoms] = {};
+      Twoshot::reduce_segments(
+          codec, tA, tR, thread, rank, rank_buffer,
+          comm_data_offset(data_offset, 0, slot, block_id, max_grid,
+                           kTransmittedTileSize),
+          comm_flags_offset(0, slot, block_id, max_grid, kWorldSize), color,
+          errors ? &errors->phase[0] : nullptr, tS);
+
+      if (prefetch && defer) scatter_tile(i + 1, next_block);
+
+      // Phase-2
+      uint32_t comm_data1_offset = comm_data_offset(
+          data_offset, 1, slot, block_id, max_grid, kTransmittedTileSize);
+      uint32_t comm_flags1_offset =
+          comm_flags_offset(1, slot, block_id, max_grid, kWorldSize);
+      if constexpr (Phase2Codec::kLossless) {
+        if (direct.enabled()) {
+          Twoshot::rotate_atoms(tR, Codec::kRankAtoms);
+          Twoshot::store_segment_direct(tR, layout, block, thread, rank,
+                                        direct, buffer_list,
+                                        comm_flags1_offset, color);
+          Twoshot::wait_segments_direct(thread, rank_buffer,
+                                        comm_flags1_offset, color);
+          continue;
+        }
+      }
+      Twoshot::broadcast_segment(codec2, tR, thread, rank, buffer_list,
+                                 comm_data1_offset, comm_flags1_offset, color);
+      if constexpr (Phase2Codec::kMxEncoded && !rotated) {
+        if (mx.enabled()) {
+          Twoshot::gather_segments_mx(codec2, mx, block, thread, rank_buffer,
+                                      comm_data1_offset, comm_flags1_offset,
+                                      color, N);
+          continue;
+        }
+      }
+      Twoshot::gather_segments(codec2, tA, thread, rank_buffer,
+                               comm_data1_offset, comm_flags1_offset, color,
+                               rank, tR, errors ? &errors->phase[1] : nullptr);
+
+      Twoshot::rotate_atoms(tA, kAtoms);
+      Twoshot::store_tile(input, layout, block, thread, tA);
+    }
+  }
+};
+
+// Tiles of a chunk of the host-staged all-reduce, and its device buffers.
+// Region r of a buffer, `region_bytes` apart, holds the segments of the
+// tiles of the chunk for rank r (send1), from rank r (recv1, recv2), or the
+// reduced segments of this rank (send2, region 0).
+struct StagedChunk {
+  uint32_t first_tile;
+  uint32_t num_tiles;
+  uint32_t region_bytes;
+  uint8_t* send1;
+  uint8_t* recv1;
+  uint8_t* send2;
+  uint8_t* recv2;
+};
+
+// Host-staged two-shot all-reduce, see host/staged_transport.h. The phases
+// of a chunk run as separate kernels around the copies through host memory,
+// with no flags: `encode` writes segment r of every tile to region r of
+// send1, `reduce` reduces the segments from every rank (the own one still in
+// send1) in rank order and encodes the result to send2, and `gather` decodes
+// the reduced segments of every rank (the own one still in send2) into the
+// output. Each region is the contiguous payload of one copy.
+template <class Codec, class Reduce = ReduceSum, class Phase2Codec = Codec,
+          bool rotated = false>
+struct AllReduceTwoshotStaged {
+  using Twoshot = AllReduceTwoshot<Codec, false, Reduce, Phase2Codec, rotated>;
+  static constexpr int kWorldSize = Codec::kWorldSize;
+
+  template <class LineCodec>
+  __device__ static int32x4_t* segment(uint8_t* buffer,
+                                       StagedChunk const& chunk,
+                                       int const region, uint32_t const tile) {
+    return reinterpret_cast<int32x4_t*>(
+        buffer + region * chunk.region_bytes +
+        tile * LineCodec::kRankTransmittedTileSize);
+  }
+
+  // Phase-1A: Encode segment r of the tile into region r of send1.
+  __device__ static void encode(half* __restrict__ input,
+                                TensorLayout const layout,
+                                StagedChunk const chunk, uint32_t const tile,
+                                int const rank,
+                                TileReadiness const readiness) {
+    int thread = threadIdx.x + threadIdx.y * kWavefront;
+    Codec codec(thread, rank);
+    int block = chunk.first_tile + tile;
+
+    int32x4_t tA[kAtoms];
+    wait_tile_ready(readiness, layout.numel(), block, kTileElements, thread);
+    Twoshot::load_tile(input, layout, block, thread, tA);
+    Twoshot::rotate_atoms(tA, kAtoms);
+    for (int r = 0; r < kWorldSize; r++) {
+      codec.send(segment<Codec>(chunk.send1, chunk, r, tile),
+                 &tA[r * Codec::kRankAtoms]);
+    }
+  }
+
+  // Phase-1B: Reduce the segments of the tile from every rank, and encode
+  // the reduced segment into send2.
+  __device__ static void reduce(StagedChunk const chunk, uint32_t const tile,
+                                int const rank) {
+    int thread = threadIdx.x + threadIdx.y * kWavefront;
+    Codec codec(thread, rank);
+    Phase2Codec codec2(thread, rank);
+
+    int32x4_t tR[Codec::kRankAtoms];
+    int32x4_t tB[Codec::kRankAtoms];
 #pragma unroll
-        for (int j = 0; j < 4; ++j) {
-          float2 f = __half22float2(half_buf[j]);
-          bf16_buf[j] = __float22bfloat162_rn(f);
+    for (int r = 0; r < kWorldSize; r++) {
+      int32x4_t* recv_buffer = segment<Codec>(
+          r == rank ? chunk.send1 : chunk.recv1, chunk, r, tile);
+      int32x4_t* received = r == 0 ? tR : tB;
+      codec.recv(&recv_buffer, received);
+      if (r != 0) {
+        for (int i = 0; i < Codec::kRankAtoms; i++) {
+          Reduce::combine(&tR[i], &tB[i]);
         }
-        buffer_store_dwordx4(*reinterpret_cast<const int32x4_t*>(bf16_buf),
-                             dst_buffer.descriptor, dst_offset, 0, 0);
-      } else {
-        buffer_store_dwordx4(tA[i], dst_buffer.descriptor, dst_offset, 0, 0);
       }
+    }
+    for (int i = 0; i < Codec::kRankAtoms; i++) {
+      Reduce::finalize(&tR[i], kWorldSize);
+    }
+    codec2.send(segment<Phase2Codec>(chunk.send2, chunk, 0, tile), tR);
+  }
+
+  // Phase-2: Decode the reduced segments of every rank into the output tile.
+  __device__ static void gather(half* __restrict__ input,
+                                TensorLayout const layout,
+                                StagedChunk const chunk, uint32_t const tile,
+                                int const rank) {
+    int thread = threadIdx.x + threadIdx.y * kWavefront;
+    Phase2Codec codec2(thread, rank);
+    int block = chunk.first_tile + tile;
+
+    int32x4_t tA[kAtoms];
+#pragma unroll
+    for (int r = 0; r < kWorldSize; r++) {
+      int32x4_t* recv_buffer =
+          r == rank ? segment<Phase2Codec>(chunk.send2, chunk, 0, tile)
+                    : segment<Phase2Codec>(chunk.recv2, chunk, r, tile);
+      codec2.recv(&recv_buffer, &tA[r * Phase2Codec::kRankAtoms]);
+    }
+    Twoshot::rotate_atoms(tA, kAtoms);
+    Twoshot::store_tile(input, layout, block, thread, tA);
+  }
+};
+
+// Broadcast from and reduce to a root, on the regions and colors of the
+// sequential two-shot kernel. See rooted_sends_segment in core/schedule.h for
+// the segments each stage moves; the flags of both stages are still set on
+// every rank.
+template <class Codec, RootedCollective kCollective, class Reduce = ReduceSum>
+struct RootedTwoshot {
+  using Twoshot = AllReduceTwoshot<Codec, false, Reduce>;
+  static constexpr int kWorldSize = Codec::kWorldSize;
+
+  __device__ static void run(
+      half* __restrict__ input,
+      TensorLayout const layout,           // rows/strides of the input
+      int const block,                     // block index
+      int const rank,                      // rank index
+      int const root,                      // root rank
+      uint8_t** __restrict__ buffer_list,  // communication buffers
+      uint32_t const data_offset,          // offset to start of the data buffer
+      uint32_t const max_grid,             // stride of the buffer regions
+      uint32_t flag_color) {
+    // Topology
+    int thread = threadIdx.x + threadIdx.y * kWavefront;
+    uint8_t* rank_buffer = buffer_list[rank];
+    Codec codec(thread, rank);
+    int block_id = blockIdx.x;
+
+    uint32_t comm_data0_offset = comm_data_offset(
+        data_offset, 0, 0, block_id, max_grid, Codec::kTransmittedTileSize);
+    uint32_t comm_data1_offset = comm_data_offset(
+        data_offset, 1, 0, block_id, max_grid, Codec::kTransmittedTileSize);
+    uint32_t comm_flags0_offset =
+        comm_flags_offset(0, 0, block_id, max_grid, kWorldSize);
+    uint32_t comm_flags1_offset =
+        comm_flags_offset(1, 0, block_id, max_grid, kWorldSize);
+
+    int32x4_t tA[kAtoms];
+    int32x4_t tR[Codec::kRankAtoms] = {};
+    if constexpr (kCollective == RootedCollective::BROADCAST) {
+      // Stage 0: the root sends segment r of its tile to rank r.
+      if (rank == root) {
+        Twoshot::load_tile(input, layout, block, thread, tA);
+      }
+      send_segments<0>(codec, tA, thread, rank, root, buffer_list,
+                       comm_data0_offset, comm_flags0_offset, flag_color);
+      receive_segments<0>(codec, tR, thread, rank, root, rank_buffer,
+                          comm_data0_offset, comm_flags0_offset, flag_color);
+    } else {
+      // Stage 0: the reduce-scatter of the all-reduce.
+      Twoshot::load_tile(input, layout, block, thread, tA);
+      Twoshot::scatter_segments(codec, tA, thread, rank, buffer_list,
+                                comm_data0_offset, comm_flags0_offset,
+                                flag_color);
+      Twoshot::reduce_segments(codec, tA, tR, thread, rank, rank_buffer,
+                               comm_data0_offset, comm_flags0_offset,
+                               flag_color);
+    }
+
+    // Stage 1: forward the segment in tR.
+    send_segments<1>(codec, tR, thread, rank, root, buffer_list,
+                     comm_data1_offset, comm_flags1_offset, flag_color);
+    receive_segments<1>(codec, tA, thread, rank, root, rank_buffer,
+                        comm_data1_offset, comm_flags1_offset, flag_color);
+
+    if (rooted_stores_output(kCollective, rank, root)) {
+      Twoshot::store_tile(input, layout, block, thread, tA);
+    }
+  }
+
+  // Send the segments this rank owes in `kStage`, then set the flag of this
+  // rank on every rank. Stage 0 sends segment r of the tile to rank r, stage
+  // 1 sends the segment in `tile`.
+  template <int kStage>
+  __device__ static void send_segments(Codec& codec,
+                                       int32x4_t const* __restrict__ tile,
+                                       int const thread, int const rank,
+                                       int const root,
+                                       uint8_t** __restrict__ buffer_list,
+                                       uint32_t const data_offset,
+                                       uint32_t const flags_offset,
+                                       uint32_t const flag_color) {
+    for (int r = 0; r < kWorldSize; r++) {
+      if (!rooted_sends_segment(kCollective, kStage, rank, r, root)) continue;
+      int32x4_t* send_buffer =
+          reinterpret_cast<int32x4_t*>(buffer_list[r] + data_offset +
+                                       rank * Codec::kRankTransmittedTileSize);
+      codec.send(send_buffer,
+                 kStage == 0 ? &tile[r * Codec::kRankAtoms] : tile);
+    }
+    Twoshot::signal_ranks(thread, rank, buffer_list, flags_offset, flag_color);
+  }
+
+  // Wait for the flag of every rank, and decode the segments sent to this
+  // rank: into `tile` in stage 0 (only the root sends), into segment r of
+  // `tile` in stage 1.
+  template <int kStage>
+  __device__ static void receive_segments(Codec& codec,
+                                          int32x4_t* __restrict__ tile,
+                                          int const thread, int const rank,
+                                          int const root,
+                                          uint8_t* __restrict__ rank_buffer,
+                                          uint32_t const data_offset,
+                                          uint32_t const flags_offset,
+                                          uint32_t const flag_color) {
+    uint32_t* flag_ptr =
+        reinterpret_cast<uint32_t*>(rank_buffer + flags_offset);
+
+    for (int r = 0; r < kWorldSize; r++) {
+      if (thread == 0) {
+        wait_sync_flag(&flag_ptr[r], flag_color);
+      }
+      __syncthreads();
+      if (!rooted_sends_segment(kCollective, kStage, r, rank, root)) continue;
+
+      int32x4_t* recv_buffer =
+          reinterpret_cast<int32x4_t*>(rank_buffer + data_offset +
+                                       r * Codec::kRankTransmittedTileSize);
+      codec.recv(&recv_buffer,
+                 kStage == 0 ? tile : &tile[r * Codec::kRankAtoms]);
+    }
+  }
+};
+
+// One-pass all-to-all, see core/all_to_all.h. A chunk is the rank segment of
+// a two-shot tile, so every line codec sends it with a single `send`.
+template <class Codec>
+struct AllToAll {
+  static constexpr int kWorldSize = Codec::kWorldSize;
+  static constexpr int kChunkAtoms = Codec::kRankAtoms;
+  static constexpr uint32_t kChunkElements =
+      kChunkAtoms * kAtomStride * kAtomElements;
+  static_assert(kChunkElements == kTileElements / kWorldSize);
+  static_assert(Codec::kRankTransmittedTileSize * kWorldSize <=
+                    kMaxTransmittedTileSize,
+                "The all-to-all regions do not fit the chunks of the codec.");
+  // Stride of the chunks in the region of a source.
+  static constexpr uint32_t kChunkBytes = kMaxTransmittedTileSize / kWorldSize;
+
+  __device__ static void run(half const* __restrict__ send,
+                             half* __restrict__ recv,
+                             AllToAllPlan const& plan,
+                             int const rank,
+                             uint8_t** __restrict__ buffer_list,
+                             uint32_t const flags_offset,  // all-to-all flags
+                             uint32_t const data_offset,
+                             uint32_t const max_chunks,
+                             uint32_t const color) {
+    int thread = threadIdx.x + threadIdx.y * kWavefront;
+    uint8_t* rank_buffer = buffer_list[rank];
+    Codec codec(thread, rank);
+    int32x4_t tA[kChunkAtoms];
+
+    // Every peer finished the previous launch, and read its regions.
+    if (thread < kWorldSize) {
+      set_sync_flag(reinterpret_cast<uint32_t*>(
+                        buffer_list[thread] +
+                        all_to_all_barrier_offset(flags_offset, rank)),
+                    color);
+      wait_sync_flag_at_least(
+          reinterpret_cast<uint32_t*>(
+              rank_buffer + all_to_all_barrier_offset(flags_offset, thread)),
+          color);
+    }
+    __syncthreads();
+
+    // Send every chunk of the block before waiting on any peer.
+    for (uint32_t j = blockIdx.x; j < plan.num_send_chunks(); j += gridDim.x) {
+      ChunkRef ref = find_chunk(plan.send_chunk_begin, kWorldSize, j);
+      load_chunk(send + plan.send_offset[ref.rank], plan.send_count[ref.rank],
+                 ref.chunk, thread, tA);
+      uint8_t* peer_buffer = buffer_list[ref.rank];
+      codec.send(reinterpret_cast<int32x4_t*>(
+                     peer_buffer + all_to_all_chunk_data_offset(
+                                       data_offset, max_chunks, kChunkBytes,
+                                       rank, ref.chunk,
+                                       Codec::kRankTransmittedTileSize)),
+                 tA);
+      __syncthreads();
+      if (thread == 0) {
+        set_sync_flag(reinterpret_cast<uint32_t*>(
+                          peer_buffer + all_to_all_chunk_flag_offset(
+                                            flags_offset, kWorldSize,
+                                            max_chunks, rank, ref.chunk)),
+                      color);
+      }
+    }
+
+    for (uint32_t j = blockIdx.x; j < plan.num_recv_chunks(); j += gridDim.x) {
+      ChunkRef ref = find_chunk(plan.recv_chunk_begin, kWorldSize, j);
+      if (thread == 0) {
+        wait_sync_flag(reinterpret_cast<uint32_t*>(
+                           rank_buffer + all_to_all_chunk_flag_offset(
+                                             flags_offset, kWorldSize,
+                                             max_chunks, ref.rank, ref.chunk)),
+                       color);
+      }
+      __syncthreads();
+      int32x4_t* recv_buffer = reinterpret_cast<int32x4_t*>(
+          rank_buffer + all_to_all_chunk_data_offset(
+                            data_offset, max_chunks, kChunkBytes, ref.rank,
+                            ref.chunk, Codec::kRankTransmittedTileSize));
+      codec.recv(&recv_buffer, tA);
+      store_chunk(recv + plan.recv_offset[ref.rank], plan.recv_count[ref.rank],
+                  ref.chunk, thread, tA);
+    }
+
+    // Every peer read its regions, before a later launch overwrites them.
+    __shared__ bool last_block;
+    __syncthreads();
+    if (thread == 0) {
+      __threadfence();
+      uint32_t* arrivals = reinterpret_cast<uint32_t*>(
+          rank_buffer + all_to_all_arrival_offset(flags_offset, kWorldSize));
+      last_block = atomicAdd(arrivals, 1u) == gridDim.x - 1;
+      if (last_block) __atomic_store_n(arrivals, 0u, __ATOMIC_RELAXED);
+    }
+    __syncthreads();
+    if (last_block && thread < kWorldSize) {
+      set_sync_flag(reinterpret_cast<uint32_t*>(
+                        buffer_list[thread] +
+                        all_to_all_done_offset(flags_offset, kWorldSize, rank)),
+                    color);
+      wait_sync_flag_at_least(
+          reinterpret_cast<uint32_t*>(
+              rank_buffer +
+              all_to_all_done_offset(flags_offset, kWorldSize, thread)),
+          color);
+    }
+  }
+
+  // Read chunk `chunk` of a segment of `count` elements. Reads past the end
+  // of the segment return zeros.
+  __device__ static void load_chunk(half const* __restrict__ segment,
+                                    uint32_t const count, uint32_t const chunk,
+                                    int const thread,
+                                    int32x4_t* __restrict__ tA) {
+    BufferResource src_buffer(const_cast<half*>(segment),
+                              count * sizeof(half));
+    uint32_t src_offset =
+        chunk * kChunkElements * sizeof(half) + thread * sizeof(int32x4_t);
+    for (int i = 0; i < kChunkAtoms; i++) {
+      tA[i] = buffer_load_dwordx4(src_buffer.descriptor, src_offset, 0, 0);
+      src_offset += kAtomStride * sizeof(int32x4_t);
+    }
+  }
+
+  // Write chunk `chunk` of a segment of `count` elements. Writes past the
+  // end of the segment are dropped.
+  __device__ static void store_chunk(half* __restrict__ segment,
+                                     uint32_t const count, uint32_t const chunk,
+                                     int const thread,
+                                     int32x4_t const* __restrict__ tA) {
+    BufferResource dst_buffer(segment, count * sizeof(half));
+    uint32_t dst_offset =
+        chunk * kChunkElements * sizeof(half) + thread * sizeof(int32x4_t);
+    for (int i = 0; i < kChunkAtoms; i++) {
+      buffer_store_dwordx4(tA[i], dst_buffer.descriptor, dst_offset, 0, 0);
       dst_offset += kAtomStride * sizeof(int32x4_t);
     }
   }
 };
 
-}  // namespace quickreduce
\ No newline at end of file
+}  // namespace quickreduce
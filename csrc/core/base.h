@@ -27,6 +27,10 @@ using int32x4_t = __attribute__((__vector_size__(4 * sizeof(int)))) int;
 // CDNA1 and CDNA2 - glc bit
   #define MUBUF_ACQUIRE 1
   #define MUBUF_RELEASE 0
+#else
+// Host compilation pass, or an architecture without scope bits.
+  #define MUBUF_ACQUIRE 0
+  #define MUBUF_RELEASE 0
 #endif
 
 static constexpr int kNegOne = 0xBC00BC00;  // {-1, -1}, fp16x2_t
@@ -43,8 +47,8 @@ static constexpr int kAtomStride = kBlockSize;
 // Workgroup scope = Tile = (256 threads x 8 atoms x 16B)
 static constexpr int kTileSize = kBlockSize * kAtoms * sizeof(int32x4_t);
 
-// Max number of blocks. 304 CUs on MI300
-static constexpr int kMaxNumBlocks = 304 * 4;
+// Number of fp16 elements of a tile.
+static constexpr int kTileElements = kTileSize / sizeof(half);
 
 // Standard CDNA wavefront size.
 static constexpr int kWavefront = 64;
@@ -87,8 +91,9 @@ __quickreduce_device_inline__ static void buffer_store_dwordx4(
     int32x4_t data, int32x4_t srsrc, int32_t voffset, int32_t soffset,
     int32_t aux) __asm("llvm.amdgcn.raw.buffer.store.v4i32");
 
+// FP16_OVFL (MODE bit 23) is available on CDNA1, CDNA2 and CDNA3.
 __quickreduce_device_inline__ static void set_fp16_ovfl(bool const value) {
-#if defined(__gfx942__)
+#if defined(__gfx942__) || defined(__gfx90a__) || defined(__gfx908__)
   if (value) {
     asm volatile("s_setreg_imm32_b32 0xdc1, 1;" ::);
   } else {
@@ -234,7 +239,7 @@ __quickreduce_device_inline__ int packed_sub<half>(int a, int b) {
   int result;
 
   // MI300 lacks packed fp16 sub instruction. So we do -1 * min + max
-  asm volatile("v_pk_fma_f16 %0, %1, %2 %3"
+  asm volatile("v_pk_fma_f16 %0, %1, %2, %3"
                : "=v"(result)
                : "v"(kNegOne), "v"(b), "v"(a));
   return result;
@@ -267,6 +272,30 @@ __quickreduce_device_inline__ int packed_mul<nv_bfloat16>(int a, int b) {
   return *(reinterpret_cast<int*>(&tR));
 }
 
+// Fused a * b + c
+template <typename T>
+__quickreduce_device_inline__ int packed_fma(int a, int b, int c);
+
+template <>
+__quickreduce_device_inline__ int packed_fma<half>(int a, int b, int c) {
+  int result;
+  asm volatile("v_pk_fma_f16 %0, %1, %2, %3"
+               : "=v"(result)
+               : "v"(a), "v"(b), "v"(c));
+  return result;
+}
+
+template <>
+__quickreduce_device_inline__ int packed_fma<nv_bfloat16>(int a, int b,
+                                                          int c) {
+  bf162_int_union A, B, C, R;
+  A.i = a;
+  B.i = b;
+  C.i = c;
+  R.bf2 = __hfma2(A.bf2, B.bf2, C.bf2);
+  return R.i;
+}
+
 template <typename T>
 __quickreduce_device_inline__ int packed_rcp(int a);
 
@@ -324,15 +353,77 @@ __quickreduce_device_inline__ int group_abs_max(int32x4_t atom) {
   return wblockmax;
 }
 
+// Minimum and maximum of the atom in the thread group, for the 2 blocks of
+// values in the upper/lower halves of the f16x2_t.
+template <typename T>
+__quickreduce_device_inline__ void group_min_max(int32x4_t atom, int& wmin,
+                                                 int& wmax) {
+  const int group_leader = (threadIdx.x / kThreadGroupSize) * kThreadGroupSize;
+
+  int a, b;
+  a = packed_max<T>(atom[0], atom[1]);
+  b = packed_max<T>(atom[2], atom[3]);
+  wmax = packed_max<T>(a, b);
+
+  a = packed_min<T>(atom[0], atom[1]);
+  b = packed_min<T>(atom[2], atom[3]);
+  wmin = packed_min<T>(a, b);
+
+  for (int i = 1; i < kThreadGroupSize; i <<= 1) {
+    int x = __shfl_down(wmax, i);
+    wmax = packed_max<T>(wmax, x);
+
+    int y = __shfl_down(wmin, i);
+    wmin = packed_min<T>(wmin, y);
+  }
+
+  // Share with the cohort
+  wmax = __shfl(wmax, group_leader);
+  wmin = __shfl(wmin, group_leader);
+}
+
 __quickreduce_device_inline__ void set_sync_flag(uint32_t* flag_ptr,
                                                  uint32_t flag) {
   __atomic_store_n(flag_ptr, flag, __ATOMIC_RELEASE);
 }
 
+#if defined(QUICKREDUCE_FLAG_WAIT_CYCLES)
+// Wall-clock ticks the kernels of this device spent spinning on flags that
+// were not set on the first load, summed over the waiting threads. Read by
+// DeviceComms::metrics_snapshot.
+static __device__ unsigned long long flag_wait_ticks = 0;
+#endif
+
+// Spin until `ready()`, counting the ticks of the wait if enabled.
+template <class Ready>
+__quickreduce_device_inline__ void spin_until(Ready ready) {
+#if defined(QUICKREDUCE_FLAG_WAIT_CYCLES)
+  if (ready()) return;
+  uint64_t start = wall_clock64();
+  while (!ready()) {
+  }
+  atomicAdd(&flag_wait_ticks,
+            static_cast<unsigned long long>(wall_clock64() - start));
+#else
+  while (!ready()) {
+  }
+#endif
+}
+
 __quickreduce_device_inline__ void wait_sync_flag(uint32_t* flag_ptr,
                                                   uint32_t flag) {
-  while (__atomic_load_n(flag_ptr, __ATOMIC_RELAXED) != flag) {
-  }
+  spin_until(
+      [&] { return __atomic_load_n(flag_ptr, __ATOMIC_RELAXED) == flag; });
+}
+
+// Wait until the flag reaches `flag` or a later color, modulo 2^32. For
+// flags that a peer may already have advanced past `flag`.
+__quickreduce_device_inline__ void wait_sync_flag_at_least(uint32_t* flag_ptr,
+                                                           uint32_t flag) {
+  spin_until([&] {
+    return static_cast<int32_t>(__atomic_load_n(flag_ptr, __ATOMIC_RELAXED) -
+                                flag) >= 0;
+  });
 }
 
 }  // namespace quickreduce
\ No newline at end of file
@@ -0,0 +1,360 @@
+#pragma once
+
+#include <cstdint>
+#include "host_device.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Code layout and constants of the block-quantization line codecs,
+    derived from the bit-width.
+
+Operation:
+    A thread quantizes its 8 fp16 values (4 x f16x2_t registers) into 8
+    unsigned codes of `bits` bits, held as uint16x2_t registers: code 2i is
+    the lower and code 2i + 1 the upper half of register i.
+
+    The codes are split into bit planes, one per set bit of `bits` from the
+    highest: 7 = 4 + 2 + 1, 6 = 4 + 2, 5 = 4 + 1, 3 = 2 + 1. Plane k holds
+    bits [shift, shift + width) of every code, with the lowest bits in the
+    first plane, and each thread stores `width` bytes of it at
+    plane_offset(k) + thread * width. This keeps every store a single
+    naturally aligned 1/2/4/8B access.
+
+    Within a thread's word, planes of 4 or 8 bits keep the register layout
+    (16 / width registers per 32-bit word, shifted and or'ed as f16x2_t
+    pairs); narrower planes store code j at bit j * width. These are the
+    hand-written layouts of the original Q4/Q6/Q8 codecs, which
+    codec_reference_test checks byte for byte.
+
+    The per-block scales (4B for the symmetric, 8B for the asymmetric
+    codecs) follow the planes, one per group of kThreadGroupSize threads.
+*/
+template <int bits, int scale_bytes = 4>
+struct QuantCodeLayout {
+  static_assert(bits >= 2 && bits <= 8, "Quantization codecs use 2 to 8 bits.");
+
+  static constexpr int kThreads = 256;
+  static constexpr int kGroupSize = 8;
+
+  static constexpr int kNumPlanes =
+      ((bits >> 3) & 1) + ((bits >> 2) & 1) + ((bits >> 1) & 1) + (bits & 1);
+
+  // Width in bits of plane k: the k-th set bit of `bits`, from the highest.
+  __quickreduce_host_device_inline__ static constexpr int plane_width(int k) {
+    for (int w = 8; w > 0; w >>= 1) {
+      if (bits & w) {
+        if (k == 0) return w;
+        k--;
+      }
+    }
+    return 0;
+  }
+
+  // First code bit held by plane k.
+  __quickreduce_host_device_inline__ static constexpr int plane_shift(int k) {
+    int shift = 0;
+    for (int j = 0; j < k; j++) shift += plane_width(j);
+    return shift;
+  }
+
+  // Byte offset of plane k in the rank tile: `width` bytes per thread.
+  __quickreduce_host_device_inline__ static constexpr int plane_offset(int k) {
+    return plane_shift(k) * kThreads;
+  }
+
+  static constexpr int kScaleOffset = bits * kThreads;
+  static constexpr int kTileStride =
+      kScaleOffset + (kThreads / kGroupSize) * scale_bytes;
+  static_assert(kTileStride % 16 == 0, "The tile stride must be 16B aligned.");
+
+  // Pack bits [shift, shift + width) of the codes in `q` into the word of
+  // plane k (word[1] is only used by 8-bit planes).
+  __quickreduce_host_device_inline__ static void pack_plane(
+      uint32_t const* q, int k, uint32_t* word) {
+    int const width = plane_width(k);
+    int const shift = plane_shift(k);
+    uint32_t const mask = (1u << width) - 1;
+    uint32_t const mask2 = mask | (mask << 16);
+    word[0] = 0;
+    word[1] = 0;
+    if (width >= 4) {
+      int const per_word = 16 / width;
+      for (int i = 0; i < 4; i++) {
+        word[i / per_word] |= ((q[i] >> shift) & mask2)
+                              << ((i % per_word) * width);
+      }
+    } else {
+      for (int i = 0; i < 4; i++) {
+        uint32_t lo = (q[i] >> shift) & mask;
+        uint32_t hi = (q[i] >> (16 + shift)) & mask;
+        word[0] |= (lo | (hi << width)) << (2 * i * width);
+      }
+    }
+  }
+
+  // Inverse of pack_plane: or the bits of plane k into the codes in `q`.
+  __quickreduce_host_device_inline__ static void unpack_plane(
+      uint32_t const* word, int k, uint32_t* q) {
+    int const width = plane_width(k);
+    int const shift = plane_shift(k);
+    uint32_t const mask = (1u << width) - 1;
+    uint32_t const mask2 = mask | (mask << 16);
+    if (width >= 4) {
+      int const per_word = 16 / width;
+      for (int i = 0; i < 4; i++) {
+        q[i] |= ((word[i / per_word] >> ((i % per_word) * width)) & mask2)
+                << shift;
+      }
+    } else {
+      for (int i = 0; i < 4; i++) {
+        uint32_t pair = word[0] >> (2 * i * width);
+        q[i] |= ((pair & mask) | (((pair >> width) & mask) << 16)) << shift;
+      }
+    }
+  }
+};
+
+// Layout of the asymmetric codecs: the codes of QuantCodeLayout, then a
+// (scale, min) pair of f16x2_t per block. Shared by the kernels and the host
+// reference, so the two cannot place the pairs differently.
+template <int bits>
+using AsymmetricCodeLayout = QuantCodeLayout<bits, 8>;
+
+/*
+===============================================================
+Desc:
+    Layout of the symmetric codecs with a per-block escape to fp16.
+
+Operation:
+    A block whose absolute maximum exceeds kRatio times its mean magnitude
+    is dominated by an outlier: scaled to it, the rest of the block
+    quantizes to zero. Such a block is also sent as its 32 raw fp16 values.
+
+    The rank tile holds the QuantCodeLayout tile of every block, then a
+    bitmap of the escaped blocks (16 bits per wavefront of 256 / 4 threads,
+    bit 2g + h for the lower (h = 0) or upper half of group g of the
+    wavefront), then `escapes` payload slots of 64B per wavefront. The
+    first `escapes` candidates of a wavefront, in block order, take the
+    slots in that order; the other candidates stay quantized. Thread t of a
+    group stores its 4 values of the block at slot_offset + t * 8.
+
+    The tile stride is bounded by the slots, but only the slots in use are
+    written: the payload sent across the fabric is the quantized tile plus
+    64B per escaped block.
+*/
+template <int bits, int escapes>
+struct EscapeLayout {
+  static_assert(escapes >= 1 && escapes <= 16,
+                "A wavefront escapes 1 to 16 of its blocks.");
+  using Quant = QuantCodeLayout<bits>;
+
+  static constexpr int kWaves = 4;
+  static constexpr int kBlocksPerWave = 16;
+  static constexpr int kBlockBytes = 64;
+  // Escape blocks with max |x| > kRatio * mean |x|.
+  static constexpr int kRatio = 8;
+
+  static constexpr int kMaskOffset = Quant::kTileStride;
+  static constexpr int kPayloadOffset = kMaskOffset + 16;
+  static constexpr int kTileStride =
+      kPayloadOffset + kWaves * escapes * kBlockBytes;
+  static_assert(kTileStride % 16 == 0, "The tile stride must be 16B aligned.");
+
+  // The first `escapes` candidate blocks of a wavefront.
+  __quickreduce_host_device_inline__ static uint32_t select(
+      uint32_t candidates) {
+    uint32_t escaped = 0;
+    for (int s = 0; s < escapes && candidates; s++) {
+      uint32_t lowest = candidates & (~candidates + 1);
+      escaped |= lowest;
+      candidates ^= lowest;
+    }
+    return escaped;
+  }
+
+  // Payload slot of escaped block b.
+  __quickreduce_host_device_inline__ static int slot(uint32_t escaped, int b) {
+    return __builtin_popcount(escaped & ((1u << b) - 1));
+  }
+
+  __quickreduce_host_device_inline__ static constexpr int slot_offset(
+      int wave, int slot) {
+    return kPayloadOffset + (wave * escapes + slot) * kBlockBytes;
+  }
+};
+
+/*
+===============================================================
+Desc:
+    Layout of the lossless fp16 codec.
+
+Operation:
+    The fp16 bits of a value split into a low byte, the 8 lowest mantissa
+    bits, and a high byte: sign, 5 exponent bits and 2 mantissa bits. The
+    low bytes are sent as they are, value j of a thread at byte j of its 8B
+    at kLowOffset + thread * 8.
+
+    The values of a group of kGroupSize threads share an exponent base, the
+    largest exponent field of the group, stored as a byte at kBaseOffset +
+    group. The high byte of a value whose exponent field is within
+    kMaxDelta of the base is coded on 6 bits: the sign, the 3-bit delta
+    base - exponent, and the 2 mantissa bits. A zero exponent field (zeros
+    and subnormals) has the delta kZeroDelta. The 48 code bits of a thread
+    hold value j at bits [6j, 6j + 6): bits [0, 32) at kHigh0Offset +
+    thread * 4 and bits [32, 48) at kHigh1Offset + thread * 2.
+
+    A thread with a value outside the window is raw: its 8 high bytes, high
+    byte j at bits [8j, 8j + 8), take the same two planes and the 2B at
+    kRawOffset + thread * 2. The raw threads of a wavefront are set in its
+    64-bit mask at kMaskOffset + wave * 8.
+
+    The tile stride is bounded by the raw fallback, but only the raw slots
+    in use are written: 14 bits per value, plus 2B per raw thread and 64B
+    of bases and masks per tile, against 16 bits.
+*/
+struct LosslessLayout {
+  static constexpr int kThreads = 256;
+  static constexpr int kGroupSize = 8;
+  static constexpr int kWaves = 4;
+
+  static constexpr int kMaxDelta = 6;
+  static constexpr int kZeroDelta = 7;
+
+  static constexpr int kLowOffset = 0;
+  static constexpr int kHigh0Offset = kLowOffset + kThreads * 8;
+  static constexpr int kHigh1Offset = kHigh0Offset + kThreads * 4;
+  static constexpr int kBaseOffset = kHigh1Offset + kThreads * 2;
+  static constexpr int kMaskOffset = kBaseOffset + kThreads / kGroupSize;
+  static constexpr int kRawOffset = kMaskOffset + kWaves * 8;
+  static constexpr int kTileStride = kRawOffset + kThreads * 2;
+  static_assert(kTileStride % 16 == 0, "The tile stride must be 16B aligned.");
+
+  // fp16 bits of value j of a thread, half j % 2 of register j / 2.
+  __quickreduce_host_device_inline__ static uint32_t value(uint32_t const* v,
+                                                           int j) {
+    return (v[j / 2] >> (16 * (j % 2))) & 0xFFFF;
+  }
+
+  __quickreduce_host_device_inline__ static int exponent(uint32_t bits) {
+    return (bits >> 10) & 0x1F;
+  }
+
+  // Largest exponent field of the 8 values of a thread.
+  __quickreduce_host_device_inline__ static int max_exponent(
+      uint32_t const* v) {
+    int e = 0;
+    for (int j = 0; j < 8; j++) {
+      int ej = exponent(value(v, j));
+      e = ej > e ? ej : e;
+    }
+    return e;
+  }
+
+  // The low bytes of a thread, value j at byte j.
+  __quickreduce_host_device_inline__ static void pack_low(uint32_t const* v,
+                                                          uint32_t* low) {
+    for (int i = 0; i < 2; i++) {
+      low[i] = (v[2 * i] & 0xFF) | ((v[2 * i] >> 8) & 0xFF00) |
+               ((v[2 * i + 1] & 0xFF) << 16) | ((v[2 * i + 1] << 8) & 0xFF000000);
+    }
+  }
+
+  // The high bits of a thread against the exponent `base` of its group:
+  // high[0] for the first plane, the lower 16 bits of high[1] for the
+  // second and its upper 16 bits for the raw slot. Returns whether the
+  // thread is raw.
+  __quickreduce_host_device_inline__ static bool pack_high(uint32_t const* v,
+                                                           int base,
+                                                           uint32_t* high) {
+    uint64_t coded = 0;
+    uint64_t raw = 0;
+    bool is_raw = false;
+    for (int j = 0; j < 8; j++) {
+      uint32_t h = value(v, j) >> 8;
+      int e = exponent(value(v, j));
+      int delta = e ? base - e : kZeroDelta;
+      is_raw |= e && delta > kMaxDelta;
+      uint64_t code = ((h >> 7) << 5) | (uint32_t(delta & 7) << 2) | (h & 3);
+      coded |= code << (6 * j);
+      raw |= uint64_t(h) << (8 * j);
+    }
+    uint64_t bits = is_raw ? raw : coded;
+    high[0] = static_cast<uint32_t>(bits);
+    high[1] = static_cast<uint32_t>(bits >> 32);
+    return is_raw;
+  }
+
+  // Inverse of pack_low and pack_high: the fp16 registers of a thread.
+  __quickreduce_host_device_inline__ static void unpack(uint32_t const* low,
+                                                        uint32_t const* high,
+                                                        bool is_raw, int base,
+                                                        uint32_t* v) {
+    uint64_t bits = uint64_t(high[0]) | (uint64_t(high[1]) << 32);
+    for (int i = 0; i < 4; i++) v[i] = 0;
+    for (int j = 0; j < 8; j++) {
+      uint32_t h;
+      if (is_raw) {
+        h = (bits >> (8 * j)) & 0xFF;
+      } else {
+        uint32_t code = (bits >> (6 * j)) & 0x3F;
+        int delta = (code >> 2) & 7;
+        uint32_t e = delta == kZeroDelta ? 0 : uint32_t(base - delta);
+        h = ((code >> 5) << 7) | (e << 2) | (code & 3);
+      }
+      uint32_t l = (low[j / 4] >> (8 * (j % 4))) & 0xFF;
+      v[j / 2] |= ((h << 8) | l) << (16 * (j % 2));
+    }
+  }
+};
+
+// fp16 bit patterns of the codec constants, exact for the values used here.
+
+// Integer v with |v| <= 2048.
+__quickreduce_host_device_inline__ constexpr uint32_t half_bits_of_int(int v) {
+  uint32_t sign = v < 0 ? 0x8000 : 0;
+  uint32_t a = v < 0 ? -v : v;
+  if (a == 0) return sign;
+  int e = 0;
+  while ((a >> (e + 1)) != 0) e++;
+  uint32_t mantissa = (a << (10 - e)) & 0x3FF;
+  return sign | ((e + 15) << 10) | mantissa;
+}
+
+// -2^-e, for 0 <= e <= 14.
+__quickreduce_host_device_inline__ constexpr uint32_t half_bits_of_neg_pow2(
+    int e) {
+  return 0x8000 | ((15 - e) << 10);
+}
+
+// The same 16-bit pattern in both halves of a f16x2_t or int16x2_t.
+__quickreduce_host_device_inline__ constexpr int pack_pair(uint32_t bits16) {
+  return static_cast<int>(bits16 | (bits16 << 16));
+}
+
+// Constants of the symmetric codec of `bits` bits.
+template <int bits>
+struct SymmetricQuantConstants {
+  static constexpr int kBias = 1 << (bits - 1);
+  // {-1/kBias, -1/kBias}, f16x2_t
+  static constexpr int kScaleFactor = pack_pair(half_bits_of_neg_pow2(bits - 1));
+  // {-kBias, -kBias}, f16x2_t
+  static constexpr int kRangeMin = pack_pair(half_bits_of_int(-kBias));
+  // {kBias - 1, kBias - 1}, f16x2_t
+  static constexpr int kRangeMax = pack_pair(half_bits_of_int(kBias - 1));
+  // {kBias, kBias}, int16x2_t
+  static constexpr int kRangeBias = pack_pair(kBias);
+  // {-(1024 + kBias), -(1024 + kBias)}, f16x2_t: a code c or'ed into 1024.0h
+  // reads as 1024 + c, and adding this gives c - kBias.
+  static constexpr int kDecodeOffset = pack_pair(half_bits_of_int(-(1024 + kBias)));
+};
+
+// Bytes of a two-shot tile of 8 atoms in the codec that transmits the most:
+// the lossless one, whose raw slots put an atom 64B above fp16. The buffer
+// regions of the two-shot and the all-to-all are sized for it, and every
+// kernel checks that its codec fits.
+static constexpr int kMaxTransmittedTileSize = 8 * LosslessLayout::kTileStride;
+
+}  // namespace quickreduce
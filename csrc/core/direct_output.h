@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include "host_device.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Outputs of the peers, written directly in Phase-2 of the two-shot
+    all-reduce.
+
+Operation:
+    By default, Phase-2 sends the reduced segment of a rank to the
+    communication buffer of every rank, and every rank reads the segments
+    back and stores them to its output. When the output is registered on
+    every rank (see host/output_registry.h), the rank that reduced a segment
+    stores it in fp16 straight into the output of every rank instead, and
+    the Phase-2 flags only signal that the segment landed: the gather read
+    and the final store go away.
+
+    `outputs[r]` is the registered output of rank r, mapped in this process,
+    and the input is that output as a whole on every rank: the ranks agreed
+    on the outputs and their offsets at registration, while an offset into
+    an output would be a per-call value the peers cannot check. The peers
+    store into a tile only after this rank sent the tile in Phase-1A, so an
+    in-place all-reduce never overwrites input that was not read yet.
+
+    Only a lossless Phase-2 codec takes this path: a compressing one would
+    send more bytes in fp16 than the gather saves.
+*/
+struct DirectOutput {
+  uint8_t** outputs = nullptr;  // nullptr: gather through the buffers
+
+  __quickreduce_host_device_inline__ bool enabled() const {
+    return outputs != nullptr;
+  }
+};
+
+}  // namespace quickreduce
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include "host_device.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Walsh-Hadamard rotation of the quantization blocks, which spreads
+    channel outliers over their block before quantization.
+
+Operation:
+    A quantization block holds the 32 values of the lower (or upper) halves
+    of the 4 f16x2_t registers of a group of kThreadGroupSize threads: value
+    4 * t + i of the block is half of register i of thread t of the group.
+    The rotation applies the orthonormal Hadamard matrix H / sqrt(32) to the
+    block: 2 butterfly stages between the registers of a thread, then 3
+    stages between the threads of the group with __shfl_xor, in that order.
+    Both blocks of a register pair are rotated at once by the f16x2_t ops.
+
+    H / sqrt(32) is symmetric and orthogonal, so the rotation is its own
+    inverse. The values are scaled by 1 / sqrt(32) first, so intermediate
+    results never exceed the rotated values. With the FP16_OVFL mode of the
+    kernels, a block whose rotated values exceed the fp16 range saturates.
+
+    Rotation is linear, so the two-shot all-reduce rotates the input tile
+    once after loading it, reduces in the rotated domain, and rotates the
+    result back before storing it (see PhaseCodecTraits in allreduce.h).
+*/
+
+// {1/sqrt(32), 1/sqrt(32)}, f16x2_t
+static constexpr int kHadamardScale = 0x31A831A8;
+
+}  // namespace quickreduce
+
+#if defined(__HIPCC__)
+#include "base.h"
+
+namespace quickreduce {
+
+// Rotate the two blocks of the atom of every thread of a group in place.
+__quickreduce_device_inline__ void hadamard_rotate(int32x4_t& atom) {
+#pragma unroll
+  for (int i = 0; i < 4; i++) {
+    atom[i] = packed_mul<half>(atom[i], kHadamardScale);
+  }
+
+  // Registers i and i ^ stride.
+#pragma unroll
+  for (int stride = 1; stride < 4; stride <<= 1) {
+#pragma unroll
+    for (int i = 0; i < 4; i++) {
+      if (i & stride) continue;
+      int a = atom[i];
+      int b = atom[i + stride];
+      atom[i] = packed_add<half>(a, b);
+      atom[i + stride] = packed_sub<half>(a, b);
+    }
+  }
+
+  // Lanes t and t ^ stride of the group: the lower lane keeps the sum.
+#pragma unroll
+  for (int stride = 1; stride < kThreadGroupSize; stride <<= 1) {
+    bool const upper = threadIdx.x & stride;
+#pragma unroll
+    for (int i = 0; i < 4; i++) {
+      int other = __shfl_xor(atom[i], stride);
+      atom[i] = upper ? packed_sub<half>(other, atom[i])
+                      : packed_add<half>(atom[i], other);
+    }
+  }
+}
+
+}  // namespace quickreduce
+#endif
@@ -0,0 +1,11 @@
+#pragma once
+
+// Qualifiers for small helpers that are shared between the kernels and
+// host-side code (planners, references and host tests). Headers that only
+// depend on this file can be compiled without the HIP toolchain.
+#if defined(__HIPCC__)
+  #include <hip/hip_runtime.h>
+  #define __quickreduce_host_device_inline__ __host__ __device__ __forceinline__
+#else
+  #define __quickreduce_host_device_inline__ inline
+#endif
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include "host_device.h"
+
+namespace quickreduce {
+
+// Occupancy the two-shot kernels are compiled for, see
+// __quickreduce_launch_bounds_two_shot__.
+static constexpr int kMaxBlocksPerCU = 4;
+
+// Fallback CU count when the device cannot be queried. 304 CUs on MI300X.
+static constexpr int kDefaultNumCUs = 304;
+
+// The communication buffer holds a region per (stage, slot, block): the two
+// stages of the two-shot algorithm, each with two slots that the pipelined
+// kernel alternates between consecutive tiles of a block.
+static constexpr int kNumStages = 2;
+static constexpr int kNumSlots = 2;
+
+/*
+===============================================================
+Desc:
+    Device dependent launch configuration of the two-shot kernels.
+
+Operation:
+    The grid is sized to fill every CU of the device at the occupancy the
+    kernel achieves on it. The flags region of the communication buffer holds
+    one flag per (rank, block) for each stage and slot, hence it depends on
+    the grid size and must be derived from the same values on every rank.
+*/
+struct LaunchConfig {
+  uint32_t max_grid;           // max number of resident blocks
+  uint32_t flags_buffer_size;  // bytes of the flags region
+};
+
+// Max resident blocks for `num_cus` CUs running `blocks_per_cu` blocks each.
+// Non-positive values fall back to the MI300X defaults, and the occupancy is
+// clamped to the launch bounds of the kernel.
+__quickreduce_host_device_inline__ uint32_t max_grid_size(int num_cus,
+                                                          int blocks_per_cu) {
+  if (num_cus <= 0) num_cus = kDefaultNumCUs;
+  if (blocks_per_cu <= 0 || blocks_per_cu > kMaxBlocksPerCU) {
+    blocks_per_cu = kMaxBlocksPerCU;
+  }
+  return static_cast<uint32_t>(num_cus) * blocks_per_cu;
+}
+
+// Grid launched for a problem of `num_blocks` tiles. Blocks loop over the
+// remaining tiles when the problem is larger than the resident grid.
+__quickreduce_host_device_inline__ uint32_t grid_size(uint32_t num_blocks,
+                                                      uint32_t max_grid) {
+  return num_blocks < max_grid ? num_blocks : max_grid;
+}
+
+// Bytes of the flags region: stages x slots x world_size x max_grid flags.
+__quickreduce_host_device_inline__ uint32_t flags_buffer_size(int world_size,
+                                                              uint32_t max_grid) {
+  return kNumStages * kNumSlots * static_cast<uint32_t>(world_size) * max_grid *
+         sizeof(uint32_t);
+}
+
+// Bytes of the two-shot regions: one transmitted tile per (stage, slot,
+// block).
+__quickreduce_host_device_inline__ int64_t twoshot_regions_size(
+    uint32_t max_grid, uint32_t tile_size) {
+  return int64_t(kNumStages) * kNumSlots * max_grid * tile_size;
+}
+
+// Bytes of the data region. Twice the max problem size, and at least the
+// two-shot regions.
+__quickreduce_host_device_inline__ int64_t data_buffer_size(
+    int64_t max_problem_size, uint32_t max_grid, uint32_t tile_size) {
+  int64_t regions = twoshot_regions_size(max_grid, tile_size);
+  return 2 * max_problem_size > regions ? 2 * max_problem_size : regions;
+}
+
+/*
+===============================================================
+Desc:
+    Submission channels of the communication buffer.
+
+Operation:
+    Channel 0 is the buffer as laid out above: the two-shot flags, the
+    all-to-all flags, then the data region. Every further channel is
+    appended after it, with its own two-shot flags followed by its own
+    two-shot regions, at a kChannelAlignment boundary. A kernel addresses a
+    channel with the buffer pointers moved to its base and the data offset
+    of the channel, so the kernels are unchanged.
+*/
+static constexpr int64_t kChannelAlignment = 4096;
+
+struct ChannelLayout {
+  int64_t base;          // bytes from the start of the buffer
+  uint32_t data_offset;  // bytes from base to the two-shot regions
+};
+
+// Bytes of a channel past the first.
+__quickreduce_host_device_inline__ int64_t channel_buffer_size(
+    int world_size, uint32_t max_grid, uint32_t tile_size) {
+  int64_t bytes = flags_buffer_size(world_size, max_grid) +
+                  twoshot_regions_size(max_grid, tile_size);
+  return (bytes + kChannelAlignment - 1) / kChannelAlignment *
+         kChannelAlignment;
+}
+
+// Layout of `channel`, in a buffer whose channel 0 has `first_bytes` bytes
+// with its data at `first_data_offset`.
+__quickreduce_host_device_inline__ ChannelLayout channel_layout(
+    int channel, int64_t first_bytes, uint32_t first_data_offset,
+    int world_size, uint32_t max_grid, uint32_t tile_size) {
+  if (channel == 0) return {0, first_data_offset};
+  int64_t first = (first_bytes + kChannelAlignment - 1) / kChannelAlignment *
+                  kChannelAlignment;
+  return {first + (channel - 1) * channel_buffer_size(world_size, max_grid,
+                                                      tile_size),
+          flags_buffer_size(world_size, max_grid)};
+}
+
+// Bytes of a buffer of `num_channels` channels.
+__quickreduce_host_device_inline__ int64_t channels_buffer_size(
+    int num_channels, int64_t first_bytes, uint32_t first_data_offset,
+    int world_size, uint32_t max_grid, uint32_t tile_size) {
+  if (num_channels <= 1) return first_bytes;
+  return channel_layout(num_channels, first_bytes, first_data_offset,
+                        world_size, max_grid, tile_size)
+      .base;
+}
+
+__quickreduce_host_device_inline__ LaunchConfig make_launch_config(
+    int world_size, int num_cus, int blocks_per_cu) {
+  LaunchConfig config;
+  config.max_grid = max_grid_size(num_cus, blocks_per_cu);
+  config.flags_buffer_size = flags_buffer_size(world_size, config.max_grid);
+  return config;
+}
+
+}  // namespace quickreduce
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include "host_device.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    2-D strided layout of the all-reduce input/output.
+
+Operation:
+    The problem is `rows` rows of `row_elements` contiguous fp16 elements,
+    with consecutive rows `row_stride` elements apart. This covers dense
+    tensors (a single row) and the slices and transposes whose inner
+    dimensions stay contiguous, such as the head shard of an activation.
+
+    Tiles are cut from the logical, row-major element order, so the codecs,
+    the schedule and the readiness flags see the same N elements as for a
+    dense tensor. Only load_tile/store_tile translate an element index into
+    a buffer offset, one atom (8 elements) at a time: rows and strides must
+    therefore be multiples of an atom, so that an atom never straddles two
+    rows. Atoms past the end of the problem map to an out-of-range offset,
+    which the buffer instructions drop (store) or read as zero (load).
+*/
+struct TensorLayout {
+  uint32_t rows = 1;
+  uint32_t row_elements = 0;  // contiguous elements per row
+  uint32_t row_stride = 0;    // elements between the starts of two rows
+
+  __quickreduce_host_device_inline__ uint32_t numel() const {
+    return rows * row_elements;
+  }
+
+  __quickreduce_host_device_inline__ bool dense() const {
+    return rows == 1 || row_stride == row_elements;
+  }
+};
+
+// Elements per 16B atom.
+static constexpr uint32_t kAtomElements = 8;
+
+__quickreduce_host_device_inline__ TensorLayout dense_layout(uint32_t N) {
+  return TensorLayout{1, N, N};
+}
+
+// Number of elements addressed by the layout, from the first element of the
+// first row to the last element of the last row.
+__quickreduce_host_device_inline__ uint64_t layout_span(
+    TensorLayout const& layout) {
+  if (layout.rows == 0 || layout.row_elements == 0) return 0;
+  return uint64_t(layout.rows - 1) * layout.row_stride + layout.row_elements;
+}
+
+// Whether the kernels can address the layout with 32-bit byte offsets and
+// whole atoms. A dense layout is always supported.
+__quickreduce_host_device_inline__ bool layout_supported(
+    TensorLayout const& layout) {
+  if (layout.dense()) return true;
+  return layout.row_elements % kAtomElements == 0 &&
+         layout.row_stride % kAtomElements == 0 &&
+         layout.row_stride >= layout.row_elements &&
+         layout_span(layout) * 2 <= UINT32_MAX;
+}
+
+// Collapse a tensor of `dims` dimensions into a layout: the trailing
+// dimensions must be contiguous, and the leading ones must step by a single
+// row stride. Returns false if the tensor has no such layout, or one the
+// kernels cannot address.
+inline bool layout_from_strides(int64_t const* sizes, int64_t const* strides,
+                                int64_t dims, TensorLayout& layout) {
+  // Trailing dimensions [inner, dims) form a contiguous row.
+  int64_t inner = dims;
+  int64_t row_elements = 1;
+  while (inner > 0 &&
+         (sizes[inner - 1] == 1 || strides[inner - 1] == row_elements)) {
+    row_elements *= sizes[inner - 1];
+    inner--;
+  }
+  int64_t rows = 1;
+  int64_t row_stride = row_elements;
+  if (inner > 0) {
+    // Leading dimensions [0, inner) step by the stride of the innermost.
+    row_stride = strides[inner - 1];
+    for (int64_t d = inner - 1; d >= 0; d--) {
+      if (sizes[d] != 1 && strides[d] != row_stride * rows) return false;
+      rows *= sizes[d];
+    }
+  }
+  if (rows * row_elements > UINT32_MAX || row_stride > UINT32_MAX ||
+      row_stride < 0) {
+    return false;
+  }
+  layout = TensorLayout{static_cast<uint32_t>(rows),
+                        static_cast<uint32_t>(row_elements),
+                        static_cast<uint32_t>(row_stride)};
+  if (rows == 1) layout.row_stride = layout.row_elements;
+  return layout_supported(layout);
+}
+
+// Buffer offset, in elements, of logical element `e` (e < numel).
+__quickreduce_host_device_inline__ uint32_t layout_offset(
+    TensorLayout const& layout, uint32_t e) {
+  if (layout.dense()) return e;
+  uint32_t row = e / layout.row_elements;
+  return row * layout.row_stride + (e - row * layout.row_elements);
+}
+
+// Byte offset of the atom of `thread` at index `atom` of tile `block`, as
+// read by load_tile and written by store_tile. Returns `range` (out of
+// bounds) for atoms past the end of the problem.
+__quickreduce_host_device_inline__ uint32_t layout_atom_offset(
+    TensorLayout const& layout, uint32_t block, int thread, int atom,
+    uint32_t tile_elements, int atom_stride, uint32_t range) {
+  uint32_t e = block * tile_elements +
+               (atom * atom_stride + thread) * kAtomElements;
+  if (layout.dense()) return e * 2;
+  if (e >= layout.numel()) return range;
+  return layout_offset(layout, e) * 2;
+}
+
+}  // namespace quickreduce
@@ -39,7 +39,7 @@ __device_inline__ static void set_fp16_ovfl(bool const value) {
     // const short simm16 = (size << 11) | (offset << 6) | hwRegId;
     // simm16 = 0xdc1
 
-#if defined(__gfx942__)
+#if defined(__gfx942__) || defined(__gfx90a__) || defined(__gfx908__)
     if (value) {
         asm volatile("s_setreg_imm32_b32 0xdc1, 1;"::);
     } else {
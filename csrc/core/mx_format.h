@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include "host_device.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    OCP Microscaling (MX) element formats: MXFP4 (E2M1), MXFP6 (E2M3) and
+    MXINT8, in blocks of 32 elements with a shared E8M0 scale.
+
+Operation:
+    A block shares the scale 2^X, stored as the byte X + 127. X is
+    floor(log2(amax)) - kEmax, where amax is the largest magnitude of the
+    block and kEmax the exponent of the largest element, so the largest
+    value of the block lands in the top binade of the element format. A
+    block of zeros gets the smallest scale, 2^-127.
+
+    An element is its value scaled by 2^-X, rounded to nearest even and
+    saturated to the largest element. The scaling is an exponent add
+    (ldexp), exact for every fp16 input, which replaces the reciprocal and
+    the multiplies of the fp16 scales of the other codecs. Decoding scales
+    the element back by 2^X and rounds once to fp16.
+
+    Element codes are unsigned bit patterns of kBits bits: sign, exponent
+    and mantissa for the float formats (no Inf or NaN), two's complement
+    with an implied scale of 2^-6 for MXINT8.
+
+    The same functions run in the kernels and in the host reference, which
+    makes the reference bit-exact.
+*/
+
+// Sign, E exponent bits with a bias of 2^(E-1) - 1, and M mantissa bits.
+template <int E, int M>
+struct MxFloatElement {
+  static constexpr int kBits = 1 + E + M;
+  static constexpr int kBias = (1 << (E - 1)) - 1;
+  static constexpr int kEmax = (1 << E) - 1 - kBias;
+  static constexpr int kEmin = 1 - kBias;
+  // (2 - 2^-M) * 2^kEmax
+  static constexpr float kMax =
+      float((2 << M) - 1) / float(1 << M) * float(1 << kEmax);
+
+  __quickreduce_host_device_inline__ static uint32_t encode(float x) {
+    uint32_t sign = x < 0.0f ? 1u << (E + M) : 0u;
+    float a = fminf(fabsf(x), kMax);
+    int e;
+    frexpf(a, &e);
+    e = e - 1 < kEmin ? kEmin : e - 1;
+    // Units of the last mantissa bit of binade e: below 2^M in the
+    // subnormal range, and 2^(M + 1) when rounding carries into binade
+    // e + 1, which the code below absorbs.
+    int q = static_cast<int>(rintf(ldexpf(a, M - e)));
+    return sign | static_cast<uint32_t>((e - kEmin) * (1 << M) + q);
+  }
+
+  __quickreduce_host_device_inline__ static float decode(uint32_t code) {
+    uint32_t field = (code >> M) & ((1u << E) - 1);
+    int mantissa = code & ((1u << M) - 1);
+    int significand = field ? (1 << M) + mantissa : mantissa;
+    int exponent = (field ? static_cast<int>(field) : 1) - kBias - M;
+    float a = ldexpf(static_cast<float>(significand), exponent);
+    return (code >> (E + M)) & 1 ? -a : a;
+  }
+};
+
+// Two's complement, implied scale 2^-6, symmetric range [-127, 127].
+struct MxIntElement {
+  static constexpr int kBits = 8;
+  static constexpr int kEmax = 0;
+  static constexpr float kMax = 127.0f / 64.0f;
+
+  __quickreduce_host_device_inline__ static uint32_t encode(float x) {
+    float q = rintf(ldexpf(x, 6));
+    q = fminf(fmaxf(q, -127.0f), 127.0f);
+    return static_cast<uint32_t>(static_cast<int>(q)) & 0xFF;
+  }
+
+  __quickreduce_host_device_inline__ static float decode(uint32_t code) {
+    return ldexpf(static_cast<float>(static_cast<int8_t>(code & 0xFF)), -6);
+  }
+};
+
+using MxFp4 = MxFloatElement<2, 1>;
+using MxFp6 = MxFloatElement<2, 3>;
+using MxInt8 = MxIntElement;
+
+static constexpr int kMxBlockSize = 32;
+static constexpr int kMxScaleBias = 127;
+
+// Shared exponent of a block with largest magnitude `amax`.
+template <class Element>
+__quickreduce_host_device_inline__ int mx_shared_exponent(float amax) {
+  if (!(amax > 0.0f)) return -kMxScaleBias;
+  int e;
+  frexpf(amax, &e);
+  int x = e - 1 - Element::kEmax;
+  return x < -kMxScaleBias ? -kMxScaleBias
+                           : (x > kMxScaleBias ? kMxScaleBias : x);
+}
+
+/*
+===============================================================
+Desc:
+    Destination of an all-reduce result handed over MX-encoded.
+
+Operation:
+    With an MX codec in Phase-2, every rank receives the reduced segments
+    MX-encoded. Instead of decoding them into the fp16 output, the kernel
+    copies the element codes and scales as they arrived into the layout a
+    consumer of MX operands reads: element i at bits [i * kBits,
+    (i + 1) * kBits) of `elements` (little-endian, so two MXFP4 elements
+    per byte, low nibble first), and the scale of elements
+    [32 * b, 32 * b + 32) at `scales[b]`. The values are the ones the fp16
+    output would have held, before the final rounding to fp16.
+
+    The fp16 input is left as it was. Only dense inputs of a multiple of 32
+    elements are supported.
+*/
+struct MxOutput {
+  uint8_t* elements = nullptr;  // nullptr: decode into the fp16 output
+  uint8_t* scales = nullptr;
+
+  __quickreduce_host_device_inline__ bool enabled() const {
+    return elements != nullptr;
+  }
+};
+
+// Bytes of the MX-encoded elements and scales of N elements.
+template <class Element>
+__quickreduce_host_device_inline__ uint64_t mx_element_bytes(uint64_t N) {
+  return (N * Element::kBits + 7) / 8;
+}
+
+__quickreduce_host_device_inline__ uint64_t mx_scale_bytes(uint64_t N) {
+  return (N + kMxBlockSize - 1) / kMxBlockSize;
+}
+
+}  // namespace quickreduce
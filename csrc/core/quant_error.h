@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include "host_device.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Sampled quantization-error telemetry of the two-shot all-reduce.
+
+Operation:
+    On the sampled tiles of a call, the kernel compares the values a rank
+    encodes with the values it decodes, in registers: the own segment of
+    a rank goes through its own communication buffer in both phases, so
+    Phase-1B decodes it while the original segment is still in tA (the
+    pipelined kernel, which loads the next tile into tA first, keeps a
+    copy of it), and Phase-2 gathers it back while the reduced segment is
+    still in tR. The
+    errors of every wave are reduced with cross-lane shuffles and added
+    to the record of the call with one set of atomics per wave.
+
+    QuantErrorStats holds the max abs error (as the bits of a non-negative
+    float, ordered like uint32), the sums of the squared errors and of the
+    squared original values, and the number of values. The relative rmse
+    is sqrt(sum_sq_error / sum_sq_value). Rotated codecs are measured in
+    the rotated domain. A phase that does not go through its codec (direct
+    and MX outputs) leaves its stats empty.
+*/
+struct QuantErrorStats {
+  uint32_t max_abs_error = 0;  // float bits
+  float sum_sq_error = 0.0f;
+  float sum_sq_value = 0.0f;
+  uint32_t count = 0;
+};
+
+// The stats of one call, per phase.
+struct QuantErrorRecord {
+  QuantErrorStats phase[2];
+};
+static_assert(sizeof(QuantErrorRecord) == 32);
+
+// Kernel parameter: the record of the call, and the sampled tiles.
+struct QuantErrorTelemetry {
+  QuantErrorRecord* record = nullptr;  // nullptr: not sampled
+  uint32_t tile_every = 1;
+
+  __quickreduce_host_device_inline__ bool enabled() const {
+    return record != nullptr;
+  }
+  // Record of tile `tile`, or nullptr if the tile is not sampled.
+  __quickreduce_host_device_inline__ QuantErrorRecord* sampled(
+      uint32_t tile) const {
+    return record != nullptr && tile % tile_every == 0 ? record : nullptr;
+  }
+};
+
+inline float quant_error_max_abs(QuantErrorStats const& s) {
+  float value;
+  std::memcpy(&value, &s.max_abs_error, sizeof(value));
+  return value;
+}
+
+// Relative rmse of the stats; infinite if the errors are not finite.
+inline double quant_error_relative_rmse(QuantErrorStats const& s) {
+  if (!std::isfinite(s.sum_sq_error) || !std::isfinite(s.sum_sq_value)) {
+    return std::numeric_limits<double>::infinity();
+  }
+  if (s.sum_sq_value <= 0.0f) {
+    return s.sum_sq_error > 0.0f ? std::numeric_limits<double>::infinity()
+                                 : 0.0;
+  }
+  return std::sqrt(double(s.sum_sq_error) / double(s.sum_sq_value));
+}
+
+inline void merge_quant_error(QuantErrorStats& into,
+                              QuantErrorStats const& from) {
+  into.max_abs_error = into.max_abs_error > from.max_abs_error
+                           ? into.max_abs_error
+                           : from.max_abs_error;
+  into.sum_sq_error += from.sum_sq_error;
+  into.sum_sq_value += from.sum_sq_value;
+  into.count += from.count;
+}
+
+// Host reference of the kernel accumulation, on fp32 values.
+inline void add_quant_error(QuantErrorStats& stats, float original,
+                            float decoded) {
+  float error = std::fabs(decoded - original);
+  uint32_t bits;
+  if (!(error <= std::numeric_limits<float>::max())) {
+    error = std::numeric_limits<float>::infinity();
+  }
+  std::memcpy(&bits, &error, sizeof(bits));
+  if (bits > stats.max_abs_error) stats.max_abs_error = bits;
+  stats.sum_sq_error += error * error;
+  stats.sum_sq_value += original * original;
+  stats.count++;
+}
+
+}  // namespace quickreduce
+
+#if defined(__HIPCC__)
+#include "base.h"
+
+namespace quickreduce {
+
+// Add the errors of the `n` decoded atoms of every thread of the block to
+// `stats`. Every thread of the block must call it.
+__quickreduce_device_inline__ void accumulate_quant_error(
+    QuantErrorStats* stats, int32x4_t const* __restrict__ original,
+    int32x4_t const* __restrict__ decoded, int const n) {
+  float max_error = 0.0f, sq_error = 0.0f, sq_value = 0.0f;
+  for (int i = 0; i < n; i++) {
+    half2 const* a = reinterpret_cast<half2 const*>(&original[i]);
+    half2 const* b = reinterpret_cast<half2 const*>(&decoded[i]);
+#pragma unroll
+    for (int j = 0; j < 4; j++) {
+      float2 x = __half22float2(a[j]);
+      float2 y = __half22float2(b[j]);
+      float ex = fabsf(y.x - x.x), ey = fabsf(y.y - x.y);
+      max_error = fmaxf(max_error, fmaxf(ex, ey));
+      sq_error += ex * ex + ey * ey;
+      sq_value += x.x * x.x + x.y * x.y;
+    }
+  }
+  for (int offset = kWavefront / 2; offset > 0; offset /= 2) {
+    max_error = fmaxf(max_error, __shfl_xor(max_error, offset));
+    sq_error += __shfl_xor(sq_error, offset);
+    sq_value += __shfl_xor(sq_value, offset);
+  }
+  if (threadIdx.x == 0) {
+    atomicMax(&stats->max_abs_error, __float_as_uint(max_error));
+    atomicAdd(&stats->sum_sq_error, sq_error);
+    atomicAdd(&stats->sum_sq_value, sq_value);
+    atomicAdd(&stats->count, static_cast<uint32_t>(n * 8 * kWavefront));
+  }
+}
+
+}  // namespace quickreduce
+#endif
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include "host_device.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Producer readiness flags of the all-reduce input.
+
+Operation:
+    The input is split into chunks of `flag_elements` elements, each with a
+    uint32 flag. The producer of the input (a GEMM epilogue, or a
+    stream-ordered write after a chunk of work) sets the flag of a chunk to
+    `epoch` once the chunk is written, with release semantics. Before reading
+    a tile, the two-shot kernel waits until every flag overlapping the tile
+    carries `epoch`, so the sends of the first tiles overlap the tail of the
+    producer instead of waiting for it to finish.
+
+    Flags are never cleared: the caller passes a new epoch per step. The flag
+    buffer must start zeroed, hence epochs start at 1.
+
+    The kernel spins on the flags, so the producer must be able to make
+    progress while the all-reduce occupies the CUs: launch the producer kernel
+    first, or set the flags with stream-ordered writes (see
+    DeviceComms::signal_ready), which do not need a CU.
+*/
+struct TileReadiness {
+  uint32_t* flags = nullptr;   // nullptr: the input is ready at launch
+  uint32_t flag_elements = 0;  // elements covered by one flag
+  uint32_t epoch = 0;          // value of a ready flag
+
+  __quickreduce_host_device_inline__ bool enabled() const {
+    return flags != nullptr;
+  }
+};
+
+// Number of flags covering a problem of N elements.
+__quickreduce_host_device_inline__ uint32_t readiness_num_flags(
+    uint32_t N, uint32_t flag_elements) {
+  return flag_elements == 0 ? 0 : (N + flag_elements - 1) / flag_elements;
+}
+
+// Range [first, last) of the flags overlapping elements [begin, end) of a
+// problem of N elements.
+struct FlagRange {
+  uint32_t first;
+  uint32_t last;
+};
+
+__quickreduce_host_device_inline__ FlagRange readiness_flag_range(
+    uint32_t begin, uint32_t end, uint32_t N, uint32_t flag_elements) {
+  end = end < N ? end : N;
+  if (begin >= end || flag_elements == 0) return {0, 0};
+  return {begin / flag_elements, (end - 1) / flag_elements + 1};
+}
+
+// Flags a tile of `tile_elements` elements depends on.
+__quickreduce_host_device_inline__ FlagRange readiness_tile_flags(
+    uint32_t tile, uint32_t tile_elements, uint32_t N, uint32_t flag_elements) {
+  uint64_t begin = static_cast<uint64_t>(tile) * tile_elements;
+  uint64_t end = begin + tile_elements;
+  if (begin >= N) return {0, 0};
+  return readiness_flag_range(static_cast<uint32_t>(begin),
+                              static_cast<uint32_t>(end < N ? end : N), N,
+                              flag_elements);
+}
+
+}  // namespace quickreduce
+
+#if defined(__HIPCC__)
+#include "base.h"
+
+namespace quickreduce {
+
+// Producer side: mark flag `index` ready once the calling block has written
+// the chunk. Every thread of the block must call it after its last store.
+__quickreduce_device_inline__ void signal_tile_ready(
+    TileReadiness const& readiness, uint32_t index) {
+  __syncthreads();
+  if (threadIdx.x == 0 && threadIdx.y == 0 && threadIdx.z == 0) {
+    __threadfence();
+    set_sync_flag(readiness.flags + index, readiness.epoch);
+  }
+}
+
+// Consumer side: wait until the input tile can be read. The threads of the
+// block wait on the flags of the tile in parallel.
+__quickreduce_device_inline__ void wait_tile_ready(
+    TileReadiness const& readiness, uint32_t N, uint32_t tile,
+    uint32_t tile_elements, int thread) {
+  if (!readiness.enabled()) return;
+  FlagRange range =
+      readiness_tile_flags(tile, tile_elements, N, readiness.flag_elements);
+  for (uint32_t f = range.first + thread; f < range.last;
+       f += blockDim.x * blockDim.y) {
+    wait_sync_flag(readiness.flags + f, readiness.epoch);
+  }
+  __threadfence();
+  __syncthreads();
+}
+
+}  // namespace quickreduce
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include "host_device.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Reduction operator of the all-reduce.
+
+Operation:
+    Phase-1B combines the segments of the ranks with the operator, starting
+    from the segment of rank 0, and MEAN scales the sum by 1 / world_size
+    before the broadcast. The scale is a power of two for the supported world
+    sizes, so it is exact.
+
+    The block-quantization and top-k codecs decode every rank against its own
+    block scale or drop values, which does not preserve the order between
+    ranks: max/min always use the fp16 codec. Sum and mean keep the codec of
+    the quant level.
+*/
+enum struct ReduceOp : int {
+  SUM = 0,
+  MAX = 1,
+  MIN = 2,
+  MEAN = 3,
+};
+
+// Whether the operator needs a lossless codec.
+__quickreduce_host_device_inline__ bool reduce_op_lossless(ReduceOp op) {
+  return op == ReduceOp::MAX || op == ReduceOp::MIN;
+}
+
+// Quant level the all-reduce runs with: F16 (0) for max/min.
+__quickreduce_host_device_inline__ int reduce_op_quant_level(ReduceOp op,
+                                                             int quant_level) {
+  return reduce_op_lossless(op) ? 0 : quant_level;
+}
+
+inline ReduceOp reduce_op_from_name(std::string const& name) {
+  if (name == "sum") return ReduceOp::SUM;
+  if (name == "max") return ReduceOp::MAX;
+  if (name == "min") return ReduceOp::MIN;
+  if (name == "mean" || name == "avg") return ReduceOp::MEAN;
+  throw std::invalid_argument("unknown reduce op: " + name);
+}
+
+}  // namespace quickreduce
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include "launch.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Tile schedule of the two-shot kernels and its communication buffer layout.
+
+Operation:
+    A kernel launch processes `num_blocks` tiles on a grid of `grid` blocks.
+    Block b handles tiles b, b + grid, b + 2 * grid, ... and the i-th of them
+    (iteration i) is synchronized with flag color `flag_color + i`. A launch
+    therefore consumes `twoshot_iterations` colors, and the next launch must
+    start after them so a stale flag can never carry an expected color.
+
+    Every (stage, slot, block) owns a region of the data and flags buffers.
+    Regions are strided by the max grid rather than the launched grid, so the
+    layout does not move between launches of different sizes. The sequential
+    kernel only uses slot 0; the pipelined kernel alternates the slots so the
+    Phase-1A send of iteration i + 1 can be issued before the Phase-1B wait
+    of iteration i.
+*/
+
+__quickreduce_host_device_inline__ uint32_t twoshot_iterations(
+    uint32_t num_blocks, uint32_t grid) {
+  return grid == 0 ? 0 : (num_blocks + grid - 1) / grid;
+}
+
+// Flag color of iteration `iteration` of a launch.
+__quickreduce_host_device_inline__ uint32_t tile_color(uint32_t flag_color,
+                                                       uint32_t iteration) {
+  return flag_color + iteration;
+}
+
+// Buffer slot of iteration `iteration` in the pipelined kernel.
+__quickreduce_host_device_inline__ int pipeline_slot(uint32_t iteration) {
+  return static_cast<int>(iteration % kNumSlots);
+}
+
+// Index of the (stage, slot, block) region.
+__quickreduce_host_device_inline__ uint32_t comm_region(int stage, int slot,
+                                                        int block_id,
+                                                        uint32_t max_grid) {
+  return (stage * kNumSlots + slot) * max_grid + block_id;
+}
+
+// Byte offset of a region in the data buffer, which starts at `data_offset`.
+__quickreduce_host_device_inline__ uint32_t comm_data_offset(
+    uint32_t data_offset, int stage, int slot, int block_id, uint32_t max_grid,
+    uint32_t transmitted_tile_size) {
+  return data_offset +
+         comm_region(stage, slot, block_id, max_grid) * transmitted_tile_size;
+}
+
+// Byte offset of a region in the flags buffer. A region holds one flag per
+// source rank.
+__quickreduce_host_device_inline__ uint32_t comm_flags_offset(
+    int stage, int slot, int block_id, uint32_t max_grid, int world_size) {
+  return comm_region(stage, slot, block_id, max_grid) * world_size *
+         sizeof(uint32_t);
+}
+
+/*
+===============================================================
+Desc:
+    Data movement of the rooted two-shot collectives.
+
+Operation:
+    Broadcast and reduce-to-root run the two stages of the all-reduce on the
+    same regions and colors, but only move the segments the result needs:
+
+    - broadcast: in stage 0 only the root sends, segment r of its tile to
+      rank r; in stage 1 every rank forwards its segment to every rank.
+    - reduce: stage 0 is the reduce-scatter of the all-reduce; in stage 1
+      every rank sends its reduced segment to the root only.
+
+    Flags are still set on every rank in both stages, and every rank waits
+    on every flag. A rank therefore only moves to the next tile of its block
+    once every peer has read the regions it is about to overwrite; the
+    schedule simulator checks this for back-to-back launches.
+*/
+enum struct RootedCollective : int {
+  BROADCAST = 0,
+  REDUCE = 1,
+};
+
+// Whether `src` sends its segment for `dst` in `stage`, and thus whether
+// `dst` reads it (otherwise `dst` only waits on the flag).
+__quickreduce_host_device_inline__ bool rooted_sends_segment(
+    RootedCollective collective, int stage, int src, int dst, int root) {
+  if (collective == RootedCollective::BROADCAST) {
+    return stage == 1 || src == root;
+  }
+  return stage == 0 || dst == root;
+}
+
+// Whether `rank` writes the result to its tensor. The broadcast root keeps
+// its input as is, also when a lossy codec is used for the payload.
+__quickreduce_host_device_inline__ bool rooted_stores_output(
+    RootedCollective collective, int rank, int root) {
+  return collective == RootedCollective::BROADCAST ? rank != root
+                                                   : rank == root;
+}
+
+}  // namespace quickreduce
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../core/layout.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Trace of sampled all-reduce inputs, to evaluate the codecs offline on
+    the data of a real model (see tools/allreduce_replay.cpp).
+
+Operation:
+    A trace file is a TraceFileHeader followed by records appended back to
+    back: a TraceRecordHeader, then `numel` fp16 values, padded to 16B. A
+    record holds the first rows of the input of an all-reduce call, as
+    dense rows of `row_elements` values.
+
+    The writer creates the file at its full capacity and maps it. A record
+    is copied in first, then `used` in the file header moves past it, so a
+    reader only ever sees whole records, also of a process that died while
+    appending. Reopening an existing trace appends after its last record.
+    A full trace drops the records that do not fit.
+
+    TraceSampler limits the capture: every sample_every-th call of the rank
+    (the first one included), at most max_elements values of it.
+*/
+
+static constexpr uint64_t kTraceMagic = 0x3145434152545251ull;  // "QRTRACE1"
+static constexpr uint32_t kTraceVersion = 1;
+static constexpr uint32_t kTraceRecordMagic = 0x43455251;  // "QREC"
+
+struct TraceFileHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t header_bytes;
+  uint64_t capacity;  // bytes of the file
+  uint64_t used;      // bytes of the header and the whole records
+};
+
+struct TraceRecordHeader {
+  uint32_t magic;
+  int32_t rank;
+  int32_t world_size;
+  int32_t quant_level;
+  int32_t op;
+  uint32_t row_elements;  // values per row of the captured rows
+  uint64_t call_index;    // all-reduce call of the rank, from 0
+  uint64_t call_numel;    // values of the whole input
+  uint64_t numel;         // values captured
+};
+static_assert(sizeof(TraceFileHeader) % 16 == 0);
+static_assert(sizeof(TraceRecordHeader) % 16 == 0);
+
+// Bytes of a record of `numel` values.
+inline uint64_t trace_record_bytes(uint64_t numel) {
+  return sizeof(TraceRecordHeader) + (numel * 2 + 15) / 16 * 16;
+}
+
+struct TraceSampler {
+  uint64_t sample_every = 1000;
+  uint64_t max_elements = 1 << 20;
+
+  bool sampled(uint64_t call_index) const {
+    return sample_every != 0 && call_index % sample_every == 0;
+  }
+};
+
+// Rows of `layout` a sample of at most `max_elements` values copies: whole
+// rows of a strided layout, as many as fit, or else the start of the first
+// row; the start of a dense one. row_stride is the one of `layout`.
+inline TensorLayout trace_sample_layout(TensorLayout const& layout,
+                                        uint64_t max_elements) {
+  TensorLayout sample = layout;
+  if (layout.dense() || layout.row_elements > max_elements) {
+    sample.rows = 1;
+    sample.row_elements = static_cast<uint32_t>(
+        std::min<uint64_t>(layout.numel(), max_elements));
+  } else {
+    sample.rows = static_cast<uint32_t>(std::min<uint64_t>(
+        layout.rows, max_elements / layout.row_elements));
+  }
+  return sample;
+}
+
+// Memory-mapped trace file, either appended to or read.
+class TraceFile {
+ public:
+  // Open `path` for appending, created at `capacity` bytes if it does not
+  // hold a trace yet.
+  static TraceFile append(std::string const& path, uint64_t capacity) {
+    TraceFile trace;
+    trace.fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (trace.fd_ < 0) {
+      throw std::runtime_error("TraceFile: cannot open " + path);
+    }
+    struct stat st;
+    fstat(trace.fd_, &st);
+    bool const existing = static_cast<uint64_t>(st.st_size) >=
+                          sizeof(TraceFileHeader);
+    if (!existing) {
+      if (capacity < sizeof(TraceFileHeader) ||
+          ftruncate(trace.fd_, capacity) != 0) {
+        throw std::runtime_error("TraceFile: cannot size " + path);
+      }
+    }
+    trace.map(path, existing ? st.st_size : capacity, PROT_READ | PROT_WRITE);
+    TraceFileHeader* header = trace.header();
+    if (!existing) {
+      *header = {kTraceMagic, kTraceVersion, sizeof(TraceFileHeader),
+                 capacity, sizeof(TraceFileHeader)};
+    }
+    trace.check(path);
+    return trace;
+  }
+
+  static TraceFile read(std::string const& path) {
+    TraceFile trace;
+    trace.fd_ = open(path.c_str(), O_RDONLY);
+    if (trace.fd_ < 0) {
+      throw std::runtime_error("TraceFile: cannot open " + path);
+    }
+    struct stat st;
+    fstat(trace.fd_, &st);
+    if (static_cast<uint64_t>(st.st_size) < sizeof(TraceFileHeader)) {
+      throw std::runtime_error("TraceFile: not a trace: " + path);
+    }
+    trace.map(path, st.st_size, PROT_READ);
+    trace.check(path);
+    return trace;
+  }
+
+  TraceFile(TraceFile&& other) noexcept { *this = std::move(other); }
+  TraceFile& operator=(TraceFile&& other) noexcept {
+    std::swap(fd_, other.fd_);
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+  ~TraceFile() {
+    if (data_ != nullptr) munmap(data_, size_);
+    if (fd_ >= 0) close(fd_);
+  }
+
+  uint64_t used() const { return header()->used; }
+  uint64_t capacity() const { return header()->capacity; }
+
+  // Append a record of `record.numel` values. Returns false, and leaves the
+  // trace as it is, if the record does not fit.
+  bool append_record(TraceRecordHeader record, uint16_t const* values) {
+    TraceFileHeader* file = header();
+    uint64_t bytes = trace_record_bytes(record.numel);
+    if (file->used + bytes > file->capacity) return false;
+    record.magic = kTraceRecordMagic;
+    uint8_t* dst = data_ + file->used;
+    std::memcpy(dst, &record, sizeof(record));
+    std::memcpy(dst + sizeof(record), values, record.numel * 2);
+    __atomic_store_n(&file->used, file->used + bytes, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // A record of the trace, pointing into the mapping.
+  struct Record {
+    TraceRecordHeader header;
+    uint16_t const* values;
+  };
+
+  std::vector<Record> records() const {
+    std::vector<Record> records;
+    uint64_t end = __atomic_load_n(&header()->used, __ATOMIC_ACQUIRE);
+    uint64_t offset = header()->header_bytes;
+    while (offset + sizeof(TraceRecordHeader) <= end) {
+      Record record;
+      std::memcpy(&record.header, data_ + offset, sizeof(record.header));
+      if (record.header.magic != kTraceRecordMagic ||
+          offset + trace_record_bytes(record.header.numel) > end) {
+        throw std::runtime_error("TraceFile: corrupt record");
+      }
+      record.values = reinterpret_cast<uint16_t const*>(
+          data_ + offset + sizeof(TraceRecordHeader));
+      records.push_back(record);
+      offset += trace_record_bytes(record.header.numel);
+    }
+    return records;
+  }
+
+ private:
+  TraceFile() = default;
+
+  TraceFileHeader* header() const {
+    return reinterpret_cast<TraceFileHeader*>(data_);
+  }
+
+  void map(std::string const& path, uint64_t size, int prot) {
+    void* data = mmap(nullptr, size, prot, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("TraceFile: cannot map " + path);
+    }
+    data_ = static_cast<uint8_t*>(data);
+    size_ = size;
+  }
+
+  void check(std::string const& path) const {
+    TraceFileHeader const* file = header();
+    if (file->magic != kTraceMagic || file->version != kTraceVersion ||
+        file->capacity > size_ || file->used > file->capacity) {
+      throw std::runtime_error("TraceFile: not a trace: " + path);
+    }
+  }
+
+  int fd_ = -1;
+  uint8_t* data_ = nullptr;
+  uint64_t size_ = 0;
+};
+
+}  // namespace quickreduce
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Fixed-capacity building blocks of the asynchronous all-reduce path.
+
+Operation:
+    The async path keeps, per communicator, a workspace per size class, a
+    pool of completion events, and a queue drained by a single completion
+    thread. All of them are backed by fixed arrays: after the first call of
+    each size class, an all-reduce does not touch the heap.
+
+    The containers are generic so that the allocation behaviour can be
+    checked on the host; the torch/HIP types live in the extension.
+*/
+
+// Workspaces are rounded up to powers of two from 4KB.
+static constexpr int64_t kMinWorkspaceBytes = int64_t(1) << 12;
+static constexpr int kNumWorkspaceClasses = 40;
+
+inline int workspace_size_class(int64_t bytes) {
+  int size_class = 0;
+  while ((kMinWorkspaceBytes << size_class) < bytes) size_class++;
+  if (size_class >= kNumWorkspaceClasses) {
+    throw std::invalid_argument("workspace too large");
+  }
+  return size_class;
+}
+
+inline int64_t workspace_class_bytes(int size_class) {
+  return kMinWorkspaceBytes << size_class;
+}
+
+// One buffer per size class, allocated on first use. Buffers are reused in
+// stream order, so a class is only shared by calls on the same stream.
+template <typename Buffer>
+class WorkspaceCache {
+ public:
+  template <typename Allocate>
+  Buffer& get(int64_t bytes, Allocate&& allocate) {
+    int size_class = workspace_size_class(bytes);
+    auto& slot = buffers_[size_class];
+    if (!slot) slot.emplace(allocate(workspace_class_bytes(size_class)));
+    return *slot;
+  }
+
+  void clear() {
+    for (auto& slot : buffers_) slot.reset();
+  }
+
+ private:
+  std::array<std::optional<Buffer>, kNumWorkspaceClasses> buffers_;
+};
+
+// Pool of up to Capacity objects, created on first use and recycled by
+// index. acquire blocks while every object is in use.
+template <typename T, int Capacity>
+class ObjectPool {
+ public:
+  ObjectPool() {
+    for (int i = 0; i < Capacity; i++) free_[i] = Capacity - 1 - i;
+  }
+
+  template <typename Create>
+  int acquire(Create&& create) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return num_free_ > 0; });
+    int index = free_[--num_free_];
+    if (!created_[index]) {
+      items_[index] = create();
+      created_[index] = true;
+    }
+    return index;
+  }
+
+  T& operator[](int index) { return items_[index]; }
+
+  void release(int index) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_[num_free_++] = index;
+    }
+    cv_.notify_one();
+  }
+
+  // Destroy the created objects. The pool must be idle.
+  template <typename Destroy>
+  void destroy_all(Destroy&& destroy) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < Capacity; i++) {
+      if (created_[i]) destroy(items_[i]);
+      created_[i] = false;
+    }
+  }
+
+  int num_created() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int n = 0;
+    for (bool c : created_) n += c;
+    return n;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::array<T, Capacity> items_{};
+  std::array<bool, Capacity> created_{};
+  std::array<int, Capacity> free_{};
+  int num_free_ = Capacity;
+};
+
+// Bounded FIFO between the submitting threads and the completion thread.
+// push blocks while the queue is full; pop blocks until an item arrives and
+// returns false once the queue is closed and drained.
+template <typename Item, int Capacity>
+class CompletionQueue {
+ public:
+  void push(Item item) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_full_.wait(lock, [&] { return size_ < Capacity || closed_; });
+      if (closed_) throw std::runtime_error("completion queue is closed");
+      ring_[(head_ + size_) % Capacity] = std::move(item);
+      size_++;
+    }
+    not_empty_.notify_one();
+  }
+
+  bool pop(Item& item) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_empty_.wait(lock, [&] { return size_ > 0 || closed_; });
+      if (size_ == 0) return false;
+      item = std::move(ring_[head_]);
+      ring_[head_] = Item();
+      head_ = (head_ + 1) % Capacity;
+      size_--;
+    }
+    not_full_.notify_one();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::array<Item, Capacity> ring_{};
+  int head_ = 0;
+  int size_ = 0;
+  bool closed_ = false;
+};
+
+}  // namespace quickreduce
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../core/quant_error.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Adaptive choice of the codec of the all-reduce from the sampled
+    quantization errors (core/quant_error.h).
+
+Operation:
+    Every quant level has a next higher precision level, up to a lossless
+    one: Q3 > Q4 > Q5 > Q6 > Q7 > Q8 > FP16, and likewise along the
+    asymmetric, phase-pair, escape, Hadamard and top-k families. The MX
+    levels stay MX, as their output format is requested by the caller.
+
+    The policy keeps, per requested level, the number of steps up this
+    ladder it runs. Every rank measures the errors of its own segments, and
+    reads its records back whenever their copies complete, so the ranks see
+    different records at different calls. They must still switch codecs on
+    the same call, or they would decode each other's segments with another
+    codec. The records therefore only move a proposal, and the caller
+    applies agreed steps collectively.
+
+    The relative rmse of a record is the worse one of its two phases. After
+    `escalate_after` records in a row above `max_relative_rmse`, a rank
+    proposes one step above the applied level; after `relax_after` records
+    in a row below relax_ratio * max_relative_rmse, one step below. Records
+    of a level that is no longer applied are ignored.
+
+    proposal() lists the proposed steps of every level. The ranks reduce
+    their proposals with a max, so that the most precise one wins and a
+    level relaxes only when every rank proposes it, and pass the result to
+    apply() between the same two calls, e.g. every few hundred steps.
+
+    A max_relative_rmse of 0 disables the policy.
+
+    QuantErrorTotals accumulates the records per level that ran, for
+    reporting.
+*/
+inline int higher_precision_level(int quant_level) {
+  switch (quant_level) {
+    case 12: return 3;   // Q3 -> Q4
+    case 3: return 11;   // Q4 -> Q5
+    case 11: return 2;   // Q5 -> Q6
+    case 2: return 10;   // Q6 -> Q7
+    case 10: return 1;   // Q7 -> Q8
+    case 1: return 0;    // Q8 -> FP16
+    case 6: return 5;    // Q4-asym -> Q6-asym
+    case 5: return 4;    // Q6-asym -> Q8-asym
+    case 4: return 0;    // Q8-asym -> FP16
+    case 8: return 7;    // Top2 -> Top4
+    case 7: return 9;    // Top4 -> Top2-Q8
+    case 9: return 0;    // Top2-Q8 -> FP16
+    case 13: return 15;  // Q4>Q8 -> Q6>Q8
+    case 15: return 1;   // Q6>Q8 -> Q8
+    case 14: return 16;  // Q4>FP16 -> Q6>FP16
+    case 16: return 17;  // Q6>FP16 -> Q8>FP16
+    case 17: return 0;   // Q8>FP16 -> FP16
+    case 18: return 19;  // Q4-Esc -> Q6-Esc
+    case 19: return 1;   // Q6-Esc -> Q8
+    case 20: return 21;  // Q4-H -> Q6-H
+    case 21: return 1;   // Q6-H -> Q8
+    case 22: return 23;  // MXFP4 -> MXFP6
+    case 23: return 24;  // MXFP6 -> MXINT8
+    default: return quant_level;
+  }
+}
+
+// Worse relative rmse of the phases of a record that went through a codec.
+inline double record_relative_rmse(QuantErrorRecord const& record) {
+  double worst = 0.0;
+  for (auto const& phase : record.phase) {
+    if (phase.count == 0) continue;
+    worst = std::max(worst, quant_error_relative_rmse(phase));
+  }
+  return worst;
+}
+
+// Level `steps` up the ladder from `level`, or its last level.
+inline int raised_level(int level, int steps) {
+  for (int i = 0; i < steps; i++) {
+    int next = higher_precision_level(level);
+    if (next == level) break;
+    level = next;
+  }
+  return level;
+}
+
+struct CodecPolicyConfig {
+  double max_relative_rmse = 0.0;  // 0: the policy is disabled
+  uint32_t escalate_after = 2;
+  uint32_t relax_after = 1000;
+  double relax_ratio = 0.5;
+};
+
+class AdaptiveCodecPolicy {
+ public:
+  // Quant levels of a proposal, above the last level.
+  static constexpr int kLevels = 32;
+
+  AdaptiveCodecPolicy() = default;
+  explicit AdaptiveCodecPolicy(CodecPolicyConfig const& config)
+      : config_(config) {}
+
+  bool enabled() const { return config_.max_relative_rmse > 0.0; }
+
+  // Level to run for the requested one.
+  int level(int requested) const {
+    auto it = states_.find(requested);
+    return it == states_.end() ? requested
+                               : raised_level(requested, it->second.applied);
+  }
+
+  // A record of a call requesting `requested`, which ran with `ran`.
+  void observe(int requested, int ran, QuantErrorRecord const& record) {
+    if (!enabled() || requested < 0 || requested >= kLevels) return;
+    State& state = states_[requested];
+    if (ran != raised_level(requested, state.applied)) return;
+    double rmse = record_relative_rmse(record);
+    if (!(rmse <= config_.max_relative_rmse)) {
+      state.under = 0;
+      if (++state.over >= config_.escalate_after) {
+        if (raised_level(requested, state.applied + 1) != ran) {
+          state.proposed = state.applied + 1;
+        }
+        state.over = 0;
+      }
+    } else if (rmse < config_.relax_ratio * config_.max_relative_rmse) {
+      state.over = 0;
+      if (state.applied > 0 && ++state.under >= config_.relax_after) {
+        state.proposed = state.applied - 1;
+        state.under = 0;
+      }
+    } else {
+      state.over = 0;
+      state.under = 0;
+    }
+  }
+
+  // Proposed steps of every requested level, to reduce across the ranks.
+  std::vector<int32_t> proposal() const {
+    std::vector<int32_t> steps(kLevels, 0);
+    for (auto const& [requested, state] : states_) {
+      steps[requested] = state.proposed;
+    }
+    return steps;
+  }
+
+  // Collective: run `steps[l]` steps above every requested level l from the
+  // next call. Every rank must pass the same steps between the same calls.
+  void apply(std::vector<int32_t> const& steps) {
+    if (steps.size() != static_cast<size_t>(kLevels)) {
+      throw std::invalid_argument("Codec policy steps need " +
+                                  std::to_string(kLevels) + " levels, got " +
+                                  std::to_string(steps.size()));
+    }
+    for (int requested = 0; requested < kLevels; requested++) {
+      int applied = std::max(0, static_cast<int>(steps[requested]));
+      // Steps past the last level of the ladder run that level.
+      while (applied > 0 && raised_level(requested, applied - 1) ==
+                                raised_level(requested, applied)) {
+        applied--;
+      }
+      auto it = states_.find(requested);
+      if (it == states_.end()) {
+        if (applied == 0) continue;
+        it = states_.emplace(requested, State()).first;
+      }
+      State& state = it->second;
+      if (applied != state.applied) {
+        state.over = 0;
+        state.under = 0;
+      }
+      state.applied = applied;
+      state.proposed = applied;
+    }
+  }
+
+  // The requested levels that run a higher precision level, and that level.
+  std::map<int, int> raised_levels() const {
+    std::map<int, int> raised;
+    for (auto const& [requested, state] : states_) {
+      if (state.applied > 0) {
+        raised[requested] = raised_level(requested, state.applied);
+      }
+    }
+    return raised;
+  }
+
+  void reset() { states_.clear(); }
+
+ private:
+  struct State {
+    int applied = 0;     // steps the calls run
+    int proposed = 0;    // steps this rank proposes
+    uint32_t over = 0;   // records in a row above the threshold
+    uint32_t under = 0;  // records in a row below the relax threshold
+  };
+
+  CodecPolicyConfig config_;
+  std::map<int, State> states_;
+};
+
+// Records per level that ran, in double precision.
+class QuantErrorTotals {
+ public:
+  struct Phase {
+    float max_abs_error = 0.0f;
+    double sum_sq_error = 0.0;
+    double sum_sq_value = 0.0;
+    uint64_t count = 0;
+
+    double relative_rmse() const {
+      if (sum_sq_value <= 0.0) {
+        return sum_sq_error > 0.0 ? std::numeric_limits<double>::infinity()
+                                  : 0.0;
+      }
+      return std::sqrt(sum_sq_error / sum_sq_value);
+    }
+  };
+  struct Total {
+    uint64_t records = 0;
+    Phase phase[2];
+  };
+
+  void add(int quant_level, QuantErrorRecord const& record) {
+    Total& total = totals_[quant_level];
+    total.records++;
+    for (int p = 0; p < 2; p++) {
+      QuantErrorStats const& s = record.phase[p];
+      Phase& phase = total.phase[p];
+      phase.max_abs_error =
+          std::max(phase.max_abs_error, quant_error_max_abs(s));
+      phase.sum_sq_error += s.sum_sq_error;
+      phase.sum_sq_value += s.sum_sq_value;
+      phase.count += s.count;
+    }
+  }
+
+  std::map<int, Total> const& totals() const { return totals_; }
+  void reset() { totals_.clear(); }
+
+ private:
+  std::map<int, Total> totals_;
+};
+
+}  // namespace quickreduce
@@ -0,0 +1,804 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "half.h"
+#include "../core/codec_layout.h"
+#include "../core/hadamard.h"
+#include "../core/mx_format.h"
+#include "../core/reduce_op.h"
+
+namespace quickreduce {
+namespace reference {
+
+/*
+===============================================================
+Desc:
+    Host reference of the block-quantization line codecs in allreduce.h.
+
+Operation:
+    The reference works on one atom: the 256 threads x 8 fp16 values that a
+    workgroup passes to a single `codec.send` iteration. Thread `t` holds the
+    values [t * 8, t * 8 + 8). Values 2i and 2i + 1 of a thread are the lower
+    and upper halves of its i-th f16x2_t register, and each half forms its own
+    quantization block of 32 values across a group of 8 threads.
+
+    `encode` writes the bytes of one rank tile stride exactly as the kernel
+    lays them out in the communication buffer, and `decode` reads them back.
+    The fp16 arithmetic is emulated by rounding every intermediate result to
+    fp16. The kernels use the hardware reciprocal, so codes can differ in the
+    last bit for values on a rounding boundary.
+*/
+
+static constexpr int kThreads = 256;
+static constexpr int kValuesPerThread = 8;
+static constexpr int kGroupSize = 8;
+static constexpr int kNumGroups = kThreads / kGroupSize;
+static constexpr int kAtomValues = kThreads * kValuesPerThread;
+
+// Smallest fp16 subnormal, kScaleEpsilon in the kernels.
+static constexpr float kHalfEpsilon = 5.9604644775390625e-08f;
+
+inline uint32_t load_u32(uint8_t const* ptr) {
+  uint32_t value;
+  std::memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+inline void store_u32(uint8_t* ptr, uint32_t value) {
+  std::memcpy(ptr, &value, sizeof(value));
+}
+
+inline uint16_t load_u16(uint8_t const* ptr) {
+  uint16_t value;
+  std::memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+inline void store_u16(uint8_t* ptr, uint16_t value) {
+  std::memcpy(ptr, &value, sizeof(value));
+}
+
+// Minimum and maximum of the quantization block (group, lane) of an atom.
+inline void block_min_max(uint16_t const* atom, int group, int lane,
+                          float& vmin, float& vmax) {
+  vmin = INFINITY;
+  vmax = -INFINITY;
+  for (int t = group * kGroupSize; t < (group + 1) * kGroupSize; t++) {
+    for (int i = 0; i < 4; i++) {
+      float v = host::half_to_float(atom[t * kValuesPerThread + 2 * i + lane]);
+      vmin = std::min(vmin, v);
+      vmax = std::max(vmax, v);
+    }
+  }
+}
+
+// Code layout of the kernels for the 8 codes of one thread, generated from
+// the bit-width by QuantCodeLayout. Codes are unsigned, ie: after the range
+// bias.
+template <int bits>
+struct GeneratedCodeLayout {
+  using Layout = QuantCodeLayout<bits>;
+  static constexpr int kScaleOffset = Layout::kScaleOffset;
+
+  static void pack(int thread, uint16_t const* c, uint8_t* tile) {
+    uint32_t q[4];
+    for (int i = 0; i < 4; i++) {
+      q[i] = uint32_t(c[2 * i]) | (uint32_t(c[2 * i + 1]) << 16);
+    }
+    for (int k = 0; k < Layout::kNumPlanes; k++) {
+      uint32_t word[2];
+      Layout::pack_plane(q, k, word);
+      int width = Layout::plane_width(k);
+      std::memcpy(tile + Layout::plane_offset(k) + thread * width, word,
+                  width);
+    }
+  }
+
+  static void unpack(int thread, uint8_t const* tile, uint16_t* c) {
+    uint32_t q[4] = {0, 0, 0, 0};
+    for (int k = 0; k < Layout::kNumPlanes; k++) {
+      uint32_t word[2] = {0, 0};
+      int width = Layout::plane_width(k);
+      std::memcpy(word, tile + Layout::plane_offset(k) + thread * width,
+                  width);
+      Layout::unpack_plane(word, k, q);
+    }
+    for (int i = 0; i < 4; i++) {
+      c[2 * i] = q[i] & 0xFFFF;
+      c[2 * i + 1] = q[i] >> 16;
+    }
+  }
+};
+
+// The hand-written layouts of the original CodecQ4, CodecQ6 and CodecQ8 are
+// kept below as the reference the generated ones are checked against; the
+// other bit-widths only exist as generated layouts.
+template <int bits>
+struct CodeLayout : GeneratedCodeLayout<bits> {};
+
+template <>
+struct CodeLayout<4> {
+  static constexpr int kScaleOffset = 1024;
+
+  static void pack(int thread, uint16_t const* c, uint8_t* tile) {
+    uint32_t qw = 0;
+    for (int i = 0; i < 4; i++) {
+      qw |= (uint32_t(c[2 * i]) << (4 * i)) |
+            (uint32_t(c[2 * i + 1]) << (16 + 4 * i));
+    }
+    store_u32(tile + thread * 4, qw);
+  }
+
+  static void unpack(int thread, uint8_t const* tile, uint16_t* c) {
+    uint32_t qw = load_u32(tile + thread * 4);
+    for (int i = 0; i < 4; i++) {
+      c[2 * i] = (qw >> (4 * i)) & 0xF;
+      c[2 * i + 1] = (qw >> (16 + 4 * i)) & 0xF;
+    }
+  }
+};
+
+template <>
+struct CodeLayout<6> {
+  static constexpr int kQ2Offset = 1024;
+  static constexpr int kScaleOffset = 1536;
+
+  static void pack(int thread, uint16_t const* c, uint8_t* tile) {
+    uint32_t q4w = 0;
+    uint16_t q2w = 0;
+    for (int i = 0; i < 4; i++) {
+      q4w |= (uint32_t(c[2 * i] & 0xF) << (4 * i)) |
+             (uint32_t(c[2 * i + 1] & 0xF) << (16 + 4 * i));
+    }
+    for (int j = 0; j < 8; j++) {
+      q2w |= (c[j] >> 4) << (2 * j);
+    }
+    store_u32(tile + thread * 4, q4w);
+    store_u16(tile + kQ2Offset + thread * 2, q2w);
+  }
+
+  static void unpack(int thread, uint8_t const* tile, uint16_t* c) {
+    uint32_t q4w = load_u32(tile + thread * 4);
+    uint16_t q2w = load_u16(tile + kQ2Offset + thread * 2);
+    for (int i = 0; i < 4; i++) {
+      c[2 * i] = ((q4w >> (4 * i)) & 0xF) | (((q2w >> (4 * i)) & 0x3) << 4);
+      c[2 * i + 1] =
+          ((q4w >> (16 + 4 * i)) & 0xF) | (((q2w >> (4 * i + 2)) & 0x3) << 4);
+    }
+  }
+};
+
+template <>
+struct CodeLayout<8> {
+  static constexpr int kScaleOffset = 2048;
+
+  static void pack(int thread, uint16_t const* c, uint8_t* tile) {
+    for (int w = 0; w < 2; w++) {
+      uint16_t const* cw = c + 4 * w;
+      uint32_t qw = uint32_t(cw[0]) | (uint32_t(cw[2]) << 8) |
+                    (uint32_t(cw[1]) << 16) | (uint32_t(cw[3]) << 24);
+      store_u32(tile + thread * 8 + w * 4, qw);
+    }
+  }
+
+  static void unpack(int thread, uint8_t const* tile, uint16_t* c) {
+    for (int w = 0; w < 2; w++) {
+      uint32_t qw = load_u32(tile + thread * 8 + w * 4);
+      uint16_t* cw = c + 4 * w;
+      cw[0] = qw & 0xFF;
+      cw[2] = (qw >> 8) & 0xFF;
+      cw[1] = (qw >> 16) & 0xFF;
+      cw[3] = (qw >> 24) & 0xFF;
+    }
+  }
+};
+
+// Reference of CodecQ (Q3 to Q8).
+template <int bits>
+struct SymmetricCodec {
+  using Layout = CodeLayout<bits>;
+  static constexpr int kBias = 1 << (bits - 1);
+  static constexpr float kRangeMin = -float(kBias);
+  static constexpr float kRangeMax = float(kBias - 1);
+  static constexpr int kScaleOffset = Layout::kScaleOffset;
+  static constexpr int kTileStride = kScaleOffset + kNumGroups * 4;
+
+  static void encode(uint16_t const* atom, uint8_t* tile) {
+    for (int g = 0; g < kNumGroups; g++) {
+      float decoding[2];
+      float encoding[2];
+      for (int lane = 0; lane < 2; lane++) {
+        // Signed value with the largest magnitude, see packed_abs_max.
+        float vmin, vmax;
+        block_min_max(atom, g, lane, vmin, vmax);
+        float blockmax = std::fabs(vmax) > std::fabs(vmin) ? vmax : vmin;
+        decoding[lane] = host::round_half(blockmax * (-1.0f / kBias));
+        encoding[lane] = host::round_half(
+            1.0f / host::round_half(decoding[lane] + kHalfEpsilon));
+      }
+      store_u16(tile + kScaleOffset + g * 4, host::float_to_half(decoding[0]));
+      store_u16(tile + kScaleOffset + g * 4 + 2,
+                host::float_to_half(decoding[1]));
+
+      for (int t = g * kGroupSize; t < (g + 1) * kGroupSize; t++) {
+        uint16_t codes[kValuesPerThread];
+        for (int j = 0; j < kValuesPerThread; j++) {
+          float v = host::half_to_float(atom[t * kValuesPerThread + j]);
+          float w = host::round_half(v * encoding[j % 2]);
+          w = std::min(std::max(w, kRangeMin), kRangeMax);
+          codes[j] = static_cast<uint16_t>(int(std::rint(w)) + kBias);
+        }
+        Layout::pack(t, codes, tile);
+      }
+    }
+  }
+
+  static void decode(uint8_t const* tile, uint16_t* atom) {
+    for (int t = 0; t < kThreads; t++) {
+      int g = t / kGroupSize;
+      uint16_t codes[kValuesPerThread];
+      Layout::unpack(t, tile, codes);
+      for (int j = 0; j < kValuesPerThread; j++) {
+        float scale = host::half_to_float(
+            load_u16(tile + kScaleOffset + g * 4 + (j % 2) * 2));
+        atom[t * kValuesPerThread + j] =
+            host::float_to_half(float(int(codes[j]) - kBias) * scale);
+      }
+    }
+  }
+};
+
+// Reference of CodecQEscape: CodecQ, plus the raw fp16 values of up to
+// `escapes` outlier blocks per wavefront (EscapeLayout).
+template <int bits, int escapes>
+struct EscapeCodec {
+  using Quant = SymmetricCodec<bits>;
+  using Layout = EscapeLayout<bits, escapes>;
+  static constexpr int kTileStride = Layout::kTileStride;
+  static constexpr int kGroupsPerWave = Layout::kBlocksPerWave / 2;
+
+  // Mean magnitude of the block (group, lane), summed in fp32 in the order
+  // of the kernel: the 4 values of a thread pairwise, then the 8 threads as
+  // a tree, and scaled once at the end.
+  static float block_abs_mean(uint16_t const* atom, int group, int lane) {
+    float sums[kGroupSize];
+    for (int t = 0; t < kGroupSize; t++) {
+      uint16_t const* v = atom + (group * kGroupSize + t) * kValuesPerThread;
+      float a[4];
+      for (int i = 0; i < 4; i++) {
+        a[i] = host::half_to_float(v[2 * i + lane] & 0x7FFF);
+      }
+      sums[t] = (a[0] + a[1]) + (a[2] + a[3]);
+    }
+    for (int step = 1; step < kGroupSize; step <<= 1) {
+      for (int t = 0; t + step < kGroupSize; t += 2 * step) {
+        sums[t] += sums[t + step];
+      }
+    }
+    return sums[0] * (1.0f / 32);
+  }
+
+  // Escaped blocks of wavefront `wave`.
+  static uint32_t escaped_blocks(uint16_t const* atom, int wave) {
+    uint32_t candidates = 0;
+    for (int b = 0; b < Layout::kBlocksPerWave; b++) {
+      int g = wave * kGroupsPerWave + b / 2;
+      float vmin, vmax;
+      block_min_max(atom, g, b % 2, vmin, vmax);
+      float absmax = std::max(std::fabs(vmin), std::fabs(vmax));
+      float threshold = Layout::kRatio * block_abs_mean(atom, g, b % 2);
+      if (absmax > threshold) candidates |= 1u << b;
+    }
+    return Layout::select(candidates);
+  }
+
+  static void encode(uint16_t const* atom, uint8_t* tile) {
+    Quant::encode(atom, tile);
+    for (int wave = 0; wave < Layout::kWaves; wave++) {
+      uint32_t escaped = escaped_blocks(atom, wave);
+      store_u16(tile + Layout::kMaskOffset + wave * 2,
+                static_cast<uint16_t>(escaped));
+      for (int b = 0; b < Layout::kBlocksPerWave; b++) {
+        if (!(escaped & (1u << b))) continue;
+        uint8_t* slot =
+            tile + Layout::slot_offset(wave, Layout::slot(escaped, b));
+        int g = wave * kGroupsPerWave + b / 2;
+        for (int t = 0; t < kGroupSize; t++) {
+          uint16_t const* v = atom + (g * kGroupSize + t) * kValuesPerThread;
+          for (int i = 0; i < 4; i++) {
+            store_u16(slot + t * 8 + i * 2, v[2 * i + b % 2]);
+          }
+        }
+      }
+    }
+  }
+
+  // Bytes the kernel writes for an encoded tile: the slots in use only.
+  static int bytes_written(uint8_t const* tile) {
+    int escaped = 0;
+    for (int wave = 0; wave < Layout::kWaves; wave++) {
+      escaped += __builtin_popcount(
+          load_u16(tile + Layout::kMaskOffset + wave * 2));
+    }
+    return Layout::kPayloadOffset + escaped * Layout::kBlockBytes;
+  }
+
+  static void decode(uint8_t const* tile, uint16_t* atom) {
+    Quant::decode(tile, atom);
+    for (int wave = 0; wave < Layout::kWaves; wave++) {
+      uint32_t escaped = load_u16(tile + Layout::kMaskOffset + wave * 2);
+      for (int b = 0; b < Layout::kBlocksPerWave; b++) {
+        if (!(escaped & (1u << b))) continue;
+        uint8_t const* slot =
+            tile + Layout::slot_offset(wave, Layout::slot(escaped, b));
+        int g = wave * kGroupsPerWave + b / 2;
+        for (int t = 0; t < kGroupSize; t++) {
+          uint16_t* v = atom + (g * kGroupSize + t) * kValuesPerThread;
+          for (int i = 0; i < 4; i++) {
+            v[2 * i + b % 2] = load_u16(slot + t * 8 + i * 2);
+          }
+        }
+      }
+    }
+  }
+};
+
+// Reference of CodecQAsym: (scale, min) pair per block.
+template <int bits>
+struct AsymmetricCodec {
+  using Layout = CodeLayout<bits>;
+  // The offsets of the kernel, see AsymmetricCodeLayout.
+  using DeviceLayout = AsymmetricCodeLayout<bits>;
+  static constexpr int kMaxCode = (1 << bits) - 1;
+  static constexpr int kScaleOffset = DeviceLayout::kScaleOffset;
+  static constexpr int kTileStride = DeviceLayout::kTileStride;
+  static_assert(kScaleOffset == Layout::kScaleOffset,
+                "The pairs follow the codes of every thread.");
+  static_assert(kTileStride == kScaleOffset + kNumGroups * 8,
+                "A (scale, min) pair per block.");
+
+  static void encode(uint16_t const* atom, uint8_t* tile) {
+    float const scale_factor = host::round_half(1.0f / kMaxCode);
+    for (int g = 0; g < kNumGroups; g++) {
+      float decoding[2];
+      float encoding[2];
+      float minimum[2];
+      for (int lane = 0; lane < 2; lane++) {
+        float vmin, vmax;
+        block_min_max(atom, g, lane, vmin, vmax);
+        minimum[lane] = vmin;
+        decoding[lane] =
+            host::round_half(host::round_half(vmax - vmin) * scale_factor);
+        encoding[lane] = host::round_half(
+            1.0f / host::round_half(decoding[lane] + kHalfEpsilon));
+      }
+      uint8_t* qs = tile + kScaleOffset + g * 8;
+      store_u16(qs + 0, host::float_to_half(decoding[0]));
+      store_u16(qs + 2, host::float_to_half(decoding[1]));
+      store_u16(qs + 4, host::float_to_half(minimum[0]));
+      store_u16(qs + 6, host::float_to_half(minimum[1]));
+
+      for (int t = g * kGroupSize; t < (g + 1) * kGroupSize; t++) {
+        uint16_t codes[kValuesPerThread];
+        for (int j = 0; j < kValuesPerThread; j++) {
+          float v = host::half_to_float(atom[t * kValuesPerThread + j]);
+          float w = host::round_half(host::round_half(v - minimum[j % 2]) *
+                                     encoding[j % 2]);
+          w = std::min(std::max(w, 0.0f), float(kMaxCode));
+          codes[j] = static_cast<uint16_t>(std::rint(w));
+        }
+        Layout::pack(t, codes, tile);
+      }
+    }
+  }
+
+  static void decode(uint8_t const* tile, uint16_t* atom) {
+    for (int t = 0; t < kThreads; t++) {
+      uint8_t const* qs = tile + kScaleOffset + (t / kGroupSize) * 8;
+      uint16_t codes[kValuesPerThread];
+      Layout::unpack(t, tile, codes);
+      for (int j = 0; j < kValuesPerThread; j++) {
+        float scale = host::half_to_float(load_u16(qs + (j % 2) * 2));
+        float minimum = host::half_to_float(load_u16(qs + 4 + (j % 2) * 2));
+        double value = double(codes[j]) * scale + minimum;
+        atom[t * kValuesPerThread + j] =
+            host::float_to_half(static_cast<float>(value));
+      }
+    }
+  }
+};
+
+// Reference of CodecTopK: k (index, value) pairs per thread.
+template <int k, bool quantize_values>
+struct TopKCodec {
+  static constexpr int kValueBytes = quantize_values ? 1 : 2;
+  static constexpr int kIndexBytes = k <= 2 ? 1 : 2;
+  static constexpr int kIndexOffset = kThreads * k * kValueBytes;
+  static constexpr int kScaleOffset = kIndexOffset + kThreads * kIndexBytes;
+  static constexpr int kTileStride =
+      kScaleOffset + (quantize_values ? kNumGroups * 2 : 0);
+  static constexpr float kValueRange = 127.0f;
+
+  // Indices of the k largest magnitudes of a thread, lowest index first
+  // among equals.
+  static void select(uint16_t const* v, int* selected) {
+    uint32_t taken = 0;
+    for (int s = 0; s < k; s++) {
+      int best = 0;
+      int best_magnitude = -1;
+      for (int j = 0; j < kValuesPerThread; j++) {
+        int magnitude = v[j] & 0x7FFF;
+        if (!(taken & (1u << j)) && magnitude > best_magnitude) {
+          best = j;
+          best_magnitude = magnitude;
+        }
+      }
+      taken |= 1u << best;
+      selected[s] = best;
+    }
+  }
+
+  static void store_bits(uint8_t* ptr, int bytes, uint64_t bits) {
+    for (int b = 0; b < bytes; b++) ptr[b] = (bits >> (8 * b)) & 0xFF;
+  }
+
+  static uint64_t load_bits(uint8_t const* ptr, int bytes) {
+    uint64_t bits = 0;
+    for (int b = 0; b < bytes; b++) bits |= uint64_t(ptr[b]) << (8 * b);
+    return bits;
+  }
+
+  static void encode(uint16_t const* atom, uint8_t* tile) {
+    for (int g = 0; g < kNumGroups; g++) {
+      float decoding_scale = 0.0f;
+      if (quantize_values) {
+        int wmax = 0;
+        for (int t = g * kGroupSize; t < (g + 1) * kGroupSize; t++) {
+          for (int j = 0; j < kValuesPerThread; j++) {
+            wmax = std::max(wmax, atom[t * kValuesPerThread + j] & 0x7FFF);
+          }
+        }
+        uint16_t scale = host::float_to_half(
+            host::half_to_float(static_cast<uint16_t>(wmax)) / kValueRange);
+        store_u16(tile + kScaleOffset + g * 2, scale);
+        decoding_scale = host::half_to_float(scale);
+      }
+      float encoding_scale = 1.0f / std::max(decoding_scale, 1e-7f);
+
+      for (int t = g * kGroupSize; t < (g + 1) * kGroupSize; t++) {
+        uint16_t const* v = atom + t * kValuesPerThread;
+        int selected[k];
+        select(v, selected);
+
+        uint64_t values = 0;
+        uint32_t indices = 0;
+        for (int s = 0; s < k; s++) {
+          indices |= selected[s] << (3 * s);
+          if (quantize_values) {
+            float w = host::half_to_float(v[selected[s]]) * encoding_scale;
+            w = std::min(std::max(std::rint(w), -kValueRange), kValueRange);
+            values |= uint64_t(static_cast<uint8_t>(static_cast<int8_t>(w)))
+                      << (8 * s);
+          } else {
+            values |= uint64_t(v[selected[s]]) << (16 * s);
+          }
+        }
+        store_bits(tile + t * k * kValueBytes, k * kValueBytes, values);
+        store_bits(tile + kIndexOffset + t * kIndexBytes, kIndexBytes, indices);
+      }
+    }
+  }
+
+  static void decode(uint8_t const* tile, uint16_t* atom) {
+    for (int t = 0; t < kThreads; t++) {
+      uint64_t values = load_bits(tile + t * k * kValueBytes, k * kValueBytes);
+      uint32_t indices = static_cast<uint32_t>(
+          load_bits(tile + kIndexOffset + t * kIndexBytes, kIndexBytes));
+      float decoding_scale =
+          quantize_values ? host::half_to_float(load_u16(
+                                tile + kScaleOffset + (t / kGroupSize) * 2))
+                          : 0.0f;
+
+      uint16_t* w = atom + t * kValuesPerThread;
+      for (int j = 0; j < kValuesPerThread; j++) w[j] = 0;
+      for (int s = 0; s < k; s++) {
+        int index = (indices >> (3 * s)) & 0x7;
+        if (quantize_values) {
+          int8_t q = static_cast<int8_t>((values >> (8 * s)) & 0xFF);
+          w[index] = host::float_to_half(q * decoding_scale);
+        } else {
+          w[index] = static_cast<uint16_t>((values >> (16 * s)) & 0xFFFF);
+        }
+      }
+    }
+  }
+};
+
+// Reference of hadamard_rotate (core/hadamard.h) on every block of an atom,
+// with the stages in the order of the kernel.
+inline void hadamard_rotate(uint16_t* atom) {
+  float const scale = host::half_to_float(kHadamardScale & 0xFFFF);
+  for (int g = 0; g < kNumGroups; g++) {
+    for (int lane = 0; lane < 2; lane++) {
+      // Value 4 * t + i of the block is half `lane` of register i of thread t.
+      float v[32];
+      uint16_t* block = atom + g * kGroupSize * kValuesPerThread + lane;
+      for (int t = 0; t < kGroupSize; t++) {
+        for (int i = 0; i < 4; i++) {
+          v[4 * t + i] = host::round_half(
+              host::half_to_float(block[t * kValuesPerThread + 2 * i]) * scale);
+        }
+      }
+      // Register strides 1 and 2, then lane strides 1, 2 and 4.
+      for (int stride = 1; stride < 32; stride <<= 1) {
+        for (int j = 0; j < 32; j++) {
+          if (j & stride) continue;
+          float a = v[j];
+          float b = v[j + stride];
+          v[j] = host::round_half(a + b);
+          v[j + stride] = host::round_half(a - b);
+        }
+      }
+      for (int t = 0; t < kGroupSize; t++) {
+        for (int i = 0; i < 4; i++) {
+          block[t * kValuesPerThread + 2 * i] = host::float_to_half(v[4 * t + i]);
+        }
+      }
+    }
+  }
+}
+
+// Reference of CodecHadamard: Codec on the rotated blocks.
+template <class Codec>
+struct HadamardCodec {
+  static constexpr int kTileStride = Codec::kTileStride;
+
+  static void encode(uint16_t const* atom, uint8_t* tile) {
+    uint16_t rotated[kAtomValues];
+    std::memcpy(rotated, atom, sizeof(rotated));
+    hadamard_rotate(rotated);
+    Codec::encode(rotated, tile);
+  }
+
+  static void decode(uint8_t const* tile, uint16_t* atom) {
+    Codec::decode(tile, atom);
+    hadamard_rotate(atom);
+  }
+};
+
+// Reference of CodecMX: blocks of the 32 values of 4 consecutive threads
+// with an E8M0 scale byte each, after the codes.
+template <class Element>
+struct MxCodec {
+  using Layout = GeneratedCodeLayout<Element::kBits>;
+  static constexpr int kBlockThreads = kMxBlockSize / kValuesPerThread;
+  static constexpr int kBlocks = kThreads / kBlockThreads;
+  static constexpr int kScaleOffset = Layout::kScaleOffset;
+  static constexpr int kTileStride =
+      QuantCodeLayout<Element::kBits, 2>::kTileStride;
+
+  static void encode(uint16_t const* atom, uint8_t* tile) {
+    for (int b = 0; b < kBlocks; b++) {
+      uint16_t const* block = atom + b * kMxBlockSize;
+      float amax = 0.0f;
+      for (int j = 0; j < kMxBlockSize; j++) {
+        amax = std::max(amax, std::fabs(host::half_to_float(block[j])));
+      }
+      int x = mx_shared_exponent<Element>(amax);
+      tile[kScaleOffset + b] = static_cast<uint8_t>(x + kMxScaleBias);
+      for (int t = b * kBlockThreads; t < (b + 1) * kBlockThreads; t++) {
+        uint16_t codes[kValuesPerThread];
+        for (int j = 0; j < kValuesPerThread; j++) {
+          float v = host::half_to_float(atom[t * kValuesPerThread + j]);
+          codes[j] = static_cast<uint16_t>(Element::encode(std::ldexp(v, -x)));
+        }
+        Layout::pack(t, codes, tile);
+      }
+    }
+  }
+
+  static void decode(uint8_t const* tile, uint16_t* atom) {
+    for (int t = 0; t < kThreads; t++) {
+      int x = int(tile[kScaleOffset + t / kBlockThreads]) - kMxScaleBias;
+      uint16_t codes[kValuesPerThread];
+      Layout::unpack(t, tile, codes);
+      for (int j = 0; j < kValuesPerThread; j++) {
+        atom[t * kValuesPerThread + j] =
+            host::float_to_half(std::ldexp(Element::decode(codes[j]), x));
+      }
+    }
+  }
+
+  // Reference of recv_mx: copy a tile that holds the elements from
+  // `first_element` on to the consumer layout of MxOutput, up to N.
+  static void hand_over(uint8_t const* tile, uint64_t first_element,
+                        uint64_t N, MxOutput const& out) {
+    for (int t = 0; t < kThreads; t++) {
+      uint64_t element = first_element + uint64_t(t) * kValuesPerThread;
+      if (element >= N) continue;
+      uint16_t codes[kValuesPerThread];
+      Layout::unpack(t, tile, codes);
+      uint64_t packed = 0;
+      for (int j = 0; j < kValuesPerThread; j++) {
+        packed |= uint64_t(codes[j]) << (j * Element::kBits);
+      }
+      std::memcpy(out.elements + element / 8 * Element::kBits, &packed,
+                  Element::kBits);
+      if (t % kBlockThreads == 0) {
+        out.scales[element / kMxBlockSize] = tile[kScaleOffset + t / kBlockThreads];
+      }
+    }
+  }
+};
+
+// Error of a codec round trip over a buffer of whole atoms.
+struct ErrorStats {
+  double max_abs_error = 0.0;
+  double sum_sq_error = 0.0;
+  double sum_sq_reference = 0.0;
+  long count = 0;
+
+  double rmse() const { return count ? std::sqrt(sum_sq_error / count) : 0.0; }
+
+  // Error energy relative to the signal energy.
+  double relative_rmse() const {
+    return sum_sq_reference > 0.0 ? std::sqrt(sum_sq_error / sum_sq_reference)
+                                  : 0.0;
+  }
+
+  void add(float reference, float actual) {
+    double error = double(actual) - double(reference);
+    max_abs_error = std::max(max_abs_error, std::fabs(error));
+    sum_sq_error += error * error;
+    sum_sq_reference += double(reference) * double(reference);
+    count++;
+  }
+};
+
+template <class Codec>
+ErrorStats round_trip(uint16_t const* values, long num_atoms,
+                      uint16_t* decoded = nullptr) {
+  ErrorStats stats;
+  uint8_t tile[Codec::kTileStride];
+  uint16_t atom[kAtomValues];
+  for (long a = 0; a < num_atoms; a++) {
+    uint16_t const* src = values + a * kAtomValues;
+    Codec::encode(src, tile);
+    Codec::decode(tile, atom);
+    for (int i = 0; i < kAtomValues; i++) {
+      stats.add(host::half_to_float(src[i]), host::half_to_float(atom[i]));
+    }
+    if (decoded) std::memcpy(decoded + a * kAtomValues, atom, sizeof(atom));
+  }
+  return stats;
+}
+
+// Reference of CodecFP: the fp16 values as they are.
+struct FPCodec {
+  static constexpr int kTileStride = kAtomValues * 2;
+
+  static void encode(uint16_t const* atom, uint8_t* tile) {
+    std::memcpy(tile, atom, kTileStride);
+  }
+
+  static void decode(uint8_t const* tile, uint16_t* atom) {
+    std::memcpy(atom, tile, kTileStride);
+  }
+};
+
+// Reference of CodecFPLossless: the fp16 values, with the exponents coded
+// against the largest exponent of their group (LosslessLayout).
+struct LosslessCodec {
+  using Layout = LosslessLayout;
+  static constexpr int kTileStride = Layout::kTileStride;
+
+  // Registers of thread t of an atom, as the kernel holds them.
+  static void registers(uint16_t const* atom, int t, uint32_t* v) {
+    for (int i = 0; i < 4; i++) {
+      v[i] = uint32_t(atom[t * kValuesPerThread + 2 * i]) |
+             (uint32_t(atom[t * kValuesPerThread + 2 * i + 1]) << 16);
+    }
+  }
+
+  static void encode(uint16_t const* atom, uint8_t* tile) {
+    std::memset(tile + Layout::kMaskOffset, 0, Layout::kWaves * 8);
+    for (int g = 0; g < kNumGroups; g++) {
+      int base = 0;
+      uint32_t v[4];
+      for (int t = g * kGroupSize; t < (g + 1) * kGroupSize; t++) {
+        registers(atom, t, v);
+        base = std::max(base, Layout::max_exponent(v));
+      }
+      tile[Layout::kBaseOffset + g] = static_cast<uint8_t>(base);
+      for (int t = g * kGroupSize; t < (g + 1) * kGroupSize; t++) {
+        registers(atom, t, v);
+        uint32_t low[2], high[2];
+        Layout::pack_low(v, low);
+        bool raw = Layout::pack_high(v, base, high);
+        store_u32(tile + Layout::kLowOffset + t * 8, low[0]);
+        store_u32(tile + Layout::kLowOffset + t * 8 + 4, low[1]);
+        store_u32(tile + Layout::kHigh0Offset + t * 4, high[0]);
+        store_u16(tile + Layout::kHigh1Offset + t * 2, high[1] & 0xFFFF);
+        if (raw) {
+          store_u16(tile + Layout::kRawOffset + t * 2, high[1] >> 16);
+          tile[Layout::kMaskOffset + t / 8] |= 1u << (t % 8);
+        }
+      }
+    }
+  }
+
+  static bool is_raw(uint8_t const* tile, int t) {
+    return (tile[Layout::kMaskOffset + t / 8] >> (t % 8)) & 1;
+  }
+
+  static void decode(uint8_t const* tile, uint16_t* atom) {
+    for (int t = 0; t < kThreads; t++) {
+      uint32_t low[2] = {load_u32(tile + Layout::kLowOffset + t * 8),
+                         load_u32(tile + Layout::kLowOffset + t * 8 + 4)};
+      bool raw = is_raw(tile, t);
+      uint32_t high[2] = {load_u32(tile + Layout::kHigh0Offset + t * 4),
+                          load_u16(tile + Layout::kHigh1Offset + t * 2)};
+      if (raw) {
+        high[1] |= uint32_t(load_u16(tile + Layout::kRawOffset + t * 2)) << 16;
+      }
+      uint32_t v[4];
+      Layout::unpack(low, high, raw, tile[Layout::kBaseOffset + t / kGroupSize],
+                     v);
+      for (int i = 0; i < 4; i++) {
+        atom[t * kValuesPerThread + 2 * i] = v[i] & 0xFFFF;
+        atom[t * kValuesPerThread + 2 * i + 1] = v[i] >> 16;
+      }
+    }
+  }
+
+  // Bytes the kernel writes for an encoded tile: the raw slots in use only.
+  static int bytes_written(uint8_t const* tile) {
+    int raw = 0;
+    for (int t = 0; t < kThreads; t++) raw += is_raw(tile, t);
+    return Layout::kRawOffset + 2 * raw;
+  }
+};
+
+// Two-shot all-reduce of one atom per rank with `op`, as seen by every rank:
+// Phase-1A encodes each input with Codec, Phase-1B combines the decoded
+// values in rank order starting from rank 0 with fp16 arithmetic, and
+// Phase-2 encodes the result once more with Phase2Codec.
+template <class Codec, class Phase2Codec = Codec>
+void reduce_atoms(ReduceOp op, uint16_t const* const* inputs, int world_size,
+                  uint16_t* result) {
+  uint8_t tile[Codec::kTileStride > Phase2Codec::kTileStride
+                   ? Codec::kTileStride
+                   : Phase2Codec::kTileStride];
+  uint16_t decoded[kAtomValues];
+  float acc[kAtomValues];
+  for (int r = 0; r < world_size; r++) {
+    Codec::encode(inputs[r], tile);
+    Codec::decode(tile, decoded);
+    for (int i = 0; i < kAtomValues; i++) {
+      float v = host::half_to_float(decoded[i]);
+      if (r == 0) {
+        acc[i] = v;
+      } else if (op == ReduceOp::MAX) {
+        acc[i] = std::max(acc[i], v);
+      } else if (op == ReduceOp::MIN) {
+        acc[i] = std::min(acc[i], v);
+      } else {
+        acc[i] = host::round_half(acc[i] + v);
+      }
+    }
+  }
+  if (op == ReduceOp::MEAN) {
+    float scale = host::round_half(1.0f / world_size);
+    for (float& v : acc) v = host::round_half(v * scale);
+  }
+  for (int i = 0; i < kAtomValues; i++) decoded[i] = host::float_to_half(acc[i]);
+  Phase2Codec::encode(decoded, tile);
+  Phase2Codec::decode(tile, result);
+}
+
+}  // namespace reference
+}  // namespace quickreduce
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Key-value store over a shared directory, for the rendezvous of the ranks
+    of a node without an external launcher.
+
+Operation:
+    A key is a file of the directory. `set` writes the value to a temporary
+    file and renames it into place, so readers never see a partial value.
+    `get` polls until the key exists, backing off up to a millisecond.
+
+    Like torch's FileStore, the directory must be unique to the job (e.g.
+    /dev/shm/quickreduce_<job id>): keys are never deleted, and a directory
+    left over from a previous job would hand out its stale values.
+*/
+class FileStore {
+ public:
+  explicit FileStore(std::string path,
+                     std::chrono::milliseconds timeout = std::chrono::minutes(5))
+      : path_(std::move(path)), timeout_(timeout) {
+    if (mkdir(path_.c_str(), 0700) != 0 && errno != EEXIST) {
+      throw std::runtime_error("FileStore: cannot create " + path_);
+    }
+  }
+
+  std::string const& path() const { return path_; }
+
+  void set(std::string const& key, std::vector<uint8_t> const& value) {
+    std::string file = file_name(key);
+    std::string tmp = file + ".tmp." + std::to_string(getpid()) + "." +
+                      std::to_string(std::hash<std::thread::id>()(
+                          std::this_thread::get_id()));
+    int fd = open(tmp.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (fd < 0) throw std::runtime_error("FileStore: cannot write " + tmp);
+    size_t written = 0;
+    while (written < value.size()) {
+      ssize_t n = write(fd, value.data() + written, value.size() - written);
+      if (n <= 0) {
+        close(fd);
+        unlink(tmp.c_str());
+        throw std::runtime_error("FileStore: cannot write " + tmp);
+      }
+      written += n;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), file.c_str()) != 0) {
+      unlink(tmp.c_str());
+      throw std::runtime_error("FileStore: cannot publish " + file);
+    }
+  }
+
+  bool check(std::string const& key) const {
+    return access(file_name(key).c_str(), F_OK) == 0;
+  }
+
+  std::vector<uint8_t> get(std::string const& key) const {
+    std::string file = file_name(key);
+    auto start = std::chrono::steady_clock::now();
+    auto backoff = std::chrono::microseconds(20);
+    while (true) {
+      int fd = open(file.c_str(), O_RDONLY);
+      if (fd >= 0) {
+        std::vector<uint8_t> value;
+        uint8_t buffer[4096];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+          value.insert(value.end(), buffer, buffer + n);
+        }
+        close(fd);
+        if (n < 0) throw std::runtime_error("FileStore: cannot read " + file);
+        return value;
+      }
+      if (std::chrono::steady_clock::now() - start > timeout_) {
+        throw std::runtime_error("FileStore: timed out waiting for " + key);
+      }
+      std::this_thread::sleep_for(backoff);
+      backoff = std::min(backoff * 2, std::chrono::microseconds(1000));
+    }
+  }
+
+ private:
+  std::string path_;
+  std::chrono::milliseconds timeout_;
+
+  // Keys may contain '/', which is mapped to '.' to keep a flat directory.
+  std::string file_name(std::string const& key) const {
+    std::string name = key;
+    std::replace(name.begin(), name.end(), '/', '.');
+    return path_ + "/" + name;
+  }
+};
+
+}  // namespace quickreduce
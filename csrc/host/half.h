@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace quickreduce {
+namespace host {
+
+/*
+===============================================================
+Desc:
+    Host-side fp16 conversions for the reference implementations.
+
+Operation:
+    Values are carried as their IEEE binary16 bit pattern (uint16_t). The
+    conversion rounds to nearest even. Like the kernels, which run with the
+    FP16_OVFL mode bit set, finite values that overflow saturate to the
+    largest finite fp16 value instead of rounding to infinity.
+*/
+
+static constexpr uint16_t kHalfMaxBits = 0x7BFF;  // 65504
+
+inline float half_to_float(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1F;
+  uint32_t mantissa = h & 0x3FF;
+  uint32_t bits;
+
+  if (exponent == 0x1F) {
+    // Inf / NaN
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    bits = sign;
+  } else {
+    // Subnormal: normalize into the float exponent range.
+    int e = -1;
+    do {
+      e++;
+      mantissa <<= 1;
+    } while ((mantissa & 0x400) == 0);
+    bits = sign | ((112 - e) << 23) | ((mantissa & 0x3FF) << 13);
+  }
+
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+inline uint16_t float_to_half(float f) {
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+  uint32_t abs_bits = bits & 0x7FFFFFFF;
+
+  if (abs_bits >= 0x7F800000) {
+    // Inf / NaN (quiet)
+    return sign | 0x7C00 | (abs_bits > 0x7F800000 ? 0x200 : 0);
+  }
+  if (abs_bits >= 0x477FF000) {
+    // Rounds beyond 65504: saturate.
+    return sign | kHalfMaxBits;
+  }
+  if (abs_bits < 0x33000000) {
+    // Below half of the smallest subnormal.
+    return sign;
+  }
+
+  int32_t exponent = static_cast<int32_t>(abs_bits >> 23) - 127;
+  uint32_t mantissa = (abs_bits & 0x7FFFFF) | 0x800000;
+  int shift;
+  uint32_t half_exponent;
+  if (exponent < -14) {
+    // Subnormal result.
+    shift = 13 + (-14 - exponent);
+    half_exponent = 0;
+  } else {
+    shift = 13;
+    half_exponent = static_cast<uint32_t>(exponent + 15);
+    mantissa &= 0x7FFFFF;
+  }
+
+  uint32_t result = mantissa >> shift;
+  uint32_t remainder = mantissa & ((1u << shift) - 1);
+  uint32_t halfway = 1u << (shift - 1);
+  if (remainder > halfway || (remainder == halfway && (result & 1))) {
+    result++;
+  }
+  // A mantissa carry propagates into the exponent field.
+  return sign | static_cast<uint16_t>((half_exponent << 10) + result);
+}
+
+// Round a float to the nearest fp16 value.
+inline float round_half(float f) { return half_to_float(float_to_half(f)); }
+
+}  // namespace host
+}  // namespace quickreduce
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Host shared-memory collectives between the ranks of a node.
+
+Operation:
+    Rank 0 creates a POSIX shared-memory segment, the other ranks attach to
+    it by name. The segment holds a barrier and one slot of `slot_bytes` per
+    rank. Problems larger than a slot are processed in chunks.
+
+    The all-reduce follows the two-shot algorithm of the device kernels:
+    every rank publishes its chunk in its slot, reduces its own segment of
+    the chunk over all slots, then gathers the reduced segments of the other
+    ranks. Segments are reduced in rank order, so every rank gets the same
+    bits.
+
+    This is the CPU path of the torch.distributed backend, and the reference
+    the backend is tested against on machines without GPUs.
+*/
+class HostComms {
+ public:
+  static constexpr int64_t kDefaultSlotBytes = 4 << 20;
+
+  HostComms(std::string const& name, int world_size, int rank,
+            int64_t slot_bytes = kDefaultSlotBytes,
+            std::chrono::milliseconds timeout = std::chrono::minutes(5))
+      : name_(name),
+        world_size_(world_size),
+        rank_(rank),
+        slot_bytes_(slot_bytes),
+        timeout_(timeout) {
+    if (world_size <= 0 || rank < 0 || rank >= world_size) {
+      throw std::invalid_argument("HostComms: invalid rank or world size");
+    }
+    if (slot_bytes <= 0 || slot_bytes % 64 != 0) {
+      throw std::invalid_argument(
+          "HostComms: slot size must be a positive multiple of 64");
+    }
+    size_ = sizeof(Header) + world_size * slot_bytes;
+    attach();
+    // Every rank has mapped the segment past this barrier, so the name can
+    // be released.
+    barrier();
+    if (rank_ == 0) shm_unlink(name_.c_str());
+  }
+
+  ~HostComms() {
+    if (base_ != nullptr) munmap(base_, size_);
+  }
+
+  HostComms(HostComms const&) = delete;
+  HostComms& operator=(HostComms const&) = delete;
+
+  int world_size() const { return world_size_; }
+  int rank() const { return rank_; }
+
+  // Sense-reversing barrier over all ranks.
+  void barrier() {
+    Header* h = header();
+    uint32_t generation = h->generation.load(std::memory_order_acquire);
+    if (h->arrived.fetch_add(1, std::memory_order_acq_rel) + 1 ==
+        static_cast<uint32_t>(world_size_)) {
+      h->arrived.store(0, std::memory_order_relaxed);
+      h->generation.fetch_add(1, std::memory_order_acq_rel);
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (h->generation.load(std::memory_order_acquire) == generation) {
+      if (std::chrono::steady_clock::now() - start > timeout_) {
+        throw std::runtime_error("HostComms: barrier timed out on " + name_);
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  // In-place sum of `count` elements over all ranks.
+  template <typename T>
+  void allreduce(T* data, int64_t count) {
+    int64_t chunk = slot_bytes_ / sizeof(T);
+    for (int64_t offset = 0; offset < count; offset += chunk) {
+      int64_t n = std::min(chunk, count - offset);
+      T* mine = slot<T>(rank_);
+      std::memcpy(mine, data + offset, n * sizeof(T));
+      barrier();
+
+      // Reduce this rank's segment into its own slot. The other ranks only
+      // read their own segment of this slot until the next barrier.
+      int64_t seg = (n + world_size_ - 1) / world_size_;
+      int64_t begin = std::min(n, rank_ * seg);
+      int64_t end = std::min(n, begin + seg);
+      for (int64_t i = begin; i < end; i++) {
+        T acc = slot<T>(0)[i];
+        for (int r = 1; r < world_size_; r++) {
+          acc = static_cast<T>(acc + slot<T>(r)[i]);
+        }
+        mine[i] = acc;
+      }
+      barrier();
+
+      for (int r = 0; r < world_size_; r++) {
+        int64_t b = std::min(n, r * seg);
+        int64_t e = std::min(n, b + seg);
+        std::memcpy(data + offset + b, slot<T>(r) + b, (e - b) * sizeof(T));
+      }
+      // The slots are rewritten by the next chunk.
+      barrier();
+    }
+  }
+
+  // Sum of the `world_size` blocks of `count` elements of `input`; this rank
+  // receives block `rank` in `output`.
+  template <typename T>
+  void reduce_scatter(T const* input, T* output, int64_t count) {
+    int64_t chunk = slot_bytes_ / sizeof(T) / world_size_;
+    if (chunk == 0) {
+      throw std::invalid_argument("HostComms: slot too small to scatter");
+    }
+    for (int64_t offset = 0; offset < count; offset += chunk) {
+      int64_t n = std::min(chunk, count - offset);
+      T* mine = slot<T>(rank_);
+      for (int r = 0; r < world_size_; r++) {
+        std::memcpy(mine + r * chunk, input + r * count + offset,
+                    n * sizeof(T));
+      }
+      barrier();
+
+      for (int64_t i = 0; i < n; i++) {
+        T acc = slot<T>(0)[rank_ * chunk + i];
+        for (int r = 1; r < world_size_; r++) {
+          acc = static_cast<T>(acc + slot<T>(r)[rank_ * chunk + i]);
+        }
+        output[offset + i] = acc;
+      }
+      barrier();
+    }
+  }
+
+  // Concatenation of the `bytes` of `input` of every rank, in rank order.
+  void all_gather(void const* input, void* output, int64_t bytes) {
+    auto const* src = static_cast<uint8_t const*>(input);
+    auto* dst = static_cast<uint8_t*>(output);
+    for (int64_t offset = 0; offset < bytes; offset += slot_bytes_) {
+      int64_t n = std::min(slot_bytes_, bytes - offset);
+      std::memcpy(slot<uint8_t>(rank_), src + offset, n);
+      barrier();
+      for (int r = 0; r < world_size_; r++) {
+        std::memcpy(dst + r * bytes + offset, slot<uint8_t>(r), n);
+      }
+      barrier();
+    }
+  }
+
+ private:
+  struct alignas(64) Header {
+    std::atomic<uint32_t> arrived;
+    std::atomic<uint32_t> generation;
+  };
+  static_assert(std::atomic<uint32_t>::is_always_lock_free,
+                "shared-memory atomics must be lock free");
+
+  std::string name_;
+  int world_size_;
+  int rank_;
+  int64_t slot_bytes_;
+  std::chrono::milliseconds timeout_;
+  int64_t size_ = 0;
+  void* base_ = nullptr;
+
+  Header* header() { return static_cast<Header*>(base_); }
+
+  template <typename T>
+  T* slot(int r) {
+    return reinterpret_cast<T*>(static_cast<uint8_t*>(base_) +
+                                sizeof(Header) + r * slot_bytes_);
+  }
+
+  // Rank 0 creates the zero-filled segment, the other ranks wait until it is
+  // created and sized.
+  void attach() {
+    int fd = -1;
+    if (rank_ == 0) {
+      shm_unlink(name_.c_str());
+      fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+      if (fd < 0 || ftruncate(fd, size_) != 0) {
+        if (fd >= 0) close(fd);
+        throw std::runtime_error("HostComms: cannot create " + name_);
+      }
+    } else {
+      auto start = std::chrono::steady_clock::now();
+      while (true) {
+        fd = shm_open(name_.c_str(), O_RDWR, 0600);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size == size_) break;
+        if (fd >= 0) close(fd);
+        if (std::chrono::steady_clock::now() - start > timeout_) {
+          throw std::runtime_error("HostComms: cannot open " + name_);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+    base_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base_ == MAP_FAILED) {
+      base_ = nullptr;
+      throw std::runtime_error("HostComms: cannot map " + name_);
+    }
+  }
+};
+
+}  // namespace quickreduce
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Runtime counters of the all-reduce calls of a communicator, for
+    monitoring in production.
+
+Operation:
+    Every call adds to the counters of its codec (the quant level it ran
+    with) and size bucket: the calls, the fp16 input bytes, the logical
+    bytes and the wire bytes. The logical bytes are the fp16 bytes the
+    two-shot exchange of the input moves to the peers, 2 (ws - 1) / ws of
+    the input; the wire bytes are the ones the codec actually sends, whole
+    encoded tiles. wire / logical is the achieved compression ratio.
+
+    The counters are relaxed atomics: recording never takes a lock, and
+    several threads may record at once. A snapshot reads every counter
+    once, so it may see part of a call recorded concurrently.
+
+    The size bucket of a call is the smallest power of two, from 4 KiB to
+    64 MiB, of at least its input bytes; the last bucket holds the larger
+    calls.
+
+    Built with QUICKREDUCE_FLAG_WAIT_CYCLES, the kernels also accumulate the
+    wall-clock ticks they spend spinning in wait_sync_flag, per device (see
+    core/base.h). The snapshot reports them with the tick rate.
+*/
+
+static constexpr int kMetricsQuantLevels = 26;
+static constexpr int kMetricsSizeBuckets = 16;
+static constexpr int kMetricsMinBucketLog2 = 12;  // 4 KiB
+
+// Codec name of a quant level, see QuickReduceQuantLevel.
+inline char const* quant_level_name(int quant_level) {
+  static char const* const kNames[kMetricsQuantLevels] = {
+      "FP16",    "Q8",      "Q6",      "Q4",      "Q8-asym", "Q6-asym",
+      "Q4-asym", "Top4",    "Top2",    "Top2-Q8", "Q7",      "Q5",
+      "Q3",      "Q4>Q8",   "Q4>FP16", "Q6>Q8",   "Q6>FP16", "Q8>FP16",
+      "Q4-Esc",  "Q6-Esc",  "Q4-H",    "Q6-H",    "MXFP4",   "MXFP6",
+      "MXINT8",  "FP16-L"};
+  if (quant_level < 0 || quant_level >= kMetricsQuantLevels) return "unknown";
+  return kNames[quant_level];
+}
+
+inline int metrics_size_bucket(uint64_t bytes) {
+  int bucket = 0;
+  while (bucket < kMetricsSizeBuckets - 1 &&
+         bytes > (uint64_t(1) << (kMetricsMinBucketLog2 + bucket))) {
+    bucket++;
+  }
+  return bucket;
+}
+
+// Largest input of a size bucket, 0 for the last, unbounded one.
+inline uint64_t metrics_bucket_bytes(int bucket) {
+  if (bucket >= kMetricsSizeBuckets - 1) return 0;
+  return uint64_t(1) << (kMetricsMinBucketLog2 + bucket);
+}
+
+// fp16 bytes a rank sends to its peers in a two-shot all-reduce of
+// `input_bytes`.
+inline uint64_t allreduce_logical_bytes(uint64_t input_bytes, int world_size) {
+  return 2 * input_bytes * (world_size - 1) / world_size;
+}
+
+struct MetricsEntry {
+  int quant_level = 0;
+  int size_bucket = 0;
+  uint64_t calls = 0;
+  uint64_t input_bytes = 0;
+  uint64_t logical_bytes = 0;
+  uint64_t wire_bytes = 0;
+};
+
+struct MetricsSnapshot {
+  int rank = 0;
+  int world_size = 1;
+  // The codecs and size buckets with at least one call.
+  std::vector<MetricsEntry> entries;
+  // Flag-wait ticks since the counters were reset, and their rate; a rate
+  // of 0 if the kernels were built without counting them.
+  uint64_t flag_wait_ticks = 0;
+  double flag_wait_tick_hz = 0.0;
+
+  // Sum over the entries of `quant_level`, or of all of them for -1.
+  MetricsEntry total(int quant_level = -1) const {
+    MetricsEntry sum;
+    sum.quant_level = quant_level;
+    sum.size_bucket = -1;
+    for (auto const& e : entries) {
+      if (quant_level >= 0 && e.quant_level != quant_level) continue;
+      sum.calls += e.calls;
+      sum.input_bytes += e.input_bytes;
+      sum.logical_bytes += e.logical_bytes;
+      sum.wire_bytes += e.wire_bytes;
+    }
+    return sum;
+  }
+
+  // Prometheus text exposition format.
+  std::string prometheus() const;
+};
+
+class CommMetrics {
+ public:
+  // Count an all-reduce call of `input_bytes` that ran with `quant_level`
+  // and sent `wire_bytes` to the peers.
+  void record(int quant_level, int world_size, uint64_t input_bytes,
+              uint64_t wire_bytes) {
+    if (quant_level < 0 || quant_level >= kMetricsQuantLevels) return;
+    Counters& c = counters_[quant_level][metrics_size_bucket(input_bytes)];
+    c.calls.fetch_add(1, std::memory_order_relaxed);
+    c.input_bytes.fetch_add(input_bytes, std::memory_order_relaxed);
+    c.logical_bytes.fetch_add(allreduce_logical_bytes(input_bytes, world_size),
+                              std::memory_order_relaxed);
+    c.wire_bytes.fetch_add(wire_bytes, std::memory_order_relaxed);
+  }
+
+  MetricsSnapshot snapshot(int rank, int world_size) const {
+    MetricsSnapshot snapshot;
+    snapshot.rank = rank;
+    snapshot.world_size = world_size;
+    for (int q = 0; q < kMetricsQuantLevels; q++) {
+      for (int b = 0; b < kMetricsSizeBuckets; b++) {
+        Counters const& c = counters_[q][b];
+        MetricsEntry e;
+        e.quant_level = q;
+        e.size_bucket = b;
+        e.calls = c.calls.load(std::memory_order_relaxed);
+        if (e.calls == 0) continue;
+        e.input_bytes = c.input_bytes.load(std::memory_order_relaxed);
+        e.logical_bytes = c.logical_bytes.load(std::memory_order_relaxed);
+        e.wire_bytes = c.wire_bytes.load(std::memory_order_relaxed);
+        snapshot.entries.push_back(e);
+      }
+    }
+    return snapshot;
+  }
+
+  void reset() {
+    for (auto& level : counters_) {
+      for (auto& c : level) {
+        c.calls.store(0, std::memory_order_relaxed);
+        c.input_bytes.store(0, std::memory_order_relaxed);
+        c.logical_bytes.store(0, std::memory_order_relaxed);
+        c.wire_bytes.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+ private:
+  struct Counters {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> input_bytes{0};
+    std::atomic<uint64_t> logical_bytes{0};
+    std::atomic<uint64_t> wire_bytes{0};
+  };
+  Counters counters_[kMetricsQuantLevels][kMetricsSizeBuckets];
+};
+
+inline std::string MetricsSnapshot::prometheus() const {
+  std::string text;
+  auto line = [&](char const* name, MetricsEntry const& e, uint64_t value) {
+    uint64_t max_bytes = metrics_bucket_bytes(e.size_bucket);
+    text += std::string(name) + "{rank=\"" + std::to_string(rank) +
+            "\",codec=\"" + quant_level_name(e.quant_level) +
+            "\",quant_level=\"" + std::to_string(e.quant_level) +
+            "\",max_bytes=\"" +
+            (max_bytes ? std::to_string(max_bytes) : std::string("+Inf")) +
+            "\"} " + std::to_string(value) + "\n";
+  };
+  auto counter = [&](char const* name, char const* help,
+                     uint64_t MetricsEntry::*field) {
+    text += std::string("# HELP ") + name + " " + help + "\n";
+    text += std::string("# TYPE ") + name + " counter\n";
+    for (auto const& e : entries) line(name, e, e.*field);
+  };
+  counter("quickreduce_allreduce_calls_total", "All-reduce calls.",
+          &MetricsEntry::calls);
+  counter("quickreduce_allreduce_input_bytes_total",
+          "fp16 input bytes of the all-reduce calls.",
+          &MetricsEntry::input_bytes);
+  counter("quickreduce_allreduce_logical_bytes_total",
+          "fp16 bytes the all-reduce calls exchange with the peers.",
+          &MetricsEntry::logical_bytes);
+  counter("quickreduce_allreduce_wire_bytes_total",
+          "Encoded bytes the all-reduce calls send to the peers.",
+          &MetricsEntry::wire_bytes);
+  if (flag_wait_tick_hz > 0.0) {
+    text +=
+        "# HELP quickreduce_flag_wait_seconds_total Time the kernels of the "
+        "device spent waiting on flags, summed over the waiting threads.\n"
+        "# TYPE quickreduce_flag_wait_seconds_total counter\n"
+        "quickreduce_flag_wait_seconds_total{rank=\"" +
+        std::to_string(rank) + "\"} " +
+        std::to_string(double(flag_wait_ticks) / flag_wait_tick_hz) + "\n";
+  }
+  return text;
+}
+
+}  // namespace quickreduce
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "rendezvous.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Registration cache of the outputs written directly by the peers in
+    Phase-2 of the two-shot all-reduce.
+
+Operation:
+    Registration is collective: every rank exports the IPC handle of the
+    allocation holding its output, with the offset and size of the output
+    in it (OutputHandle), the handles are exchanged out of band, and every
+    rank maps the allocations of its peers. The registration then holds the
+    address of the output of every rank in this process.
+
+    A peer allocation is mapped once, however many registered outputs it
+    holds: the mappings are reference counted by (rank, handle), as opening
+    the same handle twice fails.
+
+    The ranks must register the same outputs in the same order. Every rank
+    numbers its registrations, stamps the next number into its handle, and
+    checks that the handles of all the ranks carry its own: a rank that is a
+    registration ahead or behind fails instead of pairing unrelated outputs.
+
+    An all-reduce is written in place by the peers only when its input is a
+    registered output as a whole (find_exact). The offset of the output in
+    the allocation of every peer was exchanged in the handles, so the ranks
+    agree on where each of them is written without any per-call exchange.
+    Registering a range that overlaps a registration invalidates it (the
+    memory was freed and reused), and so does unregistering any part of it.
+
+    The registry only does the bookkeeping: mapping and unmapping are
+    callbacks, which keeps it testable on the host.
+*/
+struct OutputHandle {
+  uint8_t ipc_handle[kIpcHandleSize] = {};  // allocation holding the output
+  uint64_t offset = 0;                      // of the output in the allocation
+  uint64_t bytes = 0;                       // of the output
+  uint64_t id = 0;  // number of the registration on the exporting rank
+};
+
+struct OutputRegistration {
+  uintptr_t base = 0;   // local output
+  uint64_t bytes = 0;
+  uint64_t id = 0;      // the same on every rank
+  // Address of the output of every rank in this process.
+  std::vector<uintptr_t> outputs;
+  // Handles of the allocations of the peers, to release the mappings.
+  std::vector<OutputHandle> handles;
+  // Device copy of `outputs`, owned by the caller.
+  void* device_outputs = nullptr;
+
+  bool contains(uintptr_t ptr, uint64_t size) const {
+    return ptr >= base && ptr - base <= bytes && size <= bytes - (ptr - base);
+  }
+  bool overlaps(uintptr_t ptr, uint64_t size) const {
+    return ptr < base + bytes && base < ptr + size;
+  }
+};
+
+class IpcMappingCache {
+ public:
+  // Address of the allocation of `rank` with `handle`, mapped by
+  // `open(handle)` on first use.
+  template <class Open>
+  uintptr_t acquire(int rank, uint8_t const* handle, Open&& open) {
+    auto it = mappings_.find(key(rank, handle));
+    if (it == mappings_.end()) {
+      uintptr_t base = open(handle);
+      it = mappings_.emplace(key(rank, handle), Mapping{base, 0}).first;
+    }
+    it->second.refs++;
+    return it->second.base;
+  }
+
+  // Drop a reference, and unmap with `close(base)` on the last one.
+  template <class Close>
+  void release(int rank, uint8_t const* handle, Close&& close) {
+    auto it = mappings_.find(key(rank, handle));
+    if (it == mappings_.end()) return;
+    if (--it->second.refs == 0) {
+      close(it->second.base);
+      mappings_.erase(it);
+    }
+  }
+
+  size_t size() const { return mappings_.size(); }
+
+ private:
+  using Key = std::pair<int, std::array<uint8_t, kIpcHandleSize>>;
+  struct Mapping {
+    uintptr_t base;
+    int refs;
+  };
+
+  static Key key(int rank, uint8_t const* handle) {
+    Key k{rank, {}};
+    std::memcpy(k.second.data(), handle, kIpcHandleSize);
+    return k;
+  }
+
+  std::map<Key, Mapping> mappings_;
+};
+
+class OutputRegistry {
+ public:
+  // The registration holding [ptr, ptr + bytes), or nullptr.
+  OutputRegistration const* find(uintptr_t ptr, uint64_t bytes) const {
+    auto it = registrations_.upper_bound(ptr);
+    if (it == registrations_.begin()) return nullptr;
+    --it;
+    return it->second.contains(ptr, bytes) ? &it->second : nullptr;
+  }
+
+  // The registration of exactly [ptr, ptr + bytes), or nullptr.
+  OutputRegistration const* find_exact(uintptr_t ptr, uint64_t bytes) const {
+    auto it = registrations_.find(ptr);
+    if (it == registrations_.end() || it->second.bytes != bytes) {
+      return nullptr;
+    }
+    return &it->second;
+  }
+
+  // Number of the next registration, to stamp into the handle of an output.
+  uint64_t next_id() const { return next_id_; }
+
+  // Register the output [ptr, ptr + bytes) of `rank` from the handles of
+  // every rank, mapping the peer allocations with `open(handle)`. The
+  // overlapping registrations must have been invalidated first.
+  template <class Open>
+  OutputRegistration& add(int rank, uintptr_t ptr, uint64_t bytes,
+                          std::vector<OutputHandle> const& handles,
+                          Open&& open) {
+    if (rank < 0 || rank >= static_cast<int>(handles.size())) {
+      throw std::invalid_argument("Output registration: invalid rank");
+    }
+    for (auto const& h : handles) {
+      if (h.bytes != bytes) {
+        throw std::invalid_argument(
+            "Output registration: outputs differ in size across ranks (" +
+            std::to_string(h.bytes) + " vs " + std::to_string(bytes) + ")");
+      }
+      if (h.id != next_id_) {
+        throw std::invalid_argument(
+            "Output registration: ranks register outputs in a different "
+            "order (registration " + std::to_string(h.id) + " vs " +
+            std::to_string(next_id_) + ")");
+      }
+    }
+    for (auto const& entry : registrations_) {
+      if (entry.second.overlaps(ptr, bytes)) {
+        throw std::logic_error("Output registration overlaps a registration");
+      }
+    }
+
+    OutputRegistration registration;
+    registration.base = ptr;
+    registration.bytes = bytes;
+    registration.id = next_id_++;
+    registration.handles = handles;
+    registration.outputs.resize(handles.size());
+    for (int r = 0; r < static_cast<int>(handles.size()); r++) {
+      registration.outputs[r] =
+          r == rank ? ptr
+                    : mappings_.acquire(r, handles[r].ipc_handle, open) +
+                          handles[r].offset;
+    }
+    return registrations_[ptr] = std::move(registration);
+  }
+
+  // Remove the registrations overlapping [ptr, ptr + bytes), unmapping the
+  // peer allocations no other registration uses with `close(base)`. Returns
+  // the device copies of the removed registrations, for the caller to free.
+  template <class Close>
+  std::vector<void*> invalidate(int rank, uintptr_t ptr, uint64_t bytes,
+                                Close&& close) {
+    std::vector<void*> device_outputs;
+    for (auto it = registrations_.begin(); it != registrations_.end();) {
+      if (!it->second.overlaps(ptr, bytes)) {
+        ++it;
+        continue;
+      }
+      auto const& handles = it->second.handles;
+      for (int r = 0; r < static_cast<int>(handles.size()); r++) {
+        if (r != rank) mappings_.release(r, handles[r].ipc_handle, close);
+      }
+      if (it->second.device_outputs) {
+        device_outputs.push_back(it->second.device_outputs);
+      }
+      it = registrations_.erase(it);
+    }
+    return device_outputs;
+  }
+
+  template <class Close>
+  std::vector<void*> clear(int rank, Close&& close) {
+    return invalidate(rank, 0, UINTPTR_MAX, close);
+  }
+
+  size_t size() const { return registrations_.size(); }
+  size_t num_mappings() const { return mappings_.size(); }
+
+ private:
+  // Keyed by the local output address.
+  std::map<uintptr_t, OutputRegistration> registrations_;
+  IpcMappingCache mappings_;
+  uint64_t next_id_ = 0;
+};
+
+}  // namespace quickreduce
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../core/codec_layout.h"
+
+namespace quickreduce {
+namespace perf {
+
+/*
+===============================================================
+Desc:
+    Analytical latency model of the two-shot all-reduce, to pick codecs and
+    dispatch thresholds offline.
+
+Operation:
+    A launch of AllReduceTwoshot costs a fixed latency, the flag waits of its
+    two stages, and the bandwidth terms of its tiles:
+
+    - fabric: every rank sends (ws - 1) / ws of the transmitted tile in each
+      stage, spread over its ws - 1 peer links. The bandwidth of a link drops
+      as more links are active, by (ws - 1)^-fabric_scaling.
+    - compute: the codec encodes and decodes every tile twice, and every
+      rank reads its input, writes its output and reads and writes its
+      communication buffer in HBM.
+
+    The kernels overlap the two terms, but not perfectly: the model takes
+    the larger one plus `overlap_penalty` times the smaller one. Blocks that
+    loop over several waves of tiles pay the flag waits once more per wave.
+
+    The transmitted ratio of a codec follows from its tile layout; its fixed
+    and per-byte costs, and the machine parameters, are fitted to measured
+    latencies with `calibrate`. The MI300X preset is fitted to the latency
+    tables of the README (see test/perf_model_test.cpp).
+*/
+struct MachineModel {
+  double launch_us;        // launch, first tile load and fixed flag waits
+  double flag_peer_us;     // per stage, per peer whose flag is waited on
+  double link_gbps;        // one peer link, GB/s, with a single link active
+  double fabric_scaling;   // per-link bandwidth drop with the active links
+  double hbm_gbps;         // HBM bandwidth of a GPU, GB/s
+  double overlap_penalty;  // share of the smaller bandwidth term not hidden
+  uint32_t max_grid;       // resident blocks, see max_grid_size
+};
+
+struct CodecModel {
+  std::string name;
+  int quant_level;
+  double transmitted_ratio;  // transmitted bytes per fp16 byte
+  double fixed_us;           // per-launch cost of the codec
+  double compute_us_per_mb;  // encode + decode cost per MB of fp16 input
+};
+
+static constexpr double kTileBytes = 32768.0;
+static constexpr double kAtomBytes = 4096.0;  // fp16 bytes of a codec atom
+
+// Transmitted ratio of the symmetric codecs, from their tile layout.
+template <int bits>
+inline double symmetric_ratio() {
+  return QuantCodeLayout<bits>::kTileStride / kAtomBytes;
+}
+
+inline double link_bandwidth(MachineModel const& m, int world_size) {
+  return m.link_gbps * std::pow(double(world_size - 1), -m.fabric_scaling);
+}
+
+// Predicted latency of an all-reduce of `bytes` fp16 bytes, in us.
+inline double predict_us(MachineModel const& m, CodecModel const& c,
+                         int world_size, double bytes) {
+  double tiles = std::ceil(bytes / kTileBytes);
+  double waves = std::ceil(tiles / m.max_grid);
+  double sync = 2.0 * (world_size - 1) * m.flag_peer_us;
+
+  // GB/s is bytes/ns, hence the 1e-3 to get us.
+  double fabric = 2.0 * bytes * c.transmitted_ratio /
+                  (world_size * link_bandwidth(m, world_size)) * 1e-3;
+  double hbm = bytes * (2.0 + 4.0 * c.transmitted_ratio) / m.hbm_gbps * 1e-3;
+  double compute = bytes * 1e-6 * c.compute_us_per_mb + hbm;
+
+  return m.launch_us + c.fixed_us + waves * sync + std::max(fabric, compute) +
+         m.overlap_penalty * std::min(fabric, compute);
+}
+
+// A measured latency.
+struct Sample {
+  int world_size;
+  int quant_level;
+  double bytes;
+  double latency_us;
+};
+
+// Sum of squared log errors of the model over the samples of the codecs.
+inline double calibration_loss(MachineModel const& m,
+                               std::vector<CodecModel> const& codecs,
+                               std::vector<Sample> const& samples) {
+  double loss = 0.0;
+  for (auto const& s : samples) {
+    for (auto const& c : codecs) {
+      if (c.quant_level != s.quant_level) continue;
+      double e = std::log(predict_us(m, c, s.world_size, s.bytes) /
+                          s.latency_us);
+      loss += e * e;
+    }
+  }
+  return loss;
+}
+
+// Fit the machine parameters and the codec costs to the samples by
+// coordinate descent on the log of every parameter, which must start
+// positive. The transmitted ratios, HBM bandwidth and grid are not fitted:
+// they are known from the layouts and the device. Returns the final loss.
+inline double calibrate(MachineModel& m, std::vector<CodecModel>& codecs,
+                        std::vector<Sample> const& samples,
+                        int max_sweeps = 4000) {
+  std::vector<double*> params = {&m.launch_us, &m.flag_peer_us, &m.link_gbps,
+                                 &m.fabric_scaling, &m.overlap_penalty};
+  for (auto& c : codecs) {
+    params.push_back(&c.fixed_us);
+    params.push_back(&c.compute_us_per_mb);
+  }
+  double loss = calibration_loss(m, codecs, samples);
+  double step = 0.5;
+  for (int sweep = 0; sweep < max_sweeps && step > 1e-4; sweep++) {
+    bool improved = false;
+    for (double* p : params) {
+      for (double factor : {1.0 + step, 1.0 / (1.0 + step)}) {
+        double old = *p;
+        *p = old * factor;
+        double trial = calibration_loss(m, codecs, samples);
+        if (trial < loss) {
+          loss = trial;
+          improved = true;
+        } else {
+          *p = old;
+        }
+      }
+    }
+    if (!improved) step *= 0.5;
+  }
+  return loss;
+}
+
+// Fit on 8xMI300X (gfx942, 304 CUs, 4 blocks per CU), from the README
+// latency tables.
+inline MachineModel mi300x_machine() {
+  return {/*launch_us=*/6.4,      /*flag_peer_us=*/0.58,
+          /*link_gbps=*/52.8,     /*fabric_scaling=*/0.23,
+          /*hbm_gbps=*/5300.0,    /*overlap_penalty=*/0.56,
+          /*max_grid=*/1216};
+}
+
+inline std::vector<CodecModel> mi300x_codecs() {
+  return {
+      {"FP16", 0, 1.0, 0.0, 0.0},
+      {"Q8", 1, symmetric_ratio<8>(), 11.3, 3.8},
+      {"Q6", 2, symmetric_ratio<6>(), 12.9, 2.7},
+      {"Q4", 3, symmetric_ratio<4>(), 12.3, 2.0},
+  };
+}
+
+// Codec of `bits` bits, with costs interpolated linearly in the bit-width
+// between two calibrated symmetric codecs.
+template <int bits>
+inline CodecModel interpolated_codec(std::string name, int quant_level,
+                                     CodecModel const& lo, int lo_bits,
+                                     CodecModel const& hi, int hi_bits) {
+  double t = double(bits - lo_bits) / double(hi_bits - lo_bits);
+  return {name, quant_level, symmetric_ratio<bits>(),
+          lo.fixed_us + t * (hi.fixed_us - lo.fixed_us),
+          lo.compute_us_per_mb +
+              t * (hi.compute_us_per_mb - lo.compute_us_per_mb)};
+}
+
+// The calibrated codecs, and the generated Q7/Q5/Q3 codecs interpolated from
+// Q4, Q6 and Q8.
+inline std::vector<CodecModel> with_generated_codecs(
+    std::vector<CodecModel> codecs) {
+  auto find = [&](int quant_level) -> CodecModel const& {
+    for (auto const& c : codecs) {
+      if (c.quant_level == quant_level) return c;
+    }
+    return codecs.front();
+  };
+  CodecModel q8 = find(1), q6 = find(2), q4 = find(3);
+  codecs.push_back(interpolated_codec<7>("Q7", 10, q6, 6, q8, 8));
+  codecs.push_back(interpolated_codec<5>("Q5", 11, q4, 4, q6, 6));
+  codecs.push_back(interpolated_codec<3>("Q3", 12, q4, 4, q6, 6));
+  return codecs;
+}
+
+// Codec pair of the two phases (see PhaseCodecs in core/allreduce.h): each
+// phase moves half of the fabric bytes and runs half of the codec work.
+inline CodecModel paired_codec(std::string name, int quant_level,
+                               CodecModel const& phase1,
+                               CodecModel const& phase2) {
+  return {name, quant_level,
+          0.5 * (phase1.transmitted_ratio + phase2.transmitted_ratio),
+          0.5 * (phase1.fixed_us + phase2.fixed_us),
+          0.5 * (phase1.compute_us_per_mb + phase2.compute_us_per_mb)};
+}
+
+// Smallest size from which `quant_level` is the fastest codec, up to the
+// next threshold.
+struct Threshold {
+  double min_bytes;
+  int quant_level;
+};
+
+// Fastest codec for sizes in [min_bytes, max_bytes], sampled every
+// `1 + resolution`. Codecs rejected by `allowed` (eg: for accuracy) are not
+// considered.
+inline std::vector<Threshold> dispatch_thresholds(
+    MachineModel const& m, std::vector<CodecModel> const& codecs,
+    int world_size, double min_bytes, double max_bytes,
+    std::function<bool(CodecModel const&)> const& allowed = nullptr,
+    double resolution = 0.01) {
+  std::vector<Threshold> thresholds;
+  for (double bytes = min_bytes; bytes <= max_bytes;
+       bytes *= 1.0 + resolution) {
+    CodecModel const* best = nullptr;
+    double best_us = INFINITY;
+    for (auto const& c : codecs) {
+      if (allowed && !allowed(c)) continue;
+      double us = predict_us(m, c, world_size, bytes);
+      if (us < best_us) {
+        best_us = us;
+        best = &c;
+      }
+    }
+    if (best == nullptr) break;
+    if (thresholds.empty() ||
+        thresholds.back().quant_level != best->quant_level) {
+      thresholds.push_back({bytes, best->quant_level});
+    }
+  }
+  return thresholds;
+}
+
+}  // namespace perf
+}  // namespace quickreduce
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "file_store.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Rendezvous of the ranks of a communicator over a FileStore.
+
+Operation:
+    Every collective of the rendezvous is named, and each rank publishes its
+    value under "<name>/<rank>". Names must be used once per store, in the
+    same order on every rank.
+
+    `exchange_peers` gathers the PeerInfo of every rank: the IPC handle of its
+    communication buffer and the metadata needed to check that the ranks form
+    a valid single-node communicator.
+*/
+
+// IPC handles are opaque 64-byte blobs (HIP_IPC_HANDLE_SIZE).
+static constexpr int kIpcHandleSize = 64;
+
+struct PeerInfo {
+  static constexpr uint32_t kMagic = 0x51524456;  // "QRDV"
+  uint32_t magic = kMagic;
+  int32_t world_size = 0;
+  int32_t rank = 0;
+  int32_t device = 0;
+  int32_t pid = 0;
+  char hostname[64] = {};
+  uint8_t ipc_handle[kIpcHandleSize] = {};
+};
+
+class Rendezvous {
+ public:
+  Rendezvous(FileStore& store, int world_size, int rank)
+      : store_(store), world_size_(world_size), rank_(rank) {
+    if (world_size <= 0 || rank < 0 || rank >= world_size) {
+      throw std::invalid_argument("Rendezvous: invalid rank or world size");
+    }
+  }
+
+  int world_size() const { return world_size_; }
+  int rank() const { return rank_; }
+
+  std::vector<std::vector<uint8_t>> all_gather(
+      std::string const& name, std::vector<uint8_t> const& value) {
+    store_.set(name + "/" + std::to_string(rank_), value);
+    std::vector<std::vector<uint8_t>> values(world_size_);
+    for (int r = 0; r < world_size_; r++) {
+      values[r] = r == rank_ ? value
+                             : store_.get(name + "/" + std::to_string(r));
+    }
+    return values;
+  }
+
+  void barrier(std::string const& name) { all_gather(name, {}); }
+
+  std::vector<PeerInfo> exchange_peers(PeerInfo info) {
+    info.magic = PeerInfo::kMagic;
+    info.world_size = world_size_;
+    info.rank = rank_;
+    info.pid = static_cast<int32_t>(getpid());
+    gethostname(info.hostname, sizeof(info.hostname) - 1);
+
+    std::vector<uint8_t> bytes(sizeof(PeerInfo));
+    std::memcpy(bytes.data(), &info, sizeof(PeerInfo));
+    auto values = all_gather("peers", bytes);
+
+    std::vector<PeerInfo> peers(world_size_);
+    for (int r = 0; r < world_size_; r++) {
+      if (values[r].size() != sizeof(PeerInfo)) {
+        throw std::runtime_error("Rendezvous: bad peer info from rank " +
+                                 std::to_string(r));
+      }
+      std::memcpy(&peers[r], values[r].data(), sizeof(PeerInfo));
+      PeerInfo const& p = peers[r];
+      if (p.magic != PeerInfo::kMagic || p.rank != r ||
+          p.world_size != world_size_) {
+        throw std::runtime_error(
+            "Rendezvous: rank " + std::to_string(r) +
+            " joined with a different world size or rank");
+      }
+      if (std::strncmp(p.hostname, info.hostname, sizeof(p.hostname)) != 0) {
+        throw std::runtime_error("Rendezvous: rank " + std::to_string(r) +
+                                 " runs on another node");
+      }
+    }
+    return peers;
+  }
+
+ private:
+  FileStore& store_;
+  int world_size_;
+  int rank_;
+};
+
+}  // namespace quickreduce
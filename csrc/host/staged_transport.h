@@ -0,0 +1,383 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Host-staged transport of the two-shot all-reduce, for nodes where the
+    ranks cannot map each other's device buffers (containers and virtual
+    machines without peer-to-peer access).
+
+Operation:
+    The ranks share a POSIX shared-memory segment, pinned for the device in
+    every process. The tiles of a call are processed in chunks that fit a
+    slot of `slot_bytes`: the encoded segments a rank sends to rank r in
+    Phase-1 go through slot (0, rank, r), the reduced segments it sends to
+    every rank in Phase-2 through slot (1, rank). Every slot exists twice,
+    for the two stages: chunks alternate between them, so the copies of one
+    chunk overlap the kernels of the next.
+
+    Chunks are numbered by a sequence shared by the ranks, from 1 and
+    across calls; chunk `seq` uses stage seq % 2. A sender waits until
+    every receiver of the slot acknowledged chunk seq - 2, copies the
+    payload in and sets the ready flag of the slot to seq; a receiver waits
+    for the ready flag, copies the payload out and sets its ack flag to
+    seq. The flags only grow, so no flag is ever reset.
+
+    On the device, a call is a fixed schedule of ops on three queues: the
+    kernels (encode, reduce, gather) on the stream of the call, the
+    device-to-host copies (send) and the host-to-device copies (receive) on
+    streams of their own. Each op waits for the ops of the other queues it
+    depends on; the flags are waited for and set by the copy streams
+    themselves. StagedSegment also runs the protocol on the host, which is
+    how the tests exercise it with processes standing in for the devices.
+
+    A segment left behind by a run that failed before rank 0 released the
+    name has the same name and size as the next one. Rank 0 writes a nonce
+    of the run, agreed by the ranks beforehand (e.g. through the
+    rendezvous), into the header of the segment it creates; the other ranks
+    only attach to a segment carrying that nonce, and keep waiting for it
+    otherwise.
+*/
+
+static constexpr int kStagedStages = 2;
+
+inline int staged_stage(uint64_t seq) {
+  return static_cast<int>(seq % kStagedStages);
+}
+
+// A nonce for a run, never 0, which is the nonce of a segment not written
+// yet.
+inline uint64_t staged_nonce() {
+  std::random_device device;
+  uint64_t nonce = 0;
+  while (nonce == 0) nonce = (uint64_t(device()) << 32) | device();
+  return nonce;
+}
+
+// Ack a slot needs before chunk `seq` can be written into it.
+inline uint64_t staged_reusable_after(uint64_t seq) {
+  return seq > kStagedStages ? seq - kStagedStages : 0;
+}
+
+// Tiles of a chunk: the tiles whose segments of `segment_bytes` fit a slot.
+inline uint32_t staged_chunk_tiles(int64_t slot_bytes, int64_t segment_bytes) {
+  int64_t tiles = segment_bytes > 0 ? slot_bytes / segment_bytes : 0;
+  if (tiles == 0) {
+    throw std::invalid_argument("StagedSegment: slot smaller than a segment");
+  }
+  return static_cast<uint32_t>(tiles);
+}
+
+// The ops of a chunk, in their order within the chunk.
+enum class StagedOpKind {
+  ENCODE = 0,  // Phase-1A: encode the segments of the tiles
+  SEND1,       // copy the segments of every peer to its slot
+  RECV1,       // copy the segments of every peer from its slot
+  REDUCE,      // Phase-1B: reduce and encode the own segment
+  SEND2,       // copy the reduced segment to the own slot
+  RECV2,       // copy the reduced segments of every peer
+  GATHER,      // Phase-2: decode the result into the output
+};
+static constexpr int kStagedOpKinds = 7;
+
+enum class StagedQueue { COMPUTE, D2H, H2D };
+
+inline StagedQueue staged_queue(StagedOpKind kind) {
+  switch (kind) {
+    case StagedOpKind::SEND1:
+    case StagedOpKind::SEND2:
+      return StagedQueue::D2H;
+    case StagedOpKind::RECV1:
+    case StagedOpKind::RECV2:
+      return StagedQueue::H2D;
+    default:
+      return StagedQueue::COMPUTE;
+  }
+}
+
+struct StagedOp {
+  StagedOpKind kind;
+  uint32_t chunk;
+};
+
+// An op waits for op `kind` of the chunk `lag` chunks before its own.
+struct StagedDependency {
+  StagedOpKind kind;
+  uint32_t lag;
+};
+
+// The ops of other queues an op waits for: the producer of its input, and
+// the last reader of the device buffer it overwrites, two chunks back. The
+// ops of a queue run in order.
+inline std::vector<StagedDependency> staged_dependencies(StagedOpKind kind) {
+  switch (kind) {
+    case StagedOpKind::ENCODE:
+      return {{StagedOpKind::SEND1, kStagedStages}};
+    case StagedOpKind::SEND1:
+      return {{StagedOpKind::ENCODE, 0}};
+    case StagedOpKind::RECV1:
+      return {{StagedOpKind::REDUCE, kStagedStages}};
+    case StagedOpKind::REDUCE:
+      return {{StagedOpKind::RECV1, 0}, {StagedOpKind::SEND2, kStagedStages}};
+    case StagedOpKind::SEND2:
+      return {{StagedOpKind::REDUCE, 0}};
+    case StagedOpKind::RECV2:
+      return {{StagedOpKind::GATHER, kStagedStages}};
+    case StagedOpKind::GATHER:
+      return {{StagedOpKind::RECV2, 0}};
+  }
+  return {};
+}
+
+// Issue order of the ops of a call of `num_chunks` chunks. Step i issues
+// the Phase-1 ops of chunk i, the reduction of chunk i - 1 and the gather
+// of chunk i - 2, so the kernels of a chunk run while the copies of its
+// neighbours are in flight. Every op is issued after the ops it waits for,
+// in the same order on every rank.
+inline std::vector<StagedOp> staged_schedule(uint32_t num_chunks) {
+  std::vector<StagedOp> ops;
+  ops.reserve(size_t(num_chunks) * kStagedOpKinds);
+  for (uint32_t step = 0; step < num_chunks + 2; step++) {
+    if (step < num_chunks) {
+      ops.push_back({StagedOpKind::ENCODE, step});
+      ops.push_back({StagedOpKind::SEND1, step});
+      ops.push_back({StagedOpKind::RECV1, step});
+    }
+    if (step >= 1 && step - 1 < num_chunks) {
+      ops.push_back({StagedOpKind::REDUCE, step - 1});
+      ops.push_back({StagedOpKind::SEND2, step - 1});
+      ops.push_back({StagedOpKind::RECV2, step - 1});
+    }
+    if (step >= 2) {
+      ops.push_back({StagedOpKind::GATHER, step - 2});
+    }
+  }
+  return ops;
+}
+
+enum class StagedFlag { READY = 0, ACK = 1 };
+
+class StagedSegment {
+ public:
+  static constexpr int64_t kDefaultSlotBytes = 1 << 20;
+
+  // `nonce` is the same on every rank and unique to the run, see above.
+  StagedSegment(std::string const& name, int world_size, int rank,
+                uint64_t nonce, int64_t slot_bytes = kDefaultSlotBytes,
+                std::chrono::milliseconds timeout = std::chrono::minutes(5))
+      : name_(name),
+        world_size_(world_size),
+        rank_(rank),
+        nonce_(nonce),
+        slot_bytes_(slot_bytes),
+        timeout_(timeout) {
+    if (world_size <= 0 || rank < 0 || rank >= world_size) {
+      throw std::invalid_argument("StagedSegment: invalid rank or world size");
+    }
+    if (nonce == 0) {
+      throw std::invalid_argument("StagedSegment: the nonce must not be 0");
+    }
+    if (slot_bytes <= 0 || slot_bytes % 64 != 0) {
+      throw std::invalid_argument(
+          "StagedSegment: slot size must be a positive multiple of 64");
+    }
+    num_flags_ = 2 * 2 * world_size * world_size * kStagedStages;
+    num_slots_ = (world_size * world_size + world_size) * kStagedStages;
+    size_ = sizeof(Header) + num_flags_ * sizeof(Flag) +
+            num_slots_ * slot_bytes;
+    attach();
+    // Every rank has mapped the segment once all of them arrived, so the
+    // name can be released.
+    Header* h = header();
+    h->attached.fetch_add(1, std::memory_order_acq_rel);
+    wait_until([&] {
+      return h->attached.load(std::memory_order_acquire) ==
+             static_cast<uint32_t>(world_size_);
+    }, "attach");
+    if (rank_ == 0) shm_unlink(name_.c_str());
+  }
+
+  ~StagedSegment() {
+    if (base_ != nullptr) munmap(base_, size_);
+  }
+
+  StagedSegment(StagedSegment const&) = delete;
+  StagedSegment& operator=(StagedSegment const&) = delete;
+
+  int world_size() const { return world_size_; }
+  int rank() const { return rank_; }
+  int64_t slot_bytes() const { return slot_bytes_; }
+  void* base() const { return base_; }
+  int64_t bytes() const { return size_; }
+
+  // Flag of the slot of `phase` from `src` to `dst`, in `stage`; phase 0
+  // is Phase-1 of the all-reduce, phase 1 Phase-2. Phase-2 has one ready
+  // flag per sender, on dst == src.
+  std::atomic<uint64_t>* flag(StagedFlag kind, int phase, int src, int dst,
+                              int stage) const {
+    int64_t index =
+        (((static_cast<int>(kind) * 2 + phase) * world_size_ + src) *
+             world_size_ + dst) * kStagedStages + stage;
+    return &flags()[index].value;
+  }
+
+  // Slot of `phase` from `src` to `dst`, in `stage`. Phase-2 has one slot
+  // per sender, read by every peer, and ignores `dst`.
+  uint8_t* slot(int phase, int src, int dst, int stage) const {
+    int64_t index = phase == 0
+                        ? (src * world_size_ + dst) * kStagedStages + stage
+                        : (world_size_ * world_size_ + src) * kStagedStages +
+                              stage;
+    return reinterpret_cast<uint8_t*>(flags() + num_flags_) +
+           index * slot_bytes_;
+  }
+
+  // Offset of an address of the segment, to address it in another mapping.
+  int64_t offset(void const* p) const {
+    return static_cast<uint8_t const*>(p) - static_cast<uint8_t const*>(base_);
+  }
+
+  // Host side of the protocol, see above.
+
+  // Phase-1: send chunk `seq` of `bytes` to `dst`.
+  void send(int dst, uint64_t seq, void const* data, int64_t bytes) {
+    int stage = staged_stage(seq);
+    wait_flag(flag(StagedFlag::ACK, 0, rank_, dst, stage),
+              staged_reusable_after(seq));
+    std::memcpy(slot(0, rank_, dst, stage), data, bytes);
+    flag(StagedFlag::READY, 0, rank_, dst, stage)
+        ->store(seq, std::memory_order_release);
+  }
+
+  // Phase-2: send chunk `seq` of `bytes` to every peer.
+  void publish(uint64_t seq, void const* data, int64_t bytes) {
+    int stage = staged_stage(seq);
+    for (int r = 0; r < world_size_; r++) {
+      if (r == rank_) continue;
+      wait_flag(flag(StagedFlag::ACK, 1, rank_, r, stage),
+                staged_reusable_after(seq));
+    }
+    std::memcpy(slot(1, rank_, rank_, stage), data, bytes);
+    flag(StagedFlag::READY, 1, rank_, rank_, stage)
+        ->store(seq, std::memory_order_release);
+  }
+
+  // Receive chunk `seq` of `bytes` of `phase` from `src`.
+  void receive(int phase, int src, uint64_t seq, void* data, int64_t bytes) {
+    int stage = staged_stage(seq);
+    int ready_dst = phase == 0 ? rank_ : src;
+    wait_flag(flag(StagedFlag::READY, phase, src, ready_dst, stage), seq);
+    std::memcpy(data, slot(phase, src, rank_, stage), bytes);
+    flag(StagedFlag::ACK, phase, src, rank_, stage)
+        ->store(seq, std::memory_order_release);
+  }
+
+  // Wait until `flag` reaches `value`.
+  void wait_flag(std::atomic<uint64_t> const* flag, uint64_t value) const {
+    wait_until([&] { return flag->load(std::memory_order_acquire) >= value; },
+               "flag");
+  }
+
+ private:
+  struct alignas(64) Header {
+    std::atomic<uint32_t> attached;
+    std::atomic<uint64_t> nonce;
+  };
+  struct alignas(64) Flag {
+    std::atomic<uint64_t> value;
+  };
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "shared-memory atomics must be lock free");
+
+  std::string name_;
+  int world_size_;
+  int rank_;
+  uint64_t nonce_;
+  int64_t slot_bytes_;
+  std::chrono::milliseconds timeout_;
+  int64_t num_flags_ = 0;
+  int64_t num_slots_ = 0;
+  int64_t size_ = 0;
+  void* base_ = nullptr;
+
+  Header* header() const { return static_cast<Header*>(base_); }
+  Flag* flags() const {
+    return reinterpret_cast<Flag*>(static_cast<uint8_t*>(base_) +
+                                   sizeof(Header));
+  }
+
+  template <class Done>
+  void wait_until(Done const& done, char const* what) const {
+    auto start = std::chrono::steady_clock::now();
+    while (!done()) {
+      if (std::chrono::steady_clock::now() - start > timeout_) {
+        throw std::runtime_error(std::string("StagedSegment: ") + what +
+                                 " wait timed out on " + name_);
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  // Rank 0 creates the zero-filled segment and writes the nonce, the other
+  // ranks wait until a segment of the size carries the nonce.
+  void attach() {
+    if (rank_ == 0) {
+      shm_unlink(name_.c_str());
+      int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+      if (fd < 0 || ftruncate(fd, size_) != 0) {
+        if (fd >= 0) close(fd);
+        throw std::runtime_error("StagedSegment: cannot create " + name_);
+      }
+      map(fd);
+      header()->nonce.store(nonce_, std::memory_order_release);
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+      int fd = shm_open(name_.c_str(), O_RDWR, 0600);
+      struct stat st;
+      if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size == size_) {
+        map(fd);
+        if (header()->nonce.load(std::memory_order_acquire) == nonce_) return;
+        munmap(base_, size_);
+        base_ = nullptr;
+      } else if (fd >= 0) {
+        close(fd);
+      }
+      if (std::chrono::steady_clock::now() - start > timeout_) {
+        throw std::runtime_error("StagedSegment: no segment of this run at " +
+                                 name_);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  // Map the segment of `fd`, and close it.
+  void map(int fd) {
+    base_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base_ == MAP_FAILED) {
+      base_ = nullptr;
+      throw std::runtime_error("StagedSegment: cannot map " + name_);
+    }
+  }
+};
+
+}  // namespace quickreduce
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Flag colors of the submission channels of a communicator, for calls
+    submitted from several host threads.
+
+Operation:
+    A channel owns its flags and two-shot regions in the communication
+    buffer (see ChannelLayout in core/launch.h), and the colors of its
+    flags. A call reserves the `count` colors its launch uses with one
+    relaxed fetch-add on the counter of its channel: concurrent callers
+    never take a lock and always get disjoint color ranges. The counters
+    sit on their own cache lines, so callers of different channels do not
+    contend either.
+
+    Disjoint colors do not order the calls between the ranks. The calls of
+    a channel run in the order their colors were reserved, which must be
+    the same on every rank: they are issued in order, on one stream, e.g.
+    by a single thread per channel. Calls on different channels share
+    nothing in the buffer and may run concurrently on any streams.
+
+    Colors start at 1, as the flags are cleared to 0.
+*/
+static constexpr int kMaxSubmitChannels = 16;
+
+class SubmitChannels {
+ public:
+  explicit SubmitChannels(int num_channels = 1)
+      : num_channels_(num_channels),
+        colors_(new Color[num_channels > 0 ? num_channels : 1]) {
+    if (num_channels < 1 || num_channels > kMaxSubmitChannels) {
+      throw std::invalid_argument(
+          "Submission channels must be in [1, " +
+          std::to_string(kMaxSubmitChannels) + "], got " +
+          std::to_string(num_channels));
+    }
+  }
+
+  int size() const { return num_channels_; }
+
+  void check(int channel) const {
+    if (channel < 0 || channel >= num_channels_) {
+      throw std::invalid_argument("Submission channel " +
+                                  std::to_string(channel) +
+                                  " out of range for " +
+                                  std::to_string(num_channels_) + " channels");
+    }
+  }
+
+  // First of `count` consecutive colors for a call on `channel`.
+  uint32_t reserve(int channel, uint32_t count) {
+    check(channel);
+    return colors_[channel].next.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  // Next color of `channel`, for tests and diagnostics.
+  uint32_t next(int channel) const {
+    check(channel);
+    return colors_[channel].next.load(std::memory_order_relaxed);
+  }
+
+  // Not thread-safe: only while no call is submitted, with cleared flags.
+  void reset() {
+    for (int c = 0; c < num_channels_; c++) {
+      colors_[c].next.store(1, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  struct alignas(64) Color {
+    std::atomic<uint32_t> next{1};
+  };
+
+  int num_channels_;
+  std::unique_ptr<Color[]> colors_;
+};
+
+}  // namespace quickreduce
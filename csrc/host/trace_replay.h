@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "allreduce_trace.h"
+#include "codec_reference.h"
+
+namespace quickreduce {
+namespace reference {
+
+/*
+===============================================================
+Desc:
+    Replay of all-reduce traces (host/allreduce_trace.h) through the host
+    references of the line codecs.
+
+Operation:
+    Every record is cut into atoms, the last one padded with zeros, and
+    each codec encodes and decodes them: the round-trip error is measured
+    on the captured values. The records of the same call of every rank of a
+    world also replay the two-shot all-reduce (reduce_atoms), against the
+    exact sum of the fp16 inputs.
+
+    The bytes are the ones a rank sends per tile: the tile stride, or for
+    the codecs with optional slots the bytes they write (bytes_written).
+*/
+
+// Bytes the kernel writes for an encoded tile.
+template <class Codec>
+auto codec_tile_bytes(uint8_t const* tile, int)
+    -> decltype(Codec::bytes_written(tile)) {
+  return Codec::bytes_written(tile);
+}
+
+template <class Codec>
+int codec_tile_bytes(uint8_t const*, long) {
+  return Codec::kTileStride;
+}
+
+struct CodecReplay {
+  std::string name;
+  ErrorStats round_trip;  // of the captured values
+  ErrorStats allreduce;   // of the sums of the calls captured on every rank
+  uint64_t bytes = 0;     // sent for the round trips
+  uint64_t values = 0;
+
+  double bits_per_value() const {
+    return values ? 8.0 * double(bytes) / double(values) : 0.0;
+  }
+};
+
+// The sum and mean calls captured on every rank of their world: the
+// records of ranks 0 to world_size - 1, with the same number of values.
+inline std::vector<std::vector<TraceFile::Record>> complete_calls(
+    std::vector<TraceFile::Record> const& records) {
+  std::map<std::pair<int, uint64_t>, std::vector<TraceFile::Record>> calls;
+  for (auto const& record : records) {
+    if (reduce_op_lossless(static_cast<ReduceOp>(record.header.op))) continue;
+    calls[{record.header.world_size, record.header.call_index}].push_back(
+        record);
+  }
+  std::vector<std::vector<TraceFile::Record>> complete;
+  for (auto& [key, ranks] : calls) {
+    if (static_cast<int>(ranks.size()) != key.first) continue;
+    std::sort(ranks.begin(), ranks.end(), [](auto const& a, auto const& b) {
+      return a.header.rank < b.header.rank;
+    });
+    bool valid = true;
+    for (int r = 0; r < key.first; r++) {
+      valid &= ranks[r].header.rank == r &&
+               ranks[r].header.numel == ranks[0].header.numel;
+    }
+    if (valid) complete.push_back(std::move(ranks));
+  }
+  return complete;
+}
+
+// Atom `a` of a record, padded with zeros.
+inline void record_atom(TraceFile::Record const& record, uint64_t a,
+                        uint16_t* atom) {
+  uint64_t first = a * kAtomValues;
+  uint64_t n = std::min<uint64_t>(kAtomValues, record.header.numel - first);
+  std::memcpy(atom, record.values + first, n * 2);
+  std::fill(atom + n, atom + kAtomValues, 0);
+}
+
+template <class Codec, class Phase2Codec = Codec>
+CodecReplay replay_codec(
+    std::string name, std::vector<TraceFile::Record> const& records,
+    std::vector<std::vector<TraceFile::Record>> const& calls) {
+  CodecReplay replay;
+  replay.name = std::move(name);
+  std::vector<uint8_t> tile(Codec::kTileStride);
+  uint16_t atom[kAtomValues];
+  uint16_t decoded[kAtomValues];
+  for (auto const& record : records) {
+    uint64_t numel = record.header.numel;
+    for (uint64_t a = 0; a * kAtomValues < numel; a++) {
+      record_atom(record, a, atom);
+      Codec::encode(atom, tile.data());
+      Codec::decode(tile.data(), decoded);
+      replay.bytes += codec_tile_bytes<Codec>(tile.data(), 0);
+      uint64_t n = std::min<uint64_t>(kAtomValues, numel - a * kAtomValues);
+      for (uint64_t i = 0; i < n; i++) {
+        replay.round_trip.add(host::half_to_float(atom[i]),
+                              host::half_to_float(decoded[i]));
+      }
+      replay.values += n;
+    }
+  }
+
+  for (auto const& ranks : calls) {
+    int world_size = static_cast<int>(ranks.size());
+    uint64_t numel = ranks[0].header.numel;
+    std::vector<std::vector<uint16_t>> atoms(
+        world_size, std::vector<uint16_t>(kAtomValues));
+    std::vector<uint16_t const*> inputs(world_size);
+    for (uint64_t a = 0; a * kAtomValues < numel; a++) {
+      for (int r = 0; r < world_size; r++) {
+        record_atom(ranks[r], a, atoms[r].data());
+        inputs[r] = atoms[r].data();
+      }
+      reduce_atoms<Codec, Phase2Codec>(
+          static_cast<ReduceOp>(ranks[0].header.op), inputs.data(),
+          world_size, decoded);
+      uint64_t n = std::min<uint64_t>(kAtomValues, numel - a * kAtomValues);
+      for (uint64_t i = 0; i < n; i++) {
+        double exact = 0.0;
+        for (int r = 0; r < world_size; r++) {
+          exact += host::half_to_float(inputs[r][i]);
+        }
+        if (ranks[0].header.op == static_cast<int>(ReduceOp::MEAN)) {
+          exact /= world_size;
+        }
+        replay.allreduce.add(static_cast<float>(exact),
+                             host::half_to_float(decoded[i]));
+      }
+    }
+  }
+  return replay;
+}
+
+// Every line codec of the quant levels that has a host reference.
+inline std::vector<CodecReplay> replay_codecs(
+    std::vector<TraceFile::Record> const& records) {
+  auto calls = complete_calls(records);
+  return {
+      replay_codec<FPCodec>("FP16", records, calls),
+      replay_codec<LosslessCodec>("FP16-L", records, calls),
+      replay_codec<SymmetricCodec<8>>("Q8", records, calls),
+      replay_codec<SymmetricCodec<7>>("Q7", records, calls),
+      replay_codec<SymmetricCodec<6>>("Q6", records, calls),
+      replay_codec<SymmetricCodec<5>>("Q5", records, calls),
+      replay_codec<SymmetricCodec<4>>("Q4", records, calls),
+      replay_codec<SymmetricCodec<3>>("Q3", records, calls),
+      replay_codec<AsymmetricCodec<8>>("Q8-asym", records, calls),
+      replay_codec<AsymmetricCodec<6>>("Q6-asym", records, calls),
+      replay_codec<AsymmetricCodec<4>>("Q4-asym", records, calls),
+      replay_codec<SymmetricCodec<4>, SymmetricCodec<8>>("Q4>Q8", records,
+                                                          calls),
+      replay_codec<SymmetricCodec<6>, SymmetricCodec<8>>("Q6>Q8", records,
+                                                          calls),
+      replay_codec<EscapeCodec<4, 2>>("Q4-Esc", records, calls),
+      replay_codec<EscapeCodec<6, 2>>("Q6-Esc", records, calls),
+      replay_codec<HadamardCodec<SymmetricCodec<4>>>("Q4-H", records, calls),
+      replay_codec<HadamardCodec<SymmetricCodec<6>>>("Q6-H", records, calls),
+      replay_codec<MxCodec<MxFp4>>("MXFP4", records, calls),
+      replay_codec<MxCodec<MxFp6>>("MXFP6", records, calls),
+      replay_codec<MxCodec<MxInt8>>("MXINT8", records, calls),
+      replay_codec<TopKCodec<4, false>>("Top4", records, calls),
+      replay_codec<TopKCodec<2, false>>("Top2", records, calls),
+      replay_codec<TopKCodec<2, true>>("Top2-Q8", records, calls),
+  };
+}
+
+}  // namespace reference
+}  // namespace quickreduce
@@ -1,10 +1,27 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
 #include <vector>
 #include <hip/hip_runtime.h>
 #include <hip/hip_fp16.h>
 #include <ATen/hip/HIPContext.h>
 #include <ATen/hip/impl/HIPGuardImplMasqueradingAsCUDA.h>
+#include "core/all_to_all.h"
+#include "core/direct_output.h"
+#include "core/launch.h"
+#include "core/layout.h"
+#include "core/mx_format.h"
+#include "core/quant_error.h"
+#include "core/readiness.h"
+#include "core/reduce_op.h"
+#include "core/schedule.h"
+#include "host/allreduce_trace.h"
+#include "host/codec_policy.h"
+#include "host/metrics.h"
+#include "host/output_registry.h"
+#include "host/staged_transport.h"
+#include "host/submit_channels.h"
 
 
 #define HIP_CHECK(err)                                                              \
@@ -31,10 +48,128 @@ enum struct QuickReduceProfile {
     TWOSHOT_Q4 = 5
 };
 
+// Sampled capture of the all-reduce inputs into a trace, see
+// host/allreduce_trace.h. A sample is copied to pinned memory on the stream
+// of its call and appended to the trace once the copy completed, checked on
+// the next calls and on disable_capture: a call never waits for it. While a
+// sample is in flight, the calls due for a sample are skipped.
+struct AllreduceCapture {
+  std::optional<TraceFile> trace;
+  TraceSampler sampler;
+  uint64_t calls = 0;
+  half* staging = nullptr;  // pinned, sampler.max_elements values
+  hipEvent_t copied = nullptr;
+  bool pending = false;
+  TraceRecordHeader record = {};
+};
+
+// Sampled quantization-error telemetry, see core/quant_error.h. A sampled
+// call clears a device record on its stream, the kernel accumulates into it,
+// and the record is copied to pinned memory behind the kernel. The copies are
+// checked on the next calls without blocking; a sample is skipped while its
+// slot is still in flight. The records feed the totals and the proposals of
+// the policy.
+struct ErrorTelemetry {
+  static constexpr int kSlots = 8;
+
+  bool enabled = false;
+  uint32_t sample_every = 0;  // calls
+  uint32_t tile_every = 1;
+  uint64_t calls = 0;
+  QuantErrorRecord* device_records = nullptr;  // kSlots
+  QuantErrorRecord* host_records = nullptr;    // kSlots, pinned
+  hipEvent_t copied[kSlots] = {};
+  bool pending[kSlots] = {};
+  int requested_level[kSlots] = {};
+  int ran_level[kSlots] = {};
+  int next_slot = 0;
+  AdaptiveCodecPolicy policy;
+  QuantErrorTotals totals;
+};
+
+// Host-staged transport of the all-reduce, for ranks that cannot map each
+// other's buffers, see host/staged_transport.h. The shared segment is
+// pinned in every process; the copies and their flag waits and writes run
+// on two streams of the communicator, the kernels on the stream of the call.
+// An event per op kind and stage orders the queues; `done` orders a call
+// after the kernels of the previous one, which may be on another stream.
+struct HostStaging {
+  std::optional<StagedSegment> segment;
+  uint8_t* mapped = nullptr;   // device address of the segment
+  uint8_t* buffers = nullptr;  // device chunk buffers, per stage
+  hipStream_t d2h = nullptr;
+  hipStream_t h2d = nullptr;
+  hipEvent_t events[kStagedOpKinds][kStagedStages] = {};
+  hipEvent_t done = nullptr;
+  uint64_t next_seq = 1;
+
+  bool enabled() const { return segment.has_value(); }
+};
+
+// The quant_level of the all-reduce calls.
+enum QuickReduceQuantLevel {
+  F16 = 0,
+  INT8 = 1,
+  INT6 = 2,
+  INT4 = 3,
+  INT8_ASYM = 4,
+  INT6_ASYM = 5,
+  INT4_ASYM = 6,
+  SPARSE_TOP4 = 7,
+  SPARSE_TOP2 = 8,
+  SPARSE_TOP2_Q8 = 9,
+  INT7 = 10,
+  INT5 = 11,
+  INT3 = 12,
+  // Phase-1 codec, then Phase-2 codec. The other collectives run these
+  // levels with the fp16 codec.
+  INT4_INT8 = 13,
+  INT4_F16 = 14,
+  INT6_INT8 = 15,
+  INT6_F16 = 16,
+  INT8_F16 = 17,
+  // Q4/Q6 with a per-block escape of outlier blocks to fp16.
+  INT4_ESCAPE = 18,
+  INT6_ESCAPE = 19,
+  // Q4/Q6 on the Hadamard rotation of the blocks.
+  INT4_HADAMARD = 20,
+  INT6_HADAMARD = 21,
+  // OCP Microscaling formats, see core/mx_format.h.
+  MXFP4 = 22,
+  MXFP6 = 23,
+  MXINT8 = 24,
+  // Exact fp16 values, with coded exponents.
+  F16_LOSSLESS = 25,
+};
+
+// Whether the quantization level runs an MX codec in Phase-2.
+inline bool mx_quant_level(int quant_level) {
+  return quant_level == QuickReduceQuantLevel::MXFP4 ||
+         quant_level == QuickReduceQuantLevel::MXFP6 ||
+         quant_level == QuickReduceQuantLevel::MXINT8;
+}
+
+enum struct Transport {
+  AUTO = 0,         // peer mappings if every rank can open them, else staged
+  PEER = 1,         // peer mappings of the device buffers
+  HOST_STAGED = 2,  // pinned shared host memory
+};
+
 /*
 ===============================================================
 Desc:
     Device Comms Handle
+
+Operation:
+    The all-reduce may be submitted from several host threads at once, on
+    different submission channels (see host/submit_channels.h): each channel
+    has its own flags, regions and colors, and the colors are reserved
+    without a lock. The calls of a channel are issued in the same order on
+    every rank. The rooted collectives and the all-to-all run on channel 0.
+    Sampled capture, error telemetry and the host-staged transport keep
+    per-communicator state: while enabled, the calls take a mutex. The
+    setup calls (init, connect, enable/disable, register_output) must not
+    run concurrently with the collectives.
 */
 struct DeviceComms {
     int64_t kMaxProblemSize =
@@ -42,30 +177,187 @@ struct DeviceComms {
   static int constexpr kMaxWorldSize = 8;
 
   bool initialized = false;
-  uint32_t flag_color = 1;
   int world_size;
   int rank;
 
+  // Device the communicator was created on, and the launch configuration
+  // derived from its CU count and the kernel occupancy.
+  int device = 0;
+  uint32_t max_grid = 0;
+
   uint8_t* dbuffer;
   uint8_t** dbuffer_list;
   hipIpcMemHandle_t buffer_ipc_handle;
   std::vector<hipIpcMemHandle_t> all_buffer_ipc_handles;
   std::vector<uint8_t*> buffer_list;
   uint32_t data_offset;
+  // All-to-all flags, between the two-shot flags and the data buffer, and
+  // the color of the next all-to-all launch.
+  uint32_t a2a_flags_offset = 0;
+  uint32_t a2a_max_chunks = 0;
+  std::atomic<uint32_t> a2a_color{1};
+  // Submission channels: the colors, and per channel its layout and the
+  // device list of its buffers on every rank. Channel 0 uses dbuffer_list.
+  SubmitChannels channels;
+  std::vector<ChannelLayout> channel_layouts;
+  std::vector<uint8_t**> channel_lists;
+  // Peer mappings are opened on first use, see open_peers, or by connect.
+  std::atomic<bool> peers_open{false};
+  std::mutex peers_mutex;
+  // Taken by the calls while capture, error telemetry or host staging is
+  // enabled.
+  std::mutex sampling_mutex;
+  // Outputs the peers write in Phase-2, see core/direct_output.h.
+  OutputRegistry output_registry;
+  AllreduceCapture capture;
+  // Call and byte counters, see host/metrics.h, and the device flag-wait
+  // ticks at the last reset.
+  CommMetrics metrics;
+  uint64_t flag_wait_ticks_base = 0;
+  ErrorTelemetry error_telemetry;
+  HostStaging host_staging;
 
     DeviceComms() : initialized(false), world_size(1), rank(0) {}
-    ~DeviceComms() { destroy(); }
+    ~DeviceComms() {
+      disable_capture();
+      disable_error_telemetry();
+      destroy();
+    }
 
-    void init(int world_size, int rank, std::optional<int64_t> max_problem_size);
+    // Allocates `num_channels` submission channels: the buffer grows by a
+    // copy of the two-shot flags and regions per channel past the first.
+    void init(int world_size, int rank, std::optional<int64_t> max_problem_size,
+              int num_channels = 1);
     int get_world_size() { return world_size; }
     int get_rank() { return rank; }
     bool status() { return initialized; }
     void destroy();
 
     hipIpcMemHandle_t const get_handle() { return buffer_ipc_handle; }
+    // Take the handles of the ranks; the mappings of previous handles are
+    // closed, and the new ones are opened by open_peers.
     void open_ipc_handles(std::vector<hipIpcMemHandle_t> const& ipc_handles);
+    // Exchange the IPC handles with the other ranks through a FileStore
+    // directory, which must be unique to the job, and select the transport.
+    // With AUTO, every rank maps its peers now, and the ranks fall back to
+    // the host-staged transport if any of them failed.
+    void connect(std::string const& rendezvous_path,
+                 Transport transport = Transport::PEER);
+    // Map the communication buffers of the peers, in parallel. Thread-safe.
+    // The mapping synchronizes the device, so it cannot run while `stream`
+    // captures a graph: map the peers before the capture, or run a
+    // collective first.
+    void open_peers(hipStream_t stream = nullptr);
+    // Unmap the buffers of the peers.
+    void close_peers();
+    // Map the buffers of the peers, or leave none mapped and return the
+    // error.
+    hipError_t map_peers();
+
+    // Collective: run the all-reduce through the shared host segment `name`
+    // with chunk slots of `slot_bytes`, instead of peer mappings. `nonce` is
+    // the same on every rank and unique to the run (see staged_nonce). The
+    // other collectives and registered outputs need peer mappings.
+    void enable_host_staging(std::string const& name, uint64_t nonce,
+                             int64_t slot_bytes =
+                                 StagedSegment::kDefaultSlotBytes);
+    void disable_host_staging();
+
+    // Handle of the output [ptr, ptr + bytes), to exchange with the peers.
+    OutputHandle get_output_handle(void* ptr, uint64_t bytes);
+    // Register the output [ptr, ptr + bytes) from the handles of every rank.
+    // Collective: every rank registers its output of the same size, in the
+    // same order, which the handles check. An all-reduce whose input is a
+    // registered output as a whole then has its result written in place by
+    // the peers. Invalidates the registrations overlapping the output.
+    void register_output(void* ptr, uint64_t bytes,
+                         std::vector<OutputHandle> const& handles);
+    // Collective: drop the registrations overlapping [ptr, ptr + bytes).
+    void unregister_output(void* ptr, uint64_t bytes);
+    DirectOutput direct_output(half* A, TensorLayout const& layout) const;
     void allreduce(half * A, uint32_t N, int quant_level,
-                 hipStream_t stream, bool cast_bf2half);
+                 hipStream_t stream, bool cast_bf2half,
+                 TileReadiness const& readiness = {},
+                 ReduceOp op = ReduceOp::SUM, int channel = 0) {
+      allreduce(A, dense_layout(N), quant_level, stream, cast_bf2half,
+                readiness, op, {}, channel);
+    }
+    // All-reduce of a 2-D strided input, gathered and scattered in place.
+    // Max and min always run with the fp16 codec, see core/reduce_op.h.
+    // With an enabled `mx` and an MX quant level, the result is written
+    // MX-encoded to `mx` instead of `A`, see core/mx_format.h. Calls on
+    // different channels may be submitted concurrently; the host-staged
+    // transport has channel 0 only.
+    void allreduce(half * A, TensorLayout const& layout, int quant_level,
+                 hipStream_t stream, bool cast_bf2half,
+                 TileReadiness const& readiness = {},
+                 ReduceOp op = ReduceOp::SUM, MxOutput const& mx = {},
+                 int channel = 0);
+
+    // Broadcast `A` from `root` to every rank, in place. quant_level selects
+    // the line codec of the payload; the root keeps its input as is.
+    void broadcast(half* A, uint32_t N, int root, int quant_level,
+                   hipStream_t stream) {
+      rooted(A, N, root, RootedCollective::BROADCAST, quant_level, stream,
+             ReduceOp::SUM);
+    }
+    // Reduce `A` of every rank into `A` of `root`. The other ranks keep their
+    // input.
+    void reduce(half* A, uint32_t N, int root, int quant_level,
+                hipStream_t stream, ReduceOp op = ReduceOp::SUM) {
+      rooted(A, N, root, RootedCollective::REDUCE, quant_level, stream, op);
+    }
+    void rooted(half* A, uint32_t N, int root, RootedCollective collective,
+                int quant_level, hipStream_t stream, ReduceOp op);
+
+    // One-pass all-to-all with variable splits: send_counts[r] elements of
+    // `send` go to rank r, recv_counts[r] elements of `recv` come from rank
+    // r. The counts must match between the ranks, be multiples of 8, and
+    // quant_level selects the line codec of the payload.
+    void all_to_all(half const* send, uint32_t const* send_counts, half* recv,
+                    uint32_t const* recv_counts, int quant_level,
+                    hipStream_t stream);
+
+    // Opt-in: sample the inputs of the all-reduce calls of this rank into
+    // the trace at `path` (created at `capacity` bytes, or appended to).
+    void enable_capture(std::string const& path, uint64_t capacity,
+                        TraceSampler const& sampler);
+    // Append the sample in flight, if any, and close the trace.
+    void disable_capture();
+    // Start the copy of a sample of the input, if the call is due for one.
+    void capture_input(half const* A, TensorLayout const& layout,
+                       int quant_level, ReduceOp op, hipStream_t stream);
+    // Append the sample in flight once its copy completed, or wait for it.
+    void flush_capture(bool wait);
+
+    // Opt-in: measure the codec errors on every tile_every-th tile of every
+    // sample_every-th all-reduce call, and let `policy` raise the precision
+    // of the codecs whose error exceeds its threshold.
+    void enable_error_telemetry(uint32_t sample_every, uint32_t tile_every,
+                                CodecPolicyConfig const& policy);
+    void disable_error_telemetry();
+    // Account the records whose copy completed, or wait for all of them.
+    void poll_error_telemetry(bool wait);
+    // Codec steps this rank proposes per requested level, see
+    // host/codec_policy.h.
+    std::vector<int32_t> codec_policy_proposal();
+    // Collective: run the agreed steps from the next call on. Every rank
+    // passes the max of the proposals, between the same two calls.
+    void apply_codec_policy(std::vector<int32_t> const& steps);
+    // Telemetry of the call if it is sampled: clears a record on `stream`.
+    QuantErrorTelemetry begin_error_sample(int requested_level, int ran_level,
+                                           hipStream_t stream);
+    // Copy the record of a sampled call behind its kernel.
+    void end_error_sample(QuantErrorTelemetry const& sample,
+                          hipStream_t stream);
+
+    // Counters of the all-reduce calls since init or the last reset.
+    MetricsSnapshot metrics_snapshot();
+    void reset_metrics();
+
+    // Stream-ordered write of `epoch` into flags [first, first + count).
+    static void signal_ready(uint32_t* flags, uint32_t first, uint32_t count,
+                             uint32_t epoch, hipStream_t stream);
 };
 
 }  // namespace quickreduce
\ No newline at end of file
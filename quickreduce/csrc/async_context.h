@@ -0,0 +1,151 @@
+#pragma once
+
+#include <torch/extension.h>
+#include <ATen/core/ivalue.h>
+#include <hip/hip_runtime_api.h>
+
+#include <mutex>
+#include <thread>
+
+#include "quickreduce.h"
+#include "host/async_pool.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Per-communicator state of allreduce_async.
+
+Operation:
+    The fp16 staging tensor of a bf16/fp32 all-reduce comes from a workspace
+    per size class, the completion event from a fixed pool, and a single
+    completion thread marks the futures done in submission order. In steady
+    state a call allocates no device memory, no event and no thread; what is
+    left on the heap is tensor metadata and the future handed back to the
+    caller, which cannot be recycled since the caller may hold on to it.
+
+    A workspace is reused in stream order. When a call runs on another
+    stream than the previous user of the workspace, it first waits for the
+    event recorded at the end of that use.
+
+    Several threads may submit to one context. The event pool and the queue
+    are synchronized; the workspaces are not, so a call holds
+    lock_workspaces() from acquire_workspace to release_workspace. Calls
+    without a workspace (fp16 inputs) do not take it.
+*/
+class AsyncContext {
+ public:
+  static constexpr int kMaxInFlight = 64;
+
+  explicit AsyncContext(int device)
+      : device_(device), worker_([this] { run(); }) {}
+
+  ~AsyncContext() {
+    queue_.close();
+    worker_.join();
+    events_.destroy_all([](hipEvent_t& event) { hipEventDestroy(event); });
+    workspaces_.clear();
+  }
+
+  AsyncContext(AsyncContext const&) = delete;
+  AsyncContext& operator=(AsyncContext const&) = delete;
+
+  // Held by a submitting thread while it uses a workspace.
+  std::unique_lock<std::mutex> lock_workspaces() {
+    return std::unique_lock<std::mutex>(workspaces_mutex_);
+  }
+
+  // fp16 staging tensor of `numel` elements, ordered after its previous use.
+  at::Tensor& acquire_workspace(int64_t numel, hipStream_t stream) {
+    Workspace& w = workspace(numel);
+    if (w.stream != nullptr && w.stream != stream) {
+      HIP_CHECK(hipStreamWaitEvent(stream, w.released, 0));
+    }
+    if (!w.view.defined() || w.view.numel() != numel) {
+      w.view = w.buffer.narrow(0, 0, numel);
+    }
+    return w.view;
+  }
+
+  void release_workspace(int64_t numel, hipStream_t stream) {
+    Workspace& w = workspace(numel);
+    HIP_CHECK(hipEventRecord(w.released, stream));
+    w.stream = stream;
+  }
+
+  // Complete `future` with `result` once the work enqueued on `stream` is
+  // done.
+  void complete_on(hipStream_t stream,
+                   c10::intrusive_ptr<c10::ivalue::Future> future,
+                   at::Tensor result) {
+    int index = events_.acquire([] { return create_event(); });
+    HIP_CHECK(hipEventRecord(events_[index], stream));
+    queue_.push(Pending{index, std::move(future), std::move(result)});
+  }
+
+ private:
+  struct Workspace {
+    at::Tensor buffer;
+    at::Tensor view;
+    hipEvent_t released = nullptr;
+    hipStream_t stream = nullptr;
+
+    Workspace(at::Tensor b) : buffer(std::move(b)), released(create_event()) {}
+    Workspace(Workspace&& o) noexcept
+        : buffer(std::move(o.buffer)),
+          view(std::move(o.view)),
+          released(std::exchange(o.released, nullptr)),
+          stream(o.stream) {}
+    ~Workspace() {
+      if (released != nullptr) hipEventDestroy(released);
+    }
+  };
+
+  struct Pending {
+    int event = -1;
+    c10::intrusive_ptr<c10::ivalue::Future> future;
+    at::Tensor result;
+  };
+
+  static hipEvent_t create_event() {
+    hipEvent_t event;
+    HIP_CHECK(hipEventCreateWithFlags(&event, hipEventDisableTiming));
+    return event;
+  }
+
+  Workspace& workspace(int64_t numel) {
+    return workspaces_.get(numel * sizeof(at::Half), [&](int64_t bytes) {
+      auto options =
+          at::TensorOptions().dtype(at::kHalf).device(at::kCUDA, device_);
+      return Workspace(
+          at::empty({bytes / static_cast<int64_t>(sizeof(at::Half))}, options));
+    });
+  }
+
+  void run() {
+    hipSetDevice(device_);
+    Pending pending;
+    while (queue_.pop(pending)) {
+      hipError_t err = hipEventSynchronize(events_[pending.event]);
+      events_.release(pending.event);
+      if (err == hipSuccess) {
+        pending.future->markCompleted(c10::IValue(pending.result));
+      } else {
+        pending.future->setError(std::make_exception_ptr(std::runtime_error(
+            std::string("quick allreduce failed: ") + hipGetErrorString(err))));
+      }
+      pending = Pending();
+    }
+  }
+
+  int device_;
+  std::mutex workspaces_mutex_;
+  WorkspaceCache<Workspace> workspaces_;
+  ObjectPool<hipEvent_t, kMaxInFlight> events_;
+  CompletionQueue<Pending, kMaxInFlight> queue_;
+  // Started last: the completion thread uses the members above.
+  std::thread worker_;
+};
+
+}  // namespace quickreduce
@@ -0,0 +1,324 @@
+#include "backend.h"
+#include "device.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <random>
+
+namespace quickreduce {
+
+// ============================================================
+// WORK
+// ============================================================
+QuickReduceWork::QuickReduceWork(int rank, c10d::OpType op_type,
+                                 std::vector<at::Tensor> outputs)
+    : c10d::Work(rank, op_type), outputs_(std::move(outputs)) {
+  std::vector<c10::Device> devices;
+  if (!outputs_.empty() && outputs_[0].is_cuda()) {
+    devices.push_back(outputs_[0].device());
+  }
+  future_ = c10::make_intrusive<c10::ivalue::Future>(
+      c10::ListType::create(c10::TensorType::get()), devices);
+  future_->markCompleted(c10::IValue(outputs_));
+}
+
+// ============================================================
+// BACKEND
+// ============================================================
+QuickReduceBackend::QuickReduceBackend(
+    c10::intrusive_ptr<c10d::Store> const& store, int rank, int size,
+    BackendPolicy policy, c10::intrusive_ptr<c10d::Backend> device_fallback,
+    c10::intrusive_ptr<c10d::Backend> host_fallback)
+    : c10d::Backend(rank, size),
+      store_(store),
+      policy_(policy),
+      device_fallback_(std::move(device_fallback)),
+      host_fallback_(std::move(host_fallback)) {}
+
+QuickReduceBackend::~QuickReduceBackend() = default;
+
+c10::intrusive_ptr<c10d::Backend> QuickReduceBackend::create(
+    c10::intrusive_ptr<c10d::Store> const& store, int rank, int size,
+    BackendPolicy policy,
+    std::optional<c10::intrusive_ptr<c10d::Backend>> device_fallback,
+    std::optional<c10::intrusive_ptr<c10d::Backend>> host_fallback) {
+  return c10::make_intrusive<QuickReduceBackend>(
+      store, rank, size, policy,
+      device_fallback.value_or(c10::intrusive_ptr<c10d::Backend>()),
+      host_fallback.value_or(c10::intrusive_ptr<c10d::Backend>()));
+}
+
+// -------------------------------------------------------------
+// Routing
+static std::optional<ReduceOp> device_reduce_op(c10d::ReduceOp const& op) {
+  switch (op) {
+    case c10d::ReduceOp::SUM:
+      return ReduceOp::SUM;
+    case c10d::ReduceOp::MAX:
+      return ReduceOp::MAX;
+    case c10d::ReduceOp::MIN:
+      return ReduceOp::MIN;
+    case c10d::ReduceOp::AVG:
+      return ReduceOp::MEAN;
+    default:
+      return std::nullopt;
+  }
+}
+
+bool QuickReduceBackend::use_device(at::Tensor const& t,
+                                    c10d::ReduceOp const& op,
+                                    int64_t bytes) const {
+  int world_size = getSize();
+  if (world_size != 2 && world_size != 4 && world_size != 8) return false;
+  if (!t.is_cuda() || !tensor_layout(t).has_value()) return false;
+  if (!device_reduce_op(op).has_value()) return false;
+  bool dtype_ok = t.scalar_type() == at::kHalf ||
+                  (policy_.cast_bf16 && t.scalar_type() == at::kBFloat16);
+  return dtype_ok && bytes >= policy_.min_bytes && bytes <= policy_.max_bytes;
+}
+
+bool QuickReduceBackend::use_host(at::Tensor const& t,
+                                  c10d::ReduceOp const& op) const {
+  return t.device().is_cpu() && t.is_contiguous() &&
+         op == c10d::ReduceOp::SUM && !t.is_complex() &&
+         t.scalar_type() != at::kBool;
+}
+
+c10d::Backend& QuickReduceBackend::fallback(at::Tensor const& t) {
+  auto& backend = t.is_cuda() ? device_fallback_ : host_fallback_;
+  TORCH_CHECK(backend, "quickreduce: no fallback backend for ",
+              t.device().type(), " tensors of this collective");
+  return *backend;
+}
+
+// -------------------------------------------------------------
+// Communicators
+DeviceComms& QuickReduceBackend::device_comms(at::Tensor const& t) {
+  if (device_comms_) return *device_comms_;
+  c10::cuda::CUDAGuard guard(t.device());
+  auto comms = std::make_unique<DeviceComms>();
+  comms->init(getSize(), getRank(), std::nullopt);
+
+  // Exchange the IPC handles of the communication buffers through the store.
+  hipIpcMemHandle_t handle = comms->get_handle();
+  std::vector<uint8_t> bytes(sizeof(handle));
+  std::memcpy(bytes.data(), &handle, sizeof(handle));
+  store_->set("quickreduce/ipc/" + std::to_string(getRank()), bytes);
+
+  std::vector<hipIpcMemHandle_t> handles(getSize());
+  for (int r = 0; r < getSize(); r++) {
+    auto value = store_->get("quickreduce/ipc/" + std::to_string(r));
+    TORCH_CHECK(value.size() == sizeof(hipIpcMemHandle_t),
+                "quickreduce: bad IPC handle from rank ", r);
+    std::memcpy(&handles[r], value.data(), sizeof(hipIpcMemHandle_t));
+  }
+  comms->open_ipc_handles(handles);
+  device_comms_ = std::move(comms);
+  return *device_comms_;
+}
+
+HostComms& QuickReduceBackend::host_comms() {
+  if (host_comms_) return *host_comms_;
+  // Rank 0 names the shared-memory segment.
+  if (getRank() == 0) {
+    std::random_device rd;
+    std::string name = "/quickreduce_" + std::to_string(getpid()) + "_" +
+                       std::to_string(rd());
+    store_->set("quickreduce/shm",
+                std::vector<uint8_t>(name.begin(), name.end()));
+  }
+  auto value = store_->get("quickreduce/shm");
+  host_comms_ = std::make_unique<HostComms>(
+      std::string(value.begin(), value.end()), getSize(), getRank(),
+      policy_.host_slot_bytes);
+  return *host_comms_;
+}
+
+// -------------------------------------------------------------
+// Collectives
+void QuickReduceBackend::device_allreduce(at::Tensor& t,
+                                          c10d::ReduceOp const& op) {
+  DeviceComms& comms = device_comms(t);
+  ReduceOp reduce_op = device_reduce_op(op).value();
+  c10::cuda::CUDAGuard guard(t.device());
+  auto stream = at::cuda::getCurrentCUDAStream();
+  TORCH_CHECK_LE(t.numel(), comms.kMaxProblemSize);
+  if (t.scalar_type() == at::kHalf) {
+    comms.allreduce(reinterpret_cast<half*>(t.data_ptr()),
+                    tensor_layout(t).value(), policy_.quant_level, stream,
+                    false, {}, reduce_op);
+  } else {
+    at::Tensor t_fp16 = t.to(at::kHalf);
+    comms.allreduce(reinterpret_cast<half*>(t_fp16.data_ptr()),
+                    t_fp16.numel(), policy_.quant_level, stream, false, {},
+                    reduce_op);
+    t.copy_(t_fp16);
+  }
+}
+
+void QuickReduceBackend::host_allreduce(at::Tensor& t) {
+  HostComms& comms = host_comms();
+  AT_DISPATCH_ALL_TYPES_AND2(
+      at::kHalf, at::kBFloat16, t.scalar_type(), "quickreduce_host", [&] {
+        comms.allreduce(t.data_ptr<scalar_t>(), t.numel());
+      });
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::allreduce(
+    std::vector<at::Tensor>& tensors, const c10d::AllreduceOptions& opts) {
+  TORCH_CHECK(!tensors.empty(), "quickreduce: allreduce of no tensors");
+  at::Tensor& t = tensors[0];
+  if (tensors.size() == 1 && use_device(t, opts.reduceOp, t.nbytes())) {
+    device_allreduce(t, opts.reduceOp);
+  } else if (tensors.size() == 1 && use_host(t, opts.reduceOp)) {
+    host_allreduce(t);
+  } else {
+    return fallback(t).allreduce(tensors, opts);
+  }
+  return c10::make_intrusive<QuickReduceWork>(getRank(),
+                                              c10d::OpType::ALLREDUCE, tensors);
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::_reduce_scatter_base(
+    at::Tensor& output, at::Tensor& input,
+    const c10d::ReduceScatterOptions& opts) {
+  TORCH_CHECK(input.numel() == output.numel() * getSize(),
+              "quickreduce: reduce_scatter input must be world_size x output");
+  bool same_type = input.scalar_type() == output.scalar_type();
+  if (same_type && policy_.device_reduce_scatter &&
+      use_device(input, opts.reduceOp, input.nbytes())) {
+    at::Tensor buffer = input.clone(at::MemoryFormat::Contiguous);
+    device_allreduce(buffer, opts.reduceOp);
+    output.copy_(buffer.chunk(getSize())[getRank()].view_as(output));
+  } else if (same_type && use_host(input, opts.reduceOp) &&
+             output.is_contiguous()) {
+    HostComms& comms = host_comms();
+    AT_DISPATCH_ALL_TYPES_AND2(
+        at::kHalf, at::kBFloat16, input.scalar_type(), "quickreduce_host", [&] {
+          comms.reduce_scatter(input.data_ptr<scalar_t>(),
+                               output.data_ptr<scalar_t>(), output.numel());
+        });
+  } else {
+    return fallback(input)._reduce_scatter_base(output, input, opts);
+  }
+  return c10::make_intrusive<QuickReduceWork>(
+      getRank(), c10d::OpType::_REDUCE_SCATTER_BASE,
+      std::vector<at::Tensor>{output});
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::reduce_scatter(
+    std::vector<at::Tensor>& outputs,
+    std::vector<std::vector<at::Tensor>>& inputs,
+    const c10d::ReduceScatterOptions& opts) {
+  TORCH_CHECK(outputs.size() == 1 && inputs.size() == 1,
+              "quickreduce: one output tensor per rank is supported");
+  at::Tensor& output = outputs[0];
+  bool device = policy_.device_reduce_scatter &&
+                use_device(output, opts.reduceOp, output.nbytes() * getSize());
+  if (!device && !use_host(output, opts.reduceOp)) {
+    return fallback(output).reduce_scatter(outputs, inputs, opts);
+  }
+  std::vector<at::Tensor> flat;
+  for (auto const& t : inputs[0]) flat.push_back(t.reshape(-1));
+  at::Tensor input = at::cat(flat);
+  return _reduce_scatter_base(output, input, opts);
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::_allgather_base(
+    at::Tensor& output, at::Tensor& input,
+    const c10d::AllgatherOptions& opts) {
+  TORCH_CHECK(output.numel() == input.numel() * getSize(),
+              "quickreduce: allgather output must be world_size x input");
+  if (input.device().is_cpu() && input.is_contiguous() &&
+      output.is_contiguous() && input.scalar_type() == output.scalar_type()) {
+    host_comms().all_gather(input.data_ptr(), output.data_ptr(),
+                            input.nbytes());
+    return c10::make_intrusive<QuickReduceWork>(
+        getRank(), c10d::OpType::_ALLGATHER_BASE,
+        std::vector<at::Tensor>{output});
+  }
+  return fallback(input)._allgather_base(output, input, opts);
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::allgather(
+    std::vector<std::vector<at::Tensor>>& outputs,
+    std::vector<at::Tensor>& inputs, const c10d::AllgatherOptions& opts) {
+  TORCH_CHECK(outputs.size() == 1 && inputs.size() == 1,
+              "quickreduce: one input tensor per rank is supported");
+  at::Tensor& input = inputs[0];
+  if (!input.device().is_cpu() || !input.is_contiguous()) {
+    return fallback(input).allgather(outputs, inputs, opts);
+  }
+  at::Tensor output = at::empty({getSize() * input.numel()}, input.options());
+  _allgather_base(output, input, opts);
+  auto chunks = output.chunk(getSize());
+  for (int r = 0; r < getSize(); r++) {
+    outputs[0][r].copy_(chunks[r].view_as(outputs[0][r]));
+  }
+  return c10::make_intrusive<QuickReduceWork>(
+      getRank(), c10d::OpType::ALLGATHER, outputs[0]);
+}
+
+// -------------------------------------------------------------
+// Fallback
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::allreduce_coalesced(
+    std::vector<at::Tensor>& tensors,
+    const c10d::AllreduceCoalescedOptions& opts) {
+  return fallback(tensors.at(0)).allreduce_coalesced(tensors, opts);
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::broadcast(
+    std::vector<at::Tensor>& tensors, const c10d::BroadcastOptions& opts) {
+  return fallback(tensors.at(0)).broadcast(tensors, opts);
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::reduce(
+    std::vector<at::Tensor>& tensors, const c10d::ReduceOptions& opts) {
+  return fallback(tensors.at(0)).reduce(tensors, opts);
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::gather(
+    std::vector<std::vector<at::Tensor>>& outputs,
+    std::vector<at::Tensor>& inputs, const c10d::GatherOptions& opts) {
+  return fallback(inputs.at(0)).gather(outputs, inputs, opts);
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::scatter(
+    std::vector<at::Tensor>& outputs,
+    std::vector<std::vector<at::Tensor>>& inputs,
+    const c10d::ScatterOptions& opts) {
+  return fallback(outputs.at(0)).scatter(outputs, inputs, opts);
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::alltoall_base(
+    at::Tensor& output, at::Tensor& input,
+    std::vector<int64_t>& output_split_sizes,
+    std::vector<int64_t>& input_split_sizes,
+    const c10d::AllToAllOptions& opts) {
+  return fallback(input).alltoall_base(output, input, output_split_sizes,
+                                       input_split_sizes, opts);
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::send(
+    std::vector<at::Tensor>& tensors, int dst_rank, int tag) {
+  return fallback(tensors.at(0)).send(tensors, dst_rank, tag);
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::recv(
+    std::vector<at::Tensor>& tensors, int src_rank, int tag) {
+  return fallback(tensors.at(0)).recv(tensors, src_rank, tag);
+}
+
+c10::intrusive_ptr<c10d::Work> QuickReduceBackend::barrier(
+    const c10d::BarrierOptions& opts) {
+  if (device_fallback_) return device_fallback_->barrier(opts);
+  if (host_fallback_) return host_fallback_->barrier(opts);
+  host_comms().barrier();
+  return c10::make_intrusive<QuickReduceWork>(getRank(), c10d::OpType::BARRIER,
+                                              std::vector<at::Tensor>{});
+}
+
+}  // namespace quickreduce
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <torch/extension.h>
+#include <torch/csrc/distributed/c10d/Backend.hpp>
+#include <torch/csrc/distributed/c10d/Store.hpp>
+#include <torch/csrc/distributed/c10d/Work.hpp>
+
+#include <chrono>
+#include <memory>
+#include <optional>
+
+#include "quickreduce.h"
+#include "host/host_comms.h"
+
+namespace quickreduce {
+
+/*
+===============================================================
+Desc:
+    Routing policy of the torch.distributed backend.
+
+Operation:
+    A collective runs on QuickReduce when its tensor is a single CUDA fp16
+    tensor (bf16 with `cast_bf16`) with a layout the kernel can address (see
+    tensor_layout), the op is a sum, max, min or average, and its size is
+    within [min_bytes, max_bytes]. Max and min run with the fp16 codec. CPU sums of any arithmetic type use the
+    host shared-memory path. Everything else goes to the fallback backend.
+
+    bf16 is opt-in: the kernel reduces fp16, so a cast bf16 tensor loses 3
+    bits of exponent range and saturates above 65504. By default bf16
+    all-reduces go to the fallback backend.
+
+    There is no device reduce-scatter kernel: with `device_reduce_scatter` a
+    reduce-scatter runs as an all-reduce of the whole input, which only pays
+    off when the codec sends less than half of the fp16 bytes (Q4, Q6, top-k).
+    All-gather always uses the fallback on the device.
+*/
+struct BackendPolicy {
+  int64_t quant_level = 0;
+  int64_t min_bytes = 0;
+  int64_t max_bytes = std::numeric_limits<int32_t>::max();
+  bool cast_bf16 = false;  // run bf16 through an fp16 cast, see above
+  bool device_reduce_scatter = false;
+  int64_t host_slot_bytes = HostComms::kDefaultSlotBytes;
+};
+
+// Work of an operation that is enqueued on the current stream (device) or
+// already done (host). The future is completed on enqueue; being a CUDA
+// future, its consumers synchronize with the current stream.
+class QuickReduceWork : public c10d::Work {
+ public:
+  QuickReduceWork(int rank, c10d::OpType op_type,
+                  std::vector<at::Tensor> outputs);
+
+  bool isCompleted() override { return true; }
+  bool wait(std::chrono::milliseconds timeout) override { return true; }
+  std::vector<at::Tensor> result() override { return outputs_; }
+  c10::intrusive_ptr<c10::ivalue::Future> getFuture() override {
+    return future_;
+  }
+
+ private:
+  std::vector<at::Tensor> outputs_;
+  c10::intrusive_ptr<c10::ivalue::Future> future_;
+};
+
+class QuickReduceBackend : public c10d::Backend {
+ public:
+  QuickReduceBackend(c10::intrusive_ptr<c10d::Store> const& store, int rank,
+                     int size, BackendPolicy policy,
+                     c10::intrusive_ptr<c10d::Backend> device_fallback,
+                     c10::intrusive_ptr<c10d::Backend> host_fallback);
+  ~QuickReduceBackend() override;
+
+  const std::string getBackendName() const override { return "quickreduce"; }
+
+  c10::intrusive_ptr<c10d::Work> allreduce(
+      std::vector<at::Tensor>& tensors,
+      const c10d::AllreduceOptions& opts) override;
+
+  c10::intrusive_ptr<c10d::Work> reduce_scatter(
+      std::vector<at::Tensor>& outputs,
+      std::vector<std::vector<at::Tensor>>& inputs,
+      const c10d::ReduceScatterOptions& opts) override;
+
+  c10::intrusive_ptr<c10d::Work> _reduce_scatter_base(
+      at::Tensor& output, at::Tensor& input,
+      const c10d::ReduceScatterOptions& opts) override;
+
+  c10::intrusive_ptr<c10d::Work> allgather(
+      std::vector<std::vector<at::Tensor>>& outputs,
+      std::vector<at::Tensor>& inputs,
+      const c10d::AllgatherOptions& opts) override;
+
+  c10::intrusive_ptr<c10d::Work> _allgather_base(
+      at::Tensor& output, at::Tensor& input,
+      const c10d::AllgatherOptions& opts) override;
+
+  // Forwarded to the fallback backend.
+  c10::intrusive_ptr<c10d::Work> allreduce_coalesced(
+      std::vector<at::Tensor>& tensors,
+      const c10d::AllreduceCoalescedOptions& opts) override;
+  c10::intrusive_ptr<c10d::Work> broadcast(
+      std::vector<at::Tensor>& tensors,
+      const c10d::BroadcastOptions& opts) override;
+  c10::intrusive_ptr<c10d::Work> reduce(
+      std::vector<at::Tensor>& tensors,
+      const c10d::ReduceOptions& opts) override;
+  c10::intrusive_ptr<c10d::Work> gather(
+      std::vector<std::vector<at::Tensor>>& outputs,
+      std::vector<at::Tensor>& inputs,
+      const c10d::GatherOptions& opts) override;
+  c10::intrusive_ptr<c10d::Work> scatter(
+      std::vector<at::Tensor>& outputs,
+      std::vector<std::vector<at::Tensor>>& inputs,
+      const c10d::ScatterOptions& opts) override;
+  c10::intrusive_ptr<c10d::Work> alltoall_base(
+      at::Tensor& output, at::Tensor& input,
+      std::vector<int64_t>& output_split_sizes,
+      std::vector<int64_t>& input_split_sizes,
+      const c10d::AllToAllOptions& opts) override;
+  c10::intrusive_ptr<c10d::Work> send(std::vector<at::Tensor>& tensors,
+                                      int dst_rank, int tag) override;
+  c10::intrusive_ptr<c10d::Work> recv(std::vector<at::Tensor>& tensors,
+                                      int src_rank, int tag) override;
+  c10::intrusive_ptr<c10d::Work> barrier(
+      const c10d::BarrierOptions& opts) override;
+
+  // Entry point of torch.distributed.Backend.register_backend.
+  static c10::intrusive_ptr<c10d::Backend> create(
+      c10::intrusive_ptr<c10d::Store> const& store, int rank, int size,
+      BackendPolicy policy,
+      std::optional<c10::intrusive_ptr<c10d::Backend>> device_fallback,
+      std::optional<c10::intrusive_ptr<c10d::Backend>> host_fallback);
+
+ private:
+  c10::intrusive_ptr<c10d::Store> store_;
+  BackendPolicy policy_;
+  c10::intrusive_ptr<c10d::Backend> device_fallback_;
+  c10::intrusive_ptr<c10d::Backend> host_fallback_;
+
+  // Created on the first collective that uses them. Creation is collective:
+  // every rank routes the same collectives, so they all get here together.
+  std::unique_ptr<DeviceComms> device_comms_;
+  std::unique_ptr<HostComms> host_comms_;
+
+  bool use_device(at::Tensor const& t, c10d::ReduceOp const& op,
+                  int64_t bytes) const;
+  bool use_host(at::Tensor const& t, c10d::ReduceOp const& op) const;
+  DeviceComms& device_comms(at::Tensor const& t);
+  HostComms& host_comms();
+
+  void device_allreduce(at::Tensor& t, c10d::ReduceOp const& op);
+  void host_allreduce(at::Tensor& t);
+
+  c10d::Backend& fallback(at::Tensor const& t);
+};
+
+}  // namespace quickreduce
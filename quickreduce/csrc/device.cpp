@@ -2,22 +2,80 @@
 #include <utility>   
 #include <thread>   
 #include <exception> 
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "async_context.h"
 
+namespace {
 
-quickreduce::fptr_t init(int world_size, int rank, std::optional<int64_t> qr_max) {
+// allreduce_async state, keyed by communicator.
+std::mutex async_contexts_mutex;
+std::unordered_map<quickreduce::fptr_t,
+                   std::unique_ptr<quickreduce::AsyncContext>> async_contexts;
+
+quickreduce::AsyncContext& async_context(quickreduce::fptr_t fa, int device) {
+  std::lock_guard<std::mutex> lock(async_contexts_mutex);
+  auto& ctx = async_contexts[fa];
+  if (!ctx) ctx = std::make_unique<quickreduce::AsyncContext>(device);
+  return *ctx;
+}
+
+// Registered outputs, keyed by communicator and address. Holding the tensors
+// keeps their memory from being reused while the peers may write it.
+std::mutex registered_outputs_mutex;
+std::unordered_map<quickreduce::fptr_t, std::map<uintptr_t, at::Tensor>>
+    registered_outputs;
+
+// Drop the tensors overlapping [ptr, ptr + bytes), or all of them.
+void release_registered_outputs(quickreduce::fptr_t fa, uintptr_t ptr = 0,
+                                uint64_t bytes = UINTPTR_MAX) {
+  std::lock_guard<std::mutex> lock(registered_outputs_mutex);
+  auto& tensors = registered_outputs[fa];
+  for (auto it = tensors.begin(); it != tensors.end();) {
+    uintptr_t base = it->first;
+    if (base < ptr + bytes && ptr < base + it->second.nbytes()) {
+      it = tensors.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (tensors.empty()) registered_outputs.erase(fa);
+}
+
+void release_async_context(quickreduce::fptr_t fa) {
+  std::unique_ptr<quickreduce::AsyncContext> ctx;
+  {
+    std::lock_guard<std::mutex> lock(async_contexts_mutex);
+    auto it = async_contexts.find(fa);
+    if (it == async_contexts.end()) return;
+    ctx = std::move(it->second);
+    async_contexts.erase(it);
+  }
+}
+
+}  // namespace
+
+
+quickreduce::fptr_t init(int world_size, int rank, std::optional<int64_t> qr_max,
+                         int64_t channels) {
   if (world_size > 8)  throw std::invalid_argument("world size > 8 is not supported");
   if (world_size == 6) throw std::invalid_argument("world size == 6 is not supported");
   if (world_size % 2 != 0) throw std::invalid_argument("Odd num gpus is not supported for now");
   if (rank < 0 || rank >= world_size) throw std::invalid_argument("invalid rank passed in");
   auto* fptr = new quickreduce::DeviceComms();
-  fptr->init(world_size, rank, qr_max);
+  fptr->init(world_size, rank, qr_max, static_cast<int>(channels));
   return reinterpret_cast<quickreduce::fptr_t>(fptr);
 }
 
 void destroy(quickreduce::fptr_t _fa) {
   if (_fa) {
     auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+    // Drains the pending futures before the buffers go away.
+    release_async_context(_fa);
     fa->destroy();
+    release_registered_outputs(_fa);
     delete fa;
   }
 }
@@ -43,29 +101,249 @@ void open_handles(quickreduce::fptr_t _fa, const std::vector<torch::Tensor>& han
   fa->open_ipc_handles(ipc_handles);
 }
 
+void open_peers(quickreduce::fptr_t _fa) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  fa->open_peers(at::cuda::getCurrentCUDAStream());
+}
+
+static quickreduce::Transport transport_from_name(std::string const& name) {
+  if (name == "auto") return quickreduce::Transport::AUTO;
+  if (name == "peer") return quickreduce::Transport::PEER;
+  if (name == "host_staged") return quickreduce::Transport::HOST_STAGED;
+  TORCH_CHECK(false, "unknown transport '", name,
+              "', expected auto, peer or host_staged");
+}
+
+void connect(quickreduce::fptr_t _fa, const std::string& rendezvous_path,
+             std::string const& transport) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  fa->connect(rendezvous_path, transport_from_name(transport));
+}
+
+void enable_host_staging(quickreduce::fptr_t _fa, std::string const& name,
+                         uint64_t nonce, int64_t slot_bytes) {
+  TORCH_CHECK(nonce != 0, "nonce must not be 0");
+  TORCH_CHECK(slot_bytes > 0 && slot_bytes % 64 == 0 &&
+                  slot_bytes <= std::numeric_limits<uint32_t>::max(),
+              "slot_bytes must be a positive multiple of 64 below 4 GiB");
+  reinterpret_cast<quickreduce::DeviceComms*>(_fa)->enable_host_staging(
+      name, nonce, slot_bytes);
+}
+
+void disable_host_staging(quickreduce::fptr_t _fa) {
+  reinterpret_cast<quickreduce::DeviceComms*>(_fa)->disable_host_staging();
+}
+
+static void check_output(at::Tensor const& tensor) {
+  TORCH_CHECK(tensor.is_cuda() && tensor.is_contiguous(),
+              "registered outputs must be contiguous device tensors");
+}
+
+torch::Tensor get_output_handle(quickreduce::fptr_t _fa,
+                                at::Tensor const& tensor) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  check_output(tensor);
+  at::cuda::OptionalCUDAGuard guard(tensor.device());
+  quickreduce::OutputHandle handle =
+      fa->get_output_handle(tensor.data_ptr(), tensor.nbytes());
+  auto options = torch::TensorOptions().dtype(torch::kUInt8).device(torch::kCPU);
+  auto data = torch::empty({static_cast<int64_t>(sizeof(handle))}, options);
+  std::memcpy(data.data_ptr(), &handle, sizeof(handle));
+  return data;
+}
+
+void register_output(quickreduce::fptr_t _fa, at::Tensor const& tensor,
+                     const std::vector<torch::Tensor>& handles) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  check_output(tensor);
+  std::vector<quickreduce::OutputHandle> output_handles(handles.size());
+  for (size_t i = 0; i < handles.size(); i++) {
+    TORCH_CHECK(handles[i].nbytes() == sizeof(quickreduce::OutputHandle),
+                "invalid output handle");
+    std::memcpy(&output_handles[i], handles[i].data_ptr(),
+                sizeof(quickreduce::OutputHandle));
+  }
+  at::cuda::OptionalCUDAGuard guard(tensor.device());
+  fa->register_output(tensor.data_ptr(), tensor.nbytes(), output_handles);
+
+  auto ptr = reinterpret_cast<uintptr_t>(tensor.data_ptr());
+  release_registered_outputs(_fa, ptr, tensor.nbytes());
+  std::lock_guard<std::mutex> lock(registered_outputs_mutex);
+  registered_outputs[_fa][ptr] = tensor;
+}
+
+void unregister_output(quickreduce::fptr_t _fa, at::Tensor const& tensor) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  at::cuda::OptionalCUDAGuard guard(tensor.device());
+  fa->unregister_output(tensor.data_ptr(), tensor.nbytes());
+  release_registered_outputs(_fa, reinterpret_cast<uintptr_t>(tensor.data_ptr()),
+                             tensor.nbytes());
+}
+
+void enable_capture(quickreduce::fptr_t _fa, std::string const& path,
+                    int64_t capacity, int64_t sample_every,
+                    int64_t max_elements) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  TORCH_CHECK(capacity > 0 && sample_every > 0 && max_elements > 0,
+              "capture needs a positive capacity, period and sample size");
+  quickreduce::TraceSampler sampler;
+  sampler.sample_every = static_cast<uint64_t>(sample_every);
+  sampler.max_elements = static_cast<uint64_t>(max_elements);
+  fa->enable_capture(path, static_cast<uint64_t>(capacity), sampler);
+}
+
+void disable_capture(quickreduce::fptr_t _fa) {
+  reinterpret_cast<quickreduce::DeviceComms*>(_fa)->disable_capture();
+}
+
+void enable_error_telemetry(quickreduce::fptr_t _fa, int64_t sample_every,
+                            int64_t tile_every, double max_relative_rmse,
+                            int64_t escalate_after, int64_t relax_after) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  TORCH_CHECK(sample_every > 0 && tile_every > 0,
+              "error telemetry needs a positive sampling");
+  TORCH_CHECK(max_relative_rmse >= 0.0 && escalate_after > 0 &&
+                  relax_after > 0,
+              "invalid error policy");
+  quickreduce::CodecPolicyConfig policy;
+  policy.max_relative_rmse = max_relative_rmse;
+  policy.escalate_after = static_cast<uint32_t>(escalate_after);
+  policy.relax_after = static_cast<uint32_t>(relax_after);
+  fa->enable_error_telemetry(static_cast<uint32_t>(sample_every),
+                             static_cast<uint32_t>(tile_every), policy);
+}
+
+void disable_error_telemetry(quickreduce::fptr_t _fa) {
+  reinterpret_cast<quickreduce::DeviceComms*>(_fa)->disable_error_telemetry();
+}
+
+torch::Tensor codec_policy_proposal(quickreduce::fptr_t _fa) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  std::vector<int32_t> steps = fa->codec_policy_proposal();
+  auto options = torch::TensorOptions().dtype(torch::kInt32).device(torch::kCPU);
+  auto tensor = torch::empty({static_cast<int64_t>(steps.size())}, options);
+  std::memcpy(tensor.data_ptr(), steps.data(), steps.size() * sizeof(int32_t));
+  return tensor;
+}
+
+void apply_codec_policy(quickreduce::fptr_t _fa, torch::Tensor const& steps) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  TORCH_CHECK(steps.dim() == 1 && !steps.is_floating_point(),
+              "codec policy steps must be a 1-D integer tensor");
+  auto host = steps.to(torch::kCPU, torch::kInt32).contiguous();
+  auto const* data = host.data_ptr<int32_t>();
+  fa->apply_codec_policy(std::vector<int32_t>(data, data + host.numel()));
+}
+
+quickreduce::MetricsSnapshot metrics_snapshot(quickreduce::fptr_t _fa) {
+  return reinterpret_cast<quickreduce::DeviceComms*>(_fa)->metrics_snapshot();
+}
+
+std::string metrics_prometheus(quickreduce::fptr_t _fa) {
+  return metrics_snapshot(_fa).prometheus();
+}
+
+void reset_metrics(quickreduce::fptr_t _fa) {
+  reinterpret_cast<quickreduce::DeviceComms*>(_fa)->reset_metrics();
+}
+
+
+std::optional<quickreduce::TensorLayout> tensor_layout(at::Tensor const& t) {
+  quickreduce::TensorLayout layout;
+  if (!quickreduce::layout_from_strides(t.sizes().data(), t.strides().data(),
+                                        t.dim(), layout)) {
+    return std::nullopt;
+  }
+  return layout;
+}
+
+static quickreduce::TileReadiness make_readiness(
+    std::optional<at::Tensor> const& ready_flags, int64_t numel,
+    int64_t flag_elements, int64_t epoch) {
+  quickreduce::TileReadiness readiness;
+  if (!ready_flags.has_value()) return readiness;
+  auto const& flags = ready_flags.value();
+  TORCH_CHECK(flags.is_cuda() && flags.is_contiguous(),
+              "ready_flags must be a contiguous device tensor");
+  TORCH_CHECK(flags.scalar_type() == at::kInt,
+              "ready_flags must be an int32 tensor");
+  TORCH_CHECK(flag_elements > 0, "flag_elements must be positive");
+  TORCH_CHECK(epoch > 0, "epoch must be positive, the flags start at zero");
+  TORCH_CHECK_GE(flags.numel(),
+                 quickreduce::readiness_num_flags(numel, flag_elements));
+  readiness.flags = reinterpret_cast<uint32_t*>(flags.data_ptr());
+  readiness.flag_elements = static_cast<uint32_t>(flag_elements);
+  readiness.epoch = static_cast<uint32_t>(epoch);
+  return readiness;
+}
 
 void allreduce(quickreduce::fptr_t _fa,
                at::Tensor& inp,
                int64_t quant_level,
-               bool cast_bf2half) {
+               bool cast_bf2half,
+               std::optional<at::Tensor> ready_flags,
+               int64_t flag_elements,
+               int64_t epoch,
+               std::string const& op,
+               int64_t channel) {
   auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
   at::cuda::OptionalCUDAGuard guard(inp.device());
   auto stream = at::cuda::getCurrentCUDAStream(); 
   TORCH_CHECK_LE(inp.numel(), fa->kMaxProblemSize);
+  auto readiness = make_readiness(ready_flags, inp.numel(), flag_elements, epoch);
+  auto reduce_op = quickreduce::reduce_op_from_name(op);
   if (inp.scalar_type() == at::ScalarType::Half) {
+    auto layout = tensor_layout(inp);
+    TORCH_CHECK(layout.has_value(),
+                "quick allreduce needs contiguous rows of 16B-aligned length "
+                "and stride, call .contiguous() first");
     fa->allreduce(reinterpret_cast<half*>(inp.data_ptr()),
-                  inp.numel(), quant_level, stream, false);
+                  layout.value(), quant_level, stream, false, readiness,
+                  reduce_op, {}, static_cast<int>(channel));
   } else {
     throw std::runtime_error("quick allreduce only supports float16 and bfloat16");
   }
 }
 
+void allreduce_mx(quickreduce::fptr_t _fa, at::Tensor& inp,
+                  int64_t quant_level, at::Tensor& elements,
+                  at::Tensor& scales) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  at::cuda::OptionalCUDAGuard guard(inp.device());
+  auto stream = at::cuda::getCurrentCUDAStream();
+  TORCH_CHECK_LE(inp.numel(), fa->kMaxProblemSize);
+  TORCH_CHECK(inp.scalar_type() == at::ScalarType::Half && inp.is_contiguous(),
+              "quick allreduce_mx needs a contiguous float16 tensor");
+  TORCH_CHECK(elements.scalar_type() == at::kByte && elements.is_contiguous() &&
+                  scales.scalar_type() == at::kByte && scales.is_contiguous(),
+              "MX elements and scales must be contiguous uint8 tensors");
+  TORCH_CHECK(quickreduce::mx_quant_level(quant_level),
+              "quick allreduce_mx needs an MX quantization level, got ",
+              quant_level);
+  int bits = quant_level == quickreduce::QuickReduceQuantLevel::MXFP4
+                 ? quickreduce::MxFp4::kBits
+             : quant_level == quickreduce::QuickReduceQuantLevel::MXFP6
+                 ? quickreduce::MxFp6::kBits
+                 : quickreduce::MxInt8::kBits;
+  uint64_t N = inp.numel();
+  TORCH_CHECK_GE(static_cast<uint64_t>(elements.numel()), (N * bits + 7) / 8);
+  TORCH_CHECK_GE(static_cast<uint64_t>(scales.numel()),
+                 quickreduce::mx_scale_bytes(N));
+  quickreduce::MxOutput mx;
+  mx.elements = reinterpret_cast<uint8_t*>(elements.data_ptr());
+  mx.scales = reinterpret_cast<uint8_t*>(scales.data_ptr());
+  fa->allreduce(reinterpret_cast<half*>(inp.data_ptr()),
+                quickreduce::dense_layout(N), quant_level, stream, false, {},
+                quickreduce::ReduceOp::SUM, mx);
+}
+
 
 c10::intrusive_ptr<c10::ivalue::Future>
 allreduce_async(quickreduce::fptr_t fa_addr,
-                at::Tensor& tensor,         
+                at::Tensor& tensor,
                 int64_t quant_level,
-                bool cast_bf2half) {
+                bool cast_bf2half,
+                std::string const& op) {
 
   TORCH_CHECK(tensor.is_cuda(), "quick_allreduce expects CUDA/HIP tensor");
   auto in_dtype = tensor.scalar_type();
@@ -73,42 +351,123 @@ allreduce_async(quickreduce::fptr_t fa_addr,
               "quick allreduce supports float32/bfloat16/float16 as input");
 
   at::cuda::OptionalCUDAGuard guard(tensor.device());
-  auto stream = at::cuda::getCurrentCUDAStream();
-  at::cuda::CUDAStreamGuard sg(stream);  
+  hipStream_t stream = at::cuda::getCurrentCUDAStream();
   auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(fa_addr);
   TORCH_CHECK_LE(tensor.numel(), fa->kMaxProblemSize);
+  auto reduce_op = quickreduce::reduce_op_from_name(op);
+  auto& ctx = async_context(fa_addr, tensor.get_device());
 
-  at::Tensor t_fp16;
-  if (in_dtype == at::kHalf) {
-    t_fp16 = tensor;                      
+  // Everything below is enqueued on the current stream, so neither the
+  // input nor the workspace needs recordStream.
+  auto layout = in_dtype == at::kHalf
+                    ? tensor_layout(tensor)
+                    : std::optional<quickreduce::TensorLayout>();
+  if (layout.has_value()) {
+    fa->allreduce(reinterpret_cast<half*>(tensor.data_ptr()),
+                  layout.value(), quant_level, stream, false, {}, reduce_op);
   } else {
-    t_fp16 = tensor.to(at::kHalf);        
-    c10::cuda::CUDACachingAllocator::recordStream(t_fp16.storage().data_ptr(), stream);
+    // bf16/fp32, or a layout the kernel cannot address: go through an fp16
+    // workspace, which other submitting threads must not share meanwhile.
+    auto workspaces_lock = ctx.lock_workspaces();
+    at::Tensor& t_fp16 = ctx.acquire_workspace(tensor.numel(), stream);
+    auto staged = t_fp16.view(tensor.sizes());
+    staged.copy_(tensor, true);
+    fa->allreduce(reinterpret_cast<half*>(t_fp16.data_ptr()),
+                  t_fp16.numel(), quant_level, stream, false, {}, reduce_op);
+    tensor.copy_(staged, true);
+    ctx.release_workspace(tensor.numel(), stream);
   }
-  // call Comms->allreduce
-  fa->allreduce(reinterpret_cast<half*>(t_fp16.data_ptr()),
-                t_fp16.numel(), quant_level, stream, false);
 
-  if (in_dtype != at::kHalf) {
-    
-    tensor.copy_(t_fp16, true);
-  }
-  at::cuda::CUDAEvent done_event;
-  done_event.record(stream);
   auto fut = c10::make_intrusive<c10::ivalue::Future>(c10::TensorType::get());
-  std::thread([evt = std::move(done_event), fut, out = tensor, hold = std::move(t_fp16)]() mutable {
-    try {
-      evt.synchronize();  
-      fut->markCompleted(out); 
-    } catch (...) {
-      fut->setError(std::current_exception());
-    }
-  }).detach();
-  c10::cuda::CUDACachingAllocator::recordStream(tensor.storage().data_ptr(), stream);
+  ctx.complete_on(stream, fut, tensor);
   return fut;
 }
 
 
+// Broadcast and reduce run on fp16 tensors the kernel addresses densely.
+static void check_rooted(quickreduce::DeviceComms const* fa,
+                         at::Tensor const& tensor, int64_t root,
+                         char const* name) {
+  TORCH_CHECK(tensor.is_cuda() && tensor.is_contiguous() &&
+                  tensor.scalar_type() == at::kHalf,
+              "quick ", name, " expects a contiguous float16 device tensor");
+  TORCH_CHECK(root >= 0 && root < fa->world_size, name, " root ", root,
+              " out of range");
+  TORCH_CHECK_LE(tensor.numel(), fa->kMaxProblemSize);
+}
+
+void broadcast(quickreduce::fptr_t _fa, at::Tensor& tensor, int64_t root,
+               int64_t quant_level) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  check_rooted(fa, tensor, root, "broadcast");
+  at::cuda::OptionalCUDAGuard guard(tensor.device());
+  auto stream = at::cuda::getCurrentCUDAStream();
+  fa->broadcast(reinterpret_cast<half*>(tensor.data_ptr()), tensor.numel(),
+                root, quant_level, stream);
+}
+
+void reduce(quickreduce::fptr_t _fa, at::Tensor& tensor, int64_t root,
+            int64_t quant_level, std::string const& op) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  check_rooted(fa, tensor, root, "reduce");
+  auto reduce_op = quickreduce::reduce_op_from_name(op);
+  at::cuda::OptionalCUDAGuard guard(tensor.device());
+  auto stream = at::cuda::getCurrentCUDAStream();
+  fa->reduce(reinterpret_cast<half*>(tensor.data_ptr()), tensor.numel(), root,
+             quant_level, stream, reduce_op);
+}
+
+static std::vector<uint32_t> check_counts(std::vector<int64_t> const& counts,
+                                          int world_size,
+                                          at::Tensor const& tensor) {
+  TORCH_CHECK(static_cast<int>(counts.size()) == world_size,
+              "all_to_all needs one count per rank");
+  std::vector<uint32_t> result;
+  int64_t total = 0;
+  for (int64_t count : counts) {
+    TORCH_CHECK(count >= 0, "all_to_all counts must be non-negative");
+    total += count;
+    result.push_back(static_cast<uint32_t>(count));
+  }
+  TORCH_CHECK_LE(total, tensor.numel());
+  return result;
+}
+
+void all_to_all(quickreduce::fptr_t _fa,
+                at::Tensor const& send,
+                std::vector<int64_t> const& send_counts,
+                at::Tensor& recv,
+                std::vector<int64_t> const& recv_counts,
+                int64_t quant_level) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(_fa);
+  for (auto const* t : {&send, &recv}) {
+    TORCH_CHECK(t->is_cuda() && t->is_contiguous() &&
+                    t->scalar_type() == at::kHalf,
+                "quick all_to_all expects contiguous float16 device tensors");
+  }
+  auto send_counts_ = check_counts(send_counts, fa->world_size, send);
+  auto recv_counts_ = check_counts(recv_counts, fa->world_size, recv);
+  at::cuda::OptionalCUDAGuard guard(send.device());
+  auto stream = at::cuda::getCurrentCUDAStream();
+  fa->all_to_all(reinterpret_cast<half const*>(send.data_ptr()),
+                 send_counts_.data(), reinterpret_cast<half*>(recv.data_ptr()),
+                 recv_counts_.data(), quant_level, stream);
+}
+
+void signal_ready(at::Tensor& ready_flags, int64_t first, int64_t count,
+                  int64_t epoch) {
+  TORCH_CHECK(ready_flags.is_cuda() && ready_flags.scalar_type() == at::kInt,
+              "ready_flags must be an int32 device tensor");
+  TORCH_CHECK(first >= 0 && count >= 0 && first + count <= ready_flags.numel(),
+              "flag range out of bounds");
+  at::cuda::OptionalCUDAGuard guard(ready_flags.device());
+  auto stream = at::cuda::getCurrentCUDAStream();
+  quickreduce::DeviceComms::signal_ready(
+      reinterpret_cast<uint32_t*>(ready_flags.data_ptr()), first, count, epoch,
+      stream);
+}
+
+
 int64_t qr_max_size() {
   // The default is 2GB (2,147,483,648 bytes)
   return static_cast<int64_t>(std::numeric_limits<int32_t>::max()) + 1;
@@ -17,19 +17,79 @@
 #include "quickreduce.h"
 
 
-quickreduce::fptr_t init(int world_size, int rank, std::optional<int64_t> qr_max_size);
+quickreduce::fptr_t init(int world_size, int rank, std::optional<int64_t> qr_max_size,
+                         int64_t channels = 1);
 void destroy(quickreduce::fptr_t _fa);
 
 torch::Tensor get_handle(quickreduce::fptr_t _fa);
 void open_handles(quickreduce::fptr_t _fa, const std::vector<torch::Tensor>& handles);
+void open_peers(quickreduce::fptr_t _fa);
+void connect(quickreduce::fptr_t _fa, const std::string& rendezvous_path,
+             std::string const& transport = "peer");
+void enable_host_staging(quickreduce::fptr_t _fa, std::string const& name,
+                         uint64_t nonce, int64_t slot_bytes);
+void disable_host_staging(quickreduce::fptr_t _fa);
+
+torch::Tensor get_output_handle(quickreduce::fptr_t _fa, at::Tensor const& tensor);
+void register_output(quickreduce::fptr_t _fa, at::Tensor const& tensor,
+                     const std::vector<torch::Tensor>& handles);
+void unregister_output(quickreduce::fptr_t _fa, at::Tensor const& tensor);
+
+void enable_capture(quickreduce::fptr_t _fa, std::string const& path,
+                    int64_t capacity, int64_t sample_every,
+                    int64_t max_elements);
+void disable_capture(quickreduce::fptr_t _fa);
+
+void enable_error_telemetry(quickreduce::fptr_t _fa, int64_t sample_every,
+                            int64_t tile_every, double max_relative_rmse,
+                            int64_t escalate_after, int64_t relax_after);
+void disable_error_telemetry(quickreduce::fptr_t _fa);
+torch::Tensor codec_policy_proposal(quickreduce::fptr_t _fa);
+void apply_codec_policy(quickreduce::fptr_t _fa, torch::Tensor const& steps);
+
+quickreduce::MetricsSnapshot metrics_snapshot(quickreduce::fptr_t _fa);
+std::string metrics_prometheus(quickreduce::fptr_t _fa);
+void reset_metrics(quickreduce::fptr_t _fa);
+
+// 2-D strided layout of a tensor whose trailing dimensions are contiguous
+// and whose leading dimensions collapse into a single row stride, or nullopt.
+std::optional<quickreduce::TensorLayout> tensor_layout(at::Tensor const& t);
 
 void allreduce(quickreduce::fptr_t _fa,
                at::Tensor& inp,
               int64_t quant_level,
-              bool cast_bf2half);
+              bool cast_bf2half,
+              std::optional<at::Tensor> ready_flags = std::nullopt,
+              int64_t flag_elements = 0,
+              int64_t epoch = 0,
+              std::string const& op = "sum",
+              int64_t channel = 0);
+
+// Sum of `inp` over the ranks, written MX-encoded to `elements` and `scales`
+// (uint8, see core/mx_format.h). `inp` is left as it is.
+void allreduce_mx(quickreduce::fptr_t _fa, at::Tensor& inp,
+                  int64_t quant_level, at::Tensor& elements,
+                  at::Tensor& scales);
+
+void broadcast(quickreduce::fptr_t _fa, at::Tensor& tensor, int64_t root,
+               int64_t quant_level);
+
+void reduce(quickreduce::fptr_t _fa, at::Tensor& tensor, int64_t root,
+            int64_t quant_level, std::string const& op = "sum");
+
+void all_to_all(quickreduce::fptr_t _fa,
+                at::Tensor const& send,
+                std::vector<int64_t> const& send_counts,
+                at::Tensor& recv,
+                std::vector<int64_t> const& recv_counts,
+                int64_t quant_level);
+
+void signal_ready(at::Tensor& ready_flags, int64_t first, int64_t count,
+                  int64_t epoch);
 
 c10::intrusive_ptr<c10::ivalue::Future>
 allreduce_async(quickreduce::fptr_t fa_addr,
-      at::Tensor & tensor, int64_t quant_level, bool cast_bf2half);
+      at::Tensor & tensor, int64_t quant_level, bool cast_bf2half,
+      std::string const& op = "sum");
 
 int64_t qr_max_size();
\ No newline at end of file
@@ -3,27 +3,265 @@
 #include <ATen/core/ivalue.h>
 #include <c10/cuda/CUDACachingAllocator.h>
 #include <torch/csrc/jit/python/pybind_utils.h>
+#include <torch/csrc/utils/pybind.h>
 #include "device.h"
+#include "backend.h"
 static pybind11::object allreduce_async_py(quickreduce::fptr_t fa_addr,
                                            at::Tensor& tensor,
                                            int64_t quant_level,
-                                           bool cast_bf2half) {
+                                           bool cast_bf2half,
+                                           std::string const& op) {
   auto fa = reinterpret_cast<quickreduce::fptr_t>(fa_addr);
-  auto fut = allreduce_async(fa, tensor, quant_level, cast_bf2half);
+  c10::intrusive_ptr<c10::ivalue::Future> fut;
+  {
+    // The call blocks while kMaxInFlight calls are pending, until the
+    // completion thread marks one done, which may run Python callbacks.
+    pybind11::gil_scoped_release release;
+    fut = allreduce_async(fa, tensor, quant_level, cast_bf2half, op);
+  }
   return torch::jit::toPyObject(c10::IValue(fut));
 }
 
+static pybind11::dict metrics_py(quickreduce::fptr_t fa_addr) {
+  quickreduce::MetricsSnapshot snapshot = metrics_snapshot(fa_addr);
+  pybind11::list entries;
+  for (auto const& e : snapshot.entries) {
+    pybind11::dict entry;
+    entry["codec"] = quickreduce::quant_level_name(e.quant_level);
+    entry["quant_level"] = e.quant_level;
+    uint64_t max_bytes = quickreduce::metrics_bucket_bytes(e.size_bucket);
+    entry["max_bytes"] = max_bytes ? pybind11::object(pybind11::int_(max_bytes))
+                                   : pybind11::object(pybind11::none());
+    entry["calls"] = e.calls;
+    entry["input_bytes"] = e.input_bytes;
+    entry["logical_bytes"] = e.logical_bytes;
+    entry["wire_bytes"] = e.wire_bytes;
+    entries.append(entry);
+  }
+  pybind11::dict metrics;
+  metrics["rank"] = snapshot.rank;
+  metrics["world_size"] = snapshot.world_size;
+  metrics["entries"] = entries;
+  metrics["flag_wait_seconds"] =
+      snapshot.flag_wait_tick_hz > 0.0
+          ? pybind11::object(pybind11::float_(double(snapshot.flag_wait_ticks) /
+                                              snapshot.flag_wait_tick_hz))
+          : pybind11::object(pybind11::none());
+  return metrics;
+}
+
+static pybind11::dict error_telemetry_py(quickreduce::fptr_t fa_addr) {
+  auto* fa = reinterpret_cast<quickreduce::DeviceComms*>(fa_addr);
+  fa->poll_error_telemetry(false);
+  auto const& t = fa->error_telemetry;
+  pybind11::dict levels;
+  for (auto const& [level, total] : t.totals.totals()) {
+    pybind11::dict entry;
+    entry["records"] = total.records;
+    char const* phases[2] = {"phase1", "phase2"};
+    for (int p = 0; p < 2; p++) {
+      auto const& phase = total.phase[p];
+      if (phase.count == 0) continue;
+      pybind11::dict stats;
+      stats["values"] = phase.count;
+      stats["max_abs_error"] = phase.max_abs_error;
+      stats["relative_rmse"] = phase.relative_rmse();
+      entry[phases[p]] = stats;
+    }
+    levels[quickreduce::quant_level_name(level)] = entry;
+  }
+  pybind11::dict raised;
+  for (auto const& [requested, level] : t.policy.raised_levels()) {
+    raised[quickreduce::quant_level_name(requested)] =
+        quickreduce::quant_level_name(level);
+  }
+  pybind11::dict telemetry;
+  telemetry["enabled"] = t.enabled;
+  telemetry["levels"] = levels;
+  telemetry["raised"] = raised;
+  return telemetry;
+}
+
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
-  m.def("init", &init);
+  m.def("init", &init,
+        pybind11::arg("world_size"),
+        pybind11::arg("rank"),
+        pybind11::arg("qr_max_size") = std::nullopt,
+        pybind11::arg("channels") = 1,
+        "Communicator with `channels` submission channels: allreduce calls "
+        "on different channels may be issued concurrently from several "
+        "threads and streams, each channel with its own buffers");
   m.def("destroy", &destroy);
   m.def("get_handle", &get_handle);
   m.def("open_handles", &open_handles);
-  m.def("allreduce", &allreduce);
+  m.def("open_peers", &open_peers,
+        pybind11::arg("fa_addr"),
+        "Map the buffers of the peers now rather than on the first "
+        "collective, e.g. before capturing a graph, which cannot map them");
+  m.def("connect", &connect,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("rendezvous_path"),
+        pybind11::arg("transport") = "peer",
+        "Exchange the IPC handles of the ranks through a directory unique to "
+        "the job, e.g. /dev/shm/quickreduce_<job id>. transport: 'peer' maps "
+        "the device buffers of the peers, 'host_staged' stages the allreduce "
+        "through pinned shared host memory, 'auto' falls back to it if any "
+        "rank cannot map its peers");
+  m.def("enable_host_staging", &enable_host_staging,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("name"),
+        pybind11::arg("nonce"),
+        pybind11::arg("slot_bytes") = int64_t(1) << 20,
+        "Collective: run the allreduce through the POSIX shared-memory "
+        "segment name (e.g. /quickreduce_<job id>), in chunks of slot_bytes "
+        "of encoded data, instead of peer mappings. nonce is a nonzero value "
+        "shared by the ranks and unique to the run, e.g. drawn by rank 0 and "
+        "broadcast; the ranks only attach to the segment carrying it");
+  m.def("disable_host_staging", &disable_host_staging,
+        pybind11::arg("fa_addr"));
+  m.def("get_output_handle", &get_output_handle,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("tensor"),
+        "Handle of an output tensor, to all-gather before register_output");
+  m.def("register_output", &register_output,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("tensor"),
+        pybind11::arg("handles"),
+        "Collective: register tensor, with the output handles of every rank, "
+        "in the same order on every rank. fp16 all-reduces of the whole "
+        "registered tensor are written in place by the peers");
+  m.def("unregister_output", &unregister_output,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("tensor"),
+        "Collective: drop the registrations overlapping tensor");
+  m.def("enable_capture", &enable_capture,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("path"),
+        pybind11::arg("capacity") = int64_t(1) << 30,
+        pybind11::arg("sample_every") = 1000,
+        pybind11::arg("max_elements") = 1 << 20,
+        "Sample the allreduce inputs of this rank, every sample_every-th "
+        "call and up to max_elements values of it, into the trace file at "
+        "path (a file per rank), for tools/allreduce_replay");
+  m.def("disable_capture", &disable_capture,
+        pybind11::arg("fa_addr"),
+        "Write the last sample and close the capture trace");
+  m.def("enable_error_telemetry", &enable_error_telemetry,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("sample_every") = 100,
+        pybind11::arg("tile_every") = 16,
+        pybind11::arg("max_relative_rmse") = 0.0,
+        pybind11::arg("escalate_after") = 2,
+        pybind11::arg("relax_after") = 1000,
+        "Measure the codec errors on every tile_every-th tile of every "
+        "sample_every-th allreduce. With max_relative_rmse > 0, a rank whose "
+        "error exceeds it escalate_after times in a row proposes the next "
+        "higher precision codec, and one whose error stays below half of it "
+        "relax_after times proposes to step back, see codec_policy_proposal");
+  m.def("disable_error_telemetry", &disable_error_telemetry,
+        pybind11::arg("fa_addr"));
+  m.def("codec_policy_proposal", &codec_policy_proposal,
+        pybind11::arg("fa_addr"),
+        "Codec steps this rank proposes per requested quant level, an int32 "
+        "CPU tensor to all-reduce with MAX across the ranks");
+  m.def("apply_codec_policy", &apply_codec_policy,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("steps"),
+        "Collective: run the reduced proposal from the next allreduce on. "
+        "Every rank passes the same steps between the same two calls");
+  m.def("error_telemetry", &error_telemetry_py,
+        pybind11::arg("fa_addr"),
+        "Codec errors per quant level that ran (max abs error and relative "
+        "rmse of both phases), and the levels the policy raised");
+  m.def("metrics", &metrics_py,
+        pybind11::arg("fa_addr"),
+        "Counters of the allreduce calls since init or reset_metrics: calls, "
+        "input, logical (fp16) and wire bytes per codec and size bucket "
+        "(max_bytes, None for the largest), and the flag-wait time of the "
+        "device if built with QUICKREDUCE_FLAG_WAIT_CYCLES");
+  m.def("metrics_prometheus", &metrics_prometheus,
+        pybind11::arg("fa_addr"),
+        "The metrics in the Prometheus text exposition format");
+  m.def("reset_metrics", &reset_metrics,
+        pybind11::arg("fa_addr"));
+  m.def("allreduce", &allreduce,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("tensor"),
+        pybind11::arg("quant_level"),
+        pybind11::arg("cast_bf2half"),
+        pybind11::arg("ready_flags") = std::nullopt,
+        pybind11::arg("flag_elements") = 0,
+        pybind11::arg("epoch") = 0,
+        pybind11::arg("op") = "sum",
+        pybind11::arg("channel") = 0,
+        "Allreduce in place with op in {sum, max, min, mean}. With "
+        "ready_flags, tiles are sent as soon as the producer sets their flags "
+        "to epoch. The calls of a channel must be issued in the same order "
+        "on every rank");
+  m.def("allreduce_mx", &allreduce_mx,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("tensor"),
+        pybind11::arg("quant_level"),
+        pybind11::arg("elements"),
+        pybind11::arg("scales"),
+        "Sum tensor over the ranks with an MX quant_level (22 MXFP4, 23 "
+        "MXFP6, 24 MXINT8) into the MX-encoded elements and E8M0 scales "
+        "(uint8), without decoding it. tensor is left as it is");
+  m.def("broadcast", &broadcast,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("tensor"),
+        pybind11::arg("root"),
+        pybind11::arg("quant_level") = 0,
+        "Broadcast tensor from root in place. quant_level compresses the "
+        "payload; the root keeps its tensor as is");
+  m.def("reduce", &reduce,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("tensor"),
+        pybind11::arg("root"),
+        pybind11::arg("quant_level") = 0,
+        pybind11::arg("op") = "sum",
+        "Reduce tensor into root in place with op in {sum, max, min, mean}. "
+        "The other ranks keep their tensor");
+  m.def("all_to_all", &all_to_all,
+        pybind11::arg("fa_addr"),
+        pybind11::arg("send"),
+        pybind11::arg("send_counts"),
+        pybind11::arg("recv"),
+        pybind11::arg("recv_counts"),
+        pybind11::arg("quant_level") = 0,
+        "All-to-all with variable splits: send_counts[r] elements of send go "
+        "to rank r, recv_counts[r] elements of recv come from rank r");
+  m.def("signal_ready", &signal_ready,
+        pybind11::arg("ready_flags"),
+        pybind11::arg("first"),
+        pybind11::arg("count"),
+        pybind11::arg("epoch"),
+        "Stream-ordered write of epoch into ready_flags[first:first + count]");
+
+  pybind11::class_<quickreduce::BackendPolicy>(m, "BackendPolicy")
+      .def(pybind11::init<>())
+      .def_readwrite("quant_level", &quickreduce::BackendPolicy::quant_level)
+      .def_readwrite("min_bytes", &quickreduce::BackendPolicy::min_bytes)
+      .def_readwrite("max_bytes", &quickreduce::BackendPolicy::max_bytes)
+      .def_readwrite("cast_bf16", &quickreduce::BackendPolicy::cast_bf16)
+      .def_readwrite("device_reduce_scatter",
+                     &quickreduce::BackendPolicy::device_reduce_scatter)
+      .def_readwrite("host_slot_bytes",
+                     &quickreduce::BackendPolicy::host_slot_bytes);
+  m.def("create_backend", &quickreduce::QuickReduceBackend::create,
+        pybind11::arg("store"),
+        pybind11::arg("rank"),
+        pybind11::arg("size"),
+        pybind11::arg("policy"),
+        pybind11::arg("device_fallback") = std::nullopt,
+        pybind11::arg("host_fallback") = std::nullopt,
+        "Create the c10d backend used by torch.distributed");
   m.def("allreduce_async",
         &allreduce_async_py,
         pybind11::arg("fa_addr"),
         pybind11::arg("tensor"),
         pybind11::arg("quant_level"),
         pybind11::arg("cast_bf2half"),
+        pybind11::arg("op") = "sum",
         "Asynchronous quickreduce allreduce, returning torch._C.Future");
 }
\ No newline at end of file
@@ -6,6 +6,31 @@ from .device import (
     destroy,
     get_handle,
     open_handles,
+    open_peers,
+    connect,
+    enable_host_staging,
+    disable_host_staging,
+    get_output_handle,
+    register_output,
+    unregister_output,
+    enable_capture,
+    disable_capture,
+    enable_error_telemetry,
+    disable_error_telemetry,
+    error_telemetry,
+    codec_policy_proposal,
+    apply_codec_policy,
+    metrics,
+    metrics_prometheus,
+    reset_metrics,
     allreduce,
-    allreduce_async
+    allreduce_async,
+    allreduce_mx,
+    broadcast,
+    reduce,
+    all_to_all,
+    signal_ready
 )
+from . import distributed
+
+distributed.register()
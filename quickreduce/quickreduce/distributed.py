@@ -0,0 +1,80 @@
+"""torch.distributed backend for QuickReduce.
+
+Importing quickreduce registers the "quickreduce" backend, so existing
+tensor-parallel code only changes the backend name:
+
+    dist.init_process_group("quickreduce", rank=rank, world_size=world_size)
+
+Eligible all-reduces of CUDA fp16 tensors run on QuickReduce, CPU
+collectives run over host shared memory, and everything else goes to the
+fallback backends (RCCL for CUDA tensors, Gloo for CPU tensors).
+
+The routing policy is read from the environment when a group is created:
+
+    QUICKREDUCE_QUANT_LEVEL      codec of the all-reduce (0 = FP16)
+    QUICKREDUCE_MIN_BYTES        smallest all-reduce routed to QuickReduce
+    QUICKREDUCE_MAX_BYTES        largest all-reduce routed to QuickReduce
+    QUICKREDUCE_REDUCE_SCATTER   1 to run reduce-scatters as all-reduces
+    QUICKREDUCE_CAST_BF16        1 to run bf16 all-reduces through an fp16
+                                 cast (saturates above 65504), instead of
+                                 the fallback
+    QUICKREDUCE_FALLBACK         0 to disable the fallback backends
+"""
+import os
+from datetime import timedelta
+
+import torch
+import torch.distributed as dist
+
+from . import device
+
+BACKEND_NAME = "quickreduce"
+
+
+def _env_int(name, default):
+    value = os.environ.get(name)
+    return default if value is None or value == "" else int(value)
+
+
+def make_policy(quant_level=None, min_bytes=None, max_bytes=None,
+                device_reduce_scatter=None, cast_bf16=None):
+    policy = device.BackendPolicy()
+    policy.quant_level = _env_int("QUICKREDUCE_QUANT_LEVEL", 0) \
+        if quant_level is None else quant_level
+    policy.min_bytes = _env_int("QUICKREDUCE_MIN_BYTES", policy.min_bytes) \
+        if min_bytes is None else min_bytes
+    policy.max_bytes = _env_int("QUICKREDUCE_MAX_BYTES", policy.max_bytes) \
+        if max_bytes is None else max_bytes
+    policy.device_reduce_scatter = \
+        bool(_env_int("QUICKREDUCE_REDUCE_SCATTER", 0)) \
+        if device_reduce_scatter is None else device_reduce_scatter
+    policy.cast_bf16 = bool(_env_int("QUICKREDUCE_CAST_BF16", 0)) \
+        if cast_bf16 is None else cast_bf16
+    return policy
+
+
+def _fallbacks(store, rank, size, timeout):
+    if not _env_int("QUICKREDUCE_FALLBACK", 1):
+        return None, None
+    device_fallback = None
+    if torch.cuda.is_available() and dist.is_nccl_available():
+        device_fallback = dist.ProcessGroupNCCL(
+            dist.PrefixStore("quickreduce/nccl", store), rank, size)
+    host_fallback = None
+    if dist.is_gloo_available():
+        host_fallback = dist.ProcessGroupGloo(
+            dist.PrefixStore("quickreduce/gloo", store), rank, size, timeout)
+    return device_fallback, host_fallback
+
+
+def create_backend(store, rank, size, timeout=timedelta(minutes=30)):
+    device_fallback, host_fallback = _fallbacks(store, rank, size, timeout)
+    return device.create_backend(store, rank, size, make_policy(),
+                                 device_fallback, host_fallback)
+
+
+def register():
+    if hasattr(dist.Backend, BACKEND_NAME.upper()):
+        return
+    dist.Backend.register_backend(BACKEND_NAME, create_backend,
+                                  devices=["cpu", "cuda"])
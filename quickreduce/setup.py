@@ -9,9 +9,10 @@ py_root = pathlib.Path(__file__).parent.resolve()
 project_root = py_root.parent
 
 # Gather
-gpu_archs = os.environ.get("GPU_ARCHS", "gfx942")
+# Fat binary for CDNA2 (gfx90a) and CDNA3 (gfx942). The compiler defines the
+# per-target __gfxNNN__ macros for each offload architecture.
+gpu_archs = os.environ.get("GPU_ARCHS", "gfx90a;gfx942")
 rocm_arch = [f"--offload-arch={arch}" for arch in gpu_archs.split(";")]
-arch_flags = [f"-D__{arch}__" for arch in gpu_archs.split(";")]
 
 extra_compile_args = {
     "cxx": ["-g", "-O3", "-fopenmp", "-lgomp", "-std=c++17", "-Wno-unused-function","-pthread"],
@@ -19,13 +20,19 @@ extra_compile_args = {
         "-O3", "-std=c++17",
         "-Wno-unused-result", "-Wno-undefined-internal",
         "-mllvm", "-amdgpu-early-inline-all=true"
-    ] + rocm_arch + arch_flags,
+    ] + rocm_arch,
 }
 
+# QUICKREDUCE_FLAG_WAIT_CYCLES=1 makes the kernels count the time they spend
+# waiting on flags, reported by qr.metrics.
+if os.environ.get("QUICKREDUCE_FLAG_WAIT_CYCLES", "0") == "1":
+    extra_compile_args["nvcc"].append("-DQUICKREDUCE_FLAG_WAIT_CYCLES")
+
 sources = [
     str(project_root / "csrc/quickreduce.hip"),
     str(project_root / "quickreduce/csrc/device.cpp"),
     str(project_root / "quickreduce/csrc/device_pybind.cpp"),
+    str(project_root / "quickreduce/csrc/backend.cpp"),
 ]
 
 include = [
@@ -45,6 +52,7 @@ setuptools.setup(
             sources=sources,
             include_dirs=include,
             extra_compile_args=extra_compile_args,
+            libraries=["rt"],
         ),
     ],
     cmdclass={"build_ext": BuildExtension}
@@ -0,0 +1,244 @@
+#include <cstring>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <core/all_to_all.h>
+#include <core/codec_layout.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+// Elements of a two-shot tile (see core/base.h). A chunk is the rank
+// segment of a tile.
+static constexpr uint32_t kTileElements = 16384;
+
+static void test_plan() {
+    uint32_t send[4] = {16, 0, 40000, 8};
+    uint32_t recv[4] = {8, 24, 0, 16392};
+    AllToAllPlan plan;
+    HOST_CHECK(make_all_to_all_plan(4, send, recv, 4096, 100, plan) ==
+               AllToAllPlanError::OK);
+    HOST_CHECK_EQ(plan.send_offset[0], 0u);
+    HOST_CHECK_EQ(plan.send_offset[1], 16u);
+    HOST_CHECK_EQ(plan.send_offset[2], 16u);
+    HOST_CHECK_EQ(plan.send_offset[3], 40016u);
+    HOST_CHECK_EQ(plan.recv_offset[3], 32u);
+    // 1 + 0 + 10 + 1 chunks of 4096 elements.
+    HOST_CHECK_EQ(plan.send_chunk_begin[2], 1u);
+    HOST_CHECK_EQ(plan.send_chunk_begin[3], 11u);
+    HOST_CHECK_EQ(plan.num_send_chunks(), 12u);
+    HOST_CHECK_EQ(plan.num_recv_chunks(), 1u + 1u + 0u + 5u);
+
+    // Every chunk maps to one segment, and empty segments own no chunk.
+    for (uint32_t j = 0; j < plan.num_send_chunks(); j++) {
+        ChunkRef ref = find_chunk(plan.send_chunk_begin, 4, j);
+        HOST_CHECK(ref.rank != 1);
+        HOST_CHECK(ref.chunk * 4096 < plan.send_count[ref.rank]);
+    }
+    HOST_CHECK_EQ(find_chunk(plan.send_chunk_begin, 4, 1).rank, 2);
+    HOST_CHECK_EQ(find_chunk(plan.send_chunk_begin, 4, 11).rank, 3);
+
+    // Invalid plans.
+    uint32_t unaligned[4] = {16, 3, 0, 0};
+    HOST_CHECK(make_all_to_all_plan(4, unaligned, recv, 4096, 100, plan) ==
+               AllToAllPlanError::UNALIGNED_COUNT);
+    HOST_CHECK(make_all_to_all_plan(4, send, recv, 4096, 9, plan) ==
+               AllToAllPlanError::CAPACITY);
+    HOST_CHECK(make_all_to_all_plan(16, send, recv, 4096, 100, plan) ==
+               AllToAllPlanError::WORLD_SIZE);
+}
+
+static void test_buffer_layout() {
+    int const world_size = 8;
+    uint32_t const chunk = kTileElements / world_size;
+    int64_t const data_size = int64_t(1) << 31;
+    // The regions hold chunks of the lossless codec, the largest one.
+    uint32_t const chunk_bytes = kMaxTransmittedTileSize / world_size;
+    HOST_CHECK_EQ(chunk_bytes, 4160u);
+    HOST_CHECK(chunk_bytes > chunk * 2);
+    uint32_t max_chunks =
+        all_to_all_max_chunks(data_size, world_size, chunk_bytes);
+    HOST_CHECK_EQ(max_chunks, uint32_t(data_size / world_size / 4160));
+    uint32_t flags_size = all_to_all_flags_size(world_size, max_chunks);
+    HOST_CHECK_EQ(flags_size % 256, 0u);
+
+    // Barrier, done, arrival and chunk flags are distinct and inside the
+    // flags buffer.
+    uint32_t flags_offset = 1024;
+    std::set<uint32_t> offsets;
+    for (int r = 0; r < world_size; r++) {
+        offsets.insert(all_to_all_barrier_offset(flags_offset, r));
+        offsets.insert(all_to_all_done_offset(flags_offset, world_size, r));
+    }
+    offsets.insert(all_to_all_arrival_offset(flags_offset, world_size));
+    for (int s = 0; s < world_size; s++) {
+        for (uint32_t c : {0u, 1u, max_chunks - 1}) {
+            offsets.insert(all_to_all_chunk_flag_offset(
+                flags_offset, world_size, max_chunks, s, c));
+        }
+    }
+    HOST_CHECK_EQ(offsets.size(), size_t(2 * world_size + 1 + world_size * 3));
+    HOST_CHECK(*offsets.begin() == flags_offset);
+    HOST_CHECK(*offsets.rbegin() + 4 <= flags_offset + flags_size);
+
+    // The regions of the sources fit in the data buffer, with a full
+    // lossless chunk in the last slot, and do not overlap.
+    uint64_t last = all_to_all_chunk_data_offset(
+        0, max_chunks, chunk_bytes, world_size - 1, max_chunks - 1,
+        chunk_bytes);
+    HOST_CHECK(last + chunk_bytes <= uint64_t(data_size));
+    HOST_CHECK_EQ(all_to_all_chunk_data_offset(0, max_chunks, chunk_bytes, 1,
+                                               0, chunk * 2),
+                  uint64_t(max_chunks) * chunk_bytes);
+}
+
+// A rank of the simulation: its input, output and communication buffer.
+struct Rank {
+    std::vector<uint16_t> send;
+    std::vector<uint16_t> recv;
+    std::vector<uint16_t> data;    // data buffer, in elements
+    std::vector<uint32_t> flags;   // all-to-all flags, indexed like the device
+    AllToAllPlan plan;
+};
+
+// Exchange of random splits: the blocks of every rank send their chunks to
+// the region of the source on the receiver, then the receivers copy the
+// flagged chunks out. The result must be the torch all_to_all_single of the
+// send buffers.
+static void test_exchange(int world_size, unsigned seed) {
+    std::mt19937 gen(seed);
+    uint32_t const chunk = kTileElements / world_size;
+    uint32_t const max_chunks = 6;
+    int64_t const data_size = int64_t(world_size) * max_chunks * chunk * 2;
+    uint32_t const color = 7;
+
+    // counts[s][d]: elements from s to d, zero for some pairs.
+    std::vector<std::vector<uint32_t>> counts(
+        world_size, std::vector<uint32_t>(world_size));
+    std::uniform_int_distribution<uint32_t> dist(0, max_chunks * chunk / 8);
+    for (auto& row : counts) {
+        for (auto& c : row) c = gen() % 4 == 0 ? 0 : dist(gen) * 8;
+    }
+
+    std::vector<Rank> ranks(world_size);
+    for (int r = 0; r < world_size; r++) {
+        Rank& rank = ranks[r];
+        std::vector<uint32_t> send_counts(world_size), recv_counts(world_size);
+        uint32_t send_total = 0, recv_total = 0;
+        for (int p = 0; p < world_size; p++) {
+            send_counts[p] = counts[r][p];
+            recv_counts[p] = counts[p][r];
+            send_total += send_counts[p];
+            recv_total += recv_counts[p];
+        }
+        HOST_CHECK(make_all_to_all_plan(world_size, send_counts.data(),
+                                        recv_counts.data(), chunk, max_chunks,
+                                        rank.plan) == AllToAllPlanError::OK);
+        rank.send.resize(send_total);
+        for (uint32_t i = 0; i < send_total; i++) {
+            rank.send[i] = static_cast<uint16_t>(r * 7919 + i);
+        }
+        rank.recv.assign(recv_total, 0xFFFF);
+        rank.data.assign(data_size / 2, 0);
+        rank.flags.assign(all_to_all_flags_size(world_size, max_chunks) / 4, 0);
+    }
+
+    // Phase 1: every block of every rank sends its chunks.
+    for (int s = 0; s < world_size; s++) {
+        Rank& rank = ranks[s];
+        uint32_t grid = 1 + gen() % 5;
+        for (uint32_t block = 0; block < grid; block++) {
+            for (uint32_t j = block; j < rank.plan.num_send_chunks();
+                 j += grid) {
+                ChunkRef ref =
+                    find_chunk(rank.plan.send_chunk_begin, world_size, j);
+                Rank& peer = ranks[ref.rank];
+                uint64_t offset = all_to_all_chunk_data_offset(
+                    0, max_chunks, chunk * 2, s, ref.chunk, chunk * 2);
+                uint32_t begin = ref.chunk * chunk;
+                for (uint32_t i = 0; i < chunk; i++) {
+                    uint32_t e = begin + i;
+                    // Loads past the end of the segment read zeros.
+                    peer.data[offset / 2 + i] =
+                        e < rank.plan.send_count[ref.rank]
+                            ? rank.send[rank.plan.send_offset[ref.rank] + e]
+                            : 0;
+                }
+                uint32_t flag = all_to_all_chunk_flag_offset(
+                    0, world_size, max_chunks, s, ref.chunk) / 4;
+                HOST_CHECK(peer.flags[flag] != color);
+                peer.flags[flag] = color;
+            }
+        }
+    }
+
+    // Phase 2: every block of every rank receives its chunks, then arrives
+    // at the completion barrier; the last one sets the done flags.
+    uint32_t const arrival = all_to_all_arrival_offset(0, world_size) / 4;
+    for (int d = 0; d < world_size; d++) {
+        Rank& rank = ranks[d];
+        uint32_t grid = 1 + gen() % 5;
+        for (uint32_t block = 0; block < grid; block++) {
+            for (uint32_t j = block; j < rank.plan.num_recv_chunks();
+                 j += grid) {
+                ChunkRef ref =
+                    find_chunk(rank.plan.recv_chunk_begin, world_size, j);
+                uint32_t flag = all_to_all_chunk_flag_offset(
+                    0, world_size, max_chunks, ref.rank, ref.chunk) / 4;
+                HOST_CHECK_EQ(rank.flags[flag], color);
+                uint64_t offset = all_to_all_chunk_data_offset(
+                    0, max_chunks, chunk * 2, ref.rank, ref.chunk, chunk * 2);
+                uint32_t begin = ref.chunk * chunk;
+                for (uint32_t i = 0; i < chunk; i++) {
+                    uint32_t e = begin + i;
+                    // Stores past the end of the segment are dropped.
+                    if (e >= rank.plan.recv_count[ref.rank]) break;
+                    rank.recv[rank.plan.recv_offset[ref.rank] + e] =
+                        rank.data[offset / 2 + i];
+                }
+            }
+            if (rank.flags[arrival]++ == grid - 1) {
+                rank.flags[arrival] = 0;
+                for (Rank& peer : ranks) {
+                    peer.flags[all_to_all_done_offset(0, world_size, d) / 4] =
+                        color;
+                }
+            }
+        }
+    }
+
+    // Every rank leaves the barrier with the done flags of all the peers,
+    // and a cleared counter for the next launch.
+    for (Rank const& rank : ranks) {
+        HOST_CHECK_EQ(rank.flags[arrival], 0u);
+        for (int s = 0; s < world_size; s++) {
+            HOST_CHECK_EQ(
+                rank.flags[all_to_all_done_offset(0, world_size, s) / 4],
+                color);
+        }
+    }
+
+    int wrong = 0;
+    for (int d = 0; d < world_size; d++) {
+        std::vector<uint16_t> expected;
+        for (int s = 0; s < world_size; s++) {
+            Rank const& source = ranks[s];
+            auto begin = source.send.begin() + source.plan.send_offset[d];
+            expected.insert(expected.end(), begin, begin + counts[s][d]);
+        }
+        wrong += ranks[d].recv != expected;
+    }
+    HOST_CHECK_EQ(wrong, 0);
+}
+
+int main() {
+    test_plan();
+    test_buffer_layout();
+    for (int world_size : {2, 4, 8}) {
+        for (unsigned seed = 0; seed < 20; seed++) {
+            test_exchange(world_size, seed);
+        }
+    }
+    return host_test_result("all_to_all_test");
+}
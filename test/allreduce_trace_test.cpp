@@ -0,0 +1,172 @@
+#include <unistd.h>
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <host/trace_replay.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+using namespace quickreduce::reference;
+
+static std::string temp_path(char const* name) {
+    return "/tmp/quickreduce_" + std::to_string(getpid()) + "_" + name;
+}
+
+static std::vector<uint16_t> normal_values(uint64_t n, unsigned seed) {
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<uint16_t> values(n);
+    for (auto& v : values) v = host::float_to_half(dist(gen));
+    return values;
+}
+
+static TraceRecordHeader record_of(int rank, int world_size, uint64_t call,
+                                   uint64_t numel) {
+    TraceRecordHeader record = {};
+    record.rank = rank;
+    record.world_size = world_size;
+    record.quant_level = 3;
+    record.op = static_cast<int32_t>(ReduceOp::SUM);
+    record.row_elements = static_cast<uint32_t>(numel);
+    record.call_index = call;
+    record.call_numel = numel;
+    record.numel = numel;
+    return record;
+}
+
+static void test_sampler() {
+    TraceSampler sampler;
+    sampler.sample_every = 3;
+    HOST_CHECK(sampler.sampled(0));
+    HOST_CHECK(!sampler.sampled(1));
+    HOST_CHECK(sampler.sampled(6));
+    sampler.sample_every = 0;
+    HOST_CHECK(!sampler.sampled(0));
+
+    // Dense: the start of the input.
+    TensorLayout sample = trace_sample_layout(dense_layout(1 << 20), 4096);
+    HOST_CHECK_EQ(sample.rows, 1u);
+    HOST_CHECK_EQ(sample.row_elements, 4096u);
+    sample = trace_sample_layout(dense_layout(1000), 4096);
+    HOST_CHECK_EQ(sample.numel(), 1000u);
+    // Strided: whole rows, or the start of the first row.
+    TensorLayout layout{16, 1024, 4096};
+    sample = trace_sample_layout(layout, 4096 + 100);
+    HOST_CHECK_EQ(sample.rows, 4u);
+    HOST_CHECK_EQ(sample.row_elements, 1024u);
+    HOST_CHECK_EQ(sample.row_stride, 4096u);
+    sample = trace_sample_layout(layout, 512);
+    HOST_CHECK_EQ(sample.rows, 1u);
+    HOST_CHECK_EQ(sample.row_elements, 512u);
+}
+
+// Records come back as appended, across reopening, and a full trace drops
+// the records that do not fit.
+static void test_trace_file() {
+    std::string path = temp_path("trace_file");
+    unlink(path.c_str());
+    auto a = normal_values(1000, 1);
+    auto b = normal_values(24, 2);
+    uint64_t capacity = sizeof(TraceFileHeader) + trace_record_bytes(1000) +
+                        trace_record_bytes(24) + 64;
+    {
+        TraceFile trace = TraceFile::append(path, capacity);
+        HOST_CHECK_EQ(trace.used(), sizeof(TraceFileHeader));
+        HOST_CHECK(trace.append_record(record_of(0, 2, 0, 1000), a.data()));
+    }
+    {
+        TraceFile trace = TraceFile::append(path, 1);
+        HOST_CHECK_EQ(trace.capacity(), capacity);
+        HOST_CHECK(trace.append_record(record_of(0, 2, 5, 24), b.data()));
+        HOST_CHECK(!trace.append_record(record_of(0, 2, 10, 24), b.data()));
+    }
+    TraceFile trace = TraceFile::read(path);
+    auto records = trace.records();
+    HOST_CHECK_EQ(records.size(), 2u);
+    HOST_CHECK_EQ(records[0].header.call_index, 0u);
+    HOST_CHECK_EQ(records[0].header.numel, 1000u);
+    HOST_CHECK(std::vector<uint16_t>(records[0].values,
+                                     records[0].values + 1000) == a);
+    HOST_CHECK_EQ(records[1].header.call_index, 5u);
+    HOST_CHECK(std::vector<uint16_t>(records[1].values,
+                                     records[1].values + 24) == b);
+    unlink(path.c_str());
+
+    // Not a trace.
+    std::string other = temp_path("not_a_trace");
+    FILE* f = std::fopen(other.c_str(), "wb");
+    std::fprintf(f, "%064d", 0);
+    std::fclose(f);
+    bool thrown = false;
+    try {
+        TraceFile::read(other);
+    } catch (std::runtime_error const&) {
+        thrown = true;
+    }
+    HOST_CHECK(thrown);
+    unlink(other.c_str());
+}
+
+// The replay measures the codecs on the records, and the sums of the calls
+// of every rank.
+static void test_replay() {
+    std::string path = temp_path("replay");
+    unlink(path.c_str());
+    uint64_t const numel = kAtomValues + 1000;
+    std::vector<std::vector<uint16_t>> inputs;
+    {
+        TraceFile trace = TraceFile::append(path, 1 << 20);
+        for (int rank = 0; rank < 2; rank++) {
+            inputs.push_back(normal_values(numel, 10 + rank));
+            trace.append_record(record_of(rank, 2, 0, numel),
+                                inputs.back().data());
+        }
+        // Only rank 0 sampled call 1.
+        trace.append_record(record_of(0, 2, 1, numel), inputs[0].data());
+    }
+    TraceFile trace = TraceFile::read(path);
+    auto records = trace.records();
+    HOST_CHECK_EQ(records.size(), 3u);
+    HOST_CHECK_EQ(complete_calls(records).size(), 1u);
+
+    auto replays = replay_codecs(records);
+    auto find = [&](std::string const& name) {
+        for (auto const& r : replays) {
+            if (r.name == name) return r;
+        }
+        return CodecReplay();
+    };
+    CodecReplay fp = find("FP16"), lossless = find("FP16-L"), q4 = find("Q4"),
+                q8 = find("Q8");
+    HOST_CHECK_EQ(fp.values, 3 * numel);
+    HOST_CHECK_EQ(fp.round_trip.max_abs_error, 0.0);
+    HOST_CHECK_EQ(lossless.round_trip.max_abs_error, 0.0);
+    HOST_CHECK(lossless.bytes < 0.95 * fp.bytes);
+    // Two atoms per record, the second one padded.
+    HOST_CHECK_NEAR(q4.bits_per_value(),
+                    8.0 * 2 * SymmetricCodec<4>::kTileStride / numel, 1e-9);
+    HOST_CHECK(q8.round_trip.relative_rmse() < q4.round_trip.relative_rmse());
+    HOST_CHECK(q8.allreduce.relative_rmse() < q4.allreduce.relative_rmse());
+    HOST_CHECK(fp.allreduce.relative_rmse() < 1e-3);
+    HOST_CHECK_EQ(q4.allreduce.count, static_cast<long>(numel));
+
+    // A record of a whole atom replays as its round trip.
+    TraceFile::Record atom = {record_of(0, 2, 0, kAtomValues),
+                              inputs[0].data()};
+    ErrorStats direct = round_trip<SymmetricCodec<4>>(inputs[0].data(), 1);
+    ErrorStats replayed =
+        replay_codec<SymmetricCodec<4>>("Q4", {atom}, {}).round_trip;
+    HOST_CHECK_EQ(replayed.sum_sq_error, direct.sum_sq_error);
+    HOST_CHECK_EQ(replayed.count, direct.count);
+    unlink(path.c_str());
+}
+
+int main() {
+    test_sampler();
+    test_trace_file();
+    test_replay();
+    return host_test_result("allreduce_trace_test");
+}
@@ -0,0 +1,128 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <host/async_pool.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+// Every heap allocation of the process is counted. The replacements are one
+// set, kept out of line, so the compiler pairs them with each other rather
+// than with malloc and free.
+static std::atomic<long> num_allocations{0};
+
+__attribute__((noinline)) void* operator new(std::size_t size) {
+    num_allocations++;
+    if (void* p = std::malloc(size == 0 ? 1 : size)) return p;
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+__attribute__((noinline)) void operator delete[](void* p) noexcept {
+    operator delete(p);
+}
+void operator delete(void* p, std::size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, std::size_t) noexcept { operator delete(p); }
+
+static void test_size_classes() {
+    HOST_CHECK_EQ(workspace_size_class(1), 0);
+    HOST_CHECK_EQ(workspace_size_class(4096), 0);
+    HOST_CHECK_EQ(workspace_size_class(4097), 1);
+    HOST_CHECK_EQ(workspace_size_class(1 << 20), 8);
+    HOST_CHECK_EQ(workspace_class_bytes(8), 1 << 20);
+    for (int64_t bytes : {1l, 5000l, 123456l, 1l << 30}) {
+        HOST_CHECK(workspace_class_bytes(workspace_size_class(bytes)) >= bytes);
+    }
+}
+
+// Stand-ins of the extension types: a workspace tensor, a HIP event and a
+// pending future.
+using Workspace = std::vector<uint8_t>;
+using Event = int;
+
+struct Pending {
+    int event = -1;
+    long id = 0;
+};
+
+// A decode loop: every step borrows a workspace and an event, and hands
+// them to the completion thread. After the first step of each size, the
+// loop must not allocate.
+static void test_steady_state_does_not_allocate() {
+    WorkspaceCache<Workspace> workspaces;
+    ObjectPool<Event, 8> events;
+    CompletionQueue<Pending, 8> queue;
+    std::atomic<long> completed{0};
+    int next_event = 0;
+
+    std::thread completion([&] {
+        Pending p;
+        while (queue.pop(p)) {
+            completed++;
+            events.release(p.event);
+        }
+    });
+
+    auto step = [&](long id, int64_t bytes) {
+        Workspace& w = workspaces.get(bytes, [](int64_t n) {
+            return Workspace(n);
+        });
+        w[0] = static_cast<uint8_t>(id);
+        int e = events.acquire([&] { return next_event++; });
+        queue.push(Pending{e, id});
+    };
+
+    std::vector<int64_t> sizes = {3000, 70000, 1 << 20};
+    for (int64_t bytes : sizes) step(0, bytes);
+
+    long before = num_allocations.load();
+    long const steps = 10000;
+    for (long i = 1; i <= steps; i++) step(i, sizes[i % sizes.size()]);
+    long during = num_allocations.load() - before;
+
+    queue.close();
+    completion.join();
+
+    HOST_CHECK_EQ(during, 0);
+    HOST_CHECK_EQ(completed.load(), steps + 3);
+    // The events are recycled: never more than the pool capacity.
+    HOST_CHECK(next_event <= 8);
+    HOST_CHECK_EQ(events.num_created(), next_event);
+}
+
+// Submissions block rather than grow when the completion thread lags.
+static void test_backpressure() {
+    CompletionQueue<long, 4> queue;
+    std::atomic<long> sum{0};
+    std::thread consumer([&] {
+        long v;
+        while (queue.pop(v)) {
+            std::this_thread::yield();
+            sum += v;
+        }
+    });
+    std::vector<std::thread> producers;
+    for (int p = 0; p < 3; p++) {
+        producers.emplace_back([&] {
+            for (long i = 1; i <= 1000; i++) queue.push(i);
+        });
+    }
+    for (auto& t : producers) t.join();
+    queue.close();
+    consumer.join();
+    HOST_CHECK_EQ(sum.load(), 3 * 500500l);
+}
+
+int main() {
+    test_size_classes();
+    test_steady_state_does_not_allocate();
+    test_backpressure();
+    return host_test_result("async_pool_test");
+}
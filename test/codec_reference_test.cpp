@@ -0,0 +1,288 @@
+#include <random>
+#include <vector>
+
+#include <host/codec_reference.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+using namespace quickreduce::reference;
+
+static constexpr long kNumAtoms = 64;
+
+// Zero-centered activations.
+static std::vector<uint16_t> symmetric_data(unsigned seed) {
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<uint16_t> values(kNumAtoms * kAtomValues);
+    for (auto& v : values) v = host::float_to_half(dist(gen));
+    return values;
+}
+
+// Skewed, post-activation like data: every block lives in a range that is
+// far from symmetric around zero.
+static std::vector<uint16_t> skewed_data(unsigned seed) {
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<uint16_t> values(kNumAtoms * kAtomValues);
+    for (auto& v : values) v = host::float_to_half(2.0f + std::fabs(dist(gen)));
+    return values;
+}
+
+template <class Codec>
+static double report(char const* name, std::vector<uint16_t> const& values) {
+    ErrorStats stats = round_trip<Codec>(values.data(), kNumAtoms);
+    std::printf("  %-10s rmse = %.6f, max_error = %.6f, bytes/atom = %d\n",
+                name, stats.rmse(), stats.max_abs_error, Codec::kTileStride);
+    return stats.rmse();
+}
+
+static void test_layout() {
+    // Tile strides match the kernels.
+    HOST_CHECK_EQ(SymmetricCodec<4>::kTileStride, 1152);
+    HOST_CHECK_EQ(SymmetricCodec<6>::kTileStride, 1664);
+    HOST_CHECK_EQ(SymmetricCodec<8>::kTileStride, 2176);
+    HOST_CHECK_EQ(AsymmetricCodec<4>::kTileStride, 1280);
+    HOST_CHECK_EQ(AsymmetricCodec<6>::kTileStride, 1792);
+    HOST_CHECK_EQ(AsymmetricCodec<8>::kTileStride, 2304);
+
+    // Packing round trip of every code position.
+    uint16_t codes[kValuesPerThread] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint16_t unpacked[kValuesPerThread];
+    uint8_t tile[4096] = {};
+    CodeLayout<4>::pack(3, codes, tile);
+    CodeLayout<4>::unpack(3, tile, unpacked);
+    for (int j = 0; j < 8; j++) HOST_CHECK_EQ(unpacked[j], codes[j]);
+    // Q4: lower halves in the low 16 bits, 4 bits apart.
+    HOST_CHECK_EQ(load_u32(tile + 3 * 4), 0x86427531u);
+
+    uint16_t codes6[kValuesPerThread] = {63, 17, 32, 5, 48, 0, 33, 62};
+    CodeLayout<6>::pack(5, codes6, tile);
+    CodeLayout<6>::unpack(5, tile, unpacked);
+    for (int j = 0; j < 8; j++) HOST_CHECK_EQ(unpacked[j], codes6[j]);
+
+    uint16_t codes8[kValuesPerThread] = {255, 1, 128, 7, 0, 99, 200, 16};
+    CodeLayout<8>::pack(7, codes8, tile);
+    CodeLayout<8>::unpack(7, tile, unpacked);
+    for (int j = 0; j < 8; j++) HOST_CHECK_EQ(unpacked[j], codes8[j]);
+    HOST_CHECK_EQ(load_u32(tile + 7 * 8), 0x070180FFu);
+}
+
+// Packs the codes of every thread of an atom with the layout `L`.
+template <class L>
+static void pack_atom(std::vector<uint16_t> const& codes, uint8_t* tile) {
+    for (int t = 0; t < kThreads; t++) {
+        L::pack(t, &codes[t * kValuesPerThread], tile);
+    }
+}
+
+template <int bits>
+static std::vector<uint16_t> random_codes(unsigned seed) {
+    std::mt19937 gen(seed);
+    std::vector<uint16_t> codes(kAtomValues);
+    for (auto& c : codes) c = gen() & ((1u << bits) - 1);
+    return codes;
+}
+
+// The generated Q4/Q6/Q8 layouts are byte-identical to the hand-written
+// ones, in both directions.
+template <int bits>
+static void check_generated_layout() {
+    using Generated = GeneratedCodeLayout<bits>;
+    HOST_CHECK_EQ(Generated::kScaleOffset, CodeLayout<bits>::kScaleOffset);
+    for (unsigned seed = 0; seed < 8; seed++) {
+        auto codes = random_codes<bits>(seed);
+        std::vector<uint8_t> hand(4096, 0xAB);
+        std::vector<uint8_t> generated(4096, 0xAB);
+        pack_atom<CodeLayout<bits>>(codes, hand.data());
+        pack_atom<Generated>(codes, generated.data());
+        HOST_CHECK(hand == generated);
+
+        int wrong = 0;
+        for (int t = 0; t < kThreads; t++) {
+            uint16_t unpacked[kValuesPerThread];
+            Generated::unpack(t, hand.data(), unpacked);
+            for (int j = 0; j < kValuesPerThread; j++) {
+                wrong += unpacked[j] != codes[t * kValuesPerThread + j];
+            }
+        }
+        HOST_CHECK_EQ(wrong, 0);
+    }
+}
+
+// The new bit-widths pack into exactly `bits` bytes per thread and round
+// trip every code.
+template <int bits>
+static void check_new_layout(int planes, int tile_stride) {
+    using Layout = QuantCodeLayout<bits>;
+    HOST_CHECK_EQ(Layout::kNumPlanes, planes);
+    HOST_CHECK_EQ(Layout::kTileStride, tile_stride);
+    HOST_CHECK_EQ(SymmetricCodec<bits>::kTileStride, tile_stride);
+    auto codes = random_codes<bits>(bits);
+    std::vector<uint8_t> tile(4096, 0xAB);
+    pack_atom<GeneratedCodeLayout<bits>>(codes, tile.data());
+    // The planes end at the scales, which the packing leaves untouched.
+    HOST_CHECK_EQ(tile[Layout::kScaleOffset], 0xAB);
+    HOST_CHECK(tile[Layout::kScaleOffset - 1] != 0xAB ||
+               tile[Layout::kScaleOffset - 2] != 0xAB);
+    int wrong = 0;
+    for (int t = 0; t < kThreads; t++) {
+        uint16_t unpacked[kValuesPerThread];
+        GeneratedCodeLayout<bits>::unpack(t, tile.data(), unpacked);
+        for (int j = 0; j < kValuesPerThread; j++) {
+            wrong += unpacked[j] != codes[t * kValuesPerThread + j];
+        }
+    }
+    HOST_CHECK_EQ(wrong, 0);
+}
+
+// The (scale, min) pairs of the asymmetric codecs, at the offsets of the
+// kernel, follow the codes of all 256 threads: packing the codes leaves them
+// untouched, and the second half of the threads round trips.
+template <int bits>
+static void check_asymmetric_layout() {
+    using Codec = AsymmetricCodec<bits>;
+    using Device = AsymmetricCodeLayout<bits>;
+    HOST_CHECK_EQ(Codec::kScaleOffset, Device::kScaleOffset);
+    HOST_CHECK_EQ(Codec::kTileStride, Device::kTileStride);
+    HOST_CHECK_EQ(Device::kScaleOffset, bits * kThreads);
+
+    std::vector<uint16_t> codes(kAtomValues, (1u << bits) - 1);
+    std::vector<uint8_t> tile(Codec::kTileStride, 0);
+    pack_atom<typename Codec::Layout>(codes, tile.data());
+    int outside = 0;
+    for (int i = Codec::kScaleOffset; i < Codec::kTileStride; i++) {
+        outside += tile[i] != 0;
+    }
+    HOST_CHECK_EQ(outside, 0);
+    HOST_CHECK(tile[Codec::kScaleOffset - 1] != 0);
+
+    // Distinct values in the upper half of the threads.
+    std::vector<uint16_t> atom(kAtomValues);
+    for (int i = 0; i < kAtomValues; i++) {
+        atom[i] = host::float_to_half(i < kAtomValues / 2 ? 1.0f
+                                                          : 2.0f + (i % 7));
+    }
+    std::vector<uint8_t> encoded(Codec::kTileStride);
+    std::vector<uint16_t> decoded(kAtomValues);
+    Codec::encode(atom.data(), encoded.data());
+    Codec::decode(encoded.data(), decoded.data());
+    double max_error = 0.0;
+    for (int i = kAtomValues / 2; i < kAtomValues; i++) {
+        max_error = std::max(max_error,
+                             std::abs(double(host::half_to_float(decoded[i])) -
+                                      host::half_to_float(atom[i])));
+    }
+    HOST_CHECK(max_error <= 6.0 / ((1 << bits) - 1));
+}
+
+static void test_generated_layouts() {
+    check_generated_layout<4>();
+    check_generated_layout<6>();
+    check_generated_layout<8>();
+    check_new_layout<3>(2, 896);
+    check_new_layout<5>(2, 1408);
+    check_new_layout<7>(3, 1920);
+
+    // Plane split: the lowest bits go to the widest plane.
+    HOST_CHECK_EQ(QuantCodeLayout<7>::plane_width(0), 4);
+    HOST_CHECK_EQ(QuantCodeLayout<7>::plane_shift(2), 6);
+    HOST_CHECK_EQ(QuantCodeLayout<7>::plane_offset(2), 1536);
+    HOST_CHECK_EQ(QuantCodeLayout<5>::plane_width(1), 1);
+
+    // The asymmetric codecs keep their (scale, min) pairs after the planes.
+    check_asymmetric_layout<4>();
+    check_asymmetric_layout<6>();
+    check_asymmetric_layout<8>();
+
+    // Constants of the former hand-written kernels.
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<4>::kScaleFactor), 0xB000B000u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<6>::kScaleFactor), 0xA800A800u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<8>::kScaleFactor), 0xA000A000u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<4>::kRangeMin), 0xC800C800u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<6>::kRangeMin), 0xD000D000u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<8>::kRangeMin), 0xD800D800u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<4>::kRangeMax), 0x47004700u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<6>::kRangeMax), 0x4FC04FC0u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<8>::kRangeMax), 0x57F057F0u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<4>::kRangeBias), 0x00080008u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<6>::kRangeBias), 0x00200020u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<8>::kRangeBias), 0x00800080u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<4>::kDecodeOffset), 0xE408E408u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<6>::kDecodeOffset), 0xE420E420u);
+    HOST_CHECK_EQ(uint32_t(SymmetricQuantConstants<8>::kDecodeOffset), 0xE480E480u);
+
+    // The generated constants are the fp16 values they stand for.
+    HOST_CHECK_EQ(host::half_to_float(
+                      SymmetricQuantConstants<5>::kScaleFactor & 0xFFFF),
+                  -1.0f / 16);
+    HOST_CHECK_EQ(host::half_to_float(
+                      SymmetricQuantConstants<7>::kRangeMax & 0xFFFF),
+                  63.0f);
+    HOST_CHECK_EQ(host::half_to_float(
+                      SymmetricQuantConstants<3>::kDecodeOffset & 0xFFFF),
+                  -1028.0f);
+}
+
+static void test_constant_blocks() {
+    // A constant block is exact with the asymmetric codecs (zero range).
+    std::vector<uint16_t> values(kAtomValues, host::float_to_half(3.25f));
+    HOST_CHECK_EQ(round_trip<AsymmetricCodec<4>>(values.data(), 1).max_abs_error,
+                  0.0);
+
+    // The block maximum is exact with the symmetric codecs (code -2^(b-1)).
+    ErrorStats stats = round_trip<SymmetricCodec<4>>(values.data(), 1);
+    HOST_CHECK(stats.max_abs_error < 1e-3);
+}
+
+static void test_error() {
+    std::printf("Symmetric data:\n");
+    auto sym = symmetric_data(42);
+    double sym_q4 = report<SymmetricCodec<4>>("Q4", sym);
+    double sym_q6 = report<SymmetricCodec<6>>("Q6", sym);
+    double sym_q8 = report<SymmetricCodec<8>>("Q8", sym);
+    double asym_q4 = report<AsymmetricCodec<4>>("Q4-asym", sym);
+    double asym_q6 = report<AsymmetricCodec<6>>("Q6-asym", sym);
+    double asym_q8 = report<AsymmetricCodec<8>>("Q8-asym", sym);
+
+    // On zero-centered data the zero point buys little, but it costs at most
+    // the rounding of the stored minimum.
+    HOST_CHECK(sym_q6 < sym_q4 && sym_q8 < sym_q6);
+    HOST_CHECK(asym_q4 < 1.1 * sym_q4);
+    HOST_CHECK(asym_q6 < 1.1 * sym_q6);
+    HOST_CHECK(asym_q8 < 1.5 * sym_q8);
+
+    std::printf("Skewed data:\n");
+    auto skewed = skewed_data(43);
+    sym_q4 = report<SymmetricCodec<4>>("Q4", skewed);
+    sym_q6 = report<SymmetricCodec<6>>("Q6", skewed);
+    sym_q8 = report<SymmetricCodec<8>>("Q8", skewed);
+    asym_q4 = report<AsymmetricCodec<4>>("Q4-asym", skewed);
+    asym_q6 = report<AsymmetricCodec<6>>("Q6-asym", skewed);
+    asym_q8 = report<AsymmetricCodec<8>>("Q8-asym", skewed);
+
+    // Skewed blocks only use the negative half of the symmetric code space.
+    HOST_CHECK(asym_q4 < 0.5 * sym_q4);
+    HOST_CHECK(asym_q6 < 0.5 * sym_q6);
+    HOST_CHECK(asym_q8 < 0.5 * sym_q8);
+
+    // Q4 with a zero point is close to symmetric Q6, at 77% of the bytes.
+    HOST_CHECK(asym_q4 < 1.25 * sym_q6);
+
+    std::printf("Generated bit-widths, symmetric data:\n");
+    double q3 = report<SymmetricCodec<3>>("Q3", sym);
+    double q4 = report<SymmetricCodec<4>>("Q4", sym);
+    double q5 = report<SymmetricCodec<5>>("Q5", sym);
+    double q6 = report<SymmetricCodec<6>>("Q6", sym);
+    double q7 = report<SymmetricCodec<7>>("Q7", sym);
+    // Every bit roughly halves the error.
+    HOST_CHECK(q4 < 0.6 * q3 && q5 < 0.6 * q4 && q6 < 0.6 * q5);
+    HOST_CHECK(q7 < 0.6 * q6);
+}
+
+int main() {
+    test_layout();
+    test_generated_layouts();
+    test_constant_blocks();
+    test_error();
+    return host_test_result("codec_reference_test");
+}
@@ -0,0 +1,215 @@
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <host/codec_reference.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+using namespace quickreduce::reference;
+
+// FP16 bytes of one atom, the baseline of the bandwidth saving.
+static constexpr int kDenseAtomBytes = kAtomValues * 2;
+
+using Q4 = SymmetricCodec<4>;
+using Q4Escape = EscapeCodec<4, 2>;
+
+// Normal data where a fraction `outliers` of the blocks holds one value of
+// `magnitude` standard deviations.
+static std::vector<uint16_t> outlier_data(long num_atoms, double outliers,
+                                          float magnitude, unsigned seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    std::uniform_int_distribution<int> position(0, 31);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<uint16_t> values(num_atoms * kAtomValues);
+    for (auto& v : values) v = host::float_to_half(dist(gen));
+    for (long a = 0; a < num_atoms; a++) {
+        for (int g = 0; g < kNumGroups; g++) {
+            for (int lane = 0; lane < 2; lane++) {
+                if (coin(gen) >= outliers) continue;
+                int p = position(gen);
+                int t = g * kGroupSize + p / 4;
+                long i = a * kAtomValues + t * kValuesPerThread +
+                         2 * (p % 4) + lane;
+                values[i] = host::float_to_half(
+                    coin(gen) < 0.5 ? magnitude : -magnitude);
+            }
+        }
+    }
+    return values;
+}
+
+// Bytes written per atom: the quantized tile, the bitmaps and the slots in
+// use.
+static double escape_bytes(std::vector<uint16_t> const& values,
+                           long num_atoms) {
+    using Layout = Q4Escape::Layout;
+    long escaped = 0;
+    for (long a = 0; a < num_atoms; a++) {
+        for (int wave = 0; wave < Layout::kWaves; wave++) {
+            escaped += __builtin_popcount(
+                Q4Escape::escaped_blocks(values.data() + a * kAtomValues, wave));
+        }
+    }
+    return Layout::kMaskOffset + Layout::kWaves * 2 +
+           double(escaped) * Layout::kBlockBytes / num_atoms;
+}
+
+static void test_layout() {
+    using Layout = EscapeLayout<4, 2>;
+    HOST_CHECK_EQ(Layout::kMaskOffset, 1152);
+    HOST_CHECK_EQ(Layout::kPayloadOffset, 1168);
+    HOST_CHECK_EQ(Layout::kTileStride, 1168 + 4 * 2 * 64);
+    HOST_CHECK_EQ((EscapeLayout<6, 1>::kTileStride), 1664 + 16 + 4 * 64);
+    HOST_CHECK_EQ(Layout::slot_offset(3, 1), 1168 + 7 * 64);
+
+    // The lowest candidates take the slots in block order.
+    HOST_CHECK_EQ(Layout::select(0), 0u);
+    HOST_CHECK_EQ(Layout::select(0x8000), 0x8000u);
+    HOST_CHECK_EQ(Layout::select(0x8421), 0x0021u);
+    HOST_CHECK_EQ((EscapeLayout<4, 3>::select(0x8421)), 0x0421u);
+    HOST_CHECK_EQ(Layout::slot(0x0021, 0), 0);
+    HOST_CHECK_EQ(Layout::slot(0x0021, 5), 1);
+}
+
+// Without outliers no block escapes, and the codec decodes as Q4.
+static void test_no_escape() {
+    auto values = outlier_data(8, 0.0, 0.0f, 3);
+    std::vector<uint16_t> q4(values.size()), escape(values.size());
+    round_trip<Q4>(values.data(), 8, q4.data());
+    round_trip<Q4Escape>(values.data(), 8, escape.data());
+    HOST_CHECK(q4 == escape);
+    for (long a = 0; a < 8; a++) {
+        for (int wave = 0; wave < 4; wave++) {
+            HOST_CHECK_EQ(
+                Q4Escape::escaped_blocks(values.data() + a * kAtomValues, wave),
+                0u);
+        }
+    }
+}
+
+// An outlier block is sent exactly, up to the slots of its wavefront.
+static void test_outlier_blocks() {
+    auto values = outlier_data(1, 0.0, 0.0f, 5);
+    // Outliers in blocks 1, 4 and 9 of wavefront 2: group 16 + b / 2.
+    for (int b : {1, 4, 9}) {
+        int t = (16 + b / 2) * kGroupSize + 3;
+        values[t * kValuesPerThread + 2 + b % 2] = host::float_to_half(60.0f);
+    }
+    HOST_CHECK_EQ(Q4Escape::escaped_blocks(values.data(), 2), 0x12u);
+
+    std::vector<uint16_t> decoded(kAtomValues);
+    round_trip<Q4Escape>(values.data(), 1, decoded.data());
+    auto block_exact = [&](int g, int lane) {
+        bool exact = true;
+        for (int t = g * kGroupSize; t < (g + 1) * kGroupSize; t++) {
+            for (int i = 0; i < 4; i++) {
+                int j = t * kValuesPerThread + 2 * i + lane;
+                exact &= decoded[j] == values[j];
+            }
+        }
+        return exact;
+    };
+    HOST_CHECK(block_exact(16, 1));
+    HOST_CHECK(block_exact(18, 0));
+    // The third candidate has no slot left and stays quantized.
+    HOST_CHECK(!block_exact(20, 1));
+    HOST_CHECK_EQ(decoded[(20 * kGroupSize + 3) * kValuesPerThread + 3],
+                  host::float_to_half(60.0f));
+}
+
+// The mean of a block of tiny values does not flush to zero, which would
+// make every such block a candidate and take the slots of the outliers.
+static void test_tiny_blocks() {
+    auto values = outlier_data(4, 0.0, 0.0f, 11);
+    for (auto& v : values) {
+        v = host::float_to_half(host::half_to_float(v) * 0x1p-20f);
+    }
+    for (long a = 0; a < 4; a++) {
+        for (int wave = 0; wave < 4; wave++) {
+            HOST_CHECK_EQ(
+                Q4Escape::escaped_blocks(values.data() + a * kAtomValues, wave),
+                0u);
+        }
+    }
+    // An outlier among tiny values still escapes, in block 7 of wavefront 1.
+    int t = (8 + 7 / 2) * kGroupSize + 5;
+    values[t * kValuesPerThread + 4 + 7 % 2] =
+        host::float_to_half(60.0f * 0x1p-20f);
+    HOST_CHECK_EQ(Q4Escape::escaped_blocks(values.data(), 1), 0x80u);
+}
+
+// Rare outliers: the escapes remove the error they add to Q4, for a few
+// percent more bytes than Q4.
+static void test_outlier_error() {
+    long const num_atoms = 16;
+    // The same normal values, without and with outliers.
+    auto normal = outlier_data(num_atoms, 0.0, 40.0f, 9);
+    auto values = outlier_data(num_atoms, 0.02, 40.0f, 9);
+    double baseline = round_trip<Q4>(normal.data(), num_atoms).rmse();
+    double q4 = round_trip<Q4>(values.data(), num_atoms).rmse();
+    double q5 = round_trip<SymmetricCodec<5>>(values.data(), num_atoms).rmse();
+    double escape = round_trip<Q4Escape>(values.data(), num_atoms).rmse();
+    HOST_CHECK(escape < 0.6 * q4);
+    HOST_CHECK(escape < 1.05 * baseline);
+    HOST_CHECK(escape < q5);
+    HOST_CHECK(escape_bytes(values, num_atoms) < 1.1 * Q4::kTileStride);
+}
+
+// The reference all-reduce runs the codec in both phases.
+static void test_allreduce() {
+    std::vector<std::vector<uint16_t>> inputs;
+    for (int r = 0; r < 4; r++) {
+        inputs.push_back(outlier_data(1, 0.02, 40.0f, 20 + r));
+    }
+    uint16_t const* atoms[4] = {inputs[0].data(), inputs[1].data(),
+                                inputs[2].data(), inputs[3].data()};
+    std::vector<uint16_t> q4(kAtomValues), escape(kAtomValues);
+    reduce_atoms<Q4>(ReduceOp::SUM, atoms, 4, q4.data());
+    reduce_atoms<Q4Escape>(ReduceOp::SUM, atoms, 4, escape.data());
+    ErrorStats q4_stats, escape_stats;
+    for (int i = 0; i < kAtomValues; i++) {
+        float sum = 0.0f;
+        for (int r = 0; r < 4; r++) sum += host::half_to_float(atoms[r][i]);
+        q4_stats.add(sum, host::half_to_float(q4[i]));
+        escape_stats.add(sum, host::half_to_float(escape[i]));
+    }
+    HOST_CHECK(escape_stats.rmse() < q4_stats.rmse());
+}
+
+template <class Codec>
+static void report(char const* name, std::vector<uint16_t> const& values,
+                   long num_atoms, double bytes) {
+    ErrorStats stats = round_trip<Codec>(values.data(), num_atoms);
+    std::printf("  %-8s bytes = %5.1f%%, rmse = %.4f\n", name,
+                100.0 * bytes / kDenseAtomBytes, stats.rmse());
+}
+
+// `escape_codec_test bench` reports the bytes written and the error against
+// the fraction of outlier blocks.
+static void sweep(long num_atoms) {
+    for (double outliers : {0.0, 0.005, 0.02, 0.05, 0.125}) {
+        std::printf("outlier blocks = %.3f\n", outliers);
+        auto values = outlier_data(num_atoms, outliers, 40.0f, 11);
+        report<Q4>("Q4", values, num_atoms, Q4::kTileStride);
+        report<Q4Escape>("Q4-Esc", values, num_atoms,
+                         escape_bytes(values, num_atoms));
+        report<SymmetricCodec<5>>("Q5", values, num_atoms,
+                                  SymmetricCodec<5>::kTileStride);
+        report<SymmetricCodec<6>>("Q6", values, num_atoms,
+                                  SymmetricCodec<6>::kTileStride);
+    }
+}
+
+int main(int argc, char** argv) {
+    test_layout();
+    test_no_escape();
+    test_outlier_blocks();
+    test_tiny_blocks();
+    test_outlier_error();
+    test_allreduce();
+    if (argc > 1 && std::string(argv[1]) == "bench") sweep(256);
+    return host_test_result("escape_codec_test");
+}
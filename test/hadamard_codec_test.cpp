@@ -0,0 +1,224 @@
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <host/codec_reference.h>
+#include <host/perf_model.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+using namespace quickreduce::reference;
+
+using Q4 = SymmetricCodec<4>;
+using Q6 = SymmetricCodec<6>;
+using Q4H = HadamardCodec<Q4>;
+using Q6H = HadamardCodec<Q6>;
+
+// Activation-like rows of `hidden` channels: normal values, where a fraction
+// `outliers` of the channels is scaled by `magnitude` in every row. The
+// outlier channels are drawn from `channel_seed`.
+static std::vector<uint16_t> activations(long num_atoms, int hidden,
+                                         double outliers, float magnitude,
+                                         unsigned seed,
+                                         unsigned channel_seed = 0) {
+    std::mt19937 channel_gen(channel_seed ? channel_seed : seed);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    std::vector<float> channel_scale(hidden);
+    for (auto& s : channel_scale) {
+        s = coin(channel_gen) < outliers ? magnitude : 1.0f;
+    }
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<uint16_t> values(num_atoms * kAtomValues);
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = host::float_to_half(channel_scale[i % hidden] * dist(gen));
+    }
+    return values;
+}
+
+static void test_rotation() {
+    // A constant block rotates to sqrt(32) times its value in the first
+    // position, and zero elsewhere.
+    std::vector<uint16_t> atom(kAtomValues, host::float_to_half(1.0f));
+    hadamard_rotate(atom.data());
+    HOST_CHECK_NEAR(host::half_to_float(atom[0]), std::sqrt(32.0f), 1e-2);
+    HOST_CHECK_NEAR(host::half_to_float(atom[1]), std::sqrt(32.0f), 1e-2);
+    for (int t = 0; t < kGroupSize; t++) {
+        for (int j = 0; j < kValuesPerThread; j++) {
+            if (t == 0 && j < 2) continue;
+            HOST_CHECK_EQ(atom[t * kValuesPerThread + j], 0);
+        }
+    }
+
+    // The rotation is its own inverse, up to fp16 rounding, and keeps the
+    // energy of every block.
+    auto values = activations(4, 4096, 0.01, 30.0f, 3);
+    auto rotated = values;
+    double energy = 0.0, rotated_energy = 0.0;
+    for (long a = 0; a < 4; a++) {
+        hadamard_rotate(rotated.data() + a * kAtomValues);
+    }
+    for (size_t i = 0; i < values.size(); i++) {
+        energy += std::pow(host::half_to_float(values[i]), 2);
+        rotated_energy += std::pow(host::half_to_float(rotated[i]), 2);
+    }
+    HOST_CHECK_NEAR(rotated_energy / energy, 1.0, 1e-3);
+    auto back = rotated;
+    for (long a = 0; a < 4; a++) {
+        hadamard_rotate(back.data() + a * kAtomValues);
+    }
+    ErrorStats stats;
+    for (size_t i = 0; i < values.size(); i++) {
+        stats.add(host::half_to_float(values[i]), host::half_to_float(back[i]));
+    }
+    HOST_CHECK(stats.relative_rmse() < 2e-3);
+}
+
+// Error on the values of the normal channels, relative to their energy:
+// scaled to an outlier in their block, they are the ones that quantize to
+// zero.
+template <class Codec>
+static double normal_channel_error(std::vector<uint16_t> const& values,
+                                   long num_atoms) {
+    std::vector<uint16_t> decoded(values.size());
+    round_trip<Codec>(values.data(), num_atoms, decoded.data());
+    ErrorStats stats;
+    for (size_t i = 0; i < values.size(); i++) {
+        float v = host::half_to_float(values[i]);
+        if (std::fabs(v) > 6.0f) continue;
+        stats.add(v, host::half_to_float(decoded[i]));
+    }
+    return stats.relative_rmse();
+}
+
+// Normal data gains nothing, and channel outliers lose much less accuracy
+// on the rotation.
+static void test_error() {
+    long const num_atoms = 16;
+    auto normal = activations(num_atoms, 4096, 0.0, 1.0f, 5);
+    double q4 = round_trip<Q4>(normal.data(), num_atoms).relative_rmse();
+    double q4h = round_trip<Q4H>(normal.data(), num_atoms).relative_rmse();
+    HOST_CHECK(q4h < 1.05 * q4);
+
+    auto outliers = activations(num_atoms, 4096, 0.005, 50.0f, 5);
+    q4 = round_trip<Q4>(outliers.data(), num_atoms).relative_rmse();
+    q4h = round_trip<Q4H>(outliers.data(), num_atoms).relative_rmse();
+    double q6 = round_trip<Q6>(outliers.data(), num_atoms).relative_rmse();
+    double q6h = round_trip<Q6H>(outliers.data(), num_atoms).relative_rmse();
+    HOST_CHECK(q4h < 0.75 * q4);
+    HOST_CHECK(q6h < 0.5 * q6);
+
+    // On the normal channels, Q4 on the rotation comes close to Q6.
+    double q4_normal = normal_channel_error<Q4>(outliers, num_atoms);
+    double q4h_normal = normal_channel_error<Q4H>(outliers, num_atoms);
+    double q6_normal = normal_channel_error<Q6>(outliers, num_atoms);
+    HOST_CHECK(q4h_normal < 0.7 * q4_normal);
+    HOST_CHECK(q4h_normal < 1.3 * q6_normal);
+}
+
+// Error of the two-shot sum, exact fp16 inputs as reference. With `rotated`
+// the inputs are rotated once and the sum rotated back, as the all-reduce
+// kernel does, instead of around every send.
+template <class Codec>
+static double allreduce_error(std::vector<std::vector<uint16_t>> inputs,
+                              long num_atoms, bool rotated) {
+    int world_size = static_cast<int>(inputs.size());
+    auto exact = inputs;
+    if (rotated) {
+        for (auto& rank : inputs) {
+            for (long a = 0; a < num_atoms; a++) {
+                hadamard_rotate(rank.data() + a * kAtomValues);
+            }
+        }
+    }
+    ErrorStats stats;
+    std::vector<uint16_t const*> atoms(world_size);
+    std::vector<uint16_t> result(kAtomValues);
+    for (long a = 0; a < num_atoms; a++) {
+        for (int r = 0; r < world_size; r++) {
+            atoms[r] = inputs[r].data() + a * kAtomValues;
+        }
+        reduce_atoms<Codec>(ReduceOp::SUM, atoms.data(), world_size,
+                            result.data());
+        if (rotated) hadamard_rotate(result.data());
+        for (int i = 0; i < kAtomValues; i++) {
+            double sum = 0.0;
+            for (int r = 0; r < world_size; r++) {
+                sum += host::half_to_float(exact[r][a * kAtomValues + i]);
+            }
+            stats.add(static_cast<float>(sum), host::half_to_float(result[i]));
+        }
+    }
+    return stats.relative_rmse();
+}
+
+// The outlier channels of the ranks line up, so they survive the sum.
+static std::vector<std::vector<uint16_t>> rank_activations(int world_size,
+                                                           long num_atoms) {
+    std::vector<std::vector<uint16_t>> inputs;
+    for (int r = 0; r < world_size; r++) {
+        inputs.push_back(activations(num_atoms, 4096, 0.005, 50.0f, 100 + r, 5));
+    }
+    return inputs;
+}
+
+// Reducing in the rotated domain costs no accuracy against rotating around
+// every send, and the sum keeps the gain over Q4.
+static void test_allreduce() {
+    long const num_atoms = 4;
+    for (int world_size : {2, 8}) {
+        auto inputs = rank_activations(world_size, num_atoms);
+        double q4h_tile = allreduce_error<Q4>(inputs, num_atoms, true);
+        double q4h_send = allreduce_error<Q4H>(inputs, num_atoms, false);
+        double q4 = allreduce_error<Q4>(inputs, num_atoms, false);
+        HOST_CHECK(q4h_tile < 1.1 * q4h_send);
+        HOST_CHECK(q4h_tile < 0.85 * q4);
+    }
+}
+
+// `hadamard_codec_test bench` prints the error of the codecs with and
+// without the rotation against the outlier channels, over all values and
+// over the normal channels, and the modelled all-reduce latency of Q4 and Q6
+// at 16 and 64MB.
+static void study(long num_atoms) {
+    for (double fraction : {0.0, 0.001, 0.005, 0.02}) {
+        for (float magnitude : {10.0f, 50.0f}) {
+            if (fraction == 0.0 && magnitude > 10.0f) continue;
+            auto values =
+                activations(num_atoms, 4096, fraction, magnitude, 11);
+            std::printf("outlier channels = %.3f x %2.0f, relative rmse:\n",
+                        fraction, magnitude);
+            std::printf(
+                "  all values:      Q4 %.4f, Q4-H %.4f, Q6 %.4f, Q6-H %.4f\n",
+                round_trip<Q4>(values.data(), num_atoms).relative_rmse(),
+                round_trip<Q4H>(values.data(), num_atoms).relative_rmse(),
+                round_trip<Q6>(values.data(), num_atoms).relative_rmse(),
+                round_trip<Q6H>(values.data(), num_atoms).relative_rmse());
+            std::printf(
+                "  normal channels: Q4 %.4f, Q4-H %.4f, Q6 %.4f, Q6-H %.4f\n",
+                normal_channel_error<Q4>(values, num_atoms),
+                normal_channel_error<Q4H>(values, num_atoms),
+                normal_channel_error<Q6>(values, num_atoms),
+                normal_channel_error<Q6H>(values, num_atoms));
+        }
+    }
+    auto m = perf::mi300x_machine();
+    auto codecs = perf::mi300x_codecs();
+    for (int world_size : {2, 4, 8}) {
+        for (double bytes : {16e6, 64e6}) {
+            std::printf("%dxMI300X, %.0fMB: Q4 %.1f us, Q6 %.1f us\n",
+                        world_size, bytes / 1e6,
+                        perf::predict_us(m, codecs[3], world_size, bytes),
+                        perf::predict_us(m, codecs[2], world_size, bytes));
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    test_rotation();
+    test_error();
+    test_allreduce();
+    if (argc > 1 && std::string(argv[1]) == "bench") study(64);
+    return host_test_result("hadamard_codec_test");
+}
@@ -0,0 +1,133 @@
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <host/host_comms.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+// Runs `body(comms)` on a thread per rank, each with its own mapping of the
+// segment, as separate processes would have.
+static void run_ranks(int world_size, int64_t slot_bytes,
+                      std::function<void(HostComms&)> const& body) {
+    static int counter = 0;
+    std::string name = "/quickreduce_test_" + std::to_string(getpid()) + "_" +
+                       std::to_string(counter++);
+    std::vector<std::thread> threads;
+    for (int rank = 0; rank < world_size; rank++) {
+        threads.emplace_back([&, rank] {
+            HostComms comms(name, world_size, rank, slot_bytes);
+            body(comms);
+        });
+    }
+    for (auto& t : threads) t.join();
+}
+
+static float value(int rank, int64_t i) {
+    return static_cast<float>((rank + 1) * 0.25 + (i % 97));
+}
+
+static void test_allreduce() {
+    // Sizes below, equal to and above a slot, and not divisible by the
+    // world size.
+    for (int world_size : {1, 2, 3, 4, 8}) {
+        for (int64_t count : {1l, 7l, 256l, 1000l, 4099l}) {
+            std::vector<int> errors(world_size, 0);
+            run_ranks(world_size, 1024, [&](HostComms& comms) {
+                int rank = comms.rank();
+                std::vector<float> data(count);
+                for (int64_t i = 0; i < count; i++) data[i] = value(rank, i);
+                comms.allreduce(data.data(), count);
+                for (int64_t i = 0; i < count; i++) {
+                    float expected = 0;
+                    for (int r = 0; r < world_size; r++) {
+                        expected += value(r, i);
+                    }
+                    if (data[i] != expected) errors[rank]++;
+                }
+            });
+            for (int e : errors) HOST_CHECK_EQ(e, 0);
+        }
+    }
+}
+
+static void test_allreduce_int64() {
+    std::vector<int> errors(4, 0);
+    run_ranks(4, 512, [&](HostComms& comms) {
+        std::vector<int64_t> data(300, int64_t(1) << (40 + comms.rank()));
+        comms.allreduce(data.data(), data.size());
+        int64_t expected = (int64_t(1) << 40) * 15;
+        for (int64_t v : data) errors[comms.rank()] += v != expected;
+    });
+    for (int e : errors) HOST_CHECK_EQ(e, 0);
+}
+
+static void test_reduce_scatter() {
+    int world_size = 4;
+    int64_t count = 333;
+    std::vector<int> errors(world_size, 0);
+    run_ranks(world_size, 1024, [&](HostComms& comms) {
+        int rank = comms.rank();
+        std::vector<float> input(world_size * count);
+        for (int64_t i = 0; i < world_size * count; i++) {
+            input[i] = value(rank, i);
+        }
+        std::vector<float> output(count);
+        comms.reduce_scatter(input.data(), output.data(), count);
+        for (int64_t i = 0; i < count; i++) {
+            float expected = 0;
+            for (int r = 0; r < world_size; r++) {
+                expected += value(r, rank * count + i);
+            }
+            if (output[i] != expected) errors[rank]++;
+        }
+    });
+    for (int e : errors) HOST_CHECK_EQ(e, 0);
+}
+
+static void test_all_gather() {
+    int world_size = 3;
+    int64_t count = 1000;
+    std::vector<int> errors(world_size, 0);
+    run_ranks(world_size, 256, [&](HostComms& comms) {
+        int rank = comms.rank();
+        std::vector<float> input(count);
+        for (int64_t i = 0; i < count; i++) input[i] = value(rank, i);
+        std::vector<float> output(world_size * count);
+        comms.all_gather(input.data(), output.data(), count * sizeof(float));
+        for (int r = 0; r < world_size; r++) {
+            for (int64_t i = 0; i < count; i++) {
+                if (output[r * count + i] != value(r, i)) errors[rank]++;
+            }
+        }
+    });
+    for (int e : errors) HOST_CHECK_EQ(e, 0);
+}
+
+// Back-to-back collectives reuse the slots and the barrier.
+static void test_repeated() {
+    int world_size = 4;
+    std::vector<int> errors(world_size, 0);
+    run_ranks(world_size, 128, [&](HostComms& comms) {
+        for (int step = 0; step < 200; step++) {
+            std::vector<int32_t> data(37 + step, comms.rank() + step);
+            comms.allreduce(data.data(), data.size());
+            int32_t expected = 6 + 4 * step;
+            for (int32_t v : data) errors[comms.rank()] += v != expected;
+        }
+    });
+    for (int e : errors) HOST_CHECK_EQ(e, 0);
+}
+
+int main() {
+    test_allreduce();
+    test_allreduce_int64();
+    test_reduce_scatter();
+    test_all_gather();
+    test_repeated();
+    return host_test_result("host_comms_test");
+}
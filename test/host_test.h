@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+// Minimal checks for the host-side tests. A failed check reports the location
+// and makes the test return a non-zero exit code.
+
+static int host_test_failures = 0;
+
+#define HOST_CHECK(cond)                                                    \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            std::printf("CHECK failed: %s at %s:%d\n", #cond, __FILE__,     \
+                        __LINE__);                                          \
+            host_test_failures++;                                           \
+        }                                                                   \
+    } while (0)
+
+#define HOST_CHECK_EQ(a, b)                                                 \
+    do {                                                                    \
+        auto a_ = (a);                                                      \
+        auto b_ = (b);                                                      \
+        if (!(a_ == b_)) {                                                  \
+            std::printf("CHECK_EQ failed: %s (%lld) != %s (%lld) at %s:%d\n", \
+                        #a, (long long)a_, #b, (long long)b_, __FILE__,     \
+                        __LINE__);                                          \
+            host_test_failures++;                                           \
+        }                                                                   \
+    } while (0)
+
+#define HOST_CHECK_NEAR(a, b, tol)                                          \
+    do {                                                                    \
+        double a_ = (a);                                                    \
+        double b_ = (b);                                                    \
+        if (!(std::fabs(a_ - b_) <= (tol))) {                               \
+            std::printf("CHECK_NEAR failed: %s (%g) != %s (%g) at %s:%d\n", \
+                        #a, a_, #b, b_, __FILE__, __LINE__);                \
+            host_test_failures++;                                           \
+        }                                                                   \
+    } while (0)
+
+static int host_test_result(char const* name) {
+    std::printf("%s: %s\n", name, host_test_failures == 0 ? "PASS" : "FAIL");
+    return host_test_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,43 @@
+#include <core/launch.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+int main() {
+    // MI300X / MI325X: 304 CUs at the tuned occupancy.
+    HOST_CHECK_EQ(max_grid_size(304, 4), 1216u);
+
+    // MI300A: 228 CUs.
+    HOST_CHECK_EQ(max_grid_size(228, 4), 912u);
+
+    // MI250 (per GCD): 104 CUs, with a lower measured occupancy.
+    HOST_CHECK_EQ(max_grid_size(104, 2), 208u);
+
+    // Occupancy is clamped to the launch bounds, and failed queries fall back
+    // to the MI300X defaults.
+    HOST_CHECK_EQ(max_grid_size(104, 8), 416u);
+    HOST_CHECK_EQ(max_grid_size(104, 0), 416u);
+    HOST_CHECK_EQ(max_grid_size(0, 4), 1216u);
+    HOST_CHECK_EQ(max_grid_size(-1, -1), 1216u);
+
+    // Grid never exceeds the resident blocks, nor the number of tiles.
+    HOST_CHECK_EQ(grid_size(1, 1216), 1u);
+    HOST_CHECK_EQ(grid_size(1216, 1216), 1216u);
+    HOST_CHECK_EQ(grid_size(65536, 208), 208u);
+
+    // Flags region: 2 stages x 2 slots x world_size x grid x uint32_t.
+    HOST_CHECK_EQ(flags_buffer_size(8, 1216), 4u * 8 * 1216 * 4);
+    HOST_CHECK_EQ(flags_buffer_size(2, 208), 4u * 2 * 208 * 4);
+
+    // Data region: a tile per (stage, slot, block) for small max problem
+    // sizes, twice the max problem size otherwise.
+    HOST_CHECK_EQ(data_buffer_size(1 << 20, 1216, 32768), 4ll * 1216 * 32768);
+    HOST_CHECK_EQ(data_buffer_size(1ll << 31, 1216, 32768), 1ll << 32);
+    HOST_CHECK_EQ(twoshot_regions_size(1216, 32768), 4ll * 1216 * 32768);
+
+    LaunchConfig config = make_launch_config(4, 228, 4);
+    HOST_CHECK_EQ(config.max_grid, 912u);
+    HOST_CHECK_EQ(config.flags_buffer_size, flags_buffer_size(4, 912));
+
+    return host_test_result("launch_test");
+}
@@ -0,0 +1,171 @@
+#include <cstring>
+#include <vector>
+
+#include <core/layout.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+// Tile shape of the two-shot kernel (see core/base.h): 256 threads x 8 atoms
+// of 8 fp16 elements.
+static constexpr int kBlockSize = 256;
+static constexpr int kAtoms = 8;
+static constexpr int kAtomStride = kBlockSize;
+static constexpr uint32_t kTileElements = kBlockSize * kAtoms * kAtomElements;
+
+// Stand-in for the fp16 buffer: every element holds its buffer offset.
+using Buffer = std::vector<uint32_t>;
+
+// load_tile/store_tile on the host: buffer_load/store_dwordx4 read zeros and
+// drop writes outside of [0, range).
+static void load_tile(Buffer const& buffer, TensorLayout const& layout,
+                      uint32_t block, std::vector<uint32_t>& tile) {
+    uint32_t range = layout_span(layout) * 2;
+    tile.assign(kTileElements, 0);
+    for (int thread = 0; thread < kBlockSize; thread++) {
+        for (int i = 0; i < kAtoms; i++) {
+            uint32_t offset = layout_atom_offset(layout, block, thread, i,
+                                                 kTileElements, kAtomStride,
+                                                 range);
+            uint32_t* atom =
+                &tile[(i * kAtomStride + thread) * kAtomElements];
+            if (offset + 16 > range) continue;
+            std::memcpy(atom, &buffer[offset / 2],
+                        kAtomElements * sizeof(uint32_t));
+        }
+    }
+}
+
+static void store_tile(Buffer& buffer, TensorLayout const& layout,
+                       uint32_t block, std::vector<uint32_t> const& tile) {
+    uint32_t range = layout_span(layout) * 2;
+    for (int thread = 0; thread < kBlockSize; thread++) {
+        for (int i = 0; i < kAtoms; i++) {
+            uint32_t offset = layout_atom_offset(layout, block, thread, i,
+                                                 kTileElements, kAtomStride,
+                                                 range);
+            if (offset + 16 > range) continue;
+            std::memcpy(&buffer[offset / 2],
+                        &tile[(i * kAtomStride + thread) * kAtomElements],
+                        kAtomElements * sizeof(uint32_t));
+        }
+    }
+}
+
+// A tensor view described like torch: sizes and strides in elements.
+struct View {
+    std::vector<int64_t> sizes;
+    std::vector<int64_t> strides;
+
+    // Buffer offsets of the elements, in logical (row-major) order.
+    std::vector<uint32_t> offsets() const {
+        std::vector<uint32_t> result = {0};
+        for (size_t d = 0; d < sizes.size(); d++) {
+            std::vector<uint32_t> next;
+            for (uint32_t base : result) {
+                for (int64_t j = 0; j < sizes[d]; j++) {
+                    next.push_back(base + j * strides[d]);
+                }
+            }
+            result = next;
+        }
+        return result;
+    }
+};
+
+static bool to_layout(View const& view, TensorLayout& layout) {
+    return layout_from_strides(view.sizes.data(), view.strides.data(),
+                               view.sizes.size(), layout);
+}
+
+// The tiles gather the elements of the view in logical order, and storing
+// them back writes exactly those elements, leaving the gaps untouched.
+static void check_view(View const& view) {
+    TensorLayout layout;
+    HOST_CHECK(to_layout(view, layout));
+    std::vector<uint32_t> expected = view.offsets();
+    HOST_CHECK_EQ(layout.numel(), expected.size());
+
+    uint32_t span = layout_span(layout);
+    Buffer buffer(span);
+    for (uint32_t i = 0; i < span; i++) buffer[i] = i;
+
+    uint32_t num_blocks = (layout.numel() + kTileElements - 1) / kTileElements;
+    std::vector<uint32_t> tile;
+    std::vector<uint32_t> gathered;
+    for (uint32_t block = 0; block < num_blocks; block++) {
+        load_tile(buffer, layout, block, tile);
+        gathered.insert(gathered.end(), tile.begin(), tile.end());
+        for (auto& v : tile) v += 1u << 31;
+        store_tile(buffer, layout, block, tile);
+    }
+    // Past the end of the problem, the tile reads zeros.
+    for (size_t e = expected.size(); e < gathered.size(); e++) {
+        HOST_CHECK_EQ(gathered[e], 0u);
+    }
+    gathered.resize(expected.size());
+    HOST_CHECK(gathered == expected);
+
+    std::vector<bool> in_view(span, false);
+    for (uint32_t offset : expected) in_view[offset] = true;
+    int wrong = 0;
+    for (uint32_t i = 0; i < span; i++) {
+        uint32_t want = in_view[i] ? i + (1u << 31) : i;
+        wrong += buffer[i] != want;
+    }
+    HOST_CHECK_EQ(wrong, 0);
+}
+
+static void test_layouts() {
+    // Dense tensors, including a partial last tile.
+    check_view({{3 * 16384 + 800}, {1}});
+    check_view({{7, 4096}, {4096, 1}});
+
+    // Head shard of a [tokens, heads * head_dim] activation.
+    check_view({{37, 1024}, {4096, 1}});
+    check_view({{1000, 128}, {1024, 1}});
+
+    // Slice along a middle dimension: [4, 3, 64] of [4, 5, 64].
+    check_view({{4, 3, 64}, {320, 64, 1}});
+
+    // Leading dimensions that collapse into a single row stride, and unit
+    // dimensions with arbitrary strides.
+    check_view({{2, 8, 1, 256}, {8 * 512, 512, 7, 1}});
+
+    // A single row of a strided view is dense.
+    TensorLayout layout;
+    HOST_CHECK(to_layout({{1, 64}, {4096, 1}}, layout));
+    HOST_CHECK(layout.dense());
+}
+
+static void test_unsupported() {
+    TensorLayout layout;
+    // Transposed: the last dimension is not contiguous.
+    HOST_CHECK(!to_layout({{64, 32}, {1, 64}}, layout));
+    // Every other row of a slice: the leading strides do not collapse.
+    HOST_CHECK(!to_layout({{4, 3, 64}, {320, 128, 1}}, layout));
+    // Rows that are not whole atoms would split an atom across rows.
+    HOST_CHECK(!to_layout({{16, 100}, {128, 1}}, layout));
+    HOST_CHECK(!to_layout({{16, 64}, {100, 1}}, layout));
+}
+
+static void test_offsets() {
+    TensorLayout layout{3, 16, 40};
+    HOST_CHECK_EQ(layout.numel(), 48u);
+    HOST_CHECK_EQ(layout_span(layout), 96u);
+    HOST_CHECK_EQ(layout_offset(layout, 0), 0u);
+    HOST_CHECK_EQ(layout_offset(layout, 15), 15u);
+    HOST_CHECK_EQ(layout_offset(layout, 16), 40u);
+    HOST_CHECK_EQ(layout_offset(layout, 47), 95u);
+    // Atoms past the end map to the range.
+    HOST_CHECK_EQ(layout_atom_offset(layout, 0, 6, 0, kTileElements,
+                                     kAtomStride, 192),
+                  192u);
+}
+
+int main() {
+    test_offsets();
+    test_layouts();
+    test_unsupported();
+    return host_test_result("layout_test");
+}
@@ -0,0 +1,182 @@
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <host/codec_reference.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+using namespace quickreduce::reference;
+
+// FP16 bytes of one atom, the baseline of the compression ratio.
+static constexpr int kDenseAtomBytes = kAtomValues * 2;
+
+// Activation-like values: normal, scaled by `scale`, a fraction `zeros` of
+// them zero (as after a ReLU) and a fraction `outliers` scaled by 50.
+static std::vector<uint16_t> activations(long num_atoms, float scale,
+                                         double zeros, double outliers,
+                                         unsigned seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<uint16_t> values(num_atoms * kAtomValues);
+    for (auto& v : values) {
+        float x = scale * dist(gen);
+        double c = coin(gen);
+        if (c < zeros) x = 0.0f;
+        else if (c < zeros + outliers) x *= 50.0f;
+        v = host::float_to_half(x);
+    }
+    return values;
+}
+
+// Any fp16 bit pattern, including subnormals, infinities and NaNs.
+static std::vector<uint16_t> random_bits(long num_atoms, unsigned seed) {
+    std::mt19937 gen(seed);
+    std::vector<uint16_t> values(num_atoms * kAtomValues);
+    for (auto& v : values) v = static_cast<uint16_t>(gen());
+    return values;
+}
+
+// Round trip of whole atoms: whether every bit pattern came back, and the
+// bytes written over the fp16 bytes.
+static bool exact(std::vector<uint16_t> const& values, double* ratio = nullptr) {
+    long num_atoms = static_cast<long>(values.size() / kAtomValues);
+    std::vector<uint16_t> decoded(values.size());
+    uint8_t tile[LosslessCodec::kTileStride];
+    long bytes = 0;
+    for (long a = 0; a < num_atoms; a++) {
+        LosslessCodec::encode(values.data() + a * kAtomValues, tile);
+        LosslessCodec::decode(tile, decoded.data() + a * kAtomValues);
+        bytes += LosslessCodec::bytes_written(tile);
+    }
+    if (ratio) *ratio = double(bytes) / (num_atoms * kDenseAtomBytes);
+    return decoded == values;
+}
+
+static void test_layout() {
+    using Layout = LosslessLayout;
+    HOST_CHECK_EQ(Layout::kHigh0Offset, 2048);
+    HOST_CHECK_EQ(Layout::kHigh1Offset, 3072);
+    HOST_CHECK_EQ(Layout::kBaseOffset, 3584);
+    HOST_CHECK_EQ(Layout::kMaskOffset, 3616);
+    HOST_CHECK_EQ(Layout::kRawOffset, 3648);
+    HOST_CHECK_EQ(Layout::kTileStride, 4160);
+
+    // The buffer regions are sized for a lossless tile, the largest atom of
+    // any codec.
+    HOST_CHECK_EQ(kMaxTransmittedTileSize, 8 * 4160);
+    HOST_CHECK(FPCodec::kTileStride < Layout::kTileStride);
+    HOST_CHECK(AsymmetricCodec<8>::kTileStride < Layout::kTileStride);
+    HOST_CHECK((EscapeCodec<6, 2>::kTileStride < Layout::kTileStride));
+    HOST_CHECK((TopKCodec<2, true>::kTileStride < Layout::kTileStride));
+
+    // 1.0, 0.75, 0 and -2^-3: deltas 0, 1, kZeroDelta and 3 from base 15.
+    uint32_t v[4] = {0x3A003C00, 0xB0000000, 0, 0};
+    uint32_t low[2], high[2];
+    Layout::pack_low(v, low);
+    HOST_CHECK(!Layout::pack_high(v, 15, high));
+    HOST_CHECK_EQ(high[0] & 0x3F, 0u);
+    HOST_CHECK_EQ((high[0] >> 6) & 0x3F, 0x06u);
+    HOST_CHECK_EQ((high[0] >> 12) & 0x3F, 0x1Cu);
+    HOST_CHECK_EQ((high[0] >> 18) & 0x3F, 0x2Cu);
+    uint32_t w[4];
+    Layout::unpack(low, high, false, 15, w);
+    for (int i = 0; i < 4; i++) HOST_CHECK_EQ(w[i], v[i]);
+
+    // 2^-7 is 7 binades below the base: the thread is raw.
+    v[3] = 0x2000;
+    Layout::pack_low(v, low);
+    HOST_CHECK(Layout::pack_high(v, 15, high));
+    Layout::unpack(low, high, true, 15, w);
+    for (int i = 0; i < 4; i++) HOST_CHECK_EQ(w[i], v[i]);
+}
+
+// Every bit pattern comes back, whatever the data.
+static void test_exact() {
+    HOST_CHECK(exact(activations(8, 1.0f, 0.0, 0.0, 1)));
+    HOST_CHECK(exact(activations(8, 1e-3f, 0.5, 0.01, 2)));
+    HOST_CHECK(exact(activations(8, 300.0f, 0.0, 0.05, 3)));
+    HOST_CHECK(exact(random_bits(8, 4)));
+    HOST_CHECK(exact(std::vector<uint16_t>(kAtomValues, 0)));
+    HOST_CHECK(exact(std::vector<uint16_t>(kAtomValues, 0x7C00)));
+    HOST_CHECK(exact(std::vector<uint16_t>(kAtomValues, 0x0001)));
+}
+
+// Activations compress below 15 bits per value; random bit patterns fall
+// back to raw, bounded by the tile stride.
+static void test_ratio() {
+    double ratio;
+    HOST_CHECK(exact(activations(16, 1.0f, 0.0, 0.0, 5), &ratio));
+    HOST_CHECK(ratio < 0.92);
+    HOST_CHECK(exact(activations(16, 1.0f, 0.5, 0.0, 6), &ratio));
+    HOST_CHECK(ratio < 0.92);
+    HOST_CHECK(exact(random_bits(16, 7), &ratio));
+    HOST_CHECK(ratio > 0.99);
+    HOST_CHECK(ratio <= double(LosslessCodec::kTileStride) / kDenseAtomBytes);
+}
+
+// The all-reduce is bit-exact with the fp16 codec.
+static void test_allreduce() {
+    for (ReduceOp op : {ReduceOp::SUM, ReduceOp::MAX, ReduceOp::MEAN}) {
+        std::vector<std::vector<uint16_t>> inputs;
+        for (int r = 0; r < 4; r++) {
+            inputs.push_back(activations(1, 1.0f, 0.1, 0.01, 20 + r));
+        }
+        uint16_t const* atoms[4] = {inputs[0].data(), inputs[1].data(),
+                                    inputs[2].data(), inputs[3].data()};
+        std::vector<uint16_t> fp(kAtomValues), lossless(kAtomValues);
+        reduce_atoms<FPCodec>(op, atoms, 4, fp.data());
+        reduce_atoms<LosslessCodec>(op, atoms, 4, lossless.data());
+        HOST_CHECK(fp == lossless);
+    }
+}
+
+static void report(char const* name, std::vector<uint16_t> const& values) {
+    double ratio;
+    bool ok = exact(values, &ratio);
+    std::printf("  %-28s bytes = %5.1f%%, bits/value = %5.2f%s\n", name,
+                100.0 * ratio, 16.0 * ratio, ok ? "" : " (NOT EXACT)");
+}
+
+// `lossless_codec_test bench [file]` reports the compression ratio on
+// activation-like data, and on the recorded fp16 activations of `file`
+// (raw little-endian fp16, truncated to whole atoms).
+static void compression_report(char const* path) {
+    long const num_atoms = 256;
+    std::printf("compression ratio:\n");
+    report("normal", activations(num_atoms, 1.0f, 0.0, 0.0, 11));
+    report("normal x 1e-3", activations(num_atoms, 1e-3f, 0.0, 0.0, 11));
+    report("normal, 1% outliers", activations(num_atoms, 1.0f, 0.0, 0.01, 11));
+    report("ReLU, 50% zeros", activations(num_atoms, 1.0f, 0.5, 0.0, 11));
+    report("random bits", random_bits(num_atoms, 11));
+    if (path == nullptr) return;
+    FILE* f = std::fopen(path, "rb");
+    if (f == nullptr) {
+        std::printf("  cannot open %s\n", path);
+        return;
+    }
+    std::vector<uint16_t> values;
+    uint16_t buffer[kAtomValues];
+    while (std::fread(buffer, sizeof(buffer), 1, f) == 1) {
+        values.insert(values.end(), buffer, buffer + kAtomValues);
+    }
+    std::fclose(f);
+    if (values.empty()) {
+        std::printf("  %s holds less than one atom\n", path);
+        return;
+    }
+    report(path, values);
+}
+
+int main(int argc, char** argv) {
+    test_layout();
+    test_exact();
+    test_ratio();
+    test_allreduce();
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        compression_report(argc > 2 ? argv[2] : nullptr);
+    }
+    return host_test_result("lossless_codec_test");
+}
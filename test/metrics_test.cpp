@@ -0,0 +1,117 @@
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <host/metrics.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+static void test_buckets() {
+    HOST_CHECK_EQ(metrics_size_bucket(0), 0);
+    HOST_CHECK_EQ(metrics_size_bucket(4096), 0);
+    HOST_CHECK_EQ(metrics_size_bucket(4097), 1);
+    HOST_CHECK_EQ(metrics_size_bucket(1 << 20), 8);
+    HOST_CHECK_EQ(metrics_size_bucket(uint64_t(1) << 26), 14);
+    HOST_CHECK_EQ(metrics_size_bucket((uint64_t(1) << 26) + 1), 15);
+    HOST_CHECK_EQ(metrics_size_bucket(uint64_t(1) << 40), 15);
+    HOST_CHECK_EQ(metrics_bucket_bytes(8), uint64_t(1) << 20);
+    HOST_CHECK_EQ(metrics_bucket_bytes(15), 0u);
+
+    HOST_CHECK_EQ(allreduce_logical_bytes(1 << 20, 2), uint64_t(1) << 20);
+    HOST_CHECK_EQ(allreduce_logical_bytes(1 << 20, 8), 7u << 18);
+    HOST_CHECK(std::string(quant_level_name(0)) == "FP16");
+    HOST_CHECK(std::string(quant_level_name(3)) == "Q4");
+    HOST_CHECK(std::string(quant_level_name(25)) == "FP16-L");
+    HOST_CHECK(std::string(quant_level_name(26)) == "unknown");
+}
+
+// The calls add up per codec and size bucket.
+static void test_aggregation() {
+    CommMetrics metrics;
+    metrics.record(3, 4, 1 << 20, 100000);
+    metrics.record(3, 4, 1 << 20, 100000);
+    metrics.record(3, 4, 8192, 2000);
+    metrics.record(0, 4, 1 << 20, 1 << 21);
+    metrics.record(-1, 4, 1 << 20, 1);  // ignored
+    metrics.record(kMetricsQuantLevels, 4, 1 << 20, 1);
+
+    MetricsSnapshot snapshot = metrics.snapshot(2, 4);
+    HOST_CHECK_EQ(snapshot.rank, 2);
+    HOST_CHECK_EQ(snapshot.entries.size(), 3u);
+    MetricsEntry const& small = snapshot.entries[1];
+    HOST_CHECK_EQ(small.quant_level, 3);
+    HOST_CHECK_EQ(small.size_bucket, 1);
+    HOST_CHECK_EQ(small.calls, 1u);
+    MetricsEntry const& large = snapshot.entries[2];
+    HOST_CHECK_EQ(large.size_bucket, 8);
+    HOST_CHECK_EQ(large.calls, 2u);
+    HOST_CHECK_EQ(large.input_bytes, 2u << 20);
+    HOST_CHECK_EQ(large.logical_bytes, 3u << 20);
+    HOST_CHECK_EQ(large.wire_bytes, 200000u);
+
+    MetricsEntry q4 = snapshot.total(3);
+    HOST_CHECK_EQ(q4.calls, 3u);
+    HOST_CHECK_EQ(q4.wire_bytes, 202000u);
+    MetricsEntry all = snapshot.total();
+    HOST_CHECK_EQ(all.calls, 4u);
+    HOST_CHECK_EQ(all.input_bytes, (3u << 20) + 8192);
+
+    metrics.reset();
+    HOST_CHECK(metrics.snapshot(2, 4).entries.empty());
+}
+
+// Concurrent recording loses no counts.
+static void test_concurrent() {
+    CommMetrics metrics;
+    int const num_threads = 8, calls = 20000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < calls; i++) {
+                metrics.record(t % 2, 8, 4096 << (i % 3), 10);
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    MetricsEntry all = metrics.snapshot(0, 8).total();
+    HOST_CHECK_EQ(all.calls, uint64_t(num_threads) * calls);
+    HOST_CHECK_EQ(all.wire_bytes, uint64_t(num_threads) * calls * 10);
+}
+
+static bool contains(std::string const& text, std::string const& s) {
+    return text.find(s) != std::string::npos;
+}
+
+static void test_prometheus() {
+    CommMetrics metrics;
+    metrics.record(3, 2, 1 << 20, 300000);
+    metrics.record(0, 2, uint64_t(1) << 30, uint64_t(1) << 30);
+    MetricsSnapshot snapshot = metrics.snapshot(1, 2);
+    std::string text = snapshot.prometheus();
+    HOST_CHECK(contains(
+        text, "# TYPE quickreduce_allreduce_calls_total counter\n"));
+    HOST_CHECK(contains(text,
+                        "quickreduce_allreduce_calls_total{rank=\"1\",codec="
+                        "\"Q4\",quant_level=\"3\",max_bytes=\"1048576\"} 1\n"));
+    HOST_CHECK(contains(text,
+                        "quickreduce_allreduce_wire_bytes_total{rank=\"1\","
+                        "codec=\"Q4\",quant_level=\"3\",max_bytes=\"1048576\"} "
+                        "300000\n"));
+    HOST_CHECK(contains(text, "max_bytes=\"+Inf\"} 1073741824\n"));
+    HOST_CHECK(!contains(text, "flag_wait"));
+
+    snapshot.flag_wait_ticks = 250;
+    snapshot.flag_wait_tick_hz = 100.0;
+    text = snapshot.prometheus();
+    HOST_CHECK(contains(
+        text, "quickreduce_flag_wait_seconds_total{rank=\"1\"} 2.5"));
+}
+
+int main() {
+    test_buckets();
+    test_aggregation();
+    test_concurrent();
+    test_prometheus();
+    return host_test_result("metrics_test");
+}
@@ -0,0 +1,202 @@
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <host/codec_reference.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+using namespace quickreduce::reference;
+
+using MXFP4 = MxCodec<MxFp4>;
+using MXFP6 = MxCodec<MxFp6>;
+using MXINT8 = MxCodec<MxInt8>;
+
+static std::vector<uint16_t> normal_data(long num_atoms, unsigned seed) {
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<uint16_t> values(num_atoms * kAtomValues);
+    for (auto& v : values) v = host::float_to_half(dist(gen));
+    return values;
+}
+
+// Every code decodes to the value that encodes back to it, except for the
+// negative zero of the float formats and -128 of MXINT8.
+template <class Element>
+static void check_codes(uint32_t unused) {
+    for (uint32_t code = 0; code < (1u << Element::kBits); code++) {
+        if (code == unused) continue;
+        HOST_CHECK_EQ(Element::encode(Element::decode(code)), code);
+    }
+}
+
+static void test_elements() {
+    float const fp4[8] = {0.0f, 0.5f, 1.0f, 1.5f, 2.0f, 3.0f, 4.0f, 6.0f};
+    for (uint32_t code = 0; code < 8; code++) {
+        HOST_CHECK_EQ(MxFp4::decode(code), fp4[code]);
+        HOST_CHECK_EQ(MxFp4::decode(code | 8), -fp4[code]);
+    }
+    HOST_CHECK_EQ(MxFp4::kMax, 6.0f);
+    HOST_CHECK_EQ(MxFp6::kMax, 7.5f);
+    HOST_CHECK_EQ(MxFp6::decode(1), 0.125f);
+    HOST_CHECK_EQ(MxInt8::kMax, 127.0f / 64.0f);
+
+    // Ties round to the even code, and large values saturate.
+    HOST_CHECK_EQ(MxFp4::encode(0.25f), 0u);
+    HOST_CHECK_EQ(MxFp4::encode(0.75f), 2u);
+    HOST_CHECK_EQ(MxFp4::encode(1.75f), 4u);
+    HOST_CHECK_EQ(MxFp4::encode(2.5f), 4u);
+    HOST_CHECK_EQ(MxFp4::encode(5.0f), 6u);
+    HOST_CHECK_EQ(MxFp4::encode(100.0f), 7u);
+    HOST_CHECK_EQ(MxFp4::encode(-100.0f), 15u);
+    HOST_CHECK_EQ(MxFp6::encode(7.75f), 31u);
+    HOST_CHECK_EQ(MxInt8::encode(-2.0f), 0x81u);
+
+    check_codes<MxFp4>(8);
+    check_codes<MxFp6>(32);
+    check_codes<MxInt8>(0x80);
+}
+
+// The largest value of a block lands in the top binade of the element.
+static void test_scales() {
+    HOST_CHECK_EQ(mx_shared_exponent<MxFp4>(6.0f), 0);
+    HOST_CHECK_EQ(mx_shared_exponent<MxFp4>(4.0f), 0);
+    HOST_CHECK_EQ(mx_shared_exponent<MxFp4>(3.9f), -1);
+    HOST_CHECK_EQ(mx_shared_exponent<MxFp6>(1.0f), -2);
+    HOST_CHECK_EQ(mx_shared_exponent<MxInt8>(1.0f), 0);
+    HOST_CHECK_EQ(mx_shared_exponent<MxInt8>(65504.0f), 15);
+    HOST_CHECK_EQ(mx_shared_exponent<MxFp4>(0.0f), -kMxScaleBias);
+
+    // Powers of two are exact, and a block of zeros decodes to zeros.
+    std::vector<uint16_t> values(kAtomValues, 0);
+    for (int i = 0; i < kMxBlockSize; i++) {
+        values[i] = host::float_to_half(std::ldexp(1.0f, i % 4 - 1));
+    }
+    std::vector<uint16_t> decoded(kAtomValues);
+    round_trip<MXFP4>(values.data(), 1, decoded.data());
+    HOST_CHECK(values == decoded);
+    uint8_t tile[MXFP4::kTileStride];
+    MXFP4::encode(values.data(), tile);
+    HOST_CHECK_EQ(int(tile[MXFP4::kScaleOffset]), kMxScaleBias);
+    HOST_CHECK_EQ(int(tile[MXFP4::kScaleOffset + 1]), 0);
+}
+
+static void test_layout() {
+    HOST_CHECK_EQ(MXFP4::kTileStride, 4 * 256 + 64);
+    HOST_CHECK_EQ(MXFP6::kTileStride, 6 * 256 + 64);
+    HOST_CHECK_EQ(MXINT8::kTileStride, 8 * 256 + 64);
+}
+
+// The relative error of a block is bounded by the precision of the element
+// at the top of its range, and the MX formats order as their bit-widths.
+static void test_error() {
+    long const num_atoms = 16;
+    auto values = normal_data(num_atoms, 3);
+    double fp4 = round_trip<MXFP4>(values.data(), num_atoms).relative_rmse();
+    double fp6 = round_trip<MXFP6>(values.data(), num_atoms).relative_rmse();
+    double int8 = round_trip<MXINT8>(values.data(), num_atoms).relative_rmse();
+    HOST_CHECK(fp6 < 0.35 * fp4);
+    HOST_CHECK(int8 < 0.5 * fp6);
+    HOST_CHECK(fp4 < 0.2);
+    HOST_CHECK(int8 < 0.01);
+
+    // Against the symmetric codecs of the same bit-width: the power-of-two
+    // scale leaves up to half of the element range unused.
+    double q4 = round_trip<SymmetricCodec<4>>(values.data(), num_atoms)
+                    .relative_rmse();
+    double q8 = round_trip<SymmetricCodec<8>>(values.data(), num_atoms)
+                    .relative_rmse();
+    HOST_CHECK(fp4 < 1.5 * q4);
+    HOST_CHECK(int8 < 2.0 * q8);
+}
+
+// The consumer layout holds the codes of the tiles in element order: read
+// back element by element, it decodes as the tiles do.
+template <class Codec, class Element>
+static void check_hand_over(uint64_t N) {
+    long num_atoms = static_cast<long>((N + kAtomValues - 1) / kAtomValues);
+    auto values = normal_data(num_atoms, 9);
+    std::vector<uint8_t> elements(mx_element_bytes<Element>(N), 0xAA);
+    std::vector<uint8_t> scales(mx_scale_bytes(N), 0xAA);
+    MxOutput out;
+    out.elements = elements.data();
+    out.scales = scales.data();
+    std::vector<uint16_t> decoded(values.size());
+    uint8_t tile[Codec::kTileStride];
+    for (long a = 0; a < num_atoms; a++) {
+        Codec::encode(values.data() + a * kAtomValues, tile);
+        Codec::decode(tile, decoded.data() + a * kAtomValues);
+        Codec::hand_over(tile, uint64_t(a) * kAtomValues, N, out);
+    }
+    for (uint64_t i = 0; i < N; i++) {
+        uint64_t bit = i * Element::kBits;
+        uint32_t word = uint32_t(elements[bit / 8]) |
+                        (bit / 8 + 1 < elements.size()
+                             ? uint32_t(elements[bit / 8 + 1]) << 8
+                             : 0u);
+        uint32_t code = (word >> (bit % 8)) & ((1u << Element::kBits) - 1);
+        int x = int(scales[i / kMxBlockSize]) - kMxScaleBias;
+        HOST_CHECK_EQ(host::float_to_half(std::ldexp(Element::decode(code), x)),
+                      decoded[i]);
+    }
+}
+
+static void test_hand_over() {
+    check_hand_over<MXFP4, MxFp4>(2 * kAtomValues);
+    check_hand_over<MXFP4, MxFp4>(kAtomValues + 96);
+    check_hand_over<MXFP6, MxFp6>(kAtomValues + 96);
+    check_hand_over<MXINT8, MxInt8>(kAtomValues + 32);
+}
+
+// The reference all-reduce runs the codec in both phases.
+static void test_allreduce() {
+    std::vector<std::vector<uint16_t>> inputs;
+    for (int r = 0; r < 4; r++) inputs.push_back(normal_data(1, 20 + r));
+    uint16_t const* atoms[4] = {inputs[0].data(), inputs[1].data(),
+                                inputs[2].data(), inputs[3].data()};
+    std::vector<uint16_t> fp6(kAtomValues), int8(kAtomValues);
+    reduce_atoms<MXFP6>(ReduceOp::SUM, atoms, 4, fp6.data());
+    reduce_atoms<MXINT8>(ReduceOp::SUM, atoms, 4, int8.data());
+    ErrorStats fp6_stats, int8_stats;
+    for (int i = 0; i < kAtomValues; i++) {
+        float sum = 0.0f;
+        for (int r = 0; r < 4; r++) sum += host::half_to_float(atoms[r][i]);
+        fp6_stats.add(sum, host::half_to_float(fp6[i]));
+        int8_stats.add(sum, host::half_to_float(int8[i]));
+    }
+    HOST_CHECK(fp6_stats.relative_rmse() < 0.05);
+    HOST_CHECK(int8_stats.relative_rmse() < fp6_stats.relative_rmse());
+}
+
+template <class Codec>
+static void report(char const* name, std::vector<uint16_t> const& values,
+                   long num_atoms) {
+    ErrorStats stats = round_trip<Codec>(values.data(), num_atoms);
+    std::printf("  %-7s bits/value = %5.2f, relative rmse = %.4f\n", name,
+                8.0 * Codec::kTileStride / kAtomValues, stats.relative_rmse());
+}
+
+// `mx_codec_test bench` compares the size and error of the MX codecs and of
+// the symmetric codecs.
+static void compare(long num_atoms) {
+    auto values = normal_data(num_atoms, 11);
+    std::printf("normal values:\n");
+    report<MXFP4>("MXFP4", values, num_atoms);
+    report<SymmetricCodec<4>>("Q4", values, num_atoms);
+    report<MXFP6>("MXFP6", values, num_atoms);
+    report<SymmetricCodec<6>>("Q6", values, num_atoms);
+    report<MXINT8>("MXINT8", values, num_atoms);
+    report<SymmetricCodec<8>>("Q8", values, num_atoms);
+}
+
+int main(int argc, char** argv) {
+    test_elements();
+    test_scales();
+    test_layout();
+    test_error();
+    test_hand_over();
+    test_allreduce();
+    if (argc > 1 && std::string(argv[1]) == "bench") compare(256);
+    return host_test_result("mx_codec_test");
+}
@@ -0,0 +1,182 @@
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <host/output_registry.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+// Fake IPC: the handle of rank r's allocation a is {r, a}, mapped at
+// 0x100000 * (r + 1) + 0x1000 * a in this process.
+static OutputHandle make_handle(int r, int allocation, uint64_t offset,
+                                uint64_t bytes, uint64_t id) {
+    OutputHandle h;
+    h.ipc_handle[0] = static_cast<uint8_t>(r);
+    h.ipc_handle[1] = static_cast<uint8_t>(allocation);
+    h.offset = offset;
+    h.bytes = bytes;
+    h.id = id;
+    return h;
+}
+
+struct FakeIpc {
+    int opens = 0;
+    std::vector<uintptr_t> closed;
+
+    uintptr_t operator()(uint8_t const* handle) {
+        opens++;
+        return 0x100000 * (handle[0] + 1) + 0x1000 * handle[1];
+    }
+};
+
+// Handles of the next registration of `registry` on every rank.
+static std::vector<OutputHandle> handles_of(OutputRegistry const& registry,
+                                            int world_size, int allocation,
+                                            uint64_t offset, uint64_t bytes) {
+    std::vector<OutputHandle> handles;
+    for (int r = 0; r < world_size; r++) {
+        handles.push_back(make_handle(r, allocation, offset, bytes,
+                                      registry.next_id()));
+    }
+    return handles;
+}
+
+static void test_lookup() {
+    int const rank = 1;
+    FakeIpc ipc;
+    OutputRegistry registry;
+    auto& a = registry.add(rank, 0x5000, 0x400, handles_of(registry, 4, 0, 0x80, 0x400),
+                           ipc);
+    a.device_outputs = reinterpret_cast<void*>(0xA);
+    HOST_CHECK_EQ(a.outputs.size(), size_t(4));
+    HOST_CHECK_EQ(a.outputs[rank], uintptr_t(0x5000));
+    HOST_CHECK_EQ(a.outputs[0], uintptr_t(0x100000 + 0x80));
+    HOST_CHECK_EQ(a.outputs[3], uintptr_t(0x400000 + 0x80));
+    registry.add(rank, 0x9000, 0x100, handles_of(registry, 4, 1, 0, 0x100), ipc);
+
+    // Inputs inside a registration, at any offset.
+    HOST_CHECK(registry.find(0x5000, 0x400) == &a);
+    HOST_CHECK(registry.find(0x5100, 0x200) == &a);
+    HOST_CHECK(registry.find(0x53F0, 0x10) == &a);
+    HOST_CHECK_EQ(registry.find(0x9000, 0x100)->base, uintptr_t(0x9000));
+
+    // Inputs crossing the end, before, between or after the registrations.
+    HOST_CHECK(registry.find(0x53F0, 0x20) == nullptr);
+    HOST_CHECK(registry.find(0x4FF0, 0x20) == nullptr);
+    HOST_CHECK(registry.find(0x6000, 0x10) == nullptr);
+    HOST_CHECK(registry.find(0x9100, 0x10) == nullptr);
+    HOST_CHECK(registry.find(0x1000, 0x10) == nullptr);
+
+    // Only whole registered outputs take the direct path.
+    HOST_CHECK(registry.find_exact(0x5000, 0x400) == &a);
+    HOST_CHECK(registry.find_exact(0x5100, 0x200) == nullptr);
+    HOST_CHECK(registry.find_exact(0x5000, 0x200) == nullptr);
+    HOST_CHECK_EQ(a.id, uint64_t(0));
+    HOST_CHECK_EQ(registry.find_exact(0x9000, 0x100)->id, uint64_t(1));
+    HOST_CHECK_EQ(registry.next_id(), uint64_t(2));
+}
+
+static void test_mappings() {
+    int const rank = 0;
+    FakeIpc ipc;
+    OutputRegistry registry;
+    auto close = [&](uintptr_t base) { ipc.closed.push_back(base); };
+
+    // Two outputs in the same allocation of every peer share the mappings.
+    registry.add(rank, 0x1000, 0x100, handles_of(registry, 4, 0, 0x0, 0x100), ipc);
+    registry.add(rank, 0x1100, 0x100, handles_of(registry, 4, 0, 0x100, 0x100), ipc);
+    HOST_CHECK_EQ(ipc.opens, 3);
+    HOST_CHECK_EQ(registry.num_mappings(), size_t(3));
+    HOST_CHECK_EQ(registry.find(0x1100, 0x100)->outputs[2],
+                  uintptr_t(0x300000 + 0x100));
+
+    // The mappings stay open while a registration uses them.
+    registry.invalidate(rank, 0x1000, 0x100, close);
+    HOST_CHECK_EQ(registry.size(), size_t(1));
+    HOST_CHECK(ipc.closed.empty());
+    registry.invalidate(rank, 0x1100, 0x100, close);
+    HOST_CHECK_EQ(registry.size(), size_t(0));
+    HOST_CHECK_EQ(ipc.closed.size(), size_t(3));
+    HOST_CHECK_EQ(registry.num_mappings(), size_t(0));
+
+    // Re-registering maps again.
+    registry.add(rank, 0x1000, 0x100, handles_of(registry, 4, 0, 0x0, 0x100), ipc);
+    HOST_CHECK_EQ(ipc.opens, 6);
+}
+
+static void test_invalidation() {
+    int const rank = 2;
+    FakeIpc ipc;
+    OutputRegistry registry;
+    auto close = [&](uintptr_t base) { ipc.closed.push_back(base); };
+    for (int i = 0; i < 4; i++) {
+        auto& r = registry.add(rank, 0x10000 + i * 0x1000, 0x1000,
+                               handles_of(registry, 8, i, 0, 0x1000), ipc);
+        r.device_outputs = reinterpret_cast<void*>(uintptr_t(0xD0 + i));
+    }
+    HOST_CHECK_EQ(registry.size(), size_t(4));
+
+    // A range overlapping the end of the second and the start of the third
+    // registration invalidates both, and hands back their device lists.
+    auto freed = registry.invalidate(rank, 0x11FF0, 0x20, close);
+    HOST_CHECK_EQ(freed.size(), size_t(2));
+    HOST_CHECK(freed[0] == reinterpret_cast<void*>(0xD1));
+    HOST_CHECK(freed[1] == reinterpret_cast<void*>(0xD2));
+    HOST_CHECK_EQ(ipc.closed.size(), size_t(2 * 7));
+    HOST_CHECK(registry.find(0x11000, 0x10) == nullptr);
+    HOST_CHECK(registry.find(0x12000, 0x10) == nullptr);
+    HOST_CHECK(registry.find(0x10000, 0x1000) != nullptr);
+    HOST_CHECK(registry.find(0x13000, 0x1000) != nullptr);
+
+    // Adjacent ranges do not overlap.
+    HOST_CHECK(registry.invalidate(rank, 0x11000, 0x2000, close).empty());
+    HOST_CHECK_EQ(registry.size(), size_t(2));
+
+    // Overlapping registrations must be invalidated first.
+    bool threw = false;
+    try {
+        registry.add(rank, 0x10800, 0x1000, handles_of(registry, 8, 9, 0, 0x1000), ipc);
+    } catch (std::logic_error const&) {
+        threw = true;
+    }
+    HOST_CHECK(threw);
+
+    // Outputs must have the same size on every rank.
+    auto handles = handles_of(registry, 8, 9, 0, 0x1000);
+    handles[5].bytes = 0x800;
+    threw = false;
+    try {
+        registry.add(rank, 0x20000, 0x1000, handles, ipc);
+    } catch (std::invalid_argument const&) {
+        threw = true;
+    }
+    HOST_CHECK(threw);
+
+    // A rank a registration behind pairs its output with the next output of
+    // the others: the numbers differ.
+    handles = handles_of(registry, 8, 9, 0, 0x1000);
+    handles[3].id--;
+    threw = false;
+    try {
+        registry.add(rank, 0x20000, 0x1000, handles, ipc);
+    } catch (std::invalid_argument const&) {
+        threw = true;
+    }
+    HOST_CHECK(threw);
+    HOST_CHECK_EQ(registry.size(), size_t(2));
+
+    // clear releases everything.
+    auto all = registry.clear(rank, close);
+    HOST_CHECK_EQ(all.size(), size_t(2));
+    HOST_CHECK_EQ(registry.size(), size_t(0));
+    HOST_CHECK_EQ(registry.num_mappings(), size_t(0));
+    HOST_CHECK_EQ(ipc.closed.size(), size_t(4 * 7));
+}
+
+int main() {
+    test_lookup();
+    test_mappings();
+    test_invalidation();
+    return host_test_result("output_registry_test");
+}
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <host/perf_model.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+using namespace quickreduce::perf;
+
+// All-reduce latencies (us) of the README, 2/4/8xMI300X: FP16, Q8, Q6, Q4
+// for 32KB to 64MB.
+static constexpr int kNumSizes = 12;
+static constexpr double kLatency[3][4][kNumSizes] = {
+    {{8.47, 8.98, 10.31, 12.70, 18.31, 28.78, 49.83, 95.29, 191.13, 377.52,
+      737.50, 1463.51},
+     {20.45, 20.34, 21.46, 21.18, 23.52, 28.46, 39.63, 63.31, 115.01, 217.37,
+      423.87, 829.17},
+     {23.13, 22.76, 22.46, 22.77, 24.05, 27.68, 36.05, 54.28, 93.22, 174.35,
+      335.08, 650.92},
+     {20.21, 20.93, 21.24, 20.88, 22.35, 24.01, 29.68, 42.23, 70.24, 131.06,
+      249.87, 468.47}},
+    {{10.59, 11.02, 11.95, 12.90, 15.60, 21.92, 35.60, 66.23, 132.53, 239.45,
+      444.78, 831.42},
+     {23.29, 23.21, 23.89, 24.03, 25.53, 28.76, 34.77, 54.18, 108.27, 222.71,
+      394.30, 640.28},
+     {23.83, 23.47, 24.06, 24.47, 26.24, 29.18, 33.69, 43.84, 76.72, 162.61,
+      303.77, 488.78},
+     {23.23, 23.79, 23.57, 23.89, 26.15, 29.08, 33.57, 40.30, 58.12, 113.67,
+      218.10, 374.30}},
+    {{14.81, 15.41, 16.15, 16.36, 17.26, 20.01, 27.90, 46.84, 90.34, 147.05,
+      257.34, 463.72},
+     {27.51, 28.27, 28.91, 28.28, 29.71, 32.68, 36.40, 44.99, 67.73, 157.56,
+      303.94, 481.63},
+     {28.80, 28.54, 28.94, 29.00, 30.52, 33.60, 37.64, 46.98, 64.51, 106.20,
+      227.31, 372.07},
+     {25.79, 27.31, 27.47, 27.21, 28.85, 31.89, 35.43, 43.60, 60.08, 82.84,
+      157.92, 272.68}},
+};
+
+static std::vector<Sample> readme_samples() {
+    int const world_sizes[3] = {2, 4, 8};
+    int const quant_levels[4] = {0, 1, 2, 3};
+    std::vector<Sample> samples;
+    for (int w = 0; w < 3; w++) {
+        for (int c = 0; c < 4; c++) {
+            for (int i = 0; i < kNumSizes; i++) {
+                samples.push_back({world_sizes[w], quant_levels[c],
+                                   32768.0 * (1 << i), kLatency[w][c][i]});
+            }
+        }
+    }
+    return samples;
+}
+
+struct FitError {
+    double median = 0.0;  // median relative error
+    double max = 0.0;     // max relative error
+};
+
+static FitError fit_error(MachineModel const& m,
+                          std::vector<CodecModel> const& codecs,
+                          std::vector<Sample> const& samples) {
+    std::vector<double> errors;
+    for (auto const& s : samples) {
+        for (auto const& c : codecs) {
+            if (c.quant_level != s.quant_level) continue;
+            double p = predict_us(m, c, s.world_size, s.bytes);
+            errors.push_back(std::fabs(p - s.latency_us) / s.latency_us);
+        }
+    }
+    std::sort(errors.begin(), errors.end());
+    return {errors[errors.size() / 2], errors.back()};
+}
+
+static void print_model(MachineModel const& m,
+                        std::vector<CodecModel> const& codecs) {
+    std::printf("  launch_us = %.2f, flag_peer_us = %.3f, link_gbps = %.1f, "
+                "fabric_scaling = %.3f, overlap_penalty = %.3f\n",
+                m.launch_us, m.flag_peer_us, m.link_gbps, m.fabric_scaling,
+                m.overlap_penalty);
+    for (auto const& c : codecs) {
+        std::printf("  %-5s ratio = %.3f, fixed_us = %.2f, us/MB = %.2f\n",
+                    c.name.c_str(), c.transmitted_ratio, c.fixed_us,
+                    c.compute_us_per_mb);
+    }
+}
+
+// The preset reproduces the README tables.
+static void test_preset() {
+    FitError error = fit_error(mi300x_machine(), mi300x_codecs(),
+                               readme_samples());
+    std::printf("MI300X preset: median error %.1f%%, max error %.1f%%\n",
+                100 * error.median, 100 * error.max);
+    HOST_CHECK(error.median < 0.10);
+    HOST_CHECK(error.max < 0.25);
+}
+
+// Calibrating from a generic starting point converges to a fit at least as
+// good as the preset.
+static void test_calibration() {
+    MachineModel m{10.0, 1.0, 20.0, 0.5, 5300.0, 0.5, 1216};
+    std::vector<CodecModel> codecs = {
+        {"FP16", 0, 1.0, 1.0, 1.0},
+        {"Q8", 1, symmetric_ratio<8>(), 1.0, 1.0},
+        {"Q6", 2, symmetric_ratio<6>(), 1.0, 1.0},
+        {"Q4", 3, symmetric_ratio<4>(), 1.0, 1.0},
+    };
+    auto samples = readme_samples();
+    double loss = calibrate(m, codecs, samples);
+    double preset_loss =
+        calibration_loss(mi300x_machine(), mi300x_codecs(), samples);
+    std::printf("Calibrated from scratch (loss %.3f, preset %.3f):\n", loss,
+                preset_loss);
+    print_model(m, codecs);
+    HOST_CHECK(loss <= preset_loss * 1.05);
+    FitError error = fit_error(m, codecs, samples);
+    HOST_CHECK(error.median < 0.10);
+}
+
+static void test_model_shape() {
+    MachineModel m = mi300x_machine();
+    auto codecs = with_generated_codecs(mi300x_codecs());
+    HOST_CHECK_EQ(codecs.size(), size_t(7));
+
+    // Layout ratios: Q4 sends 28% of the fp16 bytes.
+    HOST_CHECK_NEAR(symmetric_ratio<4>(), 1152.0 / 4096.0, 1e-12);
+    HOST_CHECK_NEAR(symmetric_ratio<5>(), 1408.0 / 4096.0, 1e-12);
+
+    // Latency grows with the size, and fewer bits win at large sizes.
+    for (int ws : {2, 4, 8}) {
+        for (auto const& c : codecs) {
+            HOST_CHECK(predict_us(m, c, ws, 1 << 20) <
+                       predict_us(m, c, ws, 2 << 20));
+        }
+        HOST_CHECK(predict_us(m, codecs[3], ws, 1 << 30) <
+                   predict_us(m, codecs[0], ws, 1 << 30));
+    }
+
+    // Q5 sits between Q4 and Q6.
+    CodecModel const& q5 = codecs[5];
+    HOST_CHECK(q5.name == "Q5");
+    for (double bytes : {1e6, 64e6}) {
+        double t4 = predict_us(m, codecs[3], 8, bytes);
+        double t5 = predict_us(m, q5, 8, bytes);
+        double t6 = predict_us(m, codecs[2], 8, bytes);
+        HOST_CHECK(std::min(t4, t6) <= t5 && t5 <= std::max(t4, t6));
+    }
+}
+
+// FP16 wins small messages, compression wins large ones, and the 2xMI300X
+// crossover away from FP16 lies where the README table has it (512KB-2MB).
+static void test_thresholds() {
+    MachineModel m = mi300x_machine();
+    auto codecs = mi300x_codecs();
+    for (int ws : {2, 4, 8}) {
+        auto thresholds = dispatch_thresholds(m, codecs, ws, 32e3, 1e9);
+        HOST_CHECK(!thresholds.empty());
+        HOST_CHECK_EQ(thresholds.front().quant_level, 0);
+        HOST_CHECK(thresholds.back().quant_level != 0);
+        for (size_t i = 1; i < thresholds.size(); i++) {
+            HOST_CHECK(thresholds[i].min_bytes > thresholds[i - 1].min_bytes);
+        }
+    }
+    auto two = dispatch_thresholds(m, codecs, 2, 32e3, 1e9);
+    HOST_CHECK(two.size() >= 2);
+    HOST_CHECK(two[1].min_bytes > 512e3 && two[1].min_bytes < 2e6);
+
+    // Restricting to codecs of 6 bits or more never picks Q4.
+    auto at_least_q6 = dispatch_thresholds(
+        m, codecs, 8, 32e3, 1e9,
+        [](CodecModel const& c) { return c.quant_level != 3; });
+    for (auto const& t : at_least_q6) HOST_CHECK(t.quant_level != 3);
+}
+
+// `perf_model_test thresholds` prints the dispatch table of the preset.
+static void print_thresholds() {
+    MachineModel m = mi300x_machine();
+    auto codecs = with_generated_codecs(mi300x_codecs());
+    for (int ws : {2, 4, 8}) {
+        std::printf("%dxMI300X:\n", ws);
+        for (auto const& t : dispatch_thresholds(m, codecs, ws, 32e3, 2e9)) {
+            for (auto const& c : codecs) {
+                if (c.quant_level != t.quant_level) continue;
+                std::printf("  >= %10.0f B: %-5s (quant_level %d)\n",
+                            t.min_bytes, c.name.c_str(), c.quant_level);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    test_preset();
+    test_calibration();
+    test_model_shape();
+    test_thresholds();
+    if (argc > 1 && std::string(argv[1]) == "thresholds") print_thresholds();
+    return host_test_result("perf_model_test");
+}
@@ -0,0 +1,187 @@
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <host/codec_reference.h>
+#include <host/perf_model.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+using namespace quickreduce::reference;
+
+static constexpr int kNumAtoms = 16;
+
+// Inputs of every rank: a component shared by the ranks plus a component of
+// each rank. `shared` = 0 gives independent inputs, 1 identical ones.
+static std::vector<std::vector<uint16_t>> rank_inputs(int world_size,
+                                                      float shared,
+                                                      unsigned seed) {
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<float> common(kNumAtoms * kAtomValues);
+    for (auto& v : common) v = dist(gen);
+    std::vector<std::vector<uint16_t>> inputs(
+        world_size, std::vector<uint16_t>(common.size()));
+    for (auto& rank : inputs) {
+        for (size_t i = 0; i < common.size(); i++) {
+            rank[i] = host::float_to_half(shared * common[i] +
+                                          (1.0f - shared) * dist(gen));
+        }
+    }
+    return inputs;
+}
+
+// Error of the two-shot sum with Phase1/Phase2 codecs against the exact sum
+// of the fp16 inputs.
+template <class Phase1, class Phase2>
+static ErrorStats allreduce_error(
+    std::vector<std::vector<uint16_t>> const& inputs) {
+    int world_size = static_cast<int>(inputs.size());
+    ErrorStats stats;
+    std::vector<uint16_t const*> atoms(world_size);
+    std::vector<uint16_t> result(kAtomValues);
+    for (int a = 0; a < kNumAtoms; a++) {
+        for (int r = 0; r < world_size; r++) {
+            atoms[r] = inputs[r].data() + a * kAtomValues;
+        }
+        reduce_atoms<Phase1, Phase2>(ReduceOp::SUM, atoms.data(), world_size,
+                                     result.data());
+        for (int i = 0; i < kAtomValues; i++) {
+            double sum = 0.0;
+            for (int r = 0; r < world_size; r++) {
+                sum += host::half_to_float(atoms[r][i]);
+            }
+            stats.add(static_cast<float>(sum), host::half_to_float(result[i]));
+        }
+    }
+    return stats;
+}
+
+// A codec of the frontier: relative error of the sum and the latency model.
+struct Point {
+    std::string name;
+    double error;
+    perf::CodecModel model;
+};
+
+static std::vector<Point> frontier_points(
+    std::vector<std::vector<uint16_t>> const& inputs) {
+    auto codecs = perf::mi300x_codecs();
+    perf::CodecModel fp = codecs[0], q8 = codecs[1], q6 = codecs[2],
+                     q4 = codecs[3];
+    auto error = [&](auto stats) { return stats.relative_rmse(); };
+    using Q4 = SymmetricCodec<4>;
+    using Q6 = SymmetricCodec<6>;
+    using Q8 = SymmetricCodec<8>;
+    return {
+        {"FP16", error(allreduce_error<FPCodec, FPCodec>(inputs)), fp},
+        {"Q8", error(allreduce_error<Q8, Q8>(inputs)), q8},
+        {"Q6", error(allreduce_error<Q6, Q6>(inputs)), q6},
+        {"Q4", error(allreduce_error<Q4, Q4>(inputs)), q4},
+        {"Q4>Q8", error(allreduce_error<Q4, Q8>(inputs)),
+         perf::paired_codec("Q4>Q8", 13, q4, q8)},
+        {"Q4>FP16", error(allreduce_error<Q4, FPCodec>(inputs)),
+         perf::paired_codec("Q4>FP16", 14, q4, fp)},
+        {"Q6>Q8", error(allreduce_error<Q6, Q8>(inputs)),
+         perf::paired_codec("Q6>Q8", 15, q6, q8)},
+        {"Q6>FP16", error(allreduce_error<Q6, FPCodec>(inputs)),
+         perf::paired_codec("Q6>FP16", 16, q6, fp)},
+        {"Q8>FP16", error(allreduce_error<Q8, FPCodec>(inputs)),
+         perf::paired_codec("Q8>FP16", 17, q8, fp)},
+    };
+}
+
+// Phase-1 error is added by every rank, Phase-2 error once to the sum: a
+// finer Phase-2 codec removes the second term.
+static void test_combined_error() {
+    for (int world_size : {2, 8}) {
+        auto inputs = rank_inputs(world_size, 0.0f, 7 + world_size);
+        using Q4 = SymmetricCodec<4>;
+        using Q6 = SymmetricCodec<6>;
+        using Q8 = SymmetricCodec<8>;
+        double fp = allreduce_error<FPCodec, FPCodec>(inputs).relative_rmse();
+        double q4 = allreduce_error<Q4, Q4>(inputs).relative_rmse();
+        double q4_q8 = allreduce_error<Q4, Q8>(inputs).relative_rmse();
+        double q4_fp = allreduce_error<Q4, FPCodec>(inputs).relative_rmse();
+        double q6 = allreduce_error<Q6, Q6>(inputs).relative_rmse();
+        double q6_q8 = allreduce_error<Q6, Q8>(inputs).relative_rmse();
+        double q8 = allreduce_error<Q8, Q8>(inputs).relative_rmse();
+        double q8_fp = allreduce_error<Q8, FPCodec>(inputs).relative_rmse();
+
+        // Only the fp16 rounding of the accumulation.
+        HOST_CHECK(fp < 1e-3);
+        // Two independent error terms of the same size add in quadrature.
+        HOST_CHECK(q4_q8 < 0.85 * q4);
+        HOST_CHECK(q4_fp <= q4_q8 && q4_q8 < 1.05 * q4_fp);
+        HOST_CHECK(q6_q8 < 0.85 * q6);
+        HOST_CHECK(q8_fp < 0.85 * q8);
+        // The Phase-1 codec still bounds the error.
+        HOST_CHECK(q6_q8 < q4_q8 && q4_fp > q6);
+    }
+
+    // Correlated inputs: the sum grows with the world size faster than the
+    // independent Phase-1 errors, so Phase-2 dominates the error of a single
+    // codec.
+    auto inputs = rank_inputs(8, 0.9f, 21);
+    using Q4 = SymmetricCodec<4>;
+    using Q8 = SymmetricCodec<8>;
+    double q4 = allreduce_error<Q4, Q4>(inputs).relative_rmse();
+    double q4_q8 = allreduce_error<Q4, Q8>(inputs).relative_rmse();
+    HOST_CHECK(q4_q8 < 0.6 * q4);
+}
+
+// The pairs span the range between their two codecs in the latency model.
+static void test_paired_model() {
+    auto m = perf::mi300x_machine();
+    auto codecs = perf::mi300x_codecs();
+    auto q4_q8 = perf::paired_codec("Q4>Q8", 13, codecs[3], codecs[1]);
+    HOST_CHECK_NEAR(q4_q8.transmitted_ratio,
+                    0.5 * (perf::symmetric_ratio<4>() +
+                           perf::symmetric_ratio<8>()),
+                    1e-12);
+    for (int world_size : {2, 4, 8}) {
+        double bytes = 64e6;
+        double t4 = perf::predict_us(m, codecs[3], world_size, bytes);
+        double t8 = perf::predict_us(m, codecs[1], world_size, bytes);
+        double t = perf::predict_us(m, q4_q8, world_size, bytes);
+        HOST_CHECK(t4 <= t && t <= t8);
+    }
+}
+
+// `phase_codec_test bench` prints the latency/accuracy frontier of the
+// single codecs and the pairs, for independent and correlated inputs. A
+// codec is on the frontier ('*') if no other codec is both faster and more
+// accurate.
+static void print_frontier() {
+    auto m = perf::mi300x_machine();
+    for (float shared : {0.0f, 0.9f}) {
+        for (int world_size : {2, 4, 8}) {
+            auto points =
+                frontier_points(rank_inputs(world_size, shared, 5));
+            for (double bytes : {1e6, 16e6, 64e6}) {
+                std::printf("%dxMI300X, %.0fMB, shared = %.1f:\n", world_size,
+                            bytes / 1e6, shared);
+                for (auto const& p : points) {
+                    double us = perf::predict_us(m, p.model, world_size, bytes);
+                    bool dominated = false;
+                    for (auto const& q : points) {
+                        double q_us =
+                            perf::predict_us(m, q.model, world_size, bytes);
+                        dominated |= q_us < us && q.error < p.error;
+                    }
+                    std::printf("  %c %-8s %9.1f us  rel. error %.2e\n",
+                                dominated ? ' ' : '*', p.name.c_str(), us,
+                                p.error);
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    test_combined_error();
+    test_paired_model();
+    if (argc > 1 && std::string(argv[1]) == "bench") print_frontier();
+    return host_test_result("phase_codec_test");
+}
@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <host/codec_policy.h>
+#include <host/codec_reference.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+using namespace quickreduce::reference;
+
+static std::vector<uint16_t> normal_atoms(long num_atoms, unsigned seed) {
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<uint16_t> values(num_atoms * kAtomValues);
+    for (auto& v : values) v = host::float_to_half(dist(gen));
+    return values;
+}
+
+static QuantErrorRecord record_of(double relative_rmse) {
+    QuantErrorRecord record;
+    record.phase[0].sum_sq_value = 1.0f;
+    record.phase[0].sum_sq_error =
+        static_cast<float>(relative_rmse * relative_rmse);
+    record.phase[0].count = 1;
+    return record;
+}
+
+// The stats of the kernel reduction, on a codec round trip: they match the
+// reference error stats, and merging partial stats gives the whole.
+static void test_stats() {
+    long const num_atoms = 4;
+    auto values = normal_atoms(num_atoms, 1);
+    std::vector<uint16_t> decoded(values.size());
+    ErrorStats reference =
+        round_trip<SymmetricCodec<6>>(values.data(), num_atoms, decoded.data());
+
+    QuantErrorStats whole, first, second;
+    for (size_t i = 0; i < values.size(); i++) {
+        float x = host::half_to_float(values[i]);
+        float y = host::half_to_float(decoded[i]);
+        add_quant_error(whole, x, y);
+        add_quant_error(i < values.size() / 2 ? first : second, x, y);
+    }
+    HOST_CHECK_EQ(whole.count, values.size());
+    HOST_CHECK_NEAR(quant_error_max_abs(whole), reference.max_abs_error, 1e-6);
+    HOST_CHECK_NEAR(quant_error_relative_rmse(whole),
+                    reference.relative_rmse(), 1e-5);
+
+    merge_quant_error(first, second);
+    HOST_CHECK_EQ(first.count, whole.count);
+    HOST_CHECK_EQ(first.max_abs_error, whole.max_abs_error);
+    HOST_CHECK_NEAR(first.sum_sq_error, whole.sum_sq_error,
+                    1e-5 * whole.sum_sq_error);
+
+    // The max abs error compares as uint32 bits.
+    QuantErrorStats a, b;
+    add_quant_error(a, 1.0f, 1.5f);
+    add_quant_error(b, 1.0f, 3.0f);
+    merge_quant_error(a, b);
+    HOST_CHECK_EQ(quant_error_max_abs(a), 2.0f);
+
+    // Non-finite errors read as an infinite error.
+    QuantErrorStats overflow;
+    add_quant_error(overflow, 1.0f, std::numeric_limits<float>::infinity());
+    HOST_CHECK(std::isinf(quant_error_relative_rmse(overflow)));
+    HOST_CHECK(std::isinf(quant_error_max_abs(overflow)));
+    QuantErrorStats zeros;
+    add_quant_error(zeros, 0.0f, 0.0f);
+    HOST_CHECK_EQ(quant_error_relative_rmse(zeros), 0.0);
+
+    // Tile sampling.
+    QuantErrorRecord record;
+    QuantErrorTelemetry telemetry{&record, 4};
+    HOST_CHECK(telemetry.sampled(0) == &record);
+    HOST_CHECK(telemetry.sampled(3) == nullptr);
+    HOST_CHECK(telemetry.sampled(8) == &record);
+    HOST_CHECK(QuantErrorTelemetry().sampled(0) == nullptr);
+}
+
+static void test_totals() {
+    QuantErrorTotals totals;
+    totals.add(2, record_of(0.1));
+    totals.add(2, record_of(0.3));
+    totals.add(1, record_of(0.01));
+    HOST_CHECK_EQ(totals.totals().size(), 2u);
+    auto const& q6 = totals.totals().at(2);
+    HOST_CHECK_EQ(q6.records, 2u);
+    HOST_CHECK_EQ(q6.phase[0].count, 2u);
+    HOST_CHECK_EQ(q6.phase[1].count, 0u);
+    HOST_CHECK_NEAR(q6.phase[0].relative_rmse(), std::sqrt(0.05), 1e-6);
+}
+
+// Every level climbs to a fixed point within a few steps, a lossless one
+// except for the MX levels.
+static void test_ladder() {
+    for (int level = 0; level < 26; level++) {
+        int l = level;
+        for (int step = 0; step < 8; step++) l = higher_precision_level(l);
+        HOST_CHECK_EQ(higher_precision_level(l), l);
+        if (level >= 22 && level <= 24) {
+            HOST_CHECK_EQ(l, 24);
+        } else if (level == 25) {
+            HOST_CHECK_EQ(l, 25);
+        } else {
+            HOST_CHECK_EQ(l, 0);
+        }
+    }
+    HOST_CHECK_EQ(higher_precision_level(3), 11);
+    HOST_CHECK_EQ(higher_precision_level(2), 10);
+}
+
+static void test_policy() {
+    // Disabled: nothing changes.
+    AdaptiveCodecPolicy disabled;
+    disabled.observe(2, 2, record_of(1.0));
+    disabled.observe(2, 2, record_of(1.0));
+    HOST_CHECK_EQ(disabled.level(2), 2);
+    HOST_CHECK_EQ(disabled.proposal()[2], 0);
+
+    CodecPolicyConfig config;
+    config.max_relative_rmse = 0.05;
+    config.escalate_after = 2;
+    config.relax_after = 3;
+    AdaptiveCodecPolicy policy(config);
+    HOST_CHECK_EQ(policy.level(2), 2);
+    auto proposed = [&](int level) { return policy.proposal()[level]; };
+
+    // One record above the threshold is not enough; two in a row propose a
+    // step, which runs once applied.
+    policy.observe(2, 2, record_of(0.1));
+    policy.observe(2, 2, record_of(0.04));
+    policy.observe(2, 2, record_of(0.1));
+    HOST_CHECK_EQ(proposed(2), 0);
+    policy.observe(2, 2, record_of(0.1));
+    HOST_CHECK_EQ(proposed(2), 1);
+    HOST_CHECK_EQ(policy.level(2), 2);
+    policy.apply(policy.proposal());
+    HOST_CHECK_EQ(policy.level(2), 10);
+    HOST_CHECK_EQ(policy.raised_levels().at(2), 10);
+    HOST_CHECK_EQ(policy.level(3), 3);
+
+    // Records of calls that still ran Q6 are ignored.
+    policy.observe(2, 2, record_of(0.1));
+    policy.observe(2, 2, record_of(0.1));
+    HOST_CHECK_EQ(proposed(2), 1);
+
+    // A non-finite error counts as above the threshold.
+    QuantErrorRecord overflow;
+    add_quant_error(overflow.phase[1], 1.0f,
+                    std::numeric_limits<float>::infinity());
+    policy.observe(2, 10, overflow);
+    policy.observe(2, 10, overflow);
+    HOST_CHECK_EQ(proposed(2), 2);
+    policy.apply(policy.proposal());
+    HOST_CHECK_EQ(policy.level(2), 1);
+
+    // One step back down after relax_after low records in a row.
+    policy.observe(2, 1, record_of(0.01));
+    policy.observe(2, 1, record_of(0.01));
+    policy.observe(2, 1, record_of(0.03));  // between: resets the run
+    policy.observe(2, 1, record_of(0.01));
+    policy.observe(2, 1, record_of(0.01));
+    HOST_CHECK_EQ(proposed(2), 2);
+    policy.observe(2, 1, record_of(0.01));
+    HOST_CHECK_EQ(proposed(2), 1);
+    HOST_CHECK_EQ(policy.level(2), 1);
+    policy.apply(policy.proposal());
+    HOST_CHECK_EQ(policy.level(2), 10);
+    for (int i = 0; i < 3; i++) policy.observe(2, 10, record_of(0.0));
+    policy.apply(policy.proposal());
+    HOST_CHECK_EQ(policy.level(2), 2);
+    HOST_CHECK(policy.raised_levels().empty());
+
+    // Steps past the end of the ladder run its last level.
+    std::vector<int32_t> steps(AdaptiveCodecPolicy::kLevels, 0);
+    steps[2] = 100;
+    policy.apply(steps);
+    HOST_CHECK_EQ(policy.level(2), 0);
+    HOST_CHECK_EQ(proposed(2), 3);
+    bool threw = false;
+    try {
+        policy.apply(std::vector<int32_t>(3, 0));
+    } catch (std::invalid_argument const&) {
+        threw = true;
+    }
+    HOST_CHECK(threw);
+
+    // The record's worse phase decides; empty phases are skipped.
+    QuantErrorRecord mixed = record_of(0.01);
+    mixed.phase[1].sum_sq_value = 1.0f;
+    mixed.phase[1].sum_sq_error = 0.01f;
+    mixed.phase[1].count = 1;
+    HOST_CHECK_NEAR(record_relative_rmse(mixed), 0.1, 1e-6);
+}
+
+// Two ranks see different errors, and read their records back after random
+// delays: they propose different steps, but run the same level on every call
+// as they apply the max of the proposals at the same calls.
+static void test_collective() {
+    CodecPolicyConfig config;
+    config.max_relative_rmse = 0.05;
+    config.escalate_after = 2;
+    config.relax_after = 4;
+    AdaptiveCodecPolicy ranks[2] = {AdaptiveCodecPolicy(config),
+                                    AdaptiveCodecPolicy(config)};
+    struct Pending {
+        int arrival;
+        int ran;
+        double rmse;
+    };
+    std::vector<Pending> pending[2];
+    std::mt19937 gen(7);
+    int const apply_every = 16;
+    int mismatches = 0, disagreements = 0;
+    bool reached_fp16 = false;
+    for (int call = 0; call < 3000; call++) {
+        if (call % apply_every == 0) {
+            auto steps = ranks[0].proposal();
+            auto other = ranks[1].proposal();
+            disagreements += steps != other;
+            for (size_t l = 0; l < steps.size(); l++) {
+                steps[l] = std::max(steps[l], other[l]);
+            }
+            for (auto& rank : ranks) rank.apply(steps);
+        }
+        int level = ranks[0].level(2);
+        mismatches += ranks[1].level(2) != level;
+        reached_fp16 |= level == 0;
+        for (int r = 0; r < 2; r++) {
+            // Only rank 0 sees large errors, during calls [500, 1500).
+            bool large = r == 0 && call >= 500 && call < 1500;
+            pending[r].push_back({call + static_cast<int>(gen() % 40), level,
+                                  large ? 0.1 : 0.01});
+            for (auto it = pending[r].begin(); it != pending[r].end();) {
+                if (it->arrival > call) {
+                    ++it;
+                    continue;
+                }
+                ranks[r].observe(2, it->ran, record_of(it->rmse));
+                it = pending[r].erase(it);
+            }
+        }
+    }
+    HOST_CHECK_EQ(mismatches, 0);
+    HOST_CHECK(disagreements > 0);
+    // Rank 0 raised Q6 up to FP16, and both stepped back down after it.
+    HOST_CHECK(reached_fp16);
+    HOST_CHECK_EQ(ranks[0].level(2), 2);
+    HOST_CHECK_EQ(ranks[1].level(2), 2);
+}
+
+int main() {
+    test_stats();
+    test_totals();
+    test_ladder();
+    test_policy();
+    test_collective();
+    return host_test_result("quant_error_test");
+}
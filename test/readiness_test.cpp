@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <core/readiness.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+// CPU harness of the producer readiness protocol. Producer threads write the
+// chunks of the input in random order and publish each chunk with a release
+// store of the epoch, like signal_tile_ready. Consumer threads stand for the
+// blocks of the two-shot kernel: they visit the tiles in kernel order, wait
+// on the flags of a tile with the same index math as wait_tile_ready, then
+// check that the whole tile holds the values of the current epoch.
+
+static constexpr uint32_t kTileElements = 16384;
+
+static void test_flag_ranges() {
+    // One flag per tile.
+    FlagRange r = readiness_tile_flags(3, kTileElements, 10 * kTileElements,
+                                       kTileElements);
+    HOST_CHECK_EQ(r.first, 3u);
+    HOST_CHECK_EQ(r.last, 4u);
+
+    // Finer producer chunks: a tile waits on several flags.
+    r = readiness_tile_flags(1, kTileElements, 10 * kTileElements, 4096);
+    HOST_CHECK_EQ(r.first, 4u);
+    HOST_CHECK_EQ(r.last, 8u);
+
+    // Coarser chunks: several tiles share a flag.
+    r = readiness_tile_flags(5, kTileElements, 10 * kTileElements,
+                             4 * kTileElements);
+    HOST_CHECK_EQ(r.first, 1u);
+    HOST_CHECK_EQ(r.last, 2u);
+
+    // Chunks that do not divide the tile, and a partial last tile.
+    uint32_t N = 3 * kTileElements + 100;
+    r = readiness_tile_flags(1, kTileElements, N, 10000);
+    HOST_CHECK_EQ(r.first, 1u);
+    HOST_CHECK_EQ(r.last, 4u);
+    r = readiness_tile_flags(3, kTileElements, N, 10000);
+    HOST_CHECK_EQ(r.first, 4u);
+    HOST_CHECK_EQ(r.last, 5u);
+    HOST_CHECK_EQ(readiness_num_flags(N, 10000), 5u);
+
+    // Tiles past the end of the problem wait on nothing.
+    r = readiness_tile_flags(4, kTileElements, N, 10000);
+    HOST_CHECK_EQ(r.last - r.first, 0u);
+
+    // Every element is covered by the flags of its tile.
+    for (uint32_t flag_elements : {1000u, 4096u, 16384u, 50000u}) {
+        uint32_t num_flags = readiness_num_flags(N, flag_elements);
+        for (uint32_t tile = 0; tile * kTileElements < N; tile++) {
+            FlagRange range =
+                readiness_tile_flags(tile, kTileElements, N, flag_elements);
+            uint32_t begin = tile * kTileElements;
+            uint32_t end = std::min(begin + kTileElements, N);
+            HOST_CHECK(range.first * flag_elements <= begin);
+            HOST_CHECK(std::min(range.last * flag_elements, N) >= end);
+            HOST_CHECK(range.last <= num_flags);
+        }
+    }
+}
+
+struct Harness {
+    uint32_t N;
+    uint32_t flag_elements;
+    std::vector<std::atomic<uint32_t>> data;
+    std::vector<std::atomic<uint32_t>> flags;
+    std::atomic<int> stale_reads{0};
+    std::atomic<uint32_t> chunks_written{0};
+    std::atomic<uint32_t> tiles_consumed{0};
+
+    Harness(uint32_t n, uint32_t chunk)
+        : N(n),
+          flag_elements(chunk),
+          data(n),
+          flags(readiness_num_flags(n, chunk)) {
+        for (auto& f : flags) f.store(0);
+        for (auto& d : data) d.store(0);
+    }
+
+    // Mirrors set_sync_flag.
+    void signal(uint32_t chunk, uint32_t epoch) {
+        flags[chunk].store(epoch, std::memory_order_release);
+    }
+
+    // Mirrors wait_sync_flag followed by the fence of wait_tile_ready.
+    void wait(uint32_t chunk, uint32_t epoch) {
+        while (flags[chunk].load(std::memory_order_relaxed) != epoch) {
+            std::this_thread::yield();
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    void produce(std::vector<uint32_t> const& chunks, uint32_t epoch,
+                 bool hold_tail) {
+        for (size_t i = 0; i < chunks.size(); i++) {
+            // Hold the last chunks back until a consumer made progress: the
+            // consumers must not wait for the producer to finish.
+            if (hold_tail && i == chunks.size() / 2) {
+                while (tiles_consumed.load() == 0) std::this_thread::yield();
+            }
+            uint32_t c = chunks[i];
+            uint32_t end = std::min((c + 1) * flag_elements, N);
+            for (uint32_t e = c * flag_elements; e < end; e++) {
+                data[e].store(epoch * 1000003u + e, std::memory_order_relaxed);
+            }
+            chunks_written++;
+            signal(c, epoch);
+        }
+    }
+
+    void consume(uint32_t block, uint32_t grid, uint32_t epoch) {
+        uint32_t num_tiles = (N + kTileElements - 1) / kTileElements;
+        for (uint32_t tile = block; tile < num_tiles; tile += grid) {
+            FlagRange range =
+                readiness_tile_flags(tile, kTileElements, N, flag_elements);
+            for (uint32_t f = range.first; f < range.last; f++) wait(f, epoch);
+            uint32_t end = std::min((tile + 1) * kTileElements, N);
+            for (uint32_t e = tile * kTileElements; e < end; e++) {
+                if (data[e].load(std::memory_order_relaxed) !=
+                    epoch * 1000003u + e) {
+                    stale_reads++;
+                }
+            }
+            tiles_consumed++;
+        }
+    }
+};
+
+// Runs `epochs` steps on the same flags without clearing them.
+static void run_protocol(uint32_t N, uint32_t flag_elements, int producers,
+                         uint32_t grid, int epochs, unsigned seed) {
+    Harness h(N, flag_elements);
+    std::mt19937 gen(seed);
+    for (uint32_t epoch = 1; epoch <= static_cast<uint32_t>(epochs); epoch++) {
+        h.chunks_written = 0;
+        h.tiles_consumed = 0;
+
+        // Chunks complete out of order, as the tiles of a GEMM do.
+        std::vector<uint32_t> order(h.flags.size());
+        for (uint32_t i = 0; i < order.size(); i++) order[i] = i;
+        std::shuffle(order.begin(), order.end(), gen);
+        if (producers == 1) {
+            // The held back tail must not hold the flags of the first tile.
+            FlagRange first = readiness_tile_flags(0, kTileElements, N,
+                                                   flag_elements);
+            std::stable_partition(order.begin(), order.end(), [&](uint32_t c) {
+                return c < first.last;
+            });
+        }
+        std::vector<std::vector<uint32_t>> work(producers);
+        for (size_t i = 0; i < order.size(); i++) {
+            work[i % producers].push_back(order[i]);
+        }
+
+        std::vector<std::thread> threads;
+        for (uint32_t block = 0; block < grid; block++) {
+            threads.emplace_back([&, block] { h.consume(block, grid, epoch); });
+        }
+        // A single producer holds its tail back, which requires the consumers
+        // to start before the input is complete.
+        for (int p = 0; p < producers; p++) {
+            threads.emplace_back([&, p] {
+                h.produce(work[p], epoch, producers == 1);
+            });
+        }
+        for (auto& t : threads) t.join();
+
+        HOST_CHECK_EQ(h.stale_reads.load(), 0);
+        HOST_CHECK_EQ(h.chunks_written.load(), h.flags.size());
+        HOST_CHECK_EQ(h.tiles_consumed.load(),
+                      (N + kTileElements - 1) / kTileElements);
+    }
+}
+
+static void test_protocol() {
+    uint32_t N = 13 * kTileElements + 777;
+    run_protocol(N, kTileElements, 1, 4, 3, 1);
+    run_protocol(N, 4096, 1, 3, 3, 2);
+    run_protocol(N, 3 * kTileElements, 1, 2, 3, 3);
+    run_protocol(N, 10000, 4, 4, 5, 4);
+    run_protocol(N, 2048, 3, 5, 5, 5);
+}
+
+int main() {
+    test_flag_ranges();
+    test_protocol();
+    return host_test_result("readiness_test");
+}
@@ -0,0 +1,128 @@
+#include <random>
+#include <vector>
+
+#include <host/codec_reference.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+using namespace quickreduce::reference;
+
+// Inputs of `world_size` ranks, one atom each.
+struct RankAtoms {
+    std::vector<std::vector<uint16_t>> values;
+    std::vector<uint16_t const*> pointers;
+
+    RankAtoms(int world_size, unsigned seed, float mean, float stddev)
+        : values(world_size, std::vector<uint16_t>(kAtomValues)) {
+        std::mt19937 gen(seed);
+        std::normal_distribution<float> dist(mean, stddev);
+        for (auto& rank : values) {
+            for (auto& v : rank) v = host::float_to_half(dist(gen));
+            pointers.push_back(rank.data());
+        }
+    }
+
+    float at(int rank, int i) const {
+        return host::half_to_float(values[rank][i]);
+    }
+};
+
+static void test_names() {
+    HOST_CHECK(reduce_op_from_name("sum") == ReduceOp::SUM);
+    HOST_CHECK(reduce_op_from_name("max") == ReduceOp::MAX);
+    HOST_CHECK(reduce_op_from_name("min") == ReduceOp::MIN);
+    HOST_CHECK(reduce_op_from_name("mean") == ReduceOp::MEAN);
+    HOST_CHECK(reduce_op_from_name("avg") == ReduceOp::MEAN);
+    bool thrown = false;
+    try {
+        reduce_op_from_name("prod");
+    } catch (std::invalid_argument const&) {
+        thrown = true;
+    }
+    HOST_CHECK(thrown);
+
+    // Max and min run with the fp16 codec, sum and mean keep the quant level.
+    HOST_CHECK_EQ(reduce_op_quant_level(ReduceOp::MAX, 3), 0);
+    HOST_CHECK_EQ(reduce_op_quant_level(ReduceOp::MIN, 7), 0);
+    HOST_CHECK_EQ(reduce_op_quant_level(ReduceOp::SUM, 3), 3);
+    HOST_CHECK_EQ(reduce_op_quant_level(ReduceOp::MEAN, 3), 3);
+}
+
+// Max and min with the fp16 codec are exact, including for all-negative
+// inputs where a zero-initialized accumulator would return 0.
+static void test_max_min(int world_size) {
+    for (float mean : {0.0f, -4.0f, 4.0f}) {
+        RankAtoms inputs(world_size, 11 + world_size, mean, 1.0f);
+        std::vector<uint16_t> max_result(kAtomValues);
+        std::vector<uint16_t> min_result(kAtomValues);
+        reduce_atoms<FPCodec>(ReduceOp::MAX, inputs.pointers.data(),
+                              world_size, max_result.data());
+        reduce_atoms<FPCodec>(ReduceOp::MIN, inputs.pointers.data(),
+                              world_size, min_result.data());
+        int wrong = 0;
+        for (int i = 0; i < kAtomValues; i++) {
+            float vmax = inputs.at(0, i);
+            float vmin = inputs.at(0, i);
+            for (int r = 1; r < world_size; r++) {
+                vmax = std::max(vmax, inputs.at(r, i));
+                vmin = std::min(vmin, inputs.at(r, i));
+            }
+            wrong += host::half_to_float(max_result[i]) != vmax;
+            wrong += host::half_to_float(min_result[i]) != vmin;
+        }
+        HOST_CHECK_EQ(wrong, 0);
+    }
+}
+
+// Mean is the fp16 sum scaled by 1 / world_size, which is exact for the
+// power-of-two world sizes.
+static void test_sum_mean(int world_size) {
+    RankAtoms inputs(world_size, 23 + world_size, 0.0f, 1.0f);
+    std::vector<uint16_t> sum(kAtomValues);
+    std::vector<uint16_t> mean(kAtomValues);
+    reduce_atoms<FPCodec>(ReduceOp::SUM, inputs.pointers.data(), world_size,
+                          sum.data());
+    reduce_atoms<FPCodec>(ReduceOp::MEAN, inputs.pointers.data(), world_size,
+                          mean.data());
+    int wrong = 0;
+    double max_error = 0.0;
+    for (int i = 0; i < kAtomValues; i++) {
+        double exact = 0.0;
+        for (int r = 0; r < world_size; r++) exact += inputs.at(r, i);
+        max_error = std::max(max_error,
+                             std::fabs(host::half_to_float(sum[i]) - exact));
+        wrong += host::half_to_float(mean[i]) !=
+                 host::half_to_float(sum[i]) / world_size;
+    }
+    HOST_CHECK_EQ(wrong, 0);
+    // One fp16 rounding per rank of a value below 16.
+    HOST_CHECK(max_error <= world_size * 16.0 / 2048);
+}
+
+// A block-quantized max can fall below the input of a rank, since every
+// rank is decoded against its own block scale. This is why max/min use the
+// fp16 codec.
+static void test_quantized_max_is_not_order_preserving() {
+    int const world_size = 4;
+    RankAtoms inputs(world_size, 5, 0.0f, 1.0f);
+    std::vector<uint16_t> result(kAtomValues);
+    reduce_atoms<SymmetricCodec<4>>(ReduceOp::MAX, inputs.pointers.data(),
+                                    world_size, result.data());
+    int below_input = 0;
+    for (int i = 0; i < kAtomValues; i++) {
+        for (int r = 0; r < world_size; r++) {
+            below_input += host::half_to_float(result[i]) < inputs.at(r, i);
+        }
+    }
+    HOST_CHECK(below_input > 0);
+}
+
+int main() {
+    test_names();
+    for (int world_size : {2, 4, 8}) {
+        test_max_min(world_size);
+        test_sum_mean(world_size);
+    }
+    test_quantized_max_is_not_order_preserving();
+    return host_test_result("reduce_op_test");
+}
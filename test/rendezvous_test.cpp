@@ -0,0 +1,169 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <host/rendezvous.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+// Runs `body(rank)` in a process per rank and returns the number of ranks
+// that failed.
+static int run_processes(int world_size, std::function<bool(int)> const& body) {
+    std::vector<pid_t> pids;
+    // Children must not inherit buffered output.
+    std::fflush(stdout);
+    for (int rank = 0; rank < world_size; rank++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            bool ok = false;
+            try {
+                ok = body(rank);
+            } catch (std::exception const& e) {
+                std::printf("rank %d: %s\n", rank, e.what());
+            }
+            std::fflush(stdout);
+            _exit(ok ? 0 : 1);
+        }
+        pids.push_back(pid);
+    }
+    int failures = 0;
+    for (pid_t pid : pids) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failures++;
+    }
+    return failures;
+}
+
+static std::string make_store_dir() {
+    char dir[] = "/tmp/quickreduce_rendezvous_XXXXXX";
+    if (mkdtemp(dir) == nullptr) std::abort();
+    return dir;
+}
+
+static void remove_store_dir(std::string const& dir) {
+    std::string cmd = "rm -rf " + dir;
+    HOST_CHECK_EQ(std::system(cmd.c_str()), 0);
+}
+
+static void test_store() {
+    std::string dir = make_store_dir();
+    FileStore store(dir);
+    HOST_CHECK(!store.check("a/b"));
+    store.set("a/b", {1, 2, 3});
+    HOST_CHECK(store.check("a/b"));
+    HOST_CHECK((store.get("a/b") == std::vector<uint8_t>{1, 2, 3}));
+    store.set("a/b", {});
+    HOST_CHECK(store.get("a/b").empty());
+
+    FileStore short_timeout(dir, std::chrono::milliseconds(20));
+    bool timed_out = false;
+    try {
+        short_timeout.get("missing");
+    } catch (std::runtime_error const&) {
+        timed_out = true;
+    }
+    HOST_CHECK(timed_out);
+    remove_store_dir(dir);
+}
+
+static std::vector<uint8_t> blob(int rank, int round) {
+    std::vector<uint8_t> value(100 + rank * 37);
+    for (size_t i = 0; i < value.size(); i++) {
+        value[i] = static_cast<uint8_t>(rank * 31 + round * 7 + i);
+    }
+    return value;
+}
+
+// Ranks joining at different times gather the same values.
+static void test_all_gather(int world_size) {
+    std::string dir = make_store_dir();
+    int failures = run_processes(world_size, [&](int rank) {
+        usleep((world_size - rank) * 2000);
+        FileStore store(dir);
+        Rendezvous rendezvous(store, world_size, rank);
+        for (int round = 0; round < 3; round++) {
+            auto values = rendezvous.all_gather(
+                "round" + std::to_string(round), blob(rank, round));
+            for (int r = 0; r < world_size; r++) {
+                if (values[r] != blob(r, round)) return false;
+            }
+        }
+        rendezvous.barrier("done");
+        return true;
+    });
+    HOST_CHECK_EQ(failures, 0);
+    remove_store_dir(dir);
+}
+
+static void test_exchange_peers() {
+    int world_size = 4;
+    std::string dir = make_store_dir();
+    int failures = run_processes(world_size, [&](int rank) {
+        FileStore store(dir);
+        Rendezvous rendezvous(store, world_size, rank);
+        PeerInfo info;
+        info.device = rank;
+        for (int i = 0; i < kIpcHandleSize; i++) {
+            info.ipc_handle[i] = static_cast<uint8_t>(rank + i);
+        }
+        auto peers = rendezvous.exchange_peers(info);
+        for (int r = 0; r < world_size; r++) {
+            if (peers[r].device != r || peers[r].ipc_handle[5] != r + 5 ||
+                peers[r].pid == 0) {
+                return false;
+            }
+        }
+        return true;
+    });
+    HOST_CHECK_EQ(failures, 0);
+    remove_store_dir(dir);
+
+    // A rank started with another world size is rejected.
+    dir = make_store_dir();
+    failures = run_processes(2, [&](int rank) {
+        FileStore store(dir, std::chrono::seconds(2));
+        Rendezvous rendezvous(store, rank == 0 ? 2 : 3, rank);
+        rendezvous.exchange_peers(PeerInfo{});
+        return true;
+    });
+    HOST_CHECK_EQ(failures, 2);
+    remove_store_dir(dir);
+}
+
+// Startup time of the handle exchange, from process start to every rank
+// holding every handle.
+static void bench_startup() {
+    for (int world_size : {2, 4, 8}) {
+        int const trials = 20;
+        auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < trials; t++) {
+            std::string dir = make_store_dir();
+            run_processes(world_size, [&](int rank) {
+                FileStore store(dir);
+                Rendezvous rendezvous(store, world_size, rank);
+                rendezvous.exchange_peers(PeerInfo{});
+                return true;
+            });
+            remove_store_dir(dir);
+        }
+        double ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start).count() /
+                    trials;
+        std::printf("world_size = %d: rendezvous %.2f ms\n", world_size, ms);
+    }
+}
+
+int main(int argc, char** argv) {
+    test_store();
+    for (int world_size : {2, 4, 8}) test_all_gather(world_size);
+    test_exchange_peers();
+    if (argc > 1 && std::string(argv[1]) == "bench") bench_startup();
+    return host_test_result("rendezvous_test");
+}
@@ -0,0 +1,344 @@
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <host/staged_transport.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+static std::string segment_name() {
+    static int counter = 0;
+    return "/quickreduce_staged_test_" + std::to_string(getpid()) + "_" +
+           std::to_string(counter++);
+}
+
+// Runs `body(rank)` in a process per rank; returns the number of ranks that
+// failed a check or threw.
+static int run_processes(int world_size,
+                         std::function<void(int)> const& body) {
+    std::vector<pid_t> children;
+    for (int rank = 0; rank < world_size; rank++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            int status = EXIT_FAILURE;
+            try {
+                body(rank);
+                status = host_test_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+            } catch (std::exception const& e) {
+                std::printf("rank %d: %s\n", rank, e.what());
+            }
+            std::fflush(stdout);
+            _exit(status);
+        }
+        children.push_back(pid);
+    }
+    int failed = 0;
+    for (pid_t pid : children) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        failed += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    return failed;
+}
+
+// Every op is issued after the ops it waits for, and a chunk has each op
+// once.
+static void test_schedule() {
+    for (uint32_t num_chunks : {1u, 2u, 3u, 10u}) {
+        auto ops = staged_schedule(num_chunks);
+        HOST_CHECK_EQ(ops.size(), size_t(num_chunks) * kStagedOpKinds);
+        std::set<std::pair<int, uint32_t>> issued;
+        for (StagedOp const& op : ops) {
+            for (StagedDependency const& dep : staged_dependencies(op.kind)) {
+                HOST_CHECK(staged_queue(dep.kind) != staged_queue(op.kind));
+                if (op.chunk < dep.lag) continue;
+                HOST_CHECK(issued.count({static_cast<int>(dep.kind),
+                                         op.chunk - dep.lag}) == 1);
+            }
+            HOST_CHECK(issued.insert({static_cast<int>(op.kind), op.chunk})
+                           .second);
+        }
+    }
+    HOST_CHECK_EQ(staged_stage(1), 1);
+    HOST_CHECK_EQ(staged_stage(2), 0);
+    HOST_CHECK_EQ(staged_reusable_after(2), 0u);
+    HOST_CHECK_EQ(staged_reusable_after(5), 3u);
+    HOST_CHECK_EQ(staged_chunk_tiles(1 << 20, 3072), 341u);
+    bool threw = false;
+    try {
+        staged_chunk_tiles(1024, 2048);
+    } catch (std::invalid_argument const&) {
+        threw = true;
+    }
+    HOST_CHECK(threw);
+}
+
+// The flags and slots of the segment are distinct and inside it.
+static void test_layout() {
+    int const world_size = 4;
+    int64_t const slot_bytes = 256;
+    std::string name = segment_name();
+    uint64_t const nonce = staged_nonce();
+    std::vector<std::thread> peers;
+    for (int rank = 1; rank < world_size; rank++) {
+        peers.emplace_back([&, rank] {
+            StagedSegment peer(name, world_size, rank, nonce, slot_bytes);
+        });
+    }
+    StagedSegment segment(name, world_size, 0, nonce, slot_bytes);
+    for (auto& t : peers) t.join();
+    std::set<int64_t> flags, slots;
+    for (int phase = 0; phase < 2; phase++) {
+        for (int src = 0; src < world_size; src++) {
+            for (int dst = 0; dst < world_size; dst++) {
+                for (int stage = 0; stage < kStagedStages; stage++) {
+                    for (auto kind : {StagedFlag::READY, StagedFlag::ACK}) {
+                        flags.insert(segment.offset(
+                            segment.flag(kind, phase, src, dst, stage)));
+                    }
+                    slots.insert(
+                        segment.offset(segment.slot(phase, src, dst, stage)));
+                }
+            }
+        }
+    }
+    HOST_CHECK_EQ(flags.size(), size_t(2 * 2 * 16 * kStagedStages));
+    // Phase-2 has one slot per sender.
+    HOST_CHECK_EQ(slots.size(), size_t((16 + 4) * kStagedStages));
+    HOST_CHECK(*flags.rbegin() < *slots.begin());
+    for (int64_t f : flags) HOST_CHECK_EQ(f % 64, 0);
+    HOST_CHECK_EQ(*slots.rbegin() + slot_bytes, segment.bytes());
+}
+
+// A host stand-in of the device path: per rank, a thread per queue runs the
+// ops of the schedule, with memcpy for the copies and float sums for the
+// kernels. Each tile has a segment of kSegment values per rank. Ranks sleep
+// at random, so fast senders run into the acks of slow receivers.
+static void test_allreduce() {
+    int const kSegment = 8;
+    for (int world_size : {2, 4, 8}) {
+        int64_t const segment_bytes = kSegment * sizeof(float);
+        int64_t const slot_bytes = 3 * segment_bytes + 32;  // 3 tiles a chunk
+        std::string name = segment_name();
+        uint64_t const nonce = staged_nonce();
+        int failed = run_processes(world_size, [&](int rank) {
+            StagedSegment segment(name, world_size, rank, nonce, slot_bytes);
+            uint32_t const chunk_tiles =
+                staged_chunk_tiles(slot_bytes, segment_bytes);
+            uint64_t next_seq = 1;
+            // Last sequence number completed per op kind, across the calls
+            // like the events of the device path.
+            std::atomic<uint64_t> done[kStagedOpKinds] = {};
+            // Device buffers, per stage: send1 and recv1 hold a region per
+            // rank, send2 the reduced segments, recv2 a region per rank.
+            auto regions = [&] {
+                return std::vector<std::vector<float>>(
+                    world_size, std::vector<float>(chunk_tiles * kSegment));
+            };
+            std::vector<std::vector<std::vector<float>>> send1, recv1, recv2;
+            std::vector<std::vector<float>> send2;
+            for (int s = 0; s < kStagedStages; s++) {
+                send1.push_back(regions());
+                recv1.push_back(regions());
+                recv2.push_back(regions());
+                send2.emplace_back(chunk_tiles * kSegment);
+            }
+
+            for (uint32_t num_tiles : {1u, 3u, 4u, 11u, 30u}) {
+                int const tile_values = world_size * kSegment;
+                std::vector<float> data(num_tiles * tile_values);
+                for (size_t i = 0; i < data.size(); i++) {
+                    data[i] = float((rank + 1) * 1000 + i % 251);
+                }
+                uint32_t num_chunks = (num_tiles + chunk_tiles - 1) / chunk_tiles;
+                auto ops = staged_schedule(num_chunks);
+
+                auto run_queue = [&](StagedQueue queue) {
+                    std::mt19937 gen(rank * 3 + static_cast<int>(queue));
+                    for (StagedOp const& op : ops) {
+                        if (staged_queue(op.kind) != queue) continue;
+                        uint64_t seq = next_seq + op.chunk;
+                        int s = staged_stage(seq);
+                        for (auto const& dep : staged_dependencies(op.kind)) {
+                            if (dep.lag >= seq) continue;
+                            auto& d = done[static_cast<int>(dep.kind)];
+                            while (d.load(std::memory_order_acquire) <
+                                   seq - dep.lag) {
+                                std::this_thread::yield();
+                            }
+                        }
+                        if (gen() % 4 == 0) {
+                            std::this_thread::sleep_for(
+                                std::chrono::microseconds(gen() % 200));
+                        }
+                        uint32_t first = op.chunk * chunk_tiles;
+                        uint32_t tiles = std::min(chunk_tiles, num_tiles - first);
+                        int64_t bytes = tiles * segment_bytes;
+                        switch (op.kind) {
+                          case StagedOpKind::ENCODE:
+                            for (uint32_t t = 0; t < tiles; t++) {
+                                for (int r = 0; r < world_size; r++) {
+                                    std::copy_n(&data[(first + t) * tile_values +
+                                                      r * kSegment],
+                                                kSegment,
+                                                &send1[s][r][t * kSegment]);
+                                }
+                            }
+                            break;
+                          case StagedOpKind::SEND1:
+                            for (int r = 0; r < world_size; r++) {
+                                if (r != rank) {
+                                    segment.send(r, seq, send1[s][r].data(),
+                                                 bytes);
+                                }
+                            }
+                            break;
+                          case StagedOpKind::RECV1:
+                            for (int r = 0; r < world_size; r++) {
+                                if (r != rank) {
+                                    segment.receive(0, r, seq,
+                                                    recv1[s][r].data(), bytes);
+                                }
+                            }
+                            break;
+                          case StagedOpKind::REDUCE:
+                            for (uint32_t i = 0; i < tiles * kSegment; i++) {
+                                float acc = 0;
+                                for (int r = 0; r < world_size; r++) {
+                                    acc += r == rank ? send1[s][rank][i]
+                                                     : recv1[s][r][i];
+                                }
+                                send2[s][i] = acc;
+                            }
+                            break;
+                          case StagedOpKind::SEND2:
+                            segment.publish(seq, send2[s].data(), bytes);
+                            break;
+                          case StagedOpKind::RECV2:
+                            for (int r = 0; r < world_size; r++) {
+                                if (r != rank) {
+                                    segment.receive(1, r, seq,
+                                                    recv2[s][r].data(), bytes);
+                                }
+                            }
+                            break;
+                          case StagedOpKind::GATHER:
+                            for (uint32_t t = 0; t < tiles; t++) {
+                                for (int r = 0; r < world_size; r++) {
+                                    float const* reduced =
+                                        r == rank ? &send2[s][t * kSegment]
+                                                  : &recv2[s][r][t * kSegment];
+                                    std::copy_n(reduced, kSegment,
+                                                &data[(first + t) * tile_values +
+                                                      r * kSegment]);
+                                }
+                            }
+                            break;
+                        }
+                        done[static_cast<int>(op.kind)].store(
+                            seq, std::memory_order_release);
+                    }
+                };
+                std::thread d2h(run_queue, StagedQueue::D2H);
+                std::thread h2d(run_queue, StagedQueue::H2D);
+                run_queue(StagedQueue::COMPUTE);
+                d2h.join();
+                h2d.join();
+                next_seq += num_chunks;
+
+                int errors = 0;
+                for (size_t i = 0; i < data.size(); i++) {
+                    float expected = 0;
+                    for (int r = 0; r < world_size; r++) {
+                        expected += float((r + 1) * 1000 + i % 251);
+                    }
+                    errors += data[i] != expected;
+                }
+                HOST_CHECK_EQ(errors, 0);
+            }
+        });
+        HOST_CHECK_EQ(failed, 0);
+    }
+}
+
+// A receiver without a sender times out.
+static void test_timeout() {
+    std::string name = segment_name();
+    std::thread peer([&] {
+        StagedSegment segment(name, 2, 1, 1, 64,
+                              std::chrono::milliseconds(200));
+    });
+    StagedSegment segment(name, 2, 0, 1, 64, std::chrono::milliseconds(200));
+    peer.join();
+    bool threw = false;
+    char byte = 0;
+    try {
+        segment.receive(0, 1, 1, &byte, 1);
+    } catch (std::runtime_error const&) {
+        threw = true;
+    }
+    HOST_CHECK(threw);
+}
+
+// A segment left behind by a failed run is not attached to: a rank of the
+// next run waits until its rank 0 replaced it, or times out without it.
+static void test_stale() {
+    std::string name = segment_name();
+    auto const timeout = std::chrono::milliseconds(200);
+    uint64_t const stale = 1, nonce = 2;
+    // Rank 0 of the failed run gives up on its peer, so the segment keeps
+    // its name.
+    bool threw = false;
+    try {
+        StagedSegment failed(name, 2, 0, stale, 64, timeout);
+    } catch (std::runtime_error const&) {
+        threw = true;
+    }
+    HOST_CHECK(threw);
+
+    threw = false;
+    try {
+        StagedSegment segment(name, 2, 1, nonce, 64, timeout);
+    } catch (std::runtime_error const&) {
+        threw = true;
+    }
+    HOST_CHECK(threw);
+
+    std::thread peer([&] {
+        StagedSegment segment(name, 2, 1, nonce, 64);
+        char byte = 1;
+        segment.send(0, 1, &byte, 1);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    StagedSegment segment(name, 2, 0, nonce, 64);
+    char byte = 0;
+    segment.receive(0, 1, 1, &byte, 1);
+    peer.join();
+    HOST_CHECK_EQ(byte, 1);
+
+    threw = false;
+    try {
+        StagedSegment invalid(name, 2, 0, 0, 64);
+    } catch (std::invalid_argument const&) {
+        threw = true;
+    }
+    HOST_CHECK(threw);
+}
+
+int main() {
+    test_schedule();
+    test_layout();
+    test_allreduce();
+    test_timeout();
+    test_stale();
+    return host_test_result("staged_transport_test");
+}
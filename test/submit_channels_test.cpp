@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <core/codec_layout.h>
+#include <core/launch.h>
+#include <host/submit_channels.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+struct Reservation {
+    int channel;
+    uint32_t first;
+    uint32_t count;
+};
+
+// Byte ranges a two-shot launch on a channel touches: its flags, then its
+// regions.
+struct ChannelRanges {
+    int64_t flags_begin, flags_end;
+    int64_t data_begin, data_end;
+};
+
+static ChannelRanges channel_ranges(ChannelLayout const& layout,
+                                    int world_size, uint32_t max_grid,
+                                    uint32_t tile_size) {
+    int64_t data = layout.base + layout.data_offset;
+    return {layout.base, layout.base + flags_buffer_size(world_size, max_grid),
+            data, data + twoshot_regions_size(max_grid, tile_size)};
+}
+
+// The channels are disjoint, aligned, and inside the buffer; channel 0 is
+// the layout of a single-channel buffer. The buffers are sized for fp16
+// tiles, or for lossless tiles as the communicator does, whose regions then
+// fit on every channel.
+static void test_layout(uint32_t const tile_size) {
+    for (int world_size : {2, 4, 8}) {
+        for (uint32_t max_grid : {8u, 208u, 1216u}) {
+            uint32_t flags = flags_buffer_size(world_size, max_grid);
+            uint32_t data_offset = flags + 1040;  // all-to-all flags
+            int64_t first_bytes =
+                data_offset + data_buffer_size(1 << 20, max_grid, tile_size);
+            HOST_CHECK_EQ(channels_buffer_size(1, first_bytes, data_offset,
+                                               world_size, max_grid,
+                                               tile_size),
+                          first_bytes);
+
+            int const num_channels = 5;
+            int64_t total =
+                channels_buffer_size(num_channels, first_bytes, data_offset,
+                                     world_size, max_grid, tile_size);
+            std::vector<std::pair<int64_t, int64_t>> extents;
+            for (int c = 0; c < num_channels; c++) {
+                ChannelLayout layout =
+                    channel_layout(c, first_bytes, data_offset, world_size,
+                                   max_grid, tile_size);
+                ChannelRanges r =
+                    channel_ranges(layout, world_size, max_grid, tile_size);
+                HOST_CHECK(r.flags_end <= r.data_begin);
+                HOST_CHECK(r.data_end <= total);
+                HOST_CHECK_EQ(layout.base % kChannelAlignment, 0);
+                HOST_CHECK_EQ(r.data_begin % 16, 0);
+                if (c == 0) {
+                    HOST_CHECK_EQ(layout.base, 0);
+                    HOST_CHECK_EQ(layout.data_offset, data_offset);
+                    HOST_CHECK(r.data_end <= first_bytes);
+                    extents.push_back({0, first_bytes});
+                } else {
+                    HOST_CHECK(layout.base >= first_bytes);
+                    extents.push_back({layout.base, r.data_end});
+                }
+            }
+            std::sort(extents.begin(), extents.end());
+            for (size_t i = 1; i < extents.size(); i++) {
+                HOST_CHECK(extents[i - 1].second <= extents[i].first);
+            }
+            // Less than an alignment of padding per channel.
+            HOST_CHECK(total - first_bytes <
+                       (num_channels - 1) *
+                               (flags +
+                                twoshot_regions_size(max_grid, tile_size)) +
+                           num_channels * kChannelAlignment);
+        }
+    }
+}
+
+// Many threads reserve color ranges of random sizes on random channels: the
+// ranges of a channel tile [1, next) without gaps or overlaps.
+static void test_reserve() {
+    int const num_channels = 4;
+    int const num_threads = 16;
+    int const reservations = 20000;
+    SubmitChannels channels(num_channels);
+    std::vector<std::vector<Reservation>> reserved(num_threads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t] {
+            std::mt19937 gen(t);
+            for (int i = 0; i < reservations; i++) {
+                int channel = gen() % num_channels;
+                uint32_t count = 1 + gen() % 8;
+                reserved[t].push_back(
+                    {channel, channels.reserve(channel, count), count});
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+
+    for (int c = 0; c < num_channels; c++) {
+        std::vector<Reservation> ranges;
+        for (auto const& thread : reserved) {
+            for (Reservation const& r : thread) {
+                if (r.channel == c) ranges.push_back(r);
+            }
+        }
+        std::sort(ranges.begin(), ranges.end(),
+                  [](auto const& a, auto const& b) { return a.first < b.first; });
+        uint32_t next = 1;
+        int gaps = 0;
+        for (Reservation const& r : ranges) {
+            gaps += r.first != next;
+            next = r.first + r.count;
+        }
+        HOST_CHECK_EQ(gaps, 0);
+        HOST_CHECK_EQ(channels.next(c), next);
+    }
+
+    channels.reset();
+    HOST_CHECK_EQ(channels.reserve(3, 2), 1u);
+    HOST_CHECK_EQ(channels.reserve(3, 1), 3u);
+
+    int threw = 0;
+    for (int bad : {-1, num_channels}) {
+        try {
+            channels.reserve(bad, 1);
+        } catch (std::invalid_argument const&) {
+            threw++;
+        }
+    }
+    for (int bad : {0, kMaxSubmitChannels + 1}) {
+        try {
+            SubmitChannels invalid(bad);
+        } catch (std::invalid_argument const&) {
+            threw++;
+        }
+    }
+    HOST_CHECK_EQ(threw, 4);
+}
+
+// A thread per channel stands in for its launches: it writes the color of
+// each call into every flag of its channel and a tag into every word of its
+// regions, then checks that no other channel overwrote them.
+static void test_isolation() {
+    int const world_size = 8;
+    uint32_t const max_grid = 4;
+    uint32_t const tile_size = 256;
+    int const num_channels = 6;
+    int const calls = 300;
+    uint32_t flags = flags_buffer_size(world_size, max_grid);
+    uint32_t data_offset = flags + 64;
+    int64_t first_bytes =
+        data_offset + data_buffer_size(0, max_grid, tile_size);
+    int64_t total = channels_buffer_size(num_channels, first_bytes,
+                                         data_offset, world_size, max_grid,
+                                         tile_size);
+    std::vector<std::atomic<uint32_t>> buffer(total / sizeof(uint32_t));
+    for (auto& word : buffer) word.store(0, std::memory_order_relaxed);
+
+    SubmitChannels channels(num_channels);
+    std::vector<int> errors(num_channels, 0);
+    std::vector<std::thread> threads;
+    for (int c = 0; c < num_channels; c++) {
+        threads.emplace_back([&, c] {
+            ChannelRanges r = channel_ranges(
+                channel_layout(c, first_bytes, data_offset, world_size,
+                               max_grid, tile_size),
+                world_size, max_grid, tile_size);
+            auto words = [&](int64_t begin, int64_t end, auto&& f) {
+                for (int64_t i = begin / 4; i < end / 4; i++) f(buffer[i]);
+            };
+            for (int call = 0; call < calls; call++) {
+                uint32_t color = channels.reserve(c, 1 + call % 3);
+                uint32_t tag = (uint32_t(c) << 24) | color;
+                words(r.flags_begin, r.flags_end, [&](auto& w) {
+                    w.store(color, std::memory_order_relaxed);
+                });
+                words(r.data_begin, r.data_end, [&](auto& w) {
+                    w.store(tag, std::memory_order_relaxed);
+                });
+                std::this_thread::yield();
+                words(r.flags_begin, r.flags_end, [&](auto& w) {
+                    errors[c] += w.load(std::memory_order_relaxed) != color;
+                });
+                words(r.data_begin, r.data_end, [&](auto& w) {
+                    errors[c] += w.load(std::memory_order_relaxed) != tag;
+                });
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    for (int c = 0; c < num_channels; c++) HOST_CHECK_EQ(errors[c], 0);
+
+    // Every channel got the colors of its calls only.
+    for (int c = 0; c < num_channels; c++) {
+        HOST_CHECK_EQ(channels.next(c), 1u + 100 * (1 + 2 + 3));
+    }
+}
+
+int main() {
+    test_layout(32768);
+    test_layout(kMaxTransmittedTileSize);
+    test_reserve();
+    test_isolation();
+    return host_test_result("submit_channels_test");
+}
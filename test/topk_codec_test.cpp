@@ -0,0 +1,107 @@
+#include <random>
+#include <string>
+#include <vector>
+
+#include <host/codec_reference.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+using namespace quickreduce::reference;
+
+// FP16 bytes of one atom, the baseline of the bandwidth saving.
+static constexpr int kDenseAtomBytes = kAtomValues * 2;
+
+// Gradient-like data: a fraction `density` of the values is significant, the
+// rest is small noise around zero.
+static std::vector<uint16_t> sparse_data(long num_atoms, double density,
+                                         float noise, unsigned seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<uint16_t> values(num_atoms * kAtomValues);
+    for (auto& v : values) {
+        float x = coin(gen) < density ? dist(gen) : noise * dist(gen);
+        v = host::float_to_half(x);
+    }
+    return values;
+}
+
+static void test_layout() {
+    // Top2-Q8 sends fewer bytes than Q4.
+    HOST_CHECK((TopKCodec<2, true>::kTileStride) < SymmetricCodec<4>::kTileStride);
+
+    HOST_CHECK_EQ((TopKCodec<1, false>::kTileStride), 768);
+    HOST_CHECK_EQ((TopKCodec<2, false>::kTileStride), 1280);
+    HOST_CHECK_EQ((TopKCodec<4, false>::kTileStride), 2560);
+    HOST_CHECK_EQ((TopKCodec<2, true>::kTileStride), 832);
+    HOST_CHECK_EQ((TopKCodec<4, true>::kTileStride), 1600);
+}
+
+static void test_exact_when_k_sparse() {
+    // At most k non-zeros per thread are sent without loss in fp16.
+    std::mt19937 gen(7);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<uint16_t> values(kAtomValues, 0);
+    for (int t = 0; t < kThreads; t++) {
+        values[t * kValuesPerThread + (t % 8)] = host::float_to_half(dist(gen));
+        values[t * kValuesPerThread + ((t + 3) % 8)] =
+            host::float_to_half(dist(gen));
+    }
+    HOST_CHECK_EQ((round_trip<TopKCodec<2, false>>(values.data(), 1).max_abs_error),
+                  0.0);
+
+    // Ties are broken towards the lowest index.
+    std::vector<uint16_t> ties(kAtomValues, host::float_to_half(1.0f));
+    std::vector<uint16_t> decoded(kAtomValues);
+    round_trip<TopKCodec<2, false>>(ties.data(), 1, decoded.data());
+    HOST_CHECK_EQ(decoded[0], host::float_to_half(1.0f));
+    HOST_CHECK_EQ(decoded[1], host::float_to_half(1.0f));
+    HOST_CHECK_EQ(decoded[2], 0);
+}
+
+template <class Codec>
+static double report(char const* name, std::vector<uint16_t> const& values,
+                     long num_atoms) {
+    ErrorStats stats = round_trip<Codec>(values.data(), num_atoms);
+    std::printf("  %-8s bytes = %5.1f%%, relative_rmse = %.4f\n", name,
+                100.0 * Codec::kTileStride / kDenseAtomBytes,
+                stats.relative_rmse());
+    return stats.relative_rmse();
+}
+
+// Bandwidth saving against density: bytes sent relative to FP16 and the
+// relative error of the round trip.
+static void sweep(long num_atoms) {
+    for (double density : {0.01, 0.05, 0.125, 0.25, 0.5}) {
+        std::printf("density = %.3f\n", density);
+        auto values = sparse_data(num_atoms, density, 1e-3f, 11);
+        double top1 = report<TopKCodec<1, false>>("Top1", values, num_atoms);
+        double top2 = report<TopKCodec<2, false>>("Top2", values, num_atoms);
+        double top4 = report<TopKCodec<4, false>>("Top4", values, num_atoms);
+        double top2q8 = report<TopKCodec<2, true>>("Top2-Q8", values, num_atoms);
+        double q4 = report<SymmetricCodec<4>>("Q4", values, num_atoms);
+
+        HOST_CHECK(top4 <= top2 && top2 <= top1);
+        HOST_CHECK(top2q8 < top2 + 0.02);
+        if (density <= 0.01) {
+            // Few significant values per thread: top-k keeps nearly all of
+            // them. Top2-Q8 sends 72% of the bytes of Q4 for at most 1.5x its
+            // error (about 1.25x here); it is not more accurate than Q4.
+            HOST_CHECK((TopKCodec<2, true>::kTileStride <
+                        SymmetricCodec<4>::kTileStride));
+            HOST_CHECK(top2q8 < 0.05);
+            HOST_CHECK(top2q8 < 1.5 * q4);
+            // Top4 is more accurate than Q4 at this density.
+            HOST_CHECK(top4 < q4);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    bool bench = argc > 1 && std::string(argv[1]) == "bench";
+
+    test_layout();
+    test_exact_when_k_sparse();
+    sweep(bench ? 1024 : 32);
+    return host_test_result("topk_codec_test");
+}
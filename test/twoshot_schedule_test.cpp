@@ -0,0 +1,448 @@
+#include <random>
+#include <vector>
+
+#include <core/schedule.h>
+#include "host_test.h"
+
+using namespace quickreduce;
+
+// Simulator of the two-shot flag protocol. Every (rank, block) of a launch is
+// an agent executing the buffer writes, flag stores and flag waits of its
+// kernel, and agents are interleaved at random. Launches of a rank run in
+// stream order; launches of different ranks overlap freely. The simulator
+// reports reads of data that is not the expected tile, writes over data the
+// owner has not read yet, and schedules that can no longer make progress.
+
+enum class Result { kOk, kStaleRead, kOverwrite, kDeadlock };
+
+enum class Kernel { kSequential, kPipelined, kBroadcast, kReduce };
+
+struct Launch {
+    uint32_t num_blocks;
+    uint32_t grid;
+    Kernel kernel;
+    int root = 0;  // root of the broadcast and reduce kernels
+};
+
+struct Options {
+    int world_size = 4;
+    uint32_t max_grid = 4;
+    // Regressions of the layout and color rules.
+    bool advance_color_by_one = false;
+    bool stride_by_launch_grid = false;
+    // Regression of the rooted kernels: only signal the ranks data is sent to.
+    bool signal_data_targets_only = false;
+};
+
+// Identity of the data sent by a rank: launch, tile, stage and source rank.
+struct Tag {
+    int launch = -1;
+    int tile = -1;
+    int stage = -1;
+    int src = -1;
+    bool operator==(Tag const& o) const {
+        return launch == o.launch && tile == o.tile && stage == o.stage &&
+               src == o.src;
+    }
+};
+
+struct Cell {
+    Tag tag;
+    bool consumed = true;
+};
+
+struct RankMemory {
+    std::vector<uint32_t> flags;
+    std::vector<Cell> data;
+};
+
+// kWait waits on a flag without reading the data behind it.
+enum class OpKind { kWrite, kSignal, kRead, kWait };
+
+struct Op {
+    OpKind kind;
+    int target;     // rank whose memory is accessed
+    uint32_t flag;  // flag index in the target memory
+    uint32_t cell;  // data cell index in the target memory
+    uint32_t color;
+    Tag tag;
+};
+
+struct Agent {
+    int rank = 0;
+    std::vector<Op> ops = {};
+    size_t pc = 0;
+    bool done() const { return pc == ops.size(); }
+};
+
+class Simulator {
+  public:
+    explicit Simulator(Options const& options) : opt_(options) {
+        uint32_t regions = kNumStages * kNumSlots * opt_.max_grid;
+        memory_.resize(opt_.world_size);
+        for (auto& m : memory_) {
+            m.flags.assign(regions * opt_.world_size, 0);
+            m.data.assign(regions * opt_.world_size, Cell{});
+        }
+    }
+
+    Result run(std::vector<Launch> const& launches, unsigned seed) {
+        std::mt19937 gen(seed);
+
+        // Agents of every rank, grouped by launch. Each rank advances its own
+        // flag color, as DeviceComms does.
+        std::vector<std::vector<std::vector<Agent>>> agents(opt_.world_size);
+        for (int rank = 0; rank < opt_.world_size; rank++) {
+            uint32_t flag_color = 1;
+            for (size_t l = 0; l < launches.size(); l++) {
+                agents[rank].push_back(
+                    make_launch(rank, static_cast<int>(l), launches[l],
+                                flag_color));
+                flag_color += opt_.advance_color_by_one
+                                  ? 1
+                                  : twoshot_iterations(launches[l].num_blocks,
+                                                       launches[l].grid);
+            }
+        }
+
+        std::vector<size_t> current(opt_.world_size, 0);
+        std::vector<Agent*> runnable;
+        while (true) {
+            runnable.clear();
+            bool finished = true;
+            for (int rank = 0; rank < opt_.world_size; rank++) {
+                // Stream order: a launch starts when the previous one is done.
+                while (current[rank] < launches.size() &&
+                       all_done(agents[rank][current[rank]])) {
+                    current[rank]++;
+                }
+                if (current[rank] == launches.size()) continue;
+                finished = false;
+                for (auto& agent : agents[rank][current[rank]]) {
+                    if (!agent.done() && ready(agent.ops[agent.pc])) {
+                        runnable.push_back(&agent);
+                    }
+                }
+            }
+            if (finished) return Result::kOk;
+            if (runnable.empty()) return Result::kDeadlock;
+
+            std::uniform_int_distribution<size_t> pick(0, runnable.size() - 1);
+            Agent& agent = *runnable[pick(gen)];
+            Result result = execute(agent.ops[agent.pc++]);
+            if (result != Result::kOk) return result;
+        }
+    }
+
+  private:
+    Options opt_;
+    std::vector<RankMemory> memory_;
+
+    static bool all_done(std::vector<Agent> const& launch_agents) {
+        for (auto const& agent : launch_agents) {
+            if (!agent.done()) return false;
+        }
+        return true;
+    }
+
+    bool ready(Op const& op) const {
+        return (op.kind != OpKind::kRead && op.kind != OpKind::kWait) ||
+               memory_[op.target].flags[op.flag] == op.color;
+    }
+
+    Result execute(Op const& op) {
+        RankMemory& m = memory_[op.target];
+        Cell& cell = m.data[op.cell];
+        switch (op.kind) {
+            case OpKind::kWrite:
+                if (!cell.consumed) return Result::kOverwrite;
+                cell.tag = op.tag;
+                cell.consumed = false;
+                break;
+            case OpKind::kSignal:
+                m.flags[op.flag] = op.color;
+                break;
+            case OpKind::kRead:
+                if (!(cell.tag == op.tag)) return Result::kStaleRead;
+                cell.consumed = true;
+                break;
+            case OpKind::kWait:
+                break;
+        }
+        return Result::kOk;
+    }
+
+    // Region indices. The data cells of a region hold one segment per source
+    // rank, so the transmitted tile size is world_size cells.
+    uint32_t stride(Launch const& launch) const {
+        return opt_.stride_by_launch_grid ? launch.grid : opt_.max_grid;
+    }
+
+    uint32_t flag_index(Launch const& launch, int stage, int slot, int block_id,
+                        int src) const {
+        return comm_flags_offset(stage, slot, block_id, stride(launch),
+                                 opt_.world_size) / sizeof(uint32_t) + src;
+    }
+
+    uint32_t cell_index(Launch const& launch, int stage, int slot, int block_id,
+                        int src) const {
+        return comm_data_offset(0, stage, slot, block_id, stride(launch),
+                                opt_.world_size) + src;
+    }
+
+    // Whether `src` sends its segment to `dst`: always for the all-reduce.
+    static bool sends(Launch const& launch, int stage, int src, int dst) {
+        switch (launch.kernel) {
+            case Kernel::kBroadcast:
+                return rooted_sends_segment(RootedCollective::BROADCAST, stage,
+                                            src, dst, launch.root);
+            case Kernel::kReduce:
+                return rooted_sends_segment(RootedCollective::REDUCE, stage,
+                                            src, dst, launch.root);
+            default:
+                return true;
+        }
+    }
+
+    // Send the segments of a tile to the ranks that need them, then set the
+    // flags on every rank.
+    void send(Agent& agent, Launch const& launch, int l, int stage, int slot,
+              int block_id, int tile, uint32_t color) const {
+        for (int r = 0; r < opt_.world_size; r++) {
+            if (!sends(launch, stage, agent.rank, r)) continue;
+            agent.ops.push_back(
+                {OpKind::kWrite, r, 0,
+                 cell_index(launch, stage, slot, block_id, agent.rank), color,
+                 Tag{l, tile, stage, agent.rank}});
+        }
+        for (int r = 0; r < opt_.world_size; r++) {
+            if (opt_.signal_data_targets_only &&
+                !sends(launch, stage, agent.rank, r)) {
+                continue;
+            }
+            agent.ops.push_back(
+                {OpKind::kSignal, r,
+                 flag_index(launch, stage, slot, block_id, agent.rank), 0,
+                 color, Tag{}});
+        }
+    }
+
+    // Wait for the flags of every rank, and read the segments sent to this
+    // rank.
+    void receive(Agent& agent, Launch const& launch, int l, int stage, int slot,
+                 int block_id, int tile, uint32_t color) const {
+        for (int r = 0; r < opt_.world_size; r++) {
+            bool data = sends(launch, stage, r, agent.rank);
+            if (opt_.signal_data_targets_only && !data) continue;
+            agent.ops.push_back(
+                {data ? OpKind::kRead : OpKind::kWait, agent.rank,
+                 flag_index(launch, stage, slot, block_id, r),
+                 cell_index(launch, stage, slot, block_id, r), color,
+                 Tag{l, tile, stage, r}});
+        }
+    }
+
+    // Mirrors allreduce_prototype_twoshot, AllReduceTwoshotPipelined and
+    // RootedTwoshot (which follows the sequential kernel).
+    std::vector<Agent> make_launch(int rank, int l, Launch const& launch,
+                                   uint32_t flag_color) const {
+        std::vector<Agent> launch_agents;
+        for (uint32_t block_id = 0; block_id < launch.grid; block_id++) {
+            Agent agent{rank};
+            int b = static_cast<int>(block_id);
+            if (launch.kernel != Kernel::kPipelined) {
+                uint32_t i = 0;
+                for (uint32_t tile = block_id; tile < launch.num_blocks;
+                     tile += launch.grid, i++) {
+                    uint32_t color = tile_color(flag_color, i);
+                    int t = static_cast<int>(tile);
+                    send(agent, launch, l, 0, 0, b, t, color);
+                    receive(agent, launch, l, 0, 0, b, t, color);
+                    send(agent, launch, l, 1, 0, b, t, color);
+                    receive(agent, launch, l, 1, 0, b, t, color);
+                }
+            } else if (block_id < launch.num_blocks) {
+                send(agent, launch, l, 0, pipeline_slot(0), b, b,
+                     tile_color(flag_color, 0));
+                uint32_t i = 0;
+                for (uint32_t tile = block_id; tile < launch.num_blocks;
+                     tile += launch.grid, i++) {
+                    int slot = pipeline_slot(i);
+                    uint32_t color = tile_color(flag_color, i);
+                    int t = static_cast<int>(tile);
+                    uint32_t next = tile + launch.grid;
+                    if (next < launch.num_blocks) {
+                        send(agent, launch, l, 0, pipeline_slot(i + 1), b,
+                             static_cast<int>(next), tile_color(flag_color, i + 1));
+                    }
+                    receive(agent, launch, l, 0, slot, b, t, color);
+                    send(agent, launch, l, 1, slot, b, t, color);
+                    receive(agent, launch, l, 1, slot, b, t, color);
+                }
+            }
+            launch_agents.push_back(std::move(agent));
+        }
+        return launch_agents;
+    }
+};
+
+static Launch make(uint32_t num_blocks, uint32_t max_grid, Kernel kernel,
+                   int root = 0) {
+    return {num_blocks, grid_size(num_blocks, max_grid), kernel, root};
+}
+
+// Runs the launches for `seeds` random interleavings and returns the number of
+// runs that did not complete correctly.
+static int count_failures(Options const& options,
+                          std::vector<Launch> const& launches, int seeds) {
+    int failures = 0;
+    for (int seed = 0; seed < seeds; seed++) {
+        Simulator sim(options);
+        if (sim.run(launches, seed) != Result::kOk) failures++;
+    }
+    return failures;
+}
+
+static void test_schedule_helpers() {
+    HOST_CHECK_EQ(twoshot_iterations(0, 4), 0u);
+    HOST_CHECK_EQ(twoshot_iterations(4, 4), 1u);
+    HOST_CHECK_EQ(twoshot_iterations(5, 4), 2u);
+    HOST_CHECK_EQ(twoshot_iterations(65536, 1216), 54u);
+    HOST_CHECK_EQ(twoshot_iterations(3, 0), 0u);
+
+    HOST_CHECK_EQ(pipeline_slot(0), 0);
+    HOST_CHECK_EQ(pipeline_slot(1), 1);
+    HOST_CHECK_EQ(pipeline_slot(2), 0);
+
+    // Regions of different (stage, slot, block) never overlap, and the last
+    // one ends at the buffer sizes of launch.h.
+    uint32_t max_grid = 7;
+    int world_size = 4;
+    uint32_t tile = 1000;
+    std::vector<int> used(kNumStages * kNumSlots * max_grid, 0);
+    for (int stage = 0; stage < kNumStages; stage++) {
+        for (int slot = 0; slot < kNumSlots; slot++) {
+            for (uint32_t b = 0; b < max_grid; b++) {
+                used[comm_region(stage, slot, b, max_grid)]++;
+            }
+        }
+    }
+    for (int u : used) HOST_CHECK_EQ(u, 1);
+    HOST_CHECK_EQ(comm_flags_offset(kNumStages - 1, kNumSlots - 1,
+                                    max_grid - 1, max_grid, world_size) +
+                      world_size * sizeof(uint32_t),
+                  flags_buffer_size(world_size, max_grid));
+    HOST_CHECK_EQ(comm_data_offset(0, kNumStages - 1, kNumSlots - 1,
+                                   max_grid - 1, max_grid, tile) + tile,
+                  kNumStages * kNumSlots * max_grid * tile);
+}
+
+static void test_single_launch() {
+    for (int world_size : {2, 4, 8}) {
+        Options options;
+        options.world_size = world_size;
+        for (Kernel kernel : {Kernel::kSequential, Kernel::kPipelined}) {
+            for (uint32_t num_blocks : {1u, 3u, 4u, 5u, 9u, 13u}) {
+                HOST_CHECK_EQ(count_failures(options,
+                                             {make(num_blocks, 4, kernel)}, 50),
+                              0);
+            }
+        }
+    }
+}
+
+// Back-to-back launches of different sizes and kernels, as produced by a
+// training step with buckets of different sizes.
+static std::vector<Launch> mixed_launches(uint32_t max_grid) {
+    return {make(9, max_grid, Kernel::kPipelined),
+            make(2, max_grid, Kernel::kSequential),
+            make(13, max_grid, Kernel::kPipelined),
+            make(13, max_grid, Kernel::kSequential),
+            make(3, max_grid, Kernel::kPipelined),
+            make(6, max_grid, Kernel::kPipelined),
+            make(1, max_grid, Kernel::kSequential),
+            make(11, max_grid, Kernel::kPipelined)};
+}
+
+static void test_consecutive_launches() {
+    for (int world_size : {2, 4, 8}) {
+        Options options;
+        options.world_size = world_size;
+        HOST_CHECK_EQ(count_failures(options, mixed_launches(4), 200), 0);
+    }
+}
+
+static void test_rooted_predicates() {
+    // Broadcast: the root scatters, then every rank forwards its segment.
+    HOST_CHECK(rooted_sends_segment(RootedCollective::BROADCAST, 0, 2, 1, 2));
+    HOST_CHECK(!rooted_sends_segment(RootedCollective::BROADCAST, 0, 1, 2, 2));
+    HOST_CHECK(rooted_sends_segment(RootedCollective::BROADCAST, 1, 1, 3, 2));
+    // Reduce: every rank scatters, then only the root gathers.
+    HOST_CHECK(rooted_sends_segment(RootedCollective::REDUCE, 0, 1, 3, 2));
+    HOST_CHECK(rooted_sends_segment(RootedCollective::REDUCE, 1, 1, 2, 2));
+    HOST_CHECK(!rooted_sends_segment(RootedCollective::REDUCE, 1, 2, 1, 2));
+
+    HOST_CHECK(!rooted_stores_output(RootedCollective::BROADCAST, 2, 2));
+    HOST_CHECK(rooted_stores_output(RootedCollective::BROADCAST, 0, 2));
+    HOST_CHECK(rooted_stores_output(RootedCollective::REDUCE, 2, 2));
+    HOST_CHECK(!rooted_stores_output(RootedCollective::REDUCE, 0, 2));
+}
+
+// Broadcasts and reduces with different roots, interleaved with all-reduces
+// on the same regions and colors.
+static std::vector<Launch> rooted_launches(uint32_t max_grid, int world_size) {
+    int last = world_size - 1;
+    return {make(9, max_grid, Kernel::kBroadcast, 0),
+            make(5, max_grid, Kernel::kReduce, last),
+            make(13, max_grid, Kernel::kPipelined),
+            make(6, max_grid, Kernel::kReduce, 1),
+            make(2, max_grid, Kernel::kBroadcast, last),
+            make(11, max_grid, Kernel::kSequential),
+            make(7, max_grid, Kernel::kBroadcast, 1),
+            make(9, max_grid, Kernel::kReduce, 0)};
+}
+
+static void test_rooted_launches() {
+    for (int world_size : {2, 4, 8}) {
+        Options options;
+        options.world_size = world_size;
+        for (Kernel kernel : {Kernel::kBroadcast, Kernel::kReduce}) {
+            for (uint32_t num_blocks : {1u, 5u, 9u}) {
+                Launch launch = make(num_blocks, 4, kernel, world_size - 1);
+                HOST_CHECK_EQ(count_failures(options, {launch}, 50), 0);
+            }
+        }
+        HOST_CHECK_EQ(
+            count_failures(options, rooted_launches(4, world_size), 200), 0);
+    }
+}
+
+// The simulator must catch the two layout/color bugs fixed alongside the
+// pipelined kernel: advancing the flag color by one per launch, and striding
+// the buffer regions by the launched grid.
+static void test_detects_regressions() {
+    Options by_one;
+    by_one.advance_color_by_one = true;
+    HOST_CHECK(count_failures(by_one, mixed_launches(4), 200) > 0);
+
+    Options by_grid;
+    by_grid.stride_by_launch_grid = true;
+    HOST_CHECK(count_failures(by_grid, mixed_launches(4), 200) > 0);
+
+    // Without the flag-only signals of the rooted kernels, a rank can move to
+    // its next tile and overwrite a region a peer has not read yet.
+    Options data_targets_only;
+    data_targets_only.signal_data_targets_only = true;
+    HOST_CHECK(count_failures(data_targets_only, rooted_launches(4, 4), 200) >
+               0);
+}
+
+int main() {
+    test_schedule_helpers();
+    test_single_launch();
+    test_consecutive_launches();
+    test_rooted_predicates();
+    test_rooted_launches();
+    test_detects_regressions();
+    return host_test_result("twoshot_schedule_test");
+}
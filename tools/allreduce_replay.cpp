@@ -0,0 +1,51 @@
+#include <cstdio>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include <host/trace_replay.h>
+
+using namespace quickreduce;
+using namespace quickreduce::reference;
+
+// Replay all-reduce traces (DeviceComms::enable_capture) through the host
+// reference of every codec:
+//
+//   allreduce_replay rank0.trace [rank1.trace ...]
+//
+// The traces of all the ranks of a job together also replay the sums of
+// the calls sampled on every rank.
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s trace [trace ...]\n", argv[0]);
+        return 1;
+    }
+    try {
+        std::vector<TraceFile> traces;
+        std::vector<TraceFile::Record> records;
+        uint64_t values = 0;
+        for (int i = 1; i < argc; i++) {
+            traces.push_back(TraceFile::read(argv[i]));
+            for (auto const& record : traces.back().records()) {
+                records.push_back(record);
+                values += record.header.numel;
+            }
+        }
+        std::printf("%zu records, %llu values, %zu complete calls\n",
+                    records.size(), static_cast<unsigned long long>(values),
+                    complete_calls(records).size());
+        std::printf("%-8s %10s %14s %14s %14s\n", "codec", "bits/value",
+                    "rel. rmse", "max error", "sum rel. rmse");
+        for (auto const& replay : replay_codecs(records)) {
+            std::printf("%-8s %10.2f %14.3e %14.3e %14.3e\n",
+                        replay.name.c_str(), replay.bits_per_value(),
+                        replay.round_trip.relative_rmse(),
+                        replay.round_trip.max_abs_error,
+                        replay.allreduce.relative_rmse());
+        }
+    } catch (std::exception const& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}